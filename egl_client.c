@@ -2,6 +2,7 @@
 #include "egl_common.h"
 #include "client_common.h"
 #include "xdg_client_common.h"
+#include "presentation_helper.h"
 #include "shm_helper.h"
 #include "gldebug.h"
 
@@ -60,6 +61,7 @@ struct ClientObjState
     struct xdg_toplevel* mpXdgTopLevel;
 	struct eglContext mpEglContext;
 	struct wl_callback* mpFrameCallback;
+	struct PresentationLatency mPresentationLatency;
 
 	int8_t mbCloseApplication;
 	int8_t mbSurfaceConfigured;
@@ -104,6 +106,8 @@ static void updateFrame_callback( void* pData, struct wl_callback* pFrameCallbac
 	pClientObjState->mpFrameCallback = wl_surface_frame( pClientObjState->mpWlSurface );
 	wl_callback_add_listener( pClientObjState->mpFrameCallback, &frame_listener, pClientObjState );
 
+	// the swap commits the frame the feedback is for
+	RequestPresentationFeedback( &pClientObjState->mPresentationLatency, pClientObjState->mpWlSurface );
 	SwapEGLBuffers( &pClientObjState->mpEglContext );
 }
 
@@ -263,6 +267,7 @@ int main( int argc, const char* argv[] )
     struct ClientObjState clientObjState = {0};
 	clientObjState.mpEglContext.mNativeDisplay = pDisplay;
 	clientObjState.mpGlobalObjState = &gObjState;
+	InitPresentationLatency( pDisplay, &clientObjState.mPresentationLatency );
 
 	InitEGLContext( &clientObjState.mpEglContext );
 	
@@ -309,6 +314,7 @@ int main( int argc, const char* argv[] )
 		wl_display_dispatch(pDisplay);
     }
 
+	ShutdownPresentationLatency( &clientObjState.mPresentationLatency );
 	ShutdownEGLContext( &clientObjState.mpEglContext, clientObjState.mpXdgTopLevel, clientObjState.mpXdgSurface, clientObjState.mpWlSurface );
     wl_display_disconnect(pDisplay);
     printf("Client Disconnected from the Display\n");
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <wayland-client.h>
+
+#include "global_registry_handle.h"
+
+// Stress client for the server's back-pressure handling.
+//     FloodClient [--flood BURST] [--sync]
+// commits frame callbacks in bursts of BURST as fast as the socket takes
+// them and never reads a single event, --sync adds a wl_display.sync per
+// request which the server cannot hold back.
+//     FloodClient --probe [COUNT]
+// is the well behaved client to run next to it: COUNT roundtrips and
+// frame callbacks with their latency percentiles.
+
+static uint64_t get_time_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int compare_u64( const void* pA, const void* pB )
+{
+	const uint64_t a = *(const uint64_t*)pA;
+	const uint64_t b = *(const uint64_t*)pB;
+	return a < b ? -1 : a > b;
+}
+
+static void print_latency( const char* pName, uint64_t* pSamples, int count )
+{
+	if( count == 0 )
+		return;
+
+	qsort(pSamples, count, sizeof(uint64_t), compare_u64);
+	printf("%s: %d samples, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+		pName, count,
+		pSamples[count / 2] / 1000.0,
+		pSamples[(int)( ( count - 1 ) * 0.99 )] / 1000.0,
+		pSamples[count - 1] / 1000.0
+	);
+}
+
+static void frame_done( void* pData, struct wl_callback* pCallback, uint32_t time )
+{
+	*(int*)pData = 1;
+	wl_callback_destroy(pCallback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done
+};
+
+static int run_probe( struct wl_display* pDisplay, struct wl_surface* pSurface, int count )
+{
+	uint64_t* pRoundtrips = calloc(count, sizeof(uint64_t));
+	uint64_t* pFrames = calloc(count, sizeof(uint64_t));
+	if( !pRoundtrips || !pFrames )
+		return 1;
+
+	int frames = 0;
+	for( int i = 0; i < count; i++ )
+	{
+		uint64_t start = get_time_nsec();
+		if( wl_display_roundtrip(pDisplay) == -1 )
+			break;
+		pRoundtrips[i] = get_time_nsec() - start;
+
+		int bDone = 0;
+		struct wl_callback* pCallback = wl_surface_frame(pSurface);
+		wl_callback_add_listener(pCallback, &frame_listener, &bDone);
+		start = get_time_nsec();
+		wl_surface_commit(pSurface);
+		while( !bDone && wl_display_dispatch(pDisplay) != -1 )
+		{
+		}
+		if( !bDone )
+			break;
+		pFrames[frames++] = get_time_nsec() - start;
+	}
+
+	print_latency("Roundtrip", pRoundtrips, frames);
+	print_latency("Frame callback", pFrames, frames);
+	free(pRoundtrips);
+	free(pFrames);
+	return frames == count ? 0 : 1;
+}
+
+static int run_flood( struct wl_display* pDisplay, struct wl_surface* pSurface, int burst, int bSync )
+{
+	struct pollfd displayFd = { .fd = wl_display_get_fd(pDisplay), .events = POLLOUT };
+	uint64_t requests = 0;
+	uint64_t stalls = 0;
+	uint64_t lastReport = get_time_nsec();
+
+	for( ;; )
+	{
+		for( int i = 0; i < burst; i++ )
+		{
+			// the proxies go right away, their events are never read anyway
+			wl_callback_destroy(wl_surface_frame(pSurface));
+			wl_surface_commit(pSurface);
+			if( bSync )
+				wl_callback_destroy(wl_display_sync(pDisplay));
+		}
+		requests += burst;
+
+		while( wl_display_flush(pDisplay) == -1 )
+		{
+			if( errno != EAGAIN )
+			{
+				printf("Disconnected after %llu bursts of %d\n", (unsigned long long)( requests / burst ), burst);
+				return 1;
+			}
+			// the server stopped reading us
+			stalls++;
+			poll(&displayFd, 1, -1);
+		}
+
+		const uint64_t now = get_time_nsec();
+		if( now - lastReport >= 1000000000ull )
+		{
+			printf("%llu frame requests sent, %llu flush stalls\n",
+				(unsigned long long)requests, (unsigned long long)stalls);
+			lastReport = now;
+		}
+	}
+}
+
+int main( int argc, const char* argv[] )
+{
+	int burst = 256;
+	int bSync = 0;
+	int probeCount = 0;
+	for( int i = 1; i < argc; i++ )
+	{
+		if( strcmp(argv[i], "--flood") == 0 && i + 1 < argc )
+			burst = atoi(argv[++i]);
+		else if( strcmp(argv[i], "--sync") == 0 )
+			bSync = 1;
+		else if( strcmp(argv[i], "--probe") == 0 )
+		{
+			const int count = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			probeCount = count > 0 ? count : 1000;
+		}
+	}
+	if( burst <= 0 )
+		burst = 256;
+
+	struct wl_display* pDisplay = wl_display_connect(NULL);
+	if( !pDisplay )
+	{
+		printf("Failed to make display connection\n");
+		return 1;
+	}
+
+	struct GlobalObjectState gObjState = {0};
+	struct wl_registry* pRegistry = wl_display_get_registry(pDisplay);
+	wl_registry_add_listener(pRegistry, &g_registryListener, &gObjState);
+	wl_display_roundtrip(pDisplay);
+
+	if( !gObjState.mpCompositor )
+	{
+		printf("Failed to retrieve global objects\n");
+		return 1;
+	}
+
+	// no buffer needed, the server still runs the callbacks through an output
+	struct wl_surface* pSurface = wl_compositor_create_surface(gObjState.mpCompositor);
+
+	const int result = probeCount ?
+		run_probe(pDisplay, pSurface, probeCount) :
+		run_flood(pDisplay, pSurface, burst, bSync);
+
+	wl_display_disconnect(pDisplay);
+	return result;
+}
@@ -14,7 +14,9 @@ static void registry_handle_global(
 	if( strcmp("wl_output", pInterface) == 0 )
 	{
 		printf("Retrieving wl_output global object\n");
-		gpOutput = wl_registry_bind( pRegistry, name, &wl_output_interface, version );
+		// the listener below handles everything up to the version we were built with
+		const uint32_t bindVersion = version < (uint32_t)wl_output_interface.version ? version : (uint32_t)wl_output_interface.version;
+		gpOutput = wl_registry_bind( pRegistry, name, &wl_output_interface, bindVersion );
 	}
 }
 
@@ -47,8 +49,49 @@ static void wl_output_geometry_event(
 	printf("transform: %d \n", transform);
 }
 
+static void wl_output_mode_event(
+	void* pData, struct wl_output* wl_output,
+	uint32_t flags, int32_t width, int32_t height, int32_t refresh
+)
+{
+	printf("wl_output_mode_event: \n");
+	printf("width: %d, height: %d, refresh: %.3f Hz, \n", width, height, refresh / 1000.0);
+	printf("current: %d, preferred: %d \n",
+		( flags & WL_OUTPUT_MODE_CURRENT ) != 0, ( flags & WL_OUTPUT_MODE_PREFERRED ) != 0);
+}
+
+static void wl_output_scale_event( void* pData, struct wl_output* wl_output, int32_t factor )
+{
+	printf("wl_output_scale_event: factor: %d \n", factor);
+}
+
+#ifdef WL_OUTPUT_NAME_SINCE_VERSION
+static void wl_output_name_event( void* pData, struct wl_output* wl_output, const char* pName )
+{
+	printf("wl_output_name_event: %s \n", pName);
+}
+
+static void wl_output_description_event( void* pData, struct wl_output* wl_output, const char* pDescription )
+{
+	printf("wl_output_description_event: %s \n", pDescription);
+}
+#endif
+
+// everything sent since the last done is one atomic update
+static void wl_output_done_event( void* pData, struct wl_output* wl_output )
+{
+	printf("wl_output_done_event \n");
+}
+
 static const struct wl_output_listener output_listener = {
-	.geometry = wl_output_geometry_event
+	.geometry = wl_output_geometry_event,
+	.mode = wl_output_mode_event,
+	.done = wl_output_done_event,
+	.scale = wl_output_scale_event,
+#ifdef WL_OUTPUT_NAME_SINCE_VERSION
+	.name = wl_output_name_event,
+	.description = wl_output_description_event
+#endif
 };
 
 int main(int argc, const char* argv[])
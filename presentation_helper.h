@@ -0,0 +1,288 @@
+#ifndef _PRESENTATION_HELPER_H
+#define _PRESENTATION_HELPER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wayland-client.h>
+
+#include "presentation-time-client-protocol.h"
+
+// Commit to present latency of a render loop through wp_presentation. Call
+// RequestPresentationFeedback right before the commit of a frame, eglSwapBuffers
+// included, and the presented event adds the time until the frame reached the
+// screen to a histogram. A report is printed every PRESENTATION_REPORT_FRAMES
+// presented frames and by ShutdownPresentationLatency.
+
+// 0.25 ms buckets, the last one takes everything past 64 ms
+#define PRESENTATION_BUCKET_NSEC 250000ull
+#define PRESENTATION_BUCKETS 256
+#define PRESENTATION_MAX_FRAMES 16
+#define PRESENTATION_REPORT_FRAMES 300
+
+struct PresentationLatency;
+
+struct PresentationFrame
+{
+	struct PresentationLatency* mpLatency;
+	// NULL while the slot is free
+	struct wp_presentation_feedback* mpFeedback;
+	uint64_t mCommitNsec;
+};
+
+struct PresentationLatency
+{
+	struct wp_presentation* mpPresentation;
+	clockid_t mClockId;
+
+	struct PresentationFrame mFrames[PRESENTATION_MAX_FRAMES];
+	uint32_t mBuckets[PRESENTATION_BUCKETS];
+	uint64_t mPresented;
+	uint64_t mDiscarded;
+	// frames committed while every slot was waiting for its event
+	uint64_t mUnmeasured;
+	uint64_t mZeroCopy;
+	uint64_t mSumNsec;
+	uint64_t mMaxNsec;
+	// refresh of the last presented event, 0 for outputs without one
+	uint32_t mRefreshNsec;
+	uint64_t mLastSequence;
+	// vblanks that passed between two presented frames without a new one
+	uint64_t mSkippedVblanks;
+};
+
+static uint64_t PresentationNowNsec( clockid_t clockId )
+{
+	struct timespec ts;
+	clock_gettime(clockId, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void presentation_handle_clock_id( void* pData, struct wp_presentation* pPresentation, uint32_t clockId )
+{
+	struct PresentationLatency* pLatency = pData;
+	pLatency->mClockId = (clockid_t)clockId;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_handle_clock_id
+};
+
+static void presentation_registry_handle_global(
+	void* pData, struct wl_registry* pRegistry,
+	uint32_t name, const char* pInterface, uint32_t version
+)
+{
+	struct PresentationLatency* pLatency = pData;
+	if( strcmp(wp_presentation_interface.name, pInterface) != 0 )
+		return;
+
+	pLatency->mpPresentation = wl_registry_bind(
+		pRegistry, name,
+		&wp_presentation_interface, 1
+	);
+	wp_presentation_add_listener(pLatency->mpPresentation, &presentation_listener, pLatency);
+}
+
+static void presentation_registry_handle_global_remove(
+	void* pData, struct wl_registry* pRegistry,
+	uint32_t name
+)
+{
+}
+
+static const struct wl_registry_listener presentation_registry_listener = {
+	.global = presentation_registry_handle_global,
+	.global_remove = presentation_registry_handle_global_remove
+};
+
+// Returns 0 without wp_presentation, RequestPresentationFeedback is a no-op then
+static int8_t InitPresentationLatency( struct wl_display* pDisplay, struct PresentationLatency* pLatency )
+{
+	memset(pLatency, 0, sizeof(struct PresentationLatency));
+	pLatency->mClockId = CLOCK_MONOTONIC;
+
+	struct wl_registry* pRegistry = wl_display_get_registry(pDisplay);
+	if( !pRegistry )
+		return 0;
+	wl_registry_add_listener(pRegistry, &presentation_registry_listener, pLatency);
+	// one for the globals, one for the clock_id of the bind
+	wl_display_roundtrip(pDisplay);
+	if( pLatency->mpPresentation )
+		wl_display_roundtrip(pDisplay);
+	wl_registry_destroy(pRegistry);
+
+	if( !pLatency->mpPresentation )
+	{
+		printf("wp_presentation is not supported, frame latency is not measured\n");
+		return 0;
+	}
+	return 1;
+}
+
+// Reads the percentile off the histogram, the upper edge of its bucket
+static double PresentationPercentileMs( const struct PresentationLatency* pLatency, uint32_t percent )
+{
+	const uint64_t target = ( pLatency->mPresented * percent + 99 ) / 100;
+	uint64_t count = 0;
+	for( uint32_t i = 0; i < PRESENTATION_BUCKETS; i++ )
+	{
+		count += pLatency->mBuckets[i];
+		if( count >= target )
+			return ( i + 1 ) * PRESENTATION_BUCKET_NSEC / 1e6;
+	}
+	return pLatency->mMaxNsec / 1e6;
+}
+
+static void PrintPresentationLatency( const struct PresentationLatency* pLatency )
+{
+	if( !pLatency->mPresented )
+	{
+		printf("Presentation: no frame presented, %llu discarded\n", (unsigned long long)pLatency->mDiscarded);
+		return;
+	}
+
+	printf("Presentation: %llu frames, commit to present p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms, avg %.2f ms\n",
+		(unsigned long long)pLatency->mPresented,
+		PresentationPercentileMs(pLatency, 50),
+		PresentationPercentileMs(pLatency, 90),
+		PresentationPercentileMs(pLatency, 99),
+		pLatency->mMaxNsec / 1e6,
+		pLatency->mSumNsec / 1e6 / pLatency->mPresented
+	);
+	printf("    refresh %.3f ms, %llu vblanks skipped, %llu discarded, %llu zero copy, %llu not measured\n",
+		pLatency->mRefreshNsec / 1e6,
+		(unsigned long long)pLatency->mSkippedVblanks,
+		(unsigned long long)pLatency->mDiscarded,
+		(unsigned long long)pLatency->mZeroCopy,
+		(unsigned long long)pLatency->mUnmeasured
+	);
+
+	// the populated range of the histogram, one line per bucket
+	uint32_t first = PRESENTATION_BUCKETS;
+	uint32_t last = 0;
+	uint32_t peak = 0;
+	for( uint32_t i = 0; i < PRESENTATION_BUCKETS; i++ )
+	{
+		if( !pLatency->mBuckets[i] )
+			continue;
+		if( first == PRESENTATION_BUCKETS )
+			first = i;
+		last = i;
+		if( pLatency->mBuckets[i] > peak )
+			peak = pLatency->mBuckets[i];
+	}
+	for( uint32_t i = first; i <= last; i++ )
+	{
+		char bar[41];
+		const uint32_t width = (uint32_t)( (uint64_t)pLatency->mBuckets[i] * 40 / peak );
+		memset(bar, '#', width);
+		bar[width] = '\0';
+		printf("    %6.2f ms %8u %s\n", i * PRESENTATION_BUCKET_NSEC / 1e6, pLatency->mBuckets[i], bar);
+	}
+}
+
+static void PresentationFrameFree( struct PresentationFrame* pFrame )
+{
+	wp_presentation_feedback_destroy(pFrame->mpFeedback);
+	pFrame->mpFeedback = NULL;
+}
+
+static void presentation_feedback_handle_sync_output(
+	void* pData, struct wp_presentation_feedback* pFeedback,
+	struct wl_output* pOutput
+)
+{
+}
+
+static void presentation_feedback_handle_presented(
+	void* pData, struct wp_presentation_feedback* pFeedback,
+	uint32_t secHi, uint32_t secLo, uint32_t nsec,
+	uint32_t refresh, uint32_t seqHi, uint32_t seqLo,
+	uint32_t flags
+)
+{
+	struct PresentationFrame* pFrame = pData;
+	struct PresentationLatency* pLatency = pFrame->mpLatency;
+
+	const uint64_t presentNsec = ( ( (uint64_t)secHi << 32 ) | secLo ) * 1000000000ull + nsec;
+	const uint64_t latency = presentNsec > pFrame->mCommitNsec ? presentNsec - pFrame->mCommitNsec : 0;
+	uint64_t bucket = latency / PRESENTATION_BUCKET_NSEC;
+	if( bucket >= PRESENTATION_BUCKETS )
+		bucket = PRESENTATION_BUCKETS - 1;
+
+	pLatency->mBuckets[bucket]++;
+	pLatency->mSumNsec += latency;
+	if( latency > pLatency->mMaxNsec )
+		pLatency->mMaxNsec = latency;
+	if( flags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY )
+		pLatency->mZeroCopy++;
+
+	// sequences only count on outputs with a fixed refresh
+	const uint64_t sequence = ( (uint64_t)seqHi << 32 ) | seqLo;
+	if( refresh && pLatency->mPresented && sequence > pLatency->mLastSequence + 1 )
+		pLatency->mSkippedVblanks += sequence - pLatency->mLastSequence - 1;
+	pLatency->mLastSequence = sequence;
+	pLatency->mRefreshNsec = refresh;
+	pLatency->mPresented++;
+
+	PresentationFrameFree(pFrame);
+
+	if( pLatency->mPresented % PRESENTATION_REPORT_FRAMES == 0 )
+		PrintPresentationLatency(pLatency);
+}
+
+static void presentation_feedback_handle_discarded( void* pData, struct wp_presentation_feedback* pFeedback )
+{
+	struct PresentationFrame* pFrame = pData;
+	pFrame->mpLatency->mDiscarded++;
+	PresentationFrameFree(pFrame);
+}
+
+static const struct wp_presentation_feedback_listener presentation_feedback_listener = {
+	.sync_output = presentation_feedback_handle_sync_output,
+	.presented = presentation_feedback_handle_presented,
+	.discarded = presentation_feedback_handle_discarded
+};
+
+// Asks for the feedback of the next commit on pSurface
+static void RequestPresentationFeedback( struct PresentationLatency* pLatency, struct wl_surface* pSurface )
+{
+	if( !pLatency->mpPresentation )
+		return;
+
+	struct PresentationFrame* pFrame = NULL;
+	for( uint32_t i = 0; i < PRESENTATION_MAX_FRAMES && !pFrame; i++ )
+	{
+		if( !pLatency->mFrames[i].mpFeedback )
+			pFrame = &pLatency->mFrames[i];
+	}
+	if( !pFrame )
+	{
+		pLatency->mUnmeasured++;
+		return;
+	}
+
+	pFrame->mpLatency = pLatency;
+	pFrame->mpFeedback = wp_presentation_feedback(pLatency->mpPresentation, pSurface);
+	pFrame->mCommitNsec = PresentationNowNsec(pLatency->mClockId);
+	wp_presentation_feedback_add_listener(pFrame->mpFeedback, &presentation_feedback_listener, pFrame);
+}
+
+static void ShutdownPresentationLatency( struct PresentationLatency* pLatency )
+{
+	if( !pLatency->mpPresentation )
+		return;
+
+	PrintPresentationLatency(pLatency);
+	for( uint32_t i = 0; i < PRESENTATION_MAX_FRAMES; i++ )
+	{
+		if( pLatency->mFrames[i].mpFeedback )
+			PresentationFrameFree(&pLatency->mFrames[i]);
+	}
+	wp_presentation_destroy(pLatency->mpPresentation);
+	pLatency->mpPresentation = NULL;
+}
+
+#endif
@@ -1,90 +1,26 @@
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <wayland-server.h>
 
 #include "xdg-shell-server-protocol.h"
 
-struct Output;
-struct OutputState;
-struct Compositor;
-
-struct OutputState
-{
-	int32_t mX, mY;
-	int32_t mPhyWidth, mPhyHeight;
-	int32_t mSubpixel;
-	const char* mpMake;
-	const char* mpModel;
-	int32_t mTransform;
-};
-
-struct Output
-{
-	struct wl_resource* mpResource;
-	struct OutputState* mpState;
-};
-
-struct Compositor
-{
-	struct wl_resource* mpResource;
-};
-
-struct XdgWmBase
-{
-	struct wl_resource* mpResource;
-};
-
-// Output Handle
-
-static void wl_output_handle_resource_destroy( struct wl_resource* pResource )
-{
-	printf("Cleaning up wl_output resource\n");
-
-	struct Output* pClientOutput = wl_resource_get_user_data(pResource);
-	// TODO cleanup resource
-}
-
-static void wl_output_handle_release( struct wl_client* pClient, struct wl_resource* pResource )
-{
-	printf("wl_output release handle\n");
-	wl_resource_destroy(pResource);
-}
-
-
-static const struct wl_output_interface wl_output_implementation = {
-	.release = wl_output_handle_release
-};
-
-static void wl_output_handle_bind(
-	struct wl_client* pClient, void* pData,
-	uint32_t version, uint32_t id
-)
-{
-	printf("Binding wl_output Version: %d id: %d\n", version, id);
-
-	struct OutputState* pState = pData;
-	struct Output* pClientOutput = calloc(1, sizeof(struct Output));
-
-	struct wl_resource* pResource = wl_resource_create(
-		pClient, &wl_output_interface,
-		wl_output_interface.version, id
-	);
-	wl_resource_set_implementation(
-		pResource, &wl_output_implementation,
-		pClientOutput, wl_output_handle_resource_destroy
-	);
-
-	pClientOutput->mpResource = pResource;
-	pClientOutput->mpState = pState;
-
-	wl_output_send_geometry(
-		pResource, pState->mX, pState->mY, pState->mPhyWidth, pState->mPhyHeight,
-		pState->mSubpixel,
-		pState->mpMake, pState->mpModel,
-		pState->mTransform
-	);
-}
+// PNG frame dumps, see server_capture.h
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+
+#include "server_state.h"
+#include "server_bench.h"
+#include "server_client.h"
+#include "server_dmabuf.h"
+#include "server_loop_stats.h"
+#include "server_output.h"
+#include "server_presentation.h"
+#include "server_subsurface.h"
+#include "server_surface.h"
+#include "server_viewporter.h"
+#include "server_xdg_shell.h"
 
 // Compositor Handle
 
@@ -93,24 +29,36 @@ static void wl_compositor_handle_resource_destroy( struct wl_resource* pResource
 	printf("Cleaning up wl_compositor resource\n");
 
 	struct Compositor* pCompositor = wl_resource_get_user_data(pResource);
-	// TODO cleanup resource
+	if( !pCompositor )
+		return;
+
+	ClientFreeBinding(pCompositor->mpClientState, pCompositor, &pCompositor->mLink);
 }
 
-#if 1
 static void wl_compositor_handle_create_surface(
 	struct wl_client* pClient, struct wl_resource* pResource, uint32_t id
 )
 {
 	printf("Compositor Create surface request from Client with id : %d\n", id);
+
+	struct Compositor* pCompositor = wl_resource_get_user_data(pResource);
+	CreateSurface(
+		pCompositor->mpServer, pClient,
+		wl_resource_get_version(pResource), id
+	);
 }
 
+static void wl_compositor_handle_create_region(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t id
+)
+{
+	CreateRegion(pClient, wl_resource_get_version(pResource), id);
+}
 
 static const struct wl_compositor_interface wl_compositor_impl = {
-	.create_surface = wl_compositor_handle_create_surface
+	.create_surface = wl_compositor_handle_create_surface,
+	.create_region = wl_compositor_handle_create_region
 };
-#else
-static const struct wl_compositor_interface wl_compositor_impl = {};
-#endif 
 
 static void wl_compositor_handle_bind(
 	struct wl_client* pClient, void* pData,
@@ -119,23 +67,31 @@ static void wl_compositor_handle_bind(
 {
 	printf("Binding wl_compositor Version: %d id: %d\n", version, id);
 
-	struct Compositor* pCompositor = calloc(1, sizeof(struct Compositor));
+	struct ClientState* pClientState = GetClientState(pData, pClient);
+	struct Compositor* pCompositor = pClientState ? ClientAllocBinding(pClientState) : NULL;
+	if( !pCompositor )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
 
 	struct wl_resource* pResource = wl_resource_create(
 		pClient, &wl_compositor_interface,
-		wl_compositor_interface.version, id
+		version, id
 	);
-#if 0
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mBindingPool, pCompositor);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
 	wl_resource_set_implementation( pResource, &wl_compositor_impl,
 		pCompositor, wl_compositor_handle_resource_destroy
 	);
-#elif 0
-	wl_resource_set_implementation( pResource, NULL,
-		pCompositor, wl_compositor_handle_resource_destroy
-	);
-#else
-#endif
 	pCompositor->mpResource = pResource;
+	pCompositor->mpServer = pData;
+	pCompositor->mpClientState = pClientState;
+	wl_list_insert(pClientState->mCompositorList.prev, &pCompositor->mLink);
 }
 
 // XdgWmBase Handle
@@ -144,7 +100,30 @@ static void xdg_wm_base_handle_resource_destroy( struct wl_resource* pResource )
 {
 	printf("Cleaning up xdg_wm_base resource \n");
 	struct XdgWmBase* pXdgWmBase = wl_resource_get_user_data(pResource);
-	// TODO cleanup resource
+	if( !pXdgWmBase )
+		return;
+
+	ClientFreeBinding(pXdgWmBase->mpClientState, pXdgWmBase, &pXdgWmBase->mLink);
+}
+
+static void xdg_wm_base_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	struct XdgWmBase* pXdgWmBase = wl_resource_get_user_data(pResource);
+	if( pXdgWmBase->mSurfaceCount > 0 )
+	{
+		wl_resource_post_error(pResource, XDG_WM_BASE_ERROR_DEFUNCT_SURFACES,
+			"xdg_wm_base destroyed with %u xdg_surfaces alive", pXdgWmBase->mSurfaceCount);
+		return;
+	}
+	wl_resource_destroy(pResource);
+}
+
+static void xdg_wm_base_handle_create_positioner(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t id
+)
+{
+	struct XdgWmBase* pXdgWmBase = wl_resource_get_user_data(pResource);
+	CreateXdgPositioner(pXdgWmBase->mpClientState, wl_resource_get_version(pResource), id);
 }
 
 static void xdg_wm_base_handle_get_xdg_surface(
@@ -153,6 +132,9 @@ static void xdg_wm_base_handle_get_xdg_surface(
 )
 {
 	printf("Creating xdg_surface with id : %d\n", id);
+
+	struct XdgWmBase* pXdgWmBase = wl_resource_get_user_data(pResource);
+	CreateXdgSurface(pXdgWmBase, wl_resource_get_version(pResource), id, pSurface);
 }
 
 static void xdg_wm_base_handle_pong(
@@ -163,6 +145,8 @@ static void xdg_wm_base_handle_pong(
 }
 
 static const struct xdg_wm_base_interface xdg_wm_base_impl = {
+	.destroy = xdg_wm_base_handle_destroy,
+	.create_positioner = xdg_wm_base_handle_create_positioner,
 	.get_xdg_surface = xdg_wm_base_handle_get_xdg_surface,
 	.pong = xdg_wm_base_handle_pong
 };
@@ -173,25 +157,172 @@ static void xdg_wm_base_handle_bind(
 )
 {
 	printf("Binding xdg_wm_base Version: %d id: %d\n", version, id);
-	struct XdgWmBase* pXdgWmBase = calloc(1, sizeof(struct XdgWmBase));
+	struct ClientState* pClientState = GetClientState(pData, pClient);
+	struct XdgWmBase* pXdgWmBase = pClientState ? ClientAllocBinding(pClientState) : NULL;
+	if( !pXdgWmBase )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
 
 	struct wl_resource* pResource = wl_resource_create(
 		pClient, &xdg_wm_base_interface,
-		xdg_wm_base_interface.version, id
+		version, id
 	);
-#if 0
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mBindingPool, pXdgWmBase);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
 	wl_resource_set_implementation(
 		pResource, &xdg_wm_base_impl,
 		pXdgWmBase,
 		xdg_wm_base_handle_resource_destroy
 	);
-#else
-#endif
 	pXdgWmBase->mpResource = pResource;
+	pXdgWmBase->mpClientState = pClientState;
+	wl_list_insert(pClientState->mXdgWmBaseList.prev, &pXdgWmBase->mLink);
+}
+
+static int server_handle_terminate( int signalNumber, void* pData )
+{
+	struct ServerState* pServer = pData;
+	printf("Received signal %d, terminating\n", signalNumber);
+	pServer->mbRunning = 0;
+	wl_display_terminate(pServer->mpDisplay);
+	return 0;
+}
+
+static int server_handle_loop_stats( int signalNumber, void* pData )
+{
+	struct ServerState* pServer = pData;
+	PrintLoopStats(pServer->mpLoopStats);
+	return 0;
+}
+
+static int server_handle_stats( int signalNumber, void* pData )
+{
+	PrintClientStats(pData);
+	return 0;
 }
 
 int main( int argc, const char* argv[] )
 {
+	const char* pKernelName = NULL;
+	int32_t refresh = 60000;
+	int8_t bEarlyRelease = 0;
+	int8_t scaleFilter = SCALE_FILTER_BILINEAR;
+	struct OutputConfig outputConfigs[MAX_OUTPUTS];
+	uint32_t outputCount = 0;
+	int32_t threadCount = -1;
+	const char* pCapturePrefix = NULL;
+	int32_t captureFormat = CAPTURE_FORMAT_RAW;
+	uint64_t captureFrames = 0;
+
+	for( int i = 1; i < argc; i++ )
+	{
+		if( strcmp(argv[i], "--bench-compose") == 0 )
+		{
+			int32_t frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return RunComposeBenchmark(frames > 0 ? frames : 300);
+		}
+		else if( strcmp(argv[i], "--bench-outputs") == 0 )
+		{
+			int32_t frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return RunOutputBenchmark(frames > 0 ? frames : 120);
+		}
+		else if( strcmp(argv[i], "--bench-hotplug") == 0 )
+		{
+			int32_t cycles = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return RunHotplugBenchmark(cycles > 0 ? cycles : 100);
+		}
+		else if( strcmp(argv[i], "--bench-subsurfaces") == 0 )
+		{
+			int32_t frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return RunSubsurfaceBenchmark(frames > 0 ? frames : 600);
+		}
+		else if( strcmp(argv[i], "--bench-viewport") == 0 )
+		{
+			int32_t frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return RunViewportBenchmark(frames > 0 ? frames : 300);
+		}
+		else if( strcmp(argv[i], "--bench-dmabuf") == 0 )
+		{
+			int32_t frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return RunDmabufBenchmark(frames > 0 ? frames : 120);
+		}
+		else if( strcmp(argv[i], "--bench-threads") == 0 )
+		{
+			int32_t frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return RunThreadBenchmark(frames > 0 ? frames : 60);
+		}
+		else if( strcmp(argv[i], "--kernel") == 0 && i + 1 < argc )
+			pKernelName = argv[++i];
+		else if( strcmp(argv[i], "--refresh") == 0 && i + 1 < argc )
+		{
+			// in Hz, 0 repaints as fast as possible
+			refresh = (int32_t)( atof(argv[++i]) * 1000.0 );
+		}
+		else if( strcmp(argv[i], "--early-release") == 0 )
+			bEarlyRelease = 1;
+		else if( strcmp(argv[i], "--scale-filter") == 0 && i + 1 < argc )
+		{
+			i++;
+			if( strcmp(argv[i], "bilinear") == 0 )
+				scaleFilter = SCALE_FILTER_BILINEAR;
+			else if( strcmp(argv[i], "nearest") == 0 )
+				scaleFilter = SCALE_FILTER_NEAREST;
+			else
+			{
+				printf("Invalid scale filter %s, expected bilinear or nearest\n", argv[i]);
+				return 1;
+			}
+		}
+		else if( strcmp(argv[i], "--threads") == 0 && i + 1 < argc )
+		{
+			// 0 composes on the dispatch thread
+			threadCount = atoi(argv[++i]);
+		}
+		else if( strcmp(argv[i], "--capture") == 0 && i + 1 < argc )
+			pCapturePrefix = argv[++i];
+		else if( strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc )
+		{
+			i++;
+			if( strcmp(argv[i], "raw") == 0 )
+				captureFormat = CAPTURE_FORMAT_RAW;
+			else if( strcmp(argv[i], "png") == 0 )
+				captureFormat = CAPTURE_FORMAT_PNG;
+			else
+			{
+				printf("Invalid capture format %s, expected raw or png\n", argv[i]);
+				return 1;
+			}
+		}
+		else if( strcmp(argv[i], "--capture-frames") == 0 && i + 1 < argc )
+		{
+			// per output, 0 captures until exit
+			captureFrames = strtoull(argv[++i], NULL, 10);
+		}
+		else if( strcmp(argv[i], "--output") == 0 && i + 1 < argc )
+		{
+			if( outputCount == MAX_OUTPUTS )
+			{
+				printf("At most %d outputs are supported\n", MAX_OUTPUTS);
+				return 1;
+			}
+			if( ParseOutputConfig(argv[++i], &outputConfigs[outputCount]) == -1 )
+			{
+				printf("Invalid output %s, expected WIDTHxHEIGHT[@HZ][+X+Y][,ROTATION]\n", argv[i]);
+				return 1;
+			}
+			outputCount++;
+		}
+	}
+
+	if( outputCount == 0 )
+		ParseOutputConfig("1920x1080", &outputConfigs[outputCount++]);
+
 	struct wl_display* pDisplay = wl_display_create();
 	if( !pDisplay )
 	{
@@ -199,26 +330,119 @@ int main( int argc, const char* argv[] )
 		return 1;
 	}
 
-	struct OutputState displayState = {
-		0, 0,
-		1920, 1080,
-		WL_OUTPUT_SUBPIXEL_UNKNOWN,
-		"Foo Inc", "Foo Model",
-		WL_OUTPUT_TRANSFORM_NORMAL
-	};
+	struct ServerState serverState = {0};
+	serverState.mpDisplay = pDisplay;
+	serverState.mpEventLoop = wl_display_get_event_loop(pDisplay);
+	wl_list_init(&serverState.mOutputList);
+	wl_list_init(&serverState.mClientList);
+	wl_list_init(&serverState.mSurfaceList);
+	wl_list_init(&serverState.mXdgConfigureList);
+	serverState.mbEarlyRelease = bEarlyRelease;
+	serverState.mScaleFilter = scaleFilter;
+	SlabPoolInit(&serverState.mClientPool, sizeof(struct ClientState), CLIENTS_PER_SLAB_CHUNK);
+
+	serverState.mpLoopStats = LoopStatsCreate(pDisplay);
+	if( !serverState.mpLoopStats )
+	{
+		printf("Failed to set up event loop instrumentation\n");
+		return 1;
+	}
 
-	printf("Creating Global wl_output Object\n");
-	wl_global_create(
-		pDisplay, &wl_output_interface,
-		wl_output_interface.version,
-		&displayState, wl_output_handle_bind
-	);
+	ShmMappingCacheInit(&serverState.mShmCache);
+	FdMappingCacheInit(&serverState.mFdCache);
+
+	struct OutputState outputs[MAX_OUTPUTS];
+	memset(outputs, 0, sizeof(outputs));
+	int32_t nextX = 0;
+	for( uint32_t i = 0; i < outputCount; i++ )
+	{
+		const struct OutputConfig* pConfig = &outputConfigs[i];
+		const int32_t x = pConfig->mbPositioned ? pConfig->mX : nextX;
+		const int32_t y = pConfig->mbPositioned ? pConfig->mY : 0;
+		if( OutputInit(&outputs[i], &serverState, pConfig, refresh, x, y) == -1 )
+			return 1;
+		PrintOutputInfo(&outputs[i]);
+		nextX = x + outputs[i].mWidth;
+	}
+
+	serverState.mpKernels = SelectBlendKernels(pKernelName);
+	printf("Compositing with %s kernels, scaling with %s filtering\n", serverState.mpKernels->mpName,
+		scaleFilter == SCALE_FILTER_NEAREST ? "nearest" : "bilinear");
+
+	struct WorkerPool workers;
+	if( threadCount < 0 )
+		threadCount = GetDefaultWorkerCount();
+	if( threadCount > 0 )
+	{
+		if( WorkerPoolInit(&workers, threadCount) == -1 )
+		{
+			printf("Failed to start compose workers\n");
+			return 1;
+		}
+		serverState.mpWorkers = &workers;
+		serverState.mpWorkersSource = wl_event_loop_add_fd(
+			serverState.mpEventLoop, workers.mEventFd, WL_EVENT_READABLE,
+			server_workers_done, &serverState
+		);
+		printf("Composing %dx%d tiles on %u worker threads\n",
+			COMPOSE_TILE_WIDTH, COMPOSE_TILE_HEIGHT, workers.mThreadCount);
+	}
+	else
+		printf("Composing on the dispatch thread\n");
+	if( bEarlyRelease )
+		printf("Releasing shm buffers on commit\n");
+
+	struct Capture capture;
+	if( pCapturePrefix )
+	{
+		if( CaptureInit(&capture, pCapturePrefix, captureFormat, captureFrames) == -1 )
+		{
+			printf("Failed to start capture writer\n");
+			return 1;
+		}
+		serverState.mpCapture = &capture;
+		printf("Capturing %s frames to %s-output*\n",
+			captureFormat == CAPTURE_FORMAT_PNG ? "png" : "raw", pCapturePrefix);
+	}
+
+	wl_event_loop_add_signal(serverState.mpEventLoop, SIGINT, server_handle_terminate, &serverState);
+	wl_event_loop_add_signal(serverState.mpEventLoop, SIGTERM, server_handle_terminate, &serverState);
+	// kill -USR1 dumps event loop latency, kill -USR2 per client resource accounting
+	wl_event_loop_add_signal(serverState.mpEventLoop, SIGUSR1, server_handle_loop_stats, &serverState);
+	wl_event_loop_add_signal(serverState.mpEventLoop, SIGUSR2, server_handle_stats, &serverState);
+
+	for( uint32_t i = 0; i < outputCount; i++ )
+	{
+		printf("Creating Global wl_output Object\n");
+		OutputCreateGlobal(&outputs[i]);
+	}
 
 	printf("Creating Global wl_compositor Object\n");
 	wl_global_create(
 		pDisplay, &wl_compositor_interface,
 		wl_compositor_interface.version,
-		NULL, wl_compositor_handle_bind
+		&serverState, wl_compositor_handle_bind
+	);
+
+	printf("Creating Global wl_subcompositor Object\n");
+	wl_global_create(
+		pDisplay, &wl_subcompositor_interface,
+		wl_subcompositor_interface.version,
+		&serverState, wl_subcompositor_handle_bind
+	);
+
+	printf("Creating Global wp_viewporter Object\n");
+	wl_global_create(
+		pDisplay, &wp_viewporter_interface,
+		wp_viewporter_interface.version,
+		&serverState, wp_viewporter_handle_bind
+	);
+
+	printf("Creating Global wp_presentation Object\n");
+	wl_global_create(
+		pDisplay, &wp_presentation_interface,
+		wp_presentation_interface.version,
+		&serverState, wp_presentation_handle_bind
 	);
 
 	printf("Instantiating Global wl_shm Object\n");
@@ -230,11 +454,18 @@ int main( int argc, const char* argv[] )
 	wl_display_add_shm_format( pDisplay, WL_SHM_FORMAT_ARGB8888 );
 	wl_display_add_shm_format( pDisplay, WL_SHM_FORMAT_XRGB8888 );
 
+	printf("Creating Global zwp_linux_dmabuf_v1 Object\n");
+	wl_global_create(
+		pDisplay, &zwp_linux_dmabuf_v1_interface,
+		zwp_linux_dmabuf_v1_interface.version,
+		&serverState, zwp_linux_dmabuf_handle_bind
+	);
+
 	printf("Creating Global xdg_wm_base Object\n");
 	wl_global_create(
 		pDisplay, &xdg_wm_base_interface,
 		xdg_wm_base_interface.version,
-		NULL, xdg_wm_base_handle_bind
+		&serverState, xdg_wm_base_handle_bind
 	);
 
 	const char* pSocket = wl_display_add_socket_auto(pDisplay);
@@ -245,8 +476,42 @@ int main( int argc, const char* argv[] )
 	}
 
 	printf("Running Wayland Display on %s\n",pSocket);
-	wl_display_run(pDisplay);
+	RunInstrumentedLoop(&serverState);
 	printf("Wayland Display %s is about to be destroyed\n", pSocket);
+	PrintLoopStats(serverState.mpLoopStats);
+	for( uint32_t i = 0; i < outputCount; i++ )
+		PrintOutputStats(&outputs[i]);
+	PrintShmMappingStats(&serverState.mShmCache);
+	PrintFdMappingStats(&serverState.mFdCache);
+	PrintDmabufStats(&serverState);
+	PrintPresentationStats(&serverState);
+	PrintXdgShellStats(&serverState);
+	PrintSubsurfaceStats(&serverState);
+	PrintClientStats(&serverState);
+	// prints the buffer release stats of every client still connected
+	wl_display_destroy_clients(pDisplay);
+	if( serverState.mpWorkers )
+	{
+		// frames still in flight are finished and dropped
+		wl_event_source_remove(serverState.mpWorkersSource);
+		WorkerPoolFini(serverState.mpWorkers);
+		serverState.mpWorkers = NULL;
+	}
+	if( serverState.mpCapture )
+	{
+		// queued frames are still written
+		CaptureFini(serverState.mpCapture);
+		PrintCaptureStats(serverState.mpCapture);
+		serverState.mpCapture = NULL;
+	}
+	for( uint32_t i = 0; i < outputCount; i++ )
+		OutputFini(&outputs[i]);
+	LoopStatsDestroy(serverState.mpLoopStats);
 	wl_display_destroy(pDisplay);
+	ShmMappingCacheFini(&serverState.mShmCache);
+	FdMappingCacheFini(&serverState.mFdCache);
+	free(serverState.mpDrawItems);
+	free(serverState.mppSurfaceStack);
+	SlabPoolFini(&serverState.mClientPool);
 	return 0;
 }
@@ -0,0 +1,996 @@
+#ifndef _SERVER_BENCH_H
+#define _SERVER_BENCH_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/udmabuf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include <wayland-server.h>
+
+#include "server_blend.h"
+#include "server_client.h"
+#include "server_dmabuf.h"
+#include "server_fd_cache.h"
+#include "server_output.h"
+#include "server_renderer.h"
+#include "server_state.h"
+#include "server_subsurface.h"
+#include "server_surface.h"
+#include "server_workers.h"
+
+#define BENCH_OUTPUT_WIDTH 1920
+#define BENCH_OUTPUT_HEIGHT 1080
+#define BENCH_4K_WIDTH 3840
+#define BENCH_4K_HEIGHT 2160
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001u
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002u
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#endif
+
+// Synthetic shm-like buffer owned by the benchmarks
+struct BenchBuffer
+{
+	uint32_t* mpPixels;
+	int32_t mWidth, mHeight;
+	uint32_t mFormat;
+};
+
+static int BenchBufferInit(
+	struct BenchBuffer* pBuffer, int32_t width, int32_t height,
+	uint32_t format, uint8_t alpha
+)
+{
+	pBuffer->mWidth = width;
+	pBuffer->mHeight = height;
+	pBuffer->mFormat = format;
+	pBuffer->mpPixels = malloc((size_t)width * height * sizeof(uint32_t));
+	if( !pBuffer->mpPixels )
+		return -1;
+
+	// premultiplied gradient so the blend kernels see real work
+	for( int32_t y = 0; y < height; y++ )
+	{
+		for( int32_t x = 0; x < width; x++ )
+		{
+			uint32_t r = ( x * 255 / width ) * alpha / 255;
+			uint32_t g = ( y * 255 / height ) * alpha / 255;
+			uint32_t b = ( ( x ^ y ) & 0xFF ) * alpha / 255;
+			pBuffer->mpPixels[(size_t)y * width + x] = ( (uint32_t)alpha << 24 ) | ( r << 16 ) | ( g << 8 ) | b;
+		}
+	}
+	return 0;
+}
+
+static void BenchBufferFini( struct BenchBuffer* pBuffer )
+{
+	free(pBuffer->mpPixels);
+	pBuffer->mpPixels = NULL;
+}
+
+static void BenchBufferToDrawItem( const struct BenchBuffer* pBuffer, int32_t x, int32_t y, struct DrawItem* pItem )
+{
+	pItem->mpMapping = NULL;
+	pItem->mpShmBuffer = NULL;
+	pItem->mpFdMapping = NULL;
+	pItem->mpData = (const uint8_t*)pBuffer->mpPixels;
+	pItem->mStride = pBuffer->mWidth * sizeof(uint32_t);
+	pItem->mFormat = pBuffer->mFormat;
+	pItem->mX = x;
+	pItem->mY = y;
+	pItem->mWidth = pBuffer->mWidth;
+	pItem->mHeight = pBuffer->mHeight;
+	pItem->mpOpaque = NULL;
+	pItem->mbOccluded = 0;
+	pItem->mbScaled = 0;
+}
+
+// The whole buffer stretched over width x height, like a viewport with only
+// a destination size
+static void BenchBufferToScaledItem(
+	const struct BenchBuffer* pBuffer, int32_t x, int32_t y,
+	int32_t width, int32_t height, int8_t filter, struct DrawItem* pItem
+)
+{
+	BenchBufferToDrawItem(pBuffer, x, y, pItem);
+	pItem->mWidth = width;
+	pItem->mHeight = height;
+	pItem->mbScaled = 1;
+	pItem->mFilter = filter;
+	pItem->mSrcX = pItem->mSrcY = 0;
+	pItem->mSrcWidth = pBuffer->mWidth << 16;
+	pItem->mSrcHeight = pBuffer->mHeight << 16;
+}
+
+// A full screen XRGB8888 background with three overlapping translucent
+// ARGB8888 windows, composed as full frames with every supported kernel.
+static int RunComposeBenchmark( int32_t frames )
+{
+	struct Framebuffer fb;
+	if( FramebufferInit(&fb, BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT) == -1 )
+	{
+		printf("Failed to allocate benchmark framebuffer\n");
+		return 1;
+	}
+
+	struct BenchBuffer buffers[4];
+	int failed = BenchBufferInit(&buffers[0], BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, WL_SHM_FORMAT_XRGB8888, 0xFF);
+	failed |= BenchBufferInit(&buffers[1], 800, 600, WL_SHM_FORMAT_ARGB8888, 0xC0);
+	failed |= BenchBufferInit(&buffers[2], 800, 600, WL_SHM_FORMAT_ARGB8888, 0x80);
+	failed |= BenchBufferInit(&buffers[3], 640, 480, WL_SHM_FORMAT_ARGB8888, 0xFF);
+	if( failed )
+	{
+		printf("Failed to allocate benchmark buffers\n");
+		return 1;
+	}
+
+	struct DrawItem items[4];
+	BenchBufferToDrawItem(&buffers[0], 0, 0, &items[0]);
+	BenchBufferToDrawItem(&buffers[1], 100, 100, &items[1]);
+	BenchBufferToDrawItem(&buffers[2], 500, 300, &items[2]);
+	BenchBufferToDrawItem(&buffers[3], 1200, 500, &items[3]);
+
+	const struct BlendKernels* pKernels[4];
+	const int32_t kernelCount = GetSupportedBlendKernels(pKernels, 4);
+
+	printf("Compose benchmark: %dx%d output, %d frames per kernel\n",
+		BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, frames);
+
+	for( int32_t k = 0; k < kernelCount; k++ )
+	{
+		struct ComposeStats stats = {0};
+
+		// warm up caches and page in the framebuffer
+		ComposeRect(&fb, items, 4, NULL, pKernels[k], 0, 0, fb.mWidth, fb.mHeight, NULL);
+
+		const uint64_t start = GetTimeNsec();
+		for( int32_t i = 0; i < frames; i++ )
+			ComposeRect(&fb, items, 4, NULL, pKernels[k], 0, 0, fb.mWidth, fb.mHeight, &stats);
+		stats.mNsec = GetTimeNsec() - start;
+		stats.mFrames = frames;
+
+		PrintComposeStats(pKernels[k]->mpName, &stats);
+	}
+
+	// a typical kiosk update, one 5% box of the output is damaged per frame
+	{
+		struct ComposeStats stats = {0};
+		const int32_t damageWidth = BENCH_OUTPUT_WIDTH / 4;
+		const int32_t damageHeight = BENCH_OUTPUT_HEIGHT / 5;
+
+		const uint64_t start = GetTimeNsec();
+		for( int32_t i = 0; i < frames; i++ )
+		{
+			const int32_t x = ( i * 97 ) % ( BENCH_OUTPUT_WIDTH - damageWidth );
+			const int32_t y = ( i * 53 ) % ( BENCH_OUTPUT_HEIGHT - damageHeight );
+			ComposeRect(&fb, items, 4, NULL, pKernels[0], x, y, x + damageWidth, y + damageHeight, &stats);
+		}
+		stats.mNsec = GetTimeNsec() - start;
+		stats.mFrames = frames;
+
+		PrintComposeStats("5% damage", &stats);
+	}
+
+	// dashboards stacking full screen XRGB8888 clients under one translucent
+	// window, drawn back to front and then with occlusion culling
+	{
+		struct DrawItem stack[4];
+		for( int32_t i = 0; i < 3; i++ )
+			BenchBufferToDrawItem(&buffers[0], 0, 0, &stack[i]);
+		BenchBufferToDrawItem(&buffers[1], 100, 100, &stack[3]);
+
+		struct Occlusion occlusion;
+		OcclusionInit(&occlusion);
+		for( int32_t bCull = 0; bCull < 2; bCull++ )
+		{
+			struct ComposeStats stats = {0};
+			const uint64_t start = GetTimeNsec();
+			for( int32_t i = 0; i < frames; i++ )
+			{
+				const struct Region* pBackground = bCull ? CullDrawItems(&occlusion, stack, 4, fb.mWidth, fb.mHeight) : NULL;
+				ComposeRect(&fb, stack, 4, pBackground, pKernels[0], 0, 0, fb.mWidth, fb.mHeight, &stats);
+			}
+			stats.mNsec = GetTimeNsec() - start;
+			stats.mFrames = frames;
+
+			PrintComposeStats(bCull ? "stacked, culled" : "stacked", &stats);
+		}
+		OcclusionFini(&occlusion);
+	}
+
+	for( int32_t i = 0; i < 4; i++ )
+		BenchBufferFini(&buffers[i]);
+	FramebufferFini(&fb);
+	return 0;
+}
+
+// A full screen XRGB8888 client with a translucent ARGB8888 window on top,
+// composed from full resolution buffers and then from half resolution ones
+// upscaled by the viewport path with nearest and bilinear filtering, for
+// every supported kernel. The client uploads a quarter of the pixels.
+static int RunViewportBenchmark( int32_t frames )
+{
+	struct Framebuffer fb;
+	if( FramebufferInit(&fb, BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT) == -1 )
+	{
+		printf("Failed to allocate benchmark framebuffer\n");
+		return 1;
+	}
+
+	struct BenchBuffer buffers[4];
+	int failed = BenchBufferInit(&buffers[0], BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, WL_SHM_FORMAT_XRGB8888, 0xFF);
+	failed |= BenchBufferInit(&buffers[1], 800, 600, WL_SHM_FORMAT_ARGB8888, 0xC0);
+	failed |= BenchBufferInit(&buffers[2], BENCH_OUTPUT_WIDTH / 2, BENCH_OUTPUT_HEIGHT / 2, WL_SHM_FORMAT_XRGB8888, 0xFF);
+	failed |= BenchBufferInit(&buffers[3], 400, 300, WL_SHM_FORMAT_ARGB8888, 0xC0);
+	if( failed )
+	{
+		printf("Failed to allocate benchmark buffers\n");
+		return 1;
+	}
+
+	struct DrawItem native[2];
+	BenchBufferToDrawItem(&buffers[0], 0, 0, &native[0]);
+	BenchBufferToDrawItem(&buffers[1], 300, 200, &native[1]);
+
+	struct DrawItem scaled[2][2];
+	for( int8_t filter = SCALE_FILTER_BILINEAR; filter <= SCALE_FILTER_NEAREST; filter++ )
+	{
+		BenchBufferToScaledItem(&buffers[2], 0, 0, BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, filter, &scaled[filter][0]);
+		BenchBufferToScaledItem(&buffers[3], 300, 200, 800, 600, filter, &scaled[filter][1]);
+	}
+
+	const struct BlendKernels* pKernels[4];
+	const int32_t kernelCount = GetSupportedBlendKernels(pKernels, 4);
+
+	printf("Viewport benchmark: %dx%d output, %d frames per kernel, client upload %.2f MB/frame native, %.2f MB/frame at half resolution\n",
+		BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, frames,
+		( (double)buffers[0].mWidth * buffers[0].mHeight + (double)buffers[1].mWidth * buffers[1].mHeight ) * 4 / 1e6,
+		( (double)buffers[2].mWidth * buffers[2].mHeight + (double)buffers[3].mWidth * buffers[3].mHeight ) * 4 / 1e6
+	);
+
+	for( int32_t k = 0; k < kernelCount; k++ )
+	{
+		const struct DrawItem* pScenes[3] = { native, scaled[SCALE_FILTER_NEAREST], scaled[SCALE_FILTER_BILINEAR] };
+		const char* pSceneNames[3] = { "native", "half, nearest", "half, bilinear" };
+
+		for( int32_t scene = 0; scene < 3; scene++ )
+		{
+			struct ComposeStats stats = {0};
+			ComposeRect(&fb, pScenes[scene], 2, NULL, pKernels[k], 0, 0, fb.mWidth, fb.mHeight, NULL);
+
+			const uint64_t start = GetTimeNsec();
+			for( int32_t i = 0; i < frames; i++ )
+				ComposeRect(&fb, pScenes[scene], 2, NULL, pKernels[k], 0, 0, fb.mWidth, fb.mHeight, &stats);
+			stats.mNsec = GetTimeNsec() - start;
+			stats.mFrames = frames;
+
+			char label[64];
+			snprintf(label, sizeof(label), "%s %s", pKernels[k]->mpName, pSceneNames[scene]);
+			PrintComposeStats(label, &stats);
+		}
+	}
+
+	for( int32_t i = 0; i < 4; i++ )
+		BenchBufferFini(&buffers[i]);
+	FramebufferFini(&fb);
+	return 0;
+}
+
+// memfd holding the pixels of pBuffer, sealed against shrinking like a
+// client would before importing it. -1 on failure.
+static int BenchCreateMemfd( const struct BenchBuffer* pBuffer )
+{
+	const size_t size = (size_t)pBuffer->mWidth * pBuffer->mHeight * sizeof(uint32_t);
+	const int fd = (int)syscall(SYS_memfd_create, "bench-dmabuf", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if( fd == -1 )
+		return -1;
+
+	if( ftruncate(fd, (off_t)size) == -1 ||
+		pwrite(fd, pBuffer->mpPixels, size, 0) != (ssize_t)size ||
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == -1 )
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// dma-buf exported by /dev/udmabuf from memfd, -1 where the driver is missing
+static int BenchCreateUdmabuf( int memfd, size_t size )
+{
+	const int devFd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if( devFd == -1 )
+		return -1;
+
+	struct udmabuf_create create = {0};
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+	const int fd = ioctl(devFd, UDMABUF_CREATE, &create);
+	close(devFd);
+	return fd;
+}
+
+struct BenchImportStats
+{
+	uint64_t mSetupNsec;
+	uint64_t mComposeNsec;
+};
+
+static void PrintBenchImportStats( const char* pLabel, const struct BenchImportStats* pStats, int32_t frames )
+{
+	printf("%s: %.3f ms/frame, %.3f ms mapping, %.3f ms composing\n", pLabel,
+		( pStats->mSetupNsec + pStats->mComposeNsec ) / 1e6 / frames,
+		pStats->mSetupNsec / 1e6 / frames,
+		pStats->mComposeNsec / 1e6 / frames
+	);
+}
+
+// Server side cost of getting a client's 4K XRGB8888 frame on screen, a new
+// buffer every frame. wl_shm clients that create a pool per frame make the
+// server mmap, fault in and munmap 33 MB each time; a persistent pool is
+// mapped once. Imported memfds and udmabufs are received as a new fd every
+// frame like over the socket and resolve to the cached mapping. The pixels
+// are composed into a 4K framebuffer in all cases.
+static int RunDmabufBenchmark( int32_t frames )
+{
+	struct Framebuffer fb;
+	if( FramebufferInit(&fb, BENCH_4K_WIDTH, BENCH_4K_HEIGHT) == -1 )
+	{
+		printf("Failed to allocate benchmark framebuffer\n");
+		return 1;
+	}
+
+	struct BenchBuffer buffer;
+	if( BenchBufferInit(&buffer, BENCH_4K_WIDTH, BENCH_4K_HEIGHT, WL_SHM_FORMAT_XRGB8888, 0xFF) == -1 )
+	{
+		printf("Failed to allocate benchmark buffers\n");
+		return 1;
+	}
+
+	const size_t size = (size_t)buffer.mWidth * buffer.mHeight * sizeof(uint32_t);
+	const int memfd = BenchCreateMemfd(&buffer);
+	if( memfd == -1 )
+	{
+		printf("Failed to create benchmark memfd\n");
+		return 1;
+	}
+	const int udmabuf = BenchCreateUdmabuf(memfd, size);
+
+	const struct BlendKernels* pKernels[4];
+	GetSupportedBlendKernels(pKernels, 4);
+
+	struct DrawItem item;
+	BenchBufferToDrawItem(&buffer, 0, 0, &item);
+
+	printf("Dmabuf benchmark: %dx%d XRGB8888 buffer, %.1f MB, %s kernels, %d frames per path\n",
+		BENCH_4K_WIDTH, BENCH_4K_HEIGHT, size / 1e6, pKernels[0]->mpName, frames);
+
+	// warm up caches and page in the framebuffer
+	ComposeRect(&fb, &item, 1, NULL, pKernels[0], 0, 0, fb.mWidth, fb.mHeight, NULL);
+
+	// wl_shm, a new pool per frame
+	{
+		struct BenchImportStats stats = {0};
+		for( int32_t i = 0; i < frames; i++ )
+		{
+			const uint64_t t0 = GetTimeNsec();
+			const int fd = dup(memfd);
+			void* pData = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if( pData == MAP_FAILED )
+			{
+				printf("Failed to map benchmark memfd\n");
+				return 1;
+			}
+			const uint64_t t1 = GetTimeNsec();
+			item.mpData = pData;
+			ComposeRect(&fb, &item, 1, NULL, pKernels[0], 0, 0, fb.mWidth, fb.mHeight, NULL);
+			const uint64_t t2 = GetTimeNsec();
+			munmap(pData, size);
+			const uint64_t t3 = GetTimeNsec();
+
+			stats.mSetupNsec += ( t1 - t0 ) + ( t3 - t2 );
+			stats.mComposeNsec += t2 - t1;
+		}
+		PrintBenchImportStats("wl_shm, pool per frame", &stats, frames);
+	}
+
+	// wl_shm, one persistent pool
+	{
+		struct BenchImportStats stats = {0};
+		void* pData = mmap(NULL, size, PROT_READ, MAP_SHARED, memfd, 0);
+		if( pData == MAP_FAILED )
+		{
+			printf("Failed to map benchmark memfd\n");
+			return 1;
+		}
+		item.mpData = pData;
+		for( int32_t i = 0; i < frames; i++ )
+		{
+			const uint64_t start = GetTimeNsec();
+			ComposeRect(&fb, &item, 1, NULL, pKernels[0], 0, 0, fb.mWidth, fb.mHeight, NULL);
+			stats.mComposeNsec += GetTimeNsec() - start;
+		}
+		munmap(pData, size);
+		PrintBenchImportStats("wl_shm, persistent pool", &stats, frames);
+	}
+
+	// imports of the same memory through the FdMappingCache
+	const int importFds[2] = { memfd, udmabuf };
+	const char* pImportNames[2] = { "dmabuf import, memfd", "dmabuf import, udmabuf" };
+	for( int32_t path = 0; path < 2; path++ )
+	{
+		if( importFds[path] == -1 )
+		{
+			printf("%s: /dev/udmabuf is not available\n", pImportNames[path]);
+			continue;
+		}
+
+		struct FdMappingCache cache;
+		FdMappingCacheInit(&cache);
+		struct BenchImportStats stats = {0};
+		for( int32_t i = 0; i < frames; i++ )
+		{
+			const uint64_t t0 = GetTimeNsec();
+			const int fd = dup(importFds[path]);
+			struct FdMapping* pMapping = DmabufFdIsStable(fd) ? FdMappingAcquire(&cache, fd, size) : NULL;
+			close(fd);
+			if( !pMapping )
+			{
+				printf("%s: import failed\n", pImportNames[path]);
+				break;
+			}
+			const uint64_t t1 = GetTimeNsec();
+			item.mpData = pMapping->mpData;
+			FdMappingBeginAccess(pMapping);
+			ComposeRect(&fb, &item, 1, NULL, pKernels[0], 0, 0, fb.mWidth, fb.mHeight, NULL);
+			FdMappingEndAccess(pMapping);
+			const uint64_t t2 = GetTimeNsec();
+			// the wl_buffer is destroyed right after its frame
+			FdMappingRelease(&cache, pMapping);
+			const uint64_t t3 = GetTimeNsec();
+
+			stats.mSetupNsec += ( t1 - t0 ) + ( t3 - t2 );
+			stats.mComposeNsec += t2 - t1;
+		}
+		PrintBenchImportStats(pImportNames[path], &stats, frames);
+		PrintFdMappingStats(&cache);
+		FdMappingCacheFini(&cache);
+	}
+
+	if( udmabuf != -1 )
+		close(udmabuf);
+	close(memfd);
+	BenchBufferFini(&buffer);
+	FramebufferFini(&fb);
+	return 0;
+}
+
+// Compose cost as a row of 1920x1080 outputs grows from 1 to 8. Every output
+// shows a background and three windows, plus one window straddling each seam
+// so it is clipped into two outputs. Each output gets its own framebuffer and
+// draw list culled to the surfaces overlapping it, like RepaintOutput.
+#define BENCH_MAX_OUTPUTS 8
+
+static int RunOutputBenchmark( int32_t frames )
+{
+	struct BenchBuffer buffers[4];
+	int failed = BenchBufferInit(&buffers[0], BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, WL_SHM_FORMAT_XRGB8888, 0xFF);
+	failed |= BenchBufferInit(&buffers[1], 800, 600, WL_SHM_FORMAT_ARGB8888, 0xC0);
+	failed |= BenchBufferInit(&buffers[2], 640, 480, WL_SHM_FORMAT_ARGB8888, 0x80);
+	failed |= BenchBufferInit(&buffers[3], 400, 300, WL_SHM_FORMAT_ARGB8888, 0xE0);
+	if( failed )
+	{
+		printf("Failed to allocate benchmark buffers\n");
+		return 1;
+	}
+
+	struct Framebuffer framebuffers[BENCH_MAX_OUTPUTS];
+	for( int32_t i = 0; i < BENCH_MAX_OUTPUTS; i++ )
+	{
+		if( FramebufferInit(&framebuffers[i], BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT) == -1 )
+		{
+			printf("Failed to allocate benchmark framebuffer\n");
+			return 1;
+		}
+	}
+
+	// global scene for the widest layout
+	enum { ITEMS_PER_OUTPUT = 5 };
+	struct DrawItem scene[BENCH_MAX_OUTPUTS * ITEMS_PER_OUTPUT];
+	struct DrawItem items[BENCH_MAX_OUTPUTS * ITEMS_PER_OUTPUT];
+
+	const struct BlendKernels* pKernels[4];
+	GetSupportedBlendKernels(pKernels, 4);
+
+	printf("Output benchmark: %dx%d outputs, %s kernels, %d frames per layout\n",
+		BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, pKernels[0]->mpName, frames);
+
+	for( int32_t outputCount = 1; outputCount <= BENCH_MAX_OUTPUTS; outputCount++ )
+	{
+		uint32_t sceneCount = 0;
+		for( int32_t o = 0; o < outputCount; o++ )
+		{
+			const int32_t x = o * BENCH_OUTPUT_WIDTH;
+			BenchBufferToDrawItem(&buffers[0], x, 0, &scene[sceneCount++]);
+			BenchBufferToDrawItem(&buffers[1], x + 100, 100, &scene[sceneCount++]);
+			BenchBufferToDrawItem(&buffers[2], x + 700, 400, &scene[sceneCount++]);
+			BenchBufferToDrawItem(&buffers[3], x + 1300, 200, &scene[sceneCount++]);
+			if( o + 1 < outputCount )
+				BenchBufferToDrawItem(&buffers[1], x + BENCH_OUTPUT_WIDTH - 400, 500, &scene[sceneCount++]);
+		}
+
+		struct ComposeStats stats = {0};
+		const uint64_t start = GetTimeNsec();
+		for( int32_t i = 0; i < frames; i++ )
+		{
+			for( int32_t o = 0; o < outputCount; o++ )
+			{
+				const int32_t outputX = o * BENCH_OUTPUT_WIDTH;
+
+				uint32_t itemCount = 0;
+				for( uint32_t j = 0; j < sceneCount; j++ )
+				{
+					const struct DrawItem* pItem = &scene[j];
+					if( pItem->mX >= outputX + BENCH_OUTPUT_WIDTH || pItem->mX + pItem->mWidth <= outputX )
+						continue;
+
+					items[itemCount] = *pItem;
+					items[itemCount].mX -= outputX;
+					itemCount++;
+				}
+
+				ComposeRect(&framebuffers[o], items, itemCount, NULL, pKernels[0], 0, 0, BENCH_OUTPUT_WIDTH, BENCH_OUTPUT_HEIGHT, &stats);
+			}
+		}
+		stats.mNsec = GetTimeNsec() - start;
+		stats.mFrames = frames;
+
+		char label[32];
+		snprintf(label, sizeof(label), "%d output%s", outputCount, outputCount > 1 ? "s" : "");
+		PrintComposeStats(label, &stats);
+		printf("    %.3f ms per output per frame\n", stats.mNsec / 1e6 / frames / outputCount);
+	}
+
+	for( int32_t i = 0; i < BENCH_MAX_OUTPUTS; i++ )
+		FramebufferFini(&framebuffers[i]);
+	for( int32_t i = 0; i < 4; i++ )
+		BenchBufferFini(&buffers[i]);
+	return 0;
+}
+
+// Full frames of two 3840x2160 outputs composed on the dispatch thread and
+// then by tile worker pools of 1, 2, 4 and 8 threads. Both outputs are
+// submitted before waiting, like two outputs sharing a vblank.
+#define BENCH_4K_OUTPUTS 2
+
+static int RunThreadBenchmark( int32_t frames )
+{
+	struct BenchBuffer buffers[4];
+	int failed = BenchBufferInit(&buffers[0], BENCH_4K_WIDTH, BENCH_4K_HEIGHT, WL_SHM_FORMAT_XRGB8888, 0xFF);
+	failed |= BenchBufferInit(&buffers[1], 1600, 1200, WL_SHM_FORMAT_ARGB8888, 0xC0);
+	failed |= BenchBufferInit(&buffers[2], 1280, 960, WL_SHM_FORMAT_ARGB8888, 0x80);
+	failed |= BenchBufferInit(&buffers[3], 800, 600, WL_SHM_FORMAT_ARGB8888, 0xE0);
+	if( failed )
+	{
+		printf("Failed to allocate benchmark buffers\n");
+		return 1;
+	}
+
+	struct Framebuffer framebuffers[BENCH_4K_OUTPUTS];
+	struct ComposeJob jobs[BENCH_4K_OUTPUTS];
+	for( int32_t o = 0; o < BENCH_4K_OUTPUTS; o++ )
+	{
+		if( FramebufferInit(&framebuffers[o], BENCH_4K_WIDTH, BENCH_4K_HEIGHT) == -1 )
+		{
+			printf("Failed to allocate benchmark framebuffer\n");
+			return 1;
+		}
+		ComposeJobInit(&jobs[o], NULL);
+	}
+
+	struct DrawItem items[4];
+	BenchBufferToDrawItem(&buffers[0], 0, 0, &items[0]);
+	BenchBufferToDrawItem(&buffers[1], 200, 200, &items[1]);
+	BenchBufferToDrawItem(&buffers[2], 1000, 600, &items[2]);
+	BenchBufferToDrawItem(&buffers[3], 2600, 1000, &items[3]);
+
+	const struct BlendKernels* pKernels[4];
+	GetSupportedBlendKernels(pKernels, 4);
+
+	printf("Thread benchmark: %d %dx%d outputs, %s kernels, %dx%d tiles, %d frames, %u cpus\n",
+		BENCH_4K_OUTPUTS, BENCH_4K_WIDTH, BENCH_4K_HEIGHT, pKernels[0]->mpName,
+		COMPOSE_TILE_WIDTH, COMPOSE_TILE_HEIGHT, frames, GetDefaultWorkerCount());
+
+	double baseline = 0.0;
+	{
+		const uint64_t start = GetTimeNsec();
+		for( int32_t i = 0; i < frames; i++ )
+		{
+			for( int32_t o = 0; o < BENCH_4K_OUTPUTS; o++ )
+				ComposeRect(&framebuffers[o], items, 4, NULL, pKernels[0], 0, 0, BENCH_4K_WIDTH, BENCH_4K_HEIGHT, NULL);
+		}
+		baseline = frames / ( ( GetTimeNsec() - start ) / 1e9 );
+		printf("dispatch thread: %.1f frames/s\n", baseline);
+	}
+
+	const uint32_t threadCounts[] = { 1, 2, 4, 8 };
+	for( uint32_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++ )
+	{
+		struct WorkerPool pool;
+		if( WorkerPoolInit(&pool, threadCounts[t]) == -1 )
+		{
+			printf("Failed to start %u worker threads\n", threadCounts[t]);
+			break;
+		}
+
+		const uint64_t start = GetTimeNsec();
+		for( int32_t i = 0; i < frames; i++ )
+		{
+			for( int32_t o = 0; o < BENCH_4K_OUTPUTS; o++ )
+			{
+				struct ComposeJob* pJob = &jobs[o];
+				pJob->mpFramebuffer = &framebuffers[o];
+				pJob->mpKernels = pKernels[0];
+				if( ComposeJobSetItems(pJob, items, 4) == -1 ||
+					ComposeJobAddRect(pJob, &framebuffers[o], 0, 0, BENCH_4K_WIDTH, BENCH_4K_HEIGHT) == -1 )
+				{
+					printf("Failed to build compose job\n");
+					return 1;
+				}
+				WorkerPoolSubmit(&pool, pJob);
+			}
+			WorkerPoolWait(&pool);
+			while( WorkerPoolCollect(&pool) )
+				;
+		}
+		const double fps = frames / ( ( GetTimeNsec() - start ) / 1e9 );
+		WorkerPoolFini(&pool);
+
+		printf("%u thread%s: %.1f frames/s, %.2fx\n",
+			threadCounts[t], threadCounts[t] > 1 ? "s" : "", fps, fps / baseline);
+	}
+
+	for( int32_t o = 0; o < BENCH_4K_OUTPUTS; o++ )
+	{
+		ComposeJobFini(&jobs[o]);
+		FramebufferFini(&framebuffers[o]);
+	}
+	for( int32_t i = 0; i < 4; i++ )
+		BenchBufferFini(&buffers[i]);
+	return 0;
+}
+
+// Hot-plug with BENCH_HOTPLUG_CLIENTS clients connected over socketpairs,
+// all bound to a first output. Each cycle plugs a second output, binds it
+// for every client the way their registries would, switches its mode,
+// unplugs it and has every client release the stale binding. The peers are
+// drained after each step so the sockets never fill up.
+#define BENCH_HOTPLUG_CLIENTS 500
+
+// Returns the time spent flushing
+static uint64_t BenchFlushClients( struct wl_display* pDisplay, const int* pPeers, uint32_t count, uint64_t* pBytes )
+{
+	const uint64_t start = GetTimeNsec();
+	wl_display_flush_clients(pDisplay);
+	const uint64_t nsec = GetTimeNsec() - start;
+
+	char buffer[4096];
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		ssize_t length;
+		while( ( length = read(pPeers[i], buffer, sizeof(buffer)) ) > 0 )
+			*pBytes += length;
+	}
+	return nsec;
+}
+
+static int RunHotplugBenchmark( int32_t cycles )
+{
+	struct wl_display* pDisplay = wl_display_create();
+	if( !pDisplay )
+	{
+		printf("Failed to create Wayland Display\n");
+		return 1;
+	}
+
+	struct ServerState server = {0};
+	server.mpDisplay = pDisplay;
+	server.mpEventLoop = wl_display_get_event_loop(pDisplay);
+	wl_list_init(&server.mOutputList);
+	wl_list_init(&server.mClientList);
+	wl_list_init(&server.mSurfaceList);
+	wl_list_init(&server.mXdgConfigureList);
+	SlabPoolInit(&server.mClientPool, sizeof(struct ClientState), CLIENTS_PER_SLAB_CHUNK);
+	ShmMappingCacheInit(&server.mShmCache);
+	server.mpKernels = SelectBlendKernels(NULL);
+
+	struct OutputConfig config;
+	ParseOutputConfig("1920x1080", &config);
+	struct OutputState* pFirst = calloc(1, sizeof(struct OutputState));
+	if( !pFirst || OutputInit(pFirst, &server, &config, 0, 0, 0) == -1 || OutputCreateGlobal(pFirst) == -1 )
+	{
+		printf("Failed to create benchmark output\n");
+		return 1;
+	}
+
+	struct wl_client* pClients[BENCH_HOTPLUG_CLIENTS];
+	int peers[BENCH_HOTPLUG_CLIENTS];
+	uint32_t clientCount = 0;
+	for( ; clientCount < BENCH_HOTPLUG_CLIENTS; clientCount++ )
+	{
+		int fds[2];
+		if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1 )
+			break;
+		pClients[clientCount] = wl_client_create(pDisplay, fds[0]);
+		if( !pClients[clientCount] )
+		{
+			close(fds[0]);
+			close(fds[1]);
+			break;
+		}
+		peers[clientCount] = fds[1];
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+		// id 0 lets libwayland pick a free server side id
+		wl_output_handle_bind(pClients[clientCount], pFirst, wl_output_interface.version, 0);
+	}
+
+	uint64_t bytes = 0;
+	BenchFlushClients(pDisplay, peers, clientCount, &bytes);
+	printf("Hot-plug benchmark: %u clients, wl_output version %d, %d cycles\n",
+		clientCount, wl_output_interface.version, cycles);
+
+	uint64_t plugNsec = 0, bindNsec = 0, modeNsec = 0, unplugNsec = 0, releaseNsec = 0, flushNsec = 0;
+	bytes = 0;
+	for( int32_t c = 0; c < cycles; c++ )
+	{
+		struct OutputState* pOutput = calloc(1, sizeof(struct OutputState));
+		uint64_t start = GetTimeNsec();
+		if( !pOutput || OutputInit(pOutput, &server, &config, 0, 1920, 0) == -1 || OutputCreateGlobal(pOutput) == -1 )
+		{
+			printf("Failed to plug benchmark output\n");
+			return 1;
+		}
+		plugNsec += GetTimeNsec() - start;
+
+		start = GetTimeNsec();
+		for( uint32_t i = 0; i < clientCount; i++ )
+			wl_output_handle_bind(pClients[i], pOutput, wl_output_interface.version, 0);
+		bindNsec += GetTimeNsec() - start;
+		flushNsec += BenchFlushClients(pDisplay, peers, clientCount, &bytes);
+
+		start = GetTimeNsec();
+		OutputSetMode(pOutput, ( c & 1 ) ? 1920 : 2560, ( c & 1 ) ? 1080 : 1440, 0);
+		modeNsec += GetTimeNsec() - start;
+		flushNsec += BenchFlushClients(pDisplay, peers, clientCount, &bytes);
+
+		start = GetTimeNsec();
+		OutputRemove(pOutput);
+		unplugNsec += GetTimeNsec() - start;
+		free(pOutput);
+
+		// what the clients do once they see global_remove
+		start = GetTimeNsec();
+		for( uint32_t i = 0; i < clientCount; i++ )
+		{
+			struct ClientState* pClientState = FindClientState(pClients[i]);
+			struct Output* pClientOutput;
+			struct Output* pTmp;
+			wl_list_for_each_safe(pClientOutput, pTmp, &pClientState->mOutputList, mLink)
+			{
+				if( !pClientOutput->mpState )
+					wl_resource_destroy(pClientOutput->mpResource);
+			}
+		}
+		releaseNsec += GetTimeNsec() - start;
+		flushNsec += BenchFlushClients(pDisplay, peers, clientCount, &bytes);
+	}
+
+	const double perCycle = cycles > 0 ? 1000.0 * cycles : 1.0;
+	printf("    plug %.1f us, bind %.1f us (%.0f ns per client)\n",
+		plugNsec / perCycle, bindNsec / perCycle, bindNsec / perCycle * 1000.0 / clientCount);
+	printf("    mode change fan-out %.1f us (%.0f ns per binding)\n",
+		modeNsec / perCycle, modeNsec / perCycle * 1000.0 / clientCount);
+	printf("    unplug %.1f us, release %.1f us\n", unplugNsec / perCycle, releaseNsec / perCycle);
+	printf("    flush %.1f us, %.1f KB to the clients per cycle\n", flushNsec / perCycle, bytes / 1024.0 / ( cycles > 0 ? cycles : 1 ));
+
+	for( uint32_t i = 0; i < clientCount; i++ )
+	{
+		wl_client_destroy(pClients[i]);
+		close(peers[i]);
+	}
+	OutputFini(pFirst);
+	free(pFirst);
+	wl_display_destroy(pDisplay);
+	ShmMappingCacheFini(&server.mShmCache);
+	free(server.mpDrawItems);
+	SlabPoolFini(&server.mClientPool);
+	return 0;
+}
+
+// A video player per window, BENCH_SUBSURFACE_WINDOWS times over: an opaque
+// video subsurface below its UI surface and a translucent overlay
+// subsurface above it, both synchronized. Each frame every video and
+// overlay commits and their parent applies them, then the output's draw
+// list is built from the cached stack. The same draw lists are built again
+// with the stack flattened every frame, like walking the trees would.
+#define BENCH_SUBSURFACE_WINDOWS 64
+
+static struct Surface* BenchCreateSurface(
+	struct ServerState* pServer, struct wl_client* pClient,
+	const struct BenchBuffer* pBuffer, int32_t x, int32_t y
+)
+{
+	struct Surface* pSurface = CreateSurface(pServer, pClient, wl_surface_interface.version, 0);
+	if( !pSurface || SurfaceShadowReserve(&pSurface->mShadow, pBuffer->mWidth, pBuffer->mHeight) == -1 )
+		return NULL;
+
+	// drawn from the shadow like an early released buffer
+	memcpy(pSurface->mShadow.mpPixels, pBuffer->mpPixels, (size_t)pBuffer->mWidth * pBuffer->mHeight * sizeof(uint32_t));
+	pSurface->mShadow.mWidth = pBuffer->mWidth;
+	pSurface->mShadow.mHeight = pBuffer->mHeight;
+	pSurface->mShadow.mFormat = pBuffer->mFormat;
+	pSurface->mShadow.mbValid = 1;
+	pSurface->mBufferWidth = pBuffer->mWidth;
+	pSurface->mBufferHeight = pBuffer->mHeight;
+	pSurface->mBufferFormat = pBuffer->mFormat;
+	pSurface->mPending.mDx = x;
+	pSurface->mPending.mDy = y;
+	return pSurface;
+}
+
+static int RunSubsurfaceBenchmark( int32_t frames )
+{
+	struct BenchBuffer buffers[3];
+	int failed = BenchBufferInit(&buffers[0], 320, 240, WL_SHM_FORMAT_ARGB8888, 0xE0);
+	failed |= BenchBufferInit(&buffers[1], 320, 180, WL_SHM_FORMAT_XRGB8888, 0xFF);
+	failed |= BenchBufferInit(&buffers[2], 320, 40, WL_SHM_FORMAT_ARGB8888, 0x80);
+	if( failed )
+	{
+		printf("Failed to allocate benchmark buffers\n");
+		return 1;
+	}
+
+	struct wl_display* pDisplay = wl_display_create();
+	if( !pDisplay )
+	{
+		printf("Failed to create Wayland Display\n");
+		return 1;
+	}
+
+	struct ServerState server = {0};
+	server.mpDisplay = pDisplay;
+	server.mpEventLoop = wl_display_get_event_loop(pDisplay);
+	wl_list_init(&server.mOutputList);
+	wl_list_init(&server.mClientList);
+	wl_list_init(&server.mSurfaceList);
+	wl_list_init(&server.mXdgConfigureList);
+	SlabPoolInit(&server.mClientPool, sizeof(struct ClientState), CLIENTS_PER_SLAB_CHUNK);
+	ShmMappingCacheInit(&server.mShmCache);
+	server.mpKernels = SelectBlendKernels(NULL);
+
+	struct OutputConfig config;
+	ParseOutputConfig("1920x1080", &config);
+	struct OutputState* pOutput = calloc(1, sizeof(struct OutputState));
+	if( !pOutput || OutputInit(pOutput, &server, &config, 0, 0, 0) == -1 )
+	{
+		printf("Failed to create benchmark output\n");
+		return 1;
+	}
+
+	int fds[2];
+	struct wl_client* pClient = NULL;
+	if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == 0 )
+		pClient = wl_client_create(pDisplay, fds[0]);
+	if( !pClient )
+	{
+		printf("Failed to create benchmark client\n");
+		return 1;
+	}
+	fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+	wl_subcompositor_handle_bind(pClient, &server, wl_subcompositor_interface.version, 0);
+	struct ClientState* pClientState = FindClientState(pClient);
+	struct Subcompositor* pSubcompositor = wl_container_of(pClientState->mSubcompositorList.next, pSubcompositor, mLink);
+
+	struct Surface* pParents[BENCH_SUBSURFACE_WINDOWS];
+	struct Subsurface* pChildren[BENCH_SUBSURFACE_WINDOWS][2];
+	for( int32_t i = 0; i < BENCH_SUBSURFACE_WINDOWS; i++ )
+	{
+		// an 8x8 grid of windows overlapping their neighbours a little
+		const int32_t x = ( i % 8 ) * 220;
+		const int32_t y = ( i / 8 ) * 120;
+		struct Surface* pParent = BenchCreateSurface(&server, pClient, &buffers[0], x, y);
+		struct Surface* pVideo = BenchCreateSurface(&server, pClient, &buffers[1], 0, 0);
+		struct Surface* pOverlay = BenchCreateSurface(&server, pClient, &buffers[2], 0, 0);
+		if( !pParent || !pVideo || !pOverlay )
+		{
+			printf("Failed to create benchmark surfaces\n");
+			return 1;
+		}
+
+		pChildren[i][0] = CreateSubsurface(pSubcompositor, wl_subsurface_interface.version, 0, pVideo->mpResource, pParent->mpResource);
+		pChildren[i][1] = CreateSubsurface(pSubcompositor, wl_subsurface_interface.version, 0, pOverlay->mpResource, pParent->mpResource);
+		if( !pChildren[i][0] || !pChildren[i][1] )
+		{
+			printf("Failed to create benchmark subsurfaces\n");
+			return 1;
+		}
+		wl_subsurface_handle_place_below(pClient, pChildren[i][0]->mpResource, pParent->mpResource);
+		wl_subsurface_handle_set_position(pClient, pChildren[i][0]->mpResource, 0, 30);
+		wl_subsurface_handle_set_position(pClient, pChildren[i][1]->mpResource, 0, 200);
+		wl_surface_handle_commit(pClient, pVideo->mpResource);
+		wl_surface_handle_commit(pClient, pOverlay->mpResource);
+		wl_surface_handle_commit(pClient, pParent->mpResource);
+		pParents[i] = pParent;
+	}
+
+	uint32_t items = 0;
+	const uint64_t rebuildsBefore = server.mSubsurfaceStats.mStackRebuilds;
+	uint64_t commitNsec = 0, cachedNsec = 0, flattenNsec = 0;
+	for( int32_t f = 0; f < frames; f++ )
+	{
+		uint64_t start = GetTimeNsec();
+		for( int32_t i = 0; i < BENCH_SUBSURFACE_WINDOWS; i++ )
+		{
+			wl_surface_handle_commit(pClient, pChildren[i][0]->mpSurface->mpResource);
+			wl_surface_handle_commit(pClient, pChildren[i][1]->mpSurface->mpResource);
+			wl_surface_handle_commit(pClient, pParents[i]->mpResource);
+		}
+		commitNsec += GetTimeNsec() - start;
+
+		start = GetTimeNsec();
+		items = BuildDrawList(&server, pOutput);
+		cachedNsec += GetTimeNsec() - start;
+	}
+	const uint64_t rebuilds = server.mSubsurfaceStats.mStackRebuilds - rebuildsBefore;
+
+	for( int32_t f = 0; f < frames; f++ )
+	{
+		const uint64_t start = GetTimeNsec();
+		MarkSurfaceStackDirty(&server);
+		BuildDrawList(&server, pOutput);
+		flattenNsec += GetTimeNsec() - start;
+	}
+
+	const double perFrame = frames > 0 ? 1000.0 * frames : 1.0;
+	printf("Subsurface benchmark: %d windows, %u surfaces, %u draw items, %d frames\n",
+		BENCH_SUBSURFACE_WINDOWS, server.mSurfaceStackCount, items, frames);
+	printf("    synchronized commits %.1f us per frame, %llu cached, %llu applied by the parent\n",
+		commitNsec / perFrame,
+		(unsigned long long)server.mSubsurfaceStats.mCachedCommits,
+		(unsigned long long)server.mSubsurfaceStats.mParentApplies);
+	printf("    draw list from the cached stack %.2f us per frame, %llu rebuilds\n",
+		cachedNsec / perFrame, (unsigned long long)rebuilds);
+	printf("    draw list flattening the trees every frame %.2f us per frame\n", flattenNsec / perFrame);
+
+	wl_client_destroy(pClient);
+	close(fds[1]);
+	OutputFini(pOutput);
+	free(pOutput);
+	wl_display_destroy(pDisplay);
+	ShmMappingCacheFini(&server.mShmCache);
+	free(server.mpDrawItems);
+	free(server.mppSurfaceStack);
+	SlabPoolFini(&server.mClientPool);
+	for( int32_t i = 0; i < 3; i++ )
+		BenchBufferFini(&buffers[i]);
+	return 0;
+}
+
+#endif
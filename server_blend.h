@@ -0,0 +1,606 @@
+#ifndef _SERVER_BLEND_H
+#define _SERVER_BLEND_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#define BLEND_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BLEND_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Row kernels for 32bpp pixels in wl_shm little endian layout (B, G, R, A in
+// memory). ARGB8888 sources are premultiplied as required by wl_shm, so
+// "over" is dst = src + dst * ( 255 - src.a ) / 255 on every channel.
+
+typedef void (*BlendRowFunc)( uint32_t* pDst, const uint32_t* pSrc, int32_t count );
+typedef void (*CopyRowFunc)( uint32_t* pDst, const uint32_t* pSrc, int32_t count );
+typedef void (*FillRowFunc)( uint32_t* pDst, uint32_t color, int32_t count );
+// Samples count pixels of a scaled row. x is the first sample in 16.16
+// source pixels and advances by dx, samples outside [0, maxX] are clamped
+// to the edge. Bilinear filtering blends the pSrc0 row into the pSrc1 row
+// by fy / 256, nearest only reads pSrc0.
+typedef void (*ScaleRowFunc)(
+	uint32_t* pDst, const uint32_t* pSrc0, const uint32_t* pSrc1, uint32_t fy,
+	int32_t x, int32_t dx, int32_t maxX, int32_t count
+);
+
+struct BlendKernels
+{
+	const char* mpName;
+	BlendRowFunc mBlendRow;
+	CopyRowFunc mCopyRow;
+	FillRowFunc mFillRow;
+	ScaleRowFunc mScaleRowNearest;
+	ScaleRowFunc mScaleRowBilinear;
+};
+
+// rounded x / 255 for x in [0, 255 * 255]
+static inline uint32_t Div255( uint32_t x )
+{
+	x += 128;
+	return ( x + ( x >> 8 ) ) >> 8;
+}
+
+static inline int32_t ClampSample( int32_t x, int32_t maxX )
+{
+	return x < 0 ? 0 : ( x > maxX ? maxX : x );
+}
+
+// a + ( b - a ) * f / 256 on every channel, two channels per multiply
+static inline uint32_t LerpPixel( uint32_t a, uint32_t b, uint32_t f )
+{
+	const uint32_t rb = ( ( a & 0x00FF00FF ) * ( 256 - f ) + ( b & 0x00FF00FF ) * f + 0x00800080 ) >> 8;
+	const uint32_t ag = ( ( a >> 8 ) & 0x00FF00FF ) * ( 256 - f ) + ( ( b >> 8 ) & 0x00FF00FF ) * f + 0x00800080;
+	return ( rb & 0x00FF00FF ) | ( ag & 0xFF00FF00 );
+}
+
+// Scalar
+
+static void BlendRowScalar( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	for( int32_t i = 0; i < count; i++ )
+	{
+		const uint32_t s = pSrc[i];
+		const uint32_t a = s >> 24;
+
+		if( a == 0xFF )
+		{
+			pDst[i] = s;
+			continue;
+		}
+		if( s == 0 )
+			continue;
+
+		const uint32_t d = pDst[i];
+		const uint32_t inv = 255 - a;
+		uint32_t out = 0;
+		for( int shift = 0; shift < 32; shift += 8 )
+		{
+			uint32_t c = ( ( s >> shift ) & 0xFF ) + Div255( ( ( d >> shift ) & 0xFF ) * inv );
+			out |= ( c > 255 ? 255 : c ) << shift;
+		}
+		pDst[i] = out;
+	}
+}
+
+static void CopyRowScalar( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	for( int32_t i = 0; i < count; i++ )
+		pDst[i] = pSrc[i] | 0xFF000000;
+}
+
+static void FillRowScalar( uint32_t* pDst, uint32_t color, int32_t count )
+{
+	for( int32_t i = 0; i < count; i++ )
+		pDst[i] = color;
+}
+
+static void ScaleRowNearestScalar(
+	uint32_t* pDst, const uint32_t* pSrc0, const uint32_t* pSrc1, uint32_t fy,
+	int32_t x, int32_t dx, int32_t maxX, int32_t count
+)
+{
+	for( int32_t i = 0; i < count; i++, x += dx )
+		pDst[i] = pSrc0[ClampSample(x >> 16, maxX)];
+}
+
+static void ScaleRowBilinearScalar(
+	uint32_t* pDst, const uint32_t* pSrc0, const uint32_t* pSrc1, uint32_t fy,
+	int32_t x, int32_t dx, int32_t maxX, int32_t count
+)
+{
+	for( int32_t i = 0; i < count; i++, x += dx )
+	{
+		const int32_t x0 = ClampSample(x >> 16, maxX);
+		const int32_t x1 = ClampSample(( x >> 16 ) + 1, maxX);
+		const uint32_t fx = ( x >> 8 ) & 0xFF;
+
+		const uint32_t top = LerpPixel(pSrc0[x0], pSrc0[x1], fx);
+		const uint32_t bottom = LerpPixel(pSrc1[x0], pSrc1[x1], fx);
+		pDst[i] = LerpPixel(top, bottom, fy);
+	}
+}
+
+#ifdef BLEND_HAVE_X86
+
+// SSE2, 4 pixels per iteration
+
+static inline __m128i BlendOverSSE2( __m128i s, __m128i d )
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i c255 = _mm_set1_epi16(255);
+	const __m128i c128 = _mm_set1_epi16(128);
+
+	__m128i sLo = _mm_unpacklo_epi8(s, zero);
+	__m128i sHi = _mm_unpackhi_epi8(s, zero);
+	__m128i dLo = _mm_unpacklo_epi8(d, zero);
+	__m128i dHi = _mm_unpackhi_epi8(d, zero);
+
+	__m128i aLo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sLo, 0xFF), 0xFF);
+	__m128i aHi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(sHi, 0xFF), 0xFF);
+	aLo = _mm_sub_epi16(c255, aLo);
+	aHi = _mm_sub_epi16(c255, aHi);
+
+	dLo = _mm_add_epi16(_mm_mullo_epi16(dLo, aLo), c128);
+	dHi = _mm_add_epi16(_mm_mullo_epi16(dHi, aHi), c128);
+	dLo = _mm_srli_epi16(_mm_add_epi16(dLo, _mm_srli_epi16(dLo, 8)), 8);
+	dHi = _mm_srli_epi16(_mm_add_epi16(dHi, _mm_srli_epi16(dHi, 8)), 8);
+
+	return _mm_adds_epu8(s, _mm_packus_epi16(dLo, dHi));
+}
+
+static void BlendRowSSE2( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	const __m128i alphaMask = _mm_set1_epi32((int32_t)0xFF000000);
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)( pSrc + i ));
+		__m128i alpha = _mm_and_si128(s, alphaMask);
+
+		if( _mm_movemask_epi8(_mm_cmpeq_epi32(alpha, alphaMask)) == 0xFFFF )
+		{
+			_mm_storeu_si128((__m128i*)( pDst + i ), s);
+			continue;
+		}
+		if( _mm_movemask_epi8(_mm_cmpeq_epi32(s, _mm_setzero_si128())) == 0xFFFF )
+			continue;
+
+		__m128i d = _mm_loadu_si128((const __m128i*)( pDst + i ));
+		_mm_storeu_si128((__m128i*)( pDst + i ), BlendOverSSE2(s, d));
+	}
+
+	BlendRowScalar(pDst + i, pSrc + i, count - i);
+}
+
+static void CopyRowSSE2( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	const __m128i alphaMask = _mm_set1_epi32((int32_t)0xFF000000);
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+	{
+		__m128i s = _mm_loadu_si128((const __m128i*)( pSrc + i ));
+		_mm_storeu_si128((__m128i*)( pDst + i ), _mm_or_si128(s, alphaMask));
+	}
+
+	CopyRowScalar(pDst + i, pSrc + i, count - i);
+}
+
+static void FillRowSSE2( uint32_t* pDst, uint32_t color, int32_t count )
+{
+	const __m128i c = _mm_set1_epi32((int32_t)color);
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+		_mm_storeu_si128((__m128i*)( pDst + i ), c);
+
+	FillRowScalar(pDst + i, color, count - i);
+}
+
+// a + ( b - a ) * w / 256 on 16 bit channels, w in [0, 255]
+static inline __m128i LerpSSE2( __m128i a, __m128i b, __m128i w )
+{
+	const __m128i inv = _mm_sub_epi16(_mm_set1_epi16(256), w);
+	__m128i t = _mm_add_epi16(_mm_mullo_epi16(a, inv), _mm_mullo_epi16(b, w));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_set1_epi16(128)), 8);
+}
+
+// SSE2 has no gather, the four samples are fetched one by one and filtered
+// together
+static void ScaleRowBilinearSSE2(
+	uint32_t* pDst, const uint32_t* pSrc0, const uint32_t* pSrc1, uint32_t fy,
+	int32_t x, int32_t dx, int32_t maxX, int32_t count
+)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wy = _mm_set1_epi16((int16_t)fy);
+	const __m128i byteMask = _mm_set1_epi32(0xFF);
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+	{
+		int32_t x0[4], x1[4], xs[4];
+		for( int32_t j = 0; j < 4; j++, x += dx )
+		{
+			xs[j] = x;
+			x0[j] = ClampSample(x >> 16, maxX);
+			x1[j] = ClampSample(( x >> 16 ) + 1, maxX);
+		}
+
+		const __m128i a0 = _mm_setr_epi32((int32_t)pSrc0[x0[0]], (int32_t)pSrc0[x0[1]], (int32_t)pSrc0[x0[2]], (int32_t)pSrc0[x0[3]]);
+		const __m128i a1 = _mm_setr_epi32((int32_t)pSrc0[x1[0]], (int32_t)pSrc0[x1[1]], (int32_t)pSrc0[x1[2]], (int32_t)pSrc0[x1[3]]);
+		const __m128i b0 = _mm_setr_epi32((int32_t)pSrc1[x0[0]], (int32_t)pSrc1[x0[1]], (int32_t)pSrc1[x0[2]], (int32_t)pSrc1[x0[3]]);
+		const __m128i b1 = _mm_setr_epi32((int32_t)pSrc1[x1[0]], (int32_t)pSrc1[x1[1]], (int32_t)pSrc1[x1[2]], (int32_t)pSrc1[x1[3]]);
+
+		// the weight of every pixel repeated over its four 16 bit channels
+		__m128i fx = _mm_and_si128(_mm_srli_epi32(_mm_loadu_si128((const __m128i*)xs), 8), byteMask);
+		fx = _mm_or_si128(fx, _mm_slli_epi32(fx, 16));
+		const __m128i wxLo = _mm_unpacklo_epi32(fx, fx);
+		const __m128i wxHi = _mm_unpackhi_epi32(fx, fx);
+
+		const __m128i topLo = LerpSSE2(_mm_unpacklo_epi8(a0, zero), _mm_unpacklo_epi8(a1, zero), wxLo);
+		const __m128i topHi = LerpSSE2(_mm_unpackhi_epi8(a0, zero), _mm_unpackhi_epi8(a1, zero), wxHi);
+		const __m128i bottomLo = LerpSSE2(_mm_unpacklo_epi8(b0, zero), _mm_unpacklo_epi8(b1, zero), wxLo);
+		const __m128i bottomHi = LerpSSE2(_mm_unpackhi_epi8(b0, zero), _mm_unpackhi_epi8(b1, zero), wxHi);
+
+		_mm_storeu_si128((__m128i*)( pDst + i ), _mm_packus_epi16(
+			LerpSSE2(topLo, bottomLo, wy), LerpSSE2(topHi, bottomHi, wy)
+		));
+	}
+
+	ScaleRowBilinearScalar(pDst + i, pSrc0, pSrc1, fy, x, dx, maxX, count - i);
+}
+
+// AVX2, 8 pixels per iteration, only selected when the CPU reports it
+
+__attribute__((target("avx2")))
+static inline __m256i BlendOverAVX2( __m256i s, __m256i d )
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i c128 = _mm256_set1_epi16(128);
+
+	__m256i sLo = _mm256_unpacklo_epi8(s, zero);
+	__m256i sHi = _mm256_unpackhi_epi8(s, zero);
+	__m256i dLo = _mm256_unpacklo_epi8(d, zero);
+	__m256i dHi = _mm256_unpackhi_epi8(d, zero);
+
+	__m256i aLo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sLo, 0xFF), 0xFF);
+	__m256i aHi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sHi, 0xFF), 0xFF);
+	aLo = _mm256_sub_epi16(c255, aLo);
+	aHi = _mm256_sub_epi16(c255, aHi);
+
+	dLo = _mm256_add_epi16(_mm256_mullo_epi16(dLo, aLo), c128);
+	dHi = _mm256_add_epi16(_mm256_mullo_epi16(dHi, aHi), c128);
+	dLo = _mm256_srli_epi16(_mm256_add_epi16(dLo, _mm256_srli_epi16(dLo, 8)), 8);
+	dHi = _mm256_srli_epi16(_mm256_add_epi16(dHi, _mm256_srli_epi16(dHi, 8)), 8);
+
+	// unpack and pack both work per 128 bit lane, so the pixel order survives
+	return _mm256_adds_epu8(s, _mm256_packus_epi16(dLo, dHi));
+}
+
+__attribute__((target("avx2")))
+static void BlendRowAVX2( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	const __m256i alphaMask = _mm256_set1_epi32((int32_t)0xFF000000);
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)( pSrc + i ));
+		__m256i alpha = _mm256_and_si256(s, alphaMask);
+
+		if( (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alphaMask)) == 0xFFFFFFFFu )
+		{
+			_mm256_storeu_si256((__m256i*)( pDst + i ), s);
+			continue;
+		}
+		if( _mm256_testz_si256(s, s) )
+			continue;
+
+		__m256i d = _mm256_loadu_si256((const __m256i*)( pDst + i ));
+		_mm256_storeu_si256((__m256i*)( pDst + i ), BlendOverAVX2(s, d));
+	}
+
+	BlendRowSSE2(pDst + i, pSrc + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void CopyRowAVX2( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	const __m256i alphaMask = _mm256_set1_epi32((int32_t)0xFF000000);
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)( pSrc + i ));
+		_mm256_storeu_si256((__m256i*)( pDst + i ), _mm256_or_si256(s, alphaMask));
+	}
+
+	CopyRowSSE2(pDst + i, pSrc + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void FillRowAVX2( uint32_t* pDst, uint32_t color, int32_t count )
+{
+	const __m256i c = _mm256_set1_epi32((int32_t)color);
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+		_mm256_storeu_si256((__m256i*)( pDst + i ), c);
+
+	FillRowSSE2(pDst + i, color, count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i LerpAVX2( __m256i a, __m256i b, __m256i w )
+{
+	const __m256i inv = _mm256_sub_epi16(_mm256_set1_epi16(256), w);
+	__m256i t = _mm256_add_epi16(_mm256_mullo_epi16(a, inv), _mm256_mullo_epi16(b, w));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_set1_epi16(128)), 8);
+}
+
+// sample positions of the next 8 pixels, clamped like ClampSample
+__attribute__((target("avx2")))
+static inline __m256i ClampSamplesAVX2( __m256i ix, __m256i maxX )
+{
+	return _mm256_min_epi32(_mm256_max_epi32(ix, _mm256_setzero_si256()), maxX);
+}
+
+__attribute__((target("avx2")))
+static void ScaleRowNearestAVX2(
+	uint32_t* pDst, const uint32_t* pSrc0, const uint32_t* pSrc1, uint32_t fy,
+	int32_t x, int32_t dx, int32_t maxX, int32_t count
+)
+{
+	const __m256i maxv = _mm256_set1_epi32(maxX);
+	const __m256i step = _mm256_set1_epi32(dx * 8);
+	__m256i xs = _mm256_add_epi32(
+		_mm256_set1_epi32(x), _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(dx))
+	);
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8, x += dx * 8 )
+	{
+		const __m256i x0 = ClampSamplesAVX2(_mm256_srai_epi32(xs, 16), maxv);
+		_mm256_storeu_si256((__m256i*)( pDst + i ), _mm256_i32gather_epi32((const int*)pSrc0, x0, 4));
+		xs = _mm256_add_epi32(xs, step);
+	}
+
+	ScaleRowNearestScalar(pDst + i, pSrc0, pSrc1, fy, x, dx, maxX, count - i);
+}
+
+__attribute__((target("avx2")))
+static void ScaleRowBilinearAVX2(
+	uint32_t* pDst, const uint32_t* pSrc0, const uint32_t* pSrc1, uint32_t fy,
+	int32_t x, int32_t dx, int32_t maxX, int32_t count
+)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i byteMask = _mm256_set1_epi32(0xFF);
+	const __m256i maxv = _mm256_set1_epi32(maxX);
+	const __m256i wy = _mm256_set1_epi16((int16_t)fy);
+	const __m256i step = _mm256_set1_epi32(dx * 8);
+	__m256i xs = _mm256_add_epi32(
+		_mm256_set1_epi32(x), _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(dx))
+	);
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8, x += dx * 8 )
+	{
+		const __m256i ix = _mm256_srai_epi32(xs, 16);
+		const __m256i x0 = ClampSamplesAVX2(ix, maxv);
+		const __m256i x1 = ClampSamplesAVX2(_mm256_add_epi32(ix, one), maxv);
+
+		const __m256i a0 = _mm256_i32gather_epi32((const int*)pSrc0, x0, 4);
+		const __m256i a1 = _mm256_i32gather_epi32((const int*)pSrc0, x1, 4);
+		const __m256i b0 = _mm256_i32gather_epi32((const int*)pSrc1, x0, 4);
+		const __m256i b1 = _mm256_i32gather_epi32((const int*)pSrc1, x1, 4);
+
+		// like the SSE2 version, per 128 bit lane
+		__m256i fx = _mm256_and_si256(_mm256_srli_epi32(xs, 8), byteMask);
+		fx = _mm256_or_si256(fx, _mm256_slli_epi32(fx, 16));
+		const __m256i wxLo = _mm256_unpacklo_epi32(fx, fx);
+		const __m256i wxHi = _mm256_unpackhi_epi32(fx, fx);
+
+		const __m256i topLo = LerpAVX2(_mm256_unpacklo_epi8(a0, zero), _mm256_unpacklo_epi8(a1, zero), wxLo);
+		const __m256i topHi = LerpAVX2(_mm256_unpackhi_epi8(a0, zero), _mm256_unpackhi_epi8(a1, zero), wxHi);
+		const __m256i bottomLo = LerpAVX2(_mm256_unpacklo_epi8(b0, zero), _mm256_unpacklo_epi8(b1, zero), wxLo);
+		const __m256i bottomHi = LerpAVX2(_mm256_unpackhi_epi8(b0, zero), _mm256_unpackhi_epi8(b1, zero), wxHi);
+
+		_mm256_storeu_si256((__m256i*)( pDst + i ), _mm256_packus_epi16(
+			LerpAVX2(topLo, bottomLo, wy), LerpAVX2(topHi, bottomHi, wy)
+		));
+		xs = _mm256_add_epi32(xs, step);
+	}
+
+	ScaleRowBilinearScalar(pDst + i, pSrc0, pSrc1, fy, x, dx, maxX, count - i);
+}
+
+#endif
+
+#ifdef BLEND_HAVE_NEON
+
+// NEON, 8 pixels per iteration on de-interleaved channels
+
+static void BlendRowNEON( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+	{
+		uint8x8x4_t s = vld4_u8((const uint8_t*)( pSrc + i ));
+
+		if( vget_lane_u64(vreinterpret_u64_u8(vmvn_u8(s.val[3])), 0) == 0 )
+		{
+			vst4_u8((uint8_t*)( pDst + i ), s);
+			continue;
+		}
+
+		uint8x8x4_t d = vld4_u8((const uint8_t*)( pDst + i ));
+		uint8x8_t inv = vmvn_u8(s.val[3]);
+
+		for( int c = 0; c < 4; c++ )
+		{
+			uint16x8_t t = vmull_u8(d.val[c], inv);
+			d.val[c] = vqadd_u8(s.val[c], vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8));
+		}
+		vst4_u8((uint8_t*)( pDst + i ), d);
+	}
+
+	BlendRowScalar(pDst + i, pSrc + i, count - i);
+}
+
+static void CopyRowNEON( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	const uint32x4_t alphaMask = vdupq_n_u32(0xFF000000);
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+		vst1q_u32(pDst + i, vorrq_u32(vld1q_u32(pSrc + i), alphaMask));
+
+	CopyRowScalar(pDst + i, pSrc + i, count - i);
+}
+
+static void FillRowNEON( uint32_t* pDst, uint32_t color, int32_t count )
+{
+	const uint32x4_t c = vdupq_n_u32(color);
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+		vst1q_u32(pDst + i, c);
+
+	FillRowScalar(pDst + i, color, count - i);
+}
+
+// a + ( b - a ) * w / 256 as a * 256 - a * w + b * w, w in [0, 255]
+static inline uint8x8_t LerpNEON( uint8x8_t a, uint8x8_t b, uint8x8_t w )
+{
+	uint16x8_t t = vshll_n_u8(a, 8);
+	t = vmlsl_u8(t, a, w);
+	t = vmlal_u8(t, b, w);
+	return vrshrn_n_u16(t, 8);
+}
+
+// four samples fetched one by one, two pixels per 64 bit register
+static void ScaleRowBilinearNEON(
+	uint32_t* pDst, const uint32_t* pSrc0, const uint32_t* pSrc1, uint32_t fy,
+	int32_t x, int32_t dx, int32_t maxX, int32_t count
+)
+{
+	const uint8x8_t wy = vdup_n_u8((uint8_t)fy);
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+	{
+		uint32_t a0[4], a1[4], b0[4], b1[4], wx[4];
+		for( int32_t j = 0; j < 4; j++, x += dx )
+		{
+			const int32_t x0 = ClampSample(x >> 16, maxX);
+			const int32_t x1 = ClampSample(( x >> 16 ) + 1, maxX);
+			a0[j] = pSrc0[x0];
+			a1[j] = pSrc0[x1];
+			b0[j] = pSrc1[x0];
+			b1[j] = pSrc1[x1];
+			wx[j] = ( ( x >> 8 ) & 0xFF ) * 0x01010101u;
+		}
+
+		const uint8x16_t va0 = vreinterpretq_u8_u32(vld1q_u32(a0));
+		const uint8x16_t va1 = vreinterpretq_u8_u32(vld1q_u32(a1));
+		const uint8x16_t vb0 = vreinterpretq_u8_u32(vld1q_u32(b0));
+		const uint8x16_t vb1 = vreinterpretq_u8_u32(vld1q_u32(b1));
+		const uint8x16_t w = vreinterpretq_u8_u32(vld1q_u32(wx));
+
+		const uint8x8_t lo = LerpNEON(
+			LerpNEON(vget_low_u8(va0), vget_low_u8(va1), vget_low_u8(w)),
+			LerpNEON(vget_low_u8(vb0), vget_low_u8(vb1), vget_low_u8(w)),
+			wy
+		);
+		const uint8x8_t hi = LerpNEON(
+			LerpNEON(vget_high_u8(va0), vget_high_u8(va1), vget_high_u8(w)),
+			LerpNEON(vget_high_u8(vb0), vget_high_u8(vb1), vget_high_u8(w)),
+			wy
+		);
+		vst1q_u32(pDst + i, vreinterpretq_u32_u8(vcombine_u8(lo, hi)));
+	}
+
+	ScaleRowBilinearScalar(pDst + i, pSrc0, pSrc1, fy, x, dx, maxX, count - i);
+}
+
+#endif
+
+// nearest sampling is a pure gather, without one in the instruction set the
+// scalar loop is as fast as it gets
+
+static const struct BlendKernels g_blendKernelsScalar = {
+	"scalar", BlendRowScalar, CopyRowScalar, FillRowScalar,
+	ScaleRowNearestScalar, ScaleRowBilinearScalar
+};
+
+#ifdef BLEND_HAVE_X86
+static const struct BlendKernels g_blendKernelsSSE2 = {
+	"sse2", BlendRowSSE2, CopyRowSSE2, FillRowSSE2,
+	ScaleRowNearestScalar, ScaleRowBilinearSSE2
+};
+static const struct BlendKernels g_blendKernelsAVX2 = {
+	"avx2", BlendRowAVX2, CopyRowAVX2, FillRowAVX2,
+	ScaleRowNearestAVX2, ScaleRowBilinearAVX2
+};
+#endif
+
+#ifdef BLEND_HAVE_NEON
+static const struct BlendKernels g_blendKernelsNEON = {
+	"neon", BlendRowNEON, CopyRowNEON, FillRowNEON,
+	ScaleRowNearestScalar, ScaleRowBilinearNEON
+};
+#endif
+
+// Fills ppKernels with every kernel set the running CPU supports, fastest
+// first, and returns how many were written.
+static int32_t GetSupportedBlendKernels( const struct BlendKernels** ppKernels, int32_t maxCount )
+{
+	int32_t count = 0;
+
+#ifdef BLEND_HAVE_X86
+	__builtin_cpu_init();
+	if( count < maxCount && __builtin_cpu_supports("avx2") )
+		ppKernels[count++] = &g_blendKernelsAVX2;
+	if( count < maxCount && __builtin_cpu_supports("sse2") )
+		ppKernels[count++] = &g_blendKernelsSSE2;
+#endif
+#ifdef BLEND_HAVE_NEON
+	if( count < maxCount )
+		ppKernels[count++] = &g_blendKernelsNEON;
+#endif
+	if( count < maxCount )
+		ppKernels[count++] = &g_blendKernelsScalar;
+
+	return count;
+}
+
+static const struct BlendKernels* SelectBlendKernels( const char* pName )
+{
+	const struct BlendKernels* pKernels[4];
+	const int32_t count = GetSupportedBlendKernels(pKernels, 4);
+
+	if( pName )
+	{
+		for( int32_t i = 0; i < count; i++ )
+		{
+			if( strcmp(pKernels[i]->mpName, pName) == 0 )
+				return pKernels[i];
+		}
+	}
+	return pKernels[0];
+}
+
+#endif
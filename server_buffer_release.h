@@ -0,0 +1,159 @@
+#ifndef _SERVER_BUFFER_RELEASE_H
+#define _SERVER_BUFFER_RELEASE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <wayland-server.h>
+
+#include "server_loop_stats.h"
+#include "server_renderer.h"
+#include "server_slab.h"
+#include "server_state.h"
+
+// wl_buffer.release events are queued per client instead of being sent from
+// inside the commit handler. One idle source flushes every queue after the
+// dispatch that produced them, so a client committing several surfaces (or
+// re-attaching a buffer it just got back) gets each release at most once and
+// all of them land in the same socket write when wl_display_run flushes.
+
+#define RELEASES_PER_SLAB_CHUNK 32
+
+struct PendingRelease
+{
+	struct wl_resource* mpBuffer;
+	struct wl_listener mDestroyListener;
+	struct ClientState* mpClientState;
+	// when the compositor took the buffer, for the hold time statistics
+	uint64_t mCommitNsec;
+	struct wl_list mLink;
+};
+
+static void PendingReleaseFree( struct PendingRelease* pRelease )
+{
+	wl_list_remove(&pRelease->mDestroyListener.link);
+	wl_list_remove(&pRelease->mLink);
+	SlabPoolFree(&pRelease->mpClientState->mReleasePool, pRelease);
+}
+
+static void pending_release_buffer_destroy( struct wl_listener* pListener, void* pData )
+{
+	struct PendingRelease* pRelease = wl_container_of(pListener, pRelease, mDestroyListener);
+	// a compose job may still read the buffer memory libwayland is about to drop
+	WorkerPoolWait(pRelease->mpClientState->mpServer->mpWorkers);
+	PendingReleaseFree(pRelease);
+}
+
+static struct PendingRelease* FindBufferRelease( struct ClientState* pClientState, struct wl_resource* pBuffer )
+{
+	struct PendingRelease* pRelease;
+	wl_list_for_each(pRelease, &pClientState->mPendingReleaseList, mLink)
+	{
+		if( pRelease->mpBuffer == pBuffer )
+			return pRelease;
+	}
+	return NULL;
+}
+
+static void FlushBufferReleases( struct ServerState* pServer )
+{
+	const uint64_t now = GetTimeNsec();
+
+	struct ClientState* pClientState;
+	wl_list_for_each(pClientState, &pServer->mClientList, mLink)
+	{
+		if( wl_list_empty(&pClientState->mPendingReleaseList) )
+			continue;
+
+		struct PendingRelease* pRelease;
+		struct PendingRelease* pTmp;
+		wl_list_for_each_safe(pRelease, pTmp, &pClientState->mPendingReleaseList, mLink)
+		{
+			wl_buffer_send_release(pRelease->mpBuffer);
+			pClientState->mBuffersReleased++;
+			pClientState->mBufferHoldNsec += now - pRelease->mCommitNsec;
+			PendingReleaseFree(pRelease);
+		}
+		pClientState->mReleaseBatches++;
+	}
+}
+
+static void server_release_idle( void* pData )
+{
+	struct ServerState* pServer = pData;
+	pServer->mpReleaseSource = NULL;
+	LoopStatsMark(pServer->mpLoopStats);
+
+	// the tile workers may still read these buffers, FinishRepaint flushes
+	// once they are done
+	if( pServer->mComposeJobsPending )
+		return;
+	FlushBufferReleases(pServer);
+}
+
+// Queues a release for the end of this dispatch, duplicates are dropped
+static void QueueBufferRelease( struct ClientState* pClientState, struct wl_resource* pBuffer, uint64_t commitNsec )
+{
+	if( FindBufferRelease(pClientState, pBuffer) )
+		return;
+
+	struct PendingRelease* pRelease = SlabPoolAlloc(&pClientState->mReleasePool);
+	if( !pRelease )
+	{
+		// better an unbatched release than a client waiting forever
+		wl_buffer_send_release(pBuffer);
+		return;
+	}
+
+	pRelease->mpBuffer = pBuffer;
+	pRelease->mpClientState = pClientState;
+	pRelease->mCommitNsec = commitNsec;
+	pRelease->mDestroyListener.notify = pending_release_buffer_destroy;
+	wl_resource_add_destroy_listener(pBuffer, &pRelease->mDestroyListener);
+	wl_list_insert(pClientState->mPendingReleaseList.prev, &pRelease->mLink);
+
+	struct ServerState* pServer = pClientState->mpServer;
+	if( !pServer->mpReleaseSource )
+	{
+		pServer->mpReleaseSource = wl_event_loop_add_idle(
+			pServer->mpEventLoop, server_release_idle, pServer
+		);
+	}
+}
+
+// A buffer committed again before its release went out is still in use
+static void CancelBufferRelease( struct ClientState* pClientState, struct wl_resource* pBuffer )
+{
+	struct PendingRelease* pRelease = FindBufferRelease(pClientState, pBuffer);
+	if( pRelease )
+		PendingReleaseFree(pRelease);
+}
+
+// The client is going away, nobody is left to receive the releases
+static void DetachClientReleases( struct ClientState* pClientState )
+{
+	struct PendingRelease* pRelease;
+	struct PendingRelease* pTmp;
+	wl_list_for_each_safe(pRelease, pTmp, &pClientState->mPendingReleaseList, mLink)
+		PendingReleaseFree(pRelease);
+}
+
+static void PrintBufferReleaseStats( const struct ClientState* pClientState )
+{
+	// clients that never attached anything have nothing to say
+	if( pClientState->mBuffersReleased == 0 )
+		return;
+
+	pid_t pid = 0;
+	wl_client_get_credentials(pClientState->mpClient, &pid, NULL, NULL);
+
+	const uint64_t released = pClientState->mBuffersReleased;
+	printf("Client %d: %llu buffers released in %llu batches, mean hold %.3f ms\n",
+		(int)pid, (unsigned long long)released,
+		(unsigned long long)pClientState->mReleaseBatches,
+		pClientState->mBufferHoldNsec / 1e6 / released
+	);
+}
+
+#endif
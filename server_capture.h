@@ -0,0 +1,375 @@
+#ifndef _SERVER_CAPTURE_H
+#define _SERVER_CAPTURE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayland-server.h>
+
+#define UTILS_NO_GLES2
+#include "utils.h"
+
+#include "server_renderer.h"
+
+// Dumps every new output frame to disk from a writer thread. The dispatch
+// thread copies the frame into a free slot of a small ring after the frame
+// callbacks went out and moves on, a full ring drops the frame instead of
+// waiting for the disk.
+//
+// Raw streams are one file per output, <prefix>-output<N>.raw:
+//     CaptureFileHeader, padded to CAPTURE_PAGE_SIZE
+//     frame i at mHeaderSize + i * mFrameSize:
+//         CaptureFrameHeader, padded to CAPTURE_FRAME_HEADER_SIZE
+//         mHeight rows of mStride bytes of mFormat pixels, zero padded to
+//         the next page
+// so a reader can mmap the file and index frames directly. PNG captures
+// write <prefix>-output<N>-<sequence>.png per frame.
+
+#define CAPTURE_QUEUE_DEPTH 4
+#define CAPTURE_MAX_OUTPUTS 32
+#define CAPTURE_PAGE_SIZE 4096
+#define CAPTURE_FRAME_HEADER_SIZE 64
+#define CAPTURE_MAGIC "WLSCAP01"
+
+// CaptureFrameHeader::mFlags, the frame is a scanned out client buffer
+#define CAPTURE_FRAME_SCANOUT 0x1
+
+enum CaptureFormat
+{
+	CAPTURE_FORMAT_RAW,
+	CAPTURE_FORMAT_PNG
+};
+
+struct CaptureFileHeader
+{
+	char mMagic[8];
+	uint32_t mVersion;
+	uint32_t mHeaderSize;
+	uint32_t mWidth, mHeight;
+	// in bytes
+	uint32_t mStride;
+	// wl_shm format of the pixels
+	uint32_t mFormat;
+	uint32_t mFrameHeaderSize;
+	uint32_t mOutput;
+	uint64_t mFrameSize;
+};
+
+struct CaptureFrameHeader
+{
+	uint64_t mSequence;
+	// CLOCK_MONOTONIC when the frame was done
+	uint64_t mTimeNsec;
+	uint32_t mFlags;
+};
+
+struct CaptureSlot
+{
+	uint32_t* mpPixels;
+	size_t mCapacity;
+	int32_t mWidth, mHeight;
+	uint32_t mOutput;
+	struct CaptureFrameHeader mHeader;
+};
+
+struct CaptureStream
+{
+	FILE* mpFile;
+	int32_t mWidth, mHeight;
+	uint64_t mFrameSize;
+};
+
+struct Capture
+{
+	const char* mpPrefix;
+	int32_t mFormat;
+	// frames per output, 0 captures until the server exits
+	uint64_t mFrameLimit;
+	uint64_t mSequence[CAPTURE_MAX_OUTPUTS];
+
+	pthread_t mThread;
+	pthread_mutex_t mMutex;
+	// signaled when a frame is queued or the writer should stop
+	pthread_cond_t mCond;
+	int8_t mbQuit;
+
+	// slots [mHead, mHead + mCount) are queued, mHead is the one being
+	// written while the writer runs
+	struct CaptureSlot mSlots[CAPTURE_QUEUE_DEPTH];
+	uint32_t mHead;
+	uint32_t mCount;
+
+	// writer thread only
+	struct CaptureStream mStreams[CAPTURE_MAX_OUTPUTS];
+	uint8_t* mpConvert;
+	size_t mConvertCapacity;
+
+	uint64_t mFramesQueued;
+	uint64_t mFramesDropped;
+	uint64_t mFramesWritten;
+	uint64_t mBytesWritten;
+};
+
+static uint64_t CaptureAlign( uint64_t value, uint64_t alignment )
+{
+	return ( value + alignment - 1 ) / alignment * alignment;
+}
+
+static int CaptureWritePadding( FILE* pFile, uint64_t count )
+{
+	static const uint8_t zeros[CAPTURE_PAGE_SIZE];
+	while( count > 0 )
+	{
+		const size_t chunk = count < sizeof(zeros) ? count : sizeof(zeros);
+		if( fwrite(zeros, 1, chunk, pFile) != chunk )
+			return -1;
+		count -= chunk;
+	}
+	return 0;
+}
+
+static struct CaptureStream* CaptureOpenStream( struct Capture* pCapture, const struct CaptureSlot* pSlot )
+{
+	struct CaptureStream* pStream = &pCapture->mStreams[pSlot->mOutput];
+	if( pStream->mpFile )
+	{
+		if( pStream->mWidth == pSlot->mWidth && pStream->mHeight == pSlot->mHeight )
+			return pStream;
+
+		// the layout is fixed per file
+		printf("Capture: output %u changed size, frames are dropped\n", pSlot->mOutput);
+		return NULL;
+	}
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s-output%u.raw", pCapture->mpPrefix, pSlot->mOutput);
+	pStream->mpFile = fopen(path, "wb");
+	if( !pStream->mpFile )
+	{
+		printf("Capture: failed to open %s\n", path);
+		return NULL;
+	}
+
+	const uint32_t stride = pSlot->mWidth * sizeof(uint32_t);
+	pStream->mWidth = pSlot->mWidth;
+	pStream->mHeight = pSlot->mHeight;
+	pStream->mFrameSize = CaptureAlign(CAPTURE_FRAME_HEADER_SIZE + (uint64_t)stride * pSlot->mHeight, CAPTURE_PAGE_SIZE);
+
+	struct CaptureFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.mMagic, CAPTURE_MAGIC, sizeof(header.mMagic));
+	header.mVersion = 1;
+	header.mHeaderSize = CAPTURE_PAGE_SIZE;
+	header.mWidth = pSlot->mWidth;
+	header.mHeight = pSlot->mHeight;
+	header.mStride = stride;
+	header.mFormat = WL_SHM_FORMAT_XRGB8888;
+	header.mFrameHeaderSize = CAPTURE_FRAME_HEADER_SIZE;
+	header.mOutput = pSlot->mOutput;
+	header.mFrameSize = pStream->mFrameSize;
+
+	if( fwrite(&header, sizeof(header), 1, pStream->mpFile) != 1 ||
+		CaptureWritePadding(pStream->mpFile, CAPTURE_PAGE_SIZE - sizeof(header)) == -1 )
+	{
+		printf("Capture: failed to write %s\n", path);
+		fclose(pStream->mpFile);
+		pStream->mpFile = NULL;
+		return NULL;
+	}
+	return pStream;
+}
+
+static int CaptureWriteRaw( struct Capture* pCapture, const struct CaptureSlot* pSlot )
+{
+	struct CaptureStream* pStream = CaptureOpenStream(pCapture, pSlot);
+	if( !pStream )
+		return -1;
+
+	const uint64_t pixelBytes = (uint64_t)pSlot->mWidth * pSlot->mHeight * sizeof(uint32_t);
+	if( fwrite(&pSlot->mHeader, sizeof(pSlot->mHeader), 1, pStream->mpFile) != 1 ||
+		CaptureWritePadding(pStream->mpFile, CAPTURE_FRAME_HEADER_SIZE - sizeof(pSlot->mHeader)) == -1 ||
+		fwrite(pSlot->mpPixels, 1, pixelBytes, pStream->mpFile) != pixelBytes ||
+		CaptureWritePadding(pStream->mpFile, pStream->mFrameSize - CAPTURE_FRAME_HEADER_SIZE - pixelBytes) == -1 )
+	{
+		printf("Capture: failed to write frame %llu of output %u\n",
+			(unsigned long long)pSlot->mHeader.mSequence, pSlot->mOutput);
+		return -1;
+	}
+
+	pCapture->mBytesWritten += pStream->mFrameSize;
+	return 0;
+}
+
+static int CaptureWritePng( struct Capture* pCapture, const struct CaptureSlot* pSlot )
+{
+	// XRGB8888 is B, G, R, X in memory, stb wants R, G, B
+	const size_t pixelCount = (size_t)pSlot->mWidth * pSlot->mHeight;
+	if( pixelCount * 3 > pCapture->mConvertCapacity )
+	{
+		uint8_t* pConvert = realloc(pCapture->mpConvert, pixelCount * 3);
+		if( !pConvert )
+			return -1;
+		pCapture->mpConvert = pConvert;
+		pCapture->mConvertCapacity = pixelCount * 3;
+	}
+
+	uint8_t* pDst = pCapture->mpConvert;
+	for( size_t i = 0; i < pixelCount; i++ )
+	{
+		const uint32_t pixel = pSlot->mpPixels[i];
+		*pDst++ = ( pixel >> 16 ) & 0xFF;
+		*pDst++ = ( pixel >> 8 ) & 0xFF;
+		*pDst++ = pixel & 0xFF;
+	}
+
+	char path[512];
+	snprintf(path, sizeof(path), "%s-output%u-%06llu.png",
+		pCapture->mpPrefix, pSlot->mOutput, (unsigned long long)pSlot->mHeader.mSequence);
+	if( !WritePixelsToFile(path, pSlot->mWidth, pSlot->mHeight, 3, pCapture->mpConvert, 0) )
+		return -1;
+
+	pCapture->mBytesWritten += pixelCount * 3;
+	return 0;
+}
+
+static void* CaptureThread( void* pData )
+{
+	struct Capture* pCapture = pData;
+
+	pthread_mutex_lock(&pCapture->mMutex);
+	for( ;; )
+	{
+		while( pCapture->mCount == 0 && !pCapture->mbQuit )
+			pthread_cond_wait(&pCapture->mCond, &pCapture->mMutex);
+
+		// queued frames are written before the writer stops
+		if( pCapture->mCount == 0 )
+			break;
+
+		struct CaptureSlot* pSlot = &pCapture->mSlots[pCapture->mHead];
+		pthread_mutex_unlock(&pCapture->mMutex);
+
+		const int result = pCapture->mFormat == CAPTURE_FORMAT_PNG ?
+			CaptureWritePng(pCapture, pSlot) : CaptureWriteRaw(pCapture, pSlot);
+
+		pthread_mutex_lock(&pCapture->mMutex);
+		if( result == 0 )
+			pCapture->mFramesWritten++;
+		pCapture->mHead = ( pCapture->mHead + 1 ) % CAPTURE_QUEUE_DEPTH;
+		pCapture->mCount--;
+	}
+	pthread_mutex_unlock(&pCapture->mMutex);
+	return NULL;
+}
+
+static int CaptureInit( struct Capture* pCapture, const char* pPrefix, int32_t format, uint64_t frameLimit )
+{
+	memset(pCapture, 0, sizeof(struct Capture));
+	pCapture->mpPrefix = pPrefix;
+	pCapture->mFormat = format;
+	pCapture->mFrameLimit = frameLimit;
+
+	pthread_mutex_init(&pCapture->mMutex, NULL);
+	pthread_cond_init(&pCapture->mCond, NULL);
+	if( pthread_create(&pCapture->mThread, NULL, CaptureThread, pCapture) != 0 )
+	{
+		pthread_cond_destroy(&pCapture->mCond);
+		pthread_mutex_destroy(&pCapture->mMutex);
+		return -1;
+	}
+	return 0;
+}
+
+static void CaptureFini( struct Capture* pCapture )
+{
+	pthread_mutex_lock(&pCapture->mMutex);
+	pCapture->mbQuit = 1;
+	pthread_cond_signal(&pCapture->mCond);
+	pthread_mutex_unlock(&pCapture->mMutex);
+	pthread_join(pCapture->mThread, NULL);
+
+	for( uint32_t i = 0; i < CAPTURE_MAX_OUTPUTS; i++ )
+	{
+		if( pCapture->mStreams[i].mpFile )
+			fclose(pCapture->mStreams[i].mpFile);
+	}
+	for( uint32_t i = 0; i < CAPTURE_QUEUE_DEPTH; i++ )
+		free(pCapture->mSlots[i].mpPixels);
+	free(pCapture->mpConvert);
+
+	pthread_cond_destroy(&pCapture->mCond);
+	pthread_mutex_destroy(&pCapture->mMutex);
+}
+
+// Copies a finished frame into the ring, stride is in bytes. Never blocks
+// on the writer, returns -1 when the frame was dropped.
+static int CaptureQueueFrame(
+	struct Capture* pCapture, uint32_t output,
+	const uint8_t* pData, int32_t stride, int32_t width, int32_t height,
+	uint32_t flags
+)
+{
+	if( output >= CAPTURE_MAX_OUTPUTS ||
+		( pCapture->mFrameLimit && pCapture->mSequence[output] >= pCapture->mFrameLimit ) )
+		return 0;
+
+	pthread_mutex_lock(&pCapture->mMutex);
+	const uint32_t count = pCapture->mCount;
+	const uint32_t index = ( pCapture->mHead + count ) % CAPTURE_QUEUE_DEPTH;
+	pthread_mutex_unlock(&pCapture->mMutex);
+
+	// only the writer frees slots, a full ring stays full until we lock again
+	if( count == CAPTURE_QUEUE_DEPTH )
+	{
+		pCapture->mFramesDropped++;
+		return -1;
+	}
+
+	struct CaptureSlot* pSlot = &pCapture->mSlots[index];
+	const size_t pixelCount = (size_t)width * height;
+	if( pixelCount > pSlot->mCapacity )
+	{
+		uint32_t* pPixels = realloc(pSlot->mpPixels, pixelCount * sizeof(uint32_t));
+		if( !pPixels )
+		{
+			pCapture->mFramesDropped++;
+			return -1;
+		}
+		pSlot->mpPixels = pPixels;
+		pSlot->mCapacity = pixelCount;
+	}
+
+	for( int32_t y = 0; y < height; y++ )
+		memcpy(pSlot->mpPixels + (size_t)y * width, pData + (size_t)y * stride, width * sizeof(uint32_t));
+
+	pSlot->mWidth = width;
+	pSlot->mHeight = height;
+	pSlot->mOutput = output;
+	pSlot->mHeader.mSequence = pCapture->mSequence[output]++;
+	pSlot->mHeader.mTimeNsec = GetTimeNsec();
+	pSlot->mHeader.mFlags = flags;
+
+	pthread_mutex_lock(&pCapture->mMutex);
+	pCapture->mCount++;
+	pthread_cond_signal(&pCapture->mCond);
+	pthread_mutex_unlock(&pCapture->mMutex);
+
+	pCapture->mFramesQueued++;
+	return 0;
+}
+
+// only after CaptureFini, the writer is gone by then
+static void PrintCaptureStats( struct Capture* pCapture )
+{
+	printf("Capture: %llu frames queued, %llu dropped, %llu written, %.1f MB\n",
+		(unsigned long long)pCapture->mFramesQueued,
+		(unsigned long long)pCapture->mFramesDropped,
+		(unsigned long long)pCapture->mFramesWritten,
+		pCapture->mBytesWritten / 1e6
+	);
+}
+
+#endif
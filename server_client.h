@@ -0,0 +1,365 @@
+#ifndef _SERVER_CLIENT_H
+#define _SERVER_CLIENT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <wayland-server.h>
+
+#include "server_buffer_release.h"
+#include "server_repaint.h"
+#include "server_slab.h"
+#include "server_state.h"
+
+#define SURFACES_PER_SLAB_CHUNK 64
+#define BINDINGS_PER_SLAB_CHUNK 8
+#define CLIENTS_PER_SLAB_CHUNK 16
+#define XDG_SURFACES_PER_SLAB_CHUNK 16
+#define XDG_POSITIONERS_PER_SLAB_CHUNK 8
+#define SUBSURFACES_PER_SLAB_CHUNK 16
+#define DMABUF_PARAMS_PER_SLAB_CHUNK 8
+#define DMABUF_BUFFERS_PER_SLAB_CHUNK 16
+#define FEEDBACKS_PER_SLAB_CHUNK 16
+
+// defined in server_surface.h, server_subsurface.h, server_xdg_shell.h,
+// server_dmabuf.h and server_presentation.h
+static void DetachClientSurfaces( struct ClientState* pClientState );
+static void DetachClientSubsurfaces( struct ClientState* pClientState );
+static void DetachClientXdgSurfaces( struct ClientState* pClientState );
+static void ScheduleXdgConfigures( struct ServerState* pServer, struct OutputState* pOutput );
+static void DetachClientDmabuf( struct ClientState* pClientState );
+static void DetachClientPresentation( struct ClientState* pClientState );
+
+// Global bindings outlive the client state by a few calls, their resource
+// destroy handlers see NULL user data and leave the freed slots alone
+static void DetachBindingList( struct ClientState* pClientState, struct wl_list* pList, size_t linkOffset )
+{
+	struct wl_list* pLink;
+	struct wl_list* pTmp;
+	for( pLink = pList->next, pTmp = pLink->next; pLink != pList; pLink = pTmp, pTmp = pLink->next )
+	{
+		union GlobalBinding* pBinding = (union GlobalBinding*)( (uint8_t*)pLink - linkOffset );
+		// every binding starts with its wl_resource
+		wl_resource_set_user_data(pBinding->mOutput.mpResource, NULL);
+		wl_list_remove(pLink);
+		SlabPoolFree(&pClientState->mBindingPool, pBinding);
+	}
+}
+
+static void DetachClientBindings( struct ClientState* pClientState )
+{
+	struct Output* pClientOutput;
+	wl_list_for_each(pClientOutput, &pClientState->mOutputList, mLink)
+	{
+		if( !pClientOutput->mpState )
+			continue;
+		wl_list_remove(&pClientOutput->mStateLink);
+		pClientOutput->mpState->mBindingCount--;
+	}
+
+	DetachBindingList(pClientState, &pClientState->mOutputList, offsetof(struct Output, mLink));
+	DetachBindingList(pClientState, &pClientState->mCompositorList, offsetof(struct Compositor, mLink));
+	DetachBindingList(pClientState, &pClientState->mSubcompositorList, offsetof(struct Subcompositor, mLink));
+	DetachBindingList(pClientState, &pClientState->mViewporterList, offsetof(struct Viewporter, mLink));
+	DetachBindingList(pClientState, &pClientState->mLinuxDmabufList, offsetof(struct LinuxDmabuf, mLink));
+	DetachBindingList(pClientState, &pClientState->mPresentationList, offsetof(struct Presentation, mLink));
+	DetachBindingList(pClientState, &pClientState->mXdgWmBaseList, offsetof(struct XdgWmBase, mLink));
+}
+
+// Back-pressure
+//
+// libwayland keeps the EAGAIN of its flushes to itself and buffers events
+// until it gives up on the client, so the kernel send queue stands in for
+// it. Past half of SO_SNDBUF the compositor stops generating frame callbacks
+// and configures for the client, they are held until the socket reports
+// writable again, which for AF_UNIX is below a quarter of SO_SNDBUF.
+
+static int32_t ClientSendQueueBytes( struct ClientState* pClientState )
+{
+	int32_t bytes = 0;
+	if( ioctl(wl_client_get_fd(pClientState->mpClient), SIOCOUTQ, &bytes) == -1 )
+		return 0;
+	return bytes;
+}
+
+static void ClientResumeEvents( struct ClientState* pClientState )
+{
+	if( !pClientState->mbEventsPaused )
+		return;
+
+	wl_event_source_remove(pClientState->mpWritableSource);
+	close(pClientState->mWritableFd);
+	pClientState->mpWritableSource = NULL;
+	pClientState->mWritableFd = -1;
+	pClientState->mbEventsPaused = 0;
+	pClientState->mPausedNsec += GetTimeNsec() - pClientState->mPauseStartNsec;
+}
+
+static int client_handle_writable( int fd, uint32_t mask, void* pData )
+{
+	struct ClientState* pClientState = pData;
+
+	// on a hangup libwayland destroys the client, the source just has to go
+	if( !( mask & ( WL_EVENT_HANGUP | WL_EVENT_ERROR ) ) &&
+		ClientSendQueueBytes(pClientState) > pClientState->mSendBufferSize / 4 )
+		return 0;
+
+	ClientResumeEvents(pClientState);
+
+	// whatever was held goes out with the next cycle of each output
+	struct ServerState* pServer = pClientState->mpServer;
+	struct OutputState* pOutput;
+	wl_list_for_each(pOutput, &pServer->mOutputList, mLink)
+		ScheduleRepaint(pOutput);
+	if( wl_list_empty(&pServer->mOutputList) )
+		ScheduleXdgConfigures(pServer, NULL);
+	return 0;
+}
+
+// Returns 1 when no events should be generated for the client right now
+static int8_t ClientEventsPaused( struct ClientState* pClientState )
+{
+	if( pClientState->mbEventsPaused )
+		return 1;
+
+	const int clientFd = wl_client_get_fd(pClientState->mpClient);
+	if( pClientState->mSendBufferSize == 0 )
+	{
+		socklen_t length = sizeof(pClientState->mSendBufferSize);
+		if( getsockopt(clientFd, SOL_SOCKET, SO_SNDBUF, &pClientState->mSendBufferSize, &length) == -1 ||
+			pClientState->mSendBufferSize <= 0 )
+			pClientState->mSendBufferSize = INT32_MAX;
+	}
+
+	if( ClientSendQueueBytes(pClientState) < pClientState->mSendBufferSize / 2 )
+		return 0;
+
+	// libwayland already polls the fd itself, epoll only takes a second
+	// registration through another descriptor
+	const int writableFd = fcntl(clientFd, F_DUPFD_CLOEXEC, 0);
+	if( writableFd == -1 )
+		return 0;
+
+	pClientState->mpWritableSource = wl_event_loop_add_fd(
+		pClientState->mpServer->mpEventLoop, writableFd, WL_EVENT_WRITABLE,
+		client_handle_writable, pClientState
+	);
+	if( !pClientState->mpWritableSource )
+	{
+		close(writableFd);
+		return 0;
+	}
+
+	pClientState->mWritableFd = writableFd;
+	pClientState->mbEventsPaused = 1;
+	pClientState->mPauseStartNsec = GetTimeNsec();
+	pClientState->mPauseCount++;
+	return 1;
+}
+
+static void client_handle_destroy( struct wl_listener* pListener, void* pData )
+{
+	struct ClientState* pClientState = wl_container_of(pListener, pClientState, mDestroyListener);
+
+	// the client's buffers are destroyed without their listeners below
+	WorkerPoolWait(pClientState->mpServer->mpWorkers);
+
+	// wl_client emits its destroy signal before destroying its resources, so
+	// every resource still pointing into the pools is detached here first,
+	// subsurfaces before the surfaces they link together, feedbacks before
+	// the surface states they wait in
+	DetachClientPresentation(pClientState);
+	DetachClientSubsurfaces(pClientState);
+	DetachClientSurfaces(pClientState);
+	DetachClientXdgSurfaces(pClientState);
+	DetachClientDmabuf(pClientState);
+	DetachClientReleases(pClientState);
+	DetachClientBindings(pClientState);
+	ClientResumeEvents(pClientState);
+	PrintBufferReleaseStats(pClientState);
+
+	struct ServerState* pServer = pClientState->mpServer;
+	wl_list_remove(&pClientState->mLink);
+	SlabPoolFini(&pClientState->mFeedbackPool);
+	SlabPoolFini(&pClientState->mDmabufBufferPool);
+	SlabPoolFini(&pClientState->mDmabufParamsPool);
+	SlabPoolFini(&pClientState->mSubsurfacePool);
+	SlabPoolFini(&pClientState->mXdgPositionerPool);
+	SlabPoolFini(&pClientState->mXdgSurfacePool);
+	SlabPoolFini(&pClientState->mBindingPool);
+	SlabPoolFini(&pClientState->mReleasePool);
+	SlabPoolFini(&pClientState->mSurfacePool);
+	SlabPoolFree(&pServer->mClientPool, pClientState);
+	pServer->mClientsDisconnected++;
+}
+
+// NULL for clients that never created anything
+static struct ClientState* FindClientState( struct wl_client* pClient )
+{
+	struct wl_listener* pListener = wl_client_get_destroy_listener(pClient, client_handle_destroy);
+	if( !pListener )
+		return NULL;
+
+	struct ClientState* pClientState = wl_container_of(pListener, pClientState, mDestroyListener);
+	return pClientState;
+}
+
+static struct ClientState* GetClientState( struct ServerState* pServer, struct wl_client* pClient )
+{
+	struct ClientState* pClientState = FindClientState(pClient);
+	if( pClientState )
+		return pClientState;
+
+	pClientState = SlabPoolAlloc(&pServer->mClientPool);
+	if( !pClientState )
+		return NULL;
+
+	pClientState->mpClient = pClient;
+	pClientState->mpServer = pServer;
+	pClientState->mWritableFd = -1;
+	SlabPoolInit(&pClientState->mSurfacePool, sizeof(struct Surface), SURFACES_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mSurfaceList);
+	SlabPoolInit(&pClientState->mReleasePool, sizeof(struct PendingRelease), RELEASES_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mPendingReleaseList);
+	SlabPoolInit(&pClientState->mBindingPool, sizeof(union GlobalBinding), BINDINGS_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mOutputList);
+	wl_list_init(&pClientState->mCompositorList);
+	wl_list_init(&pClientState->mSubcompositorList);
+	wl_list_init(&pClientState->mViewporterList);
+	wl_list_init(&pClientState->mLinuxDmabufList);
+	wl_list_init(&pClientState->mPresentationList);
+	wl_list_init(&pClientState->mXdgWmBaseList);
+	SlabPoolInit(&pClientState->mXdgSurfacePool, sizeof(struct XdgSurface), XDG_SURFACES_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mXdgSurfaceList);
+	SlabPoolInit(&pClientState->mXdgPositionerPool, sizeof(struct XdgPositioner), XDG_POSITIONERS_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mXdgPositionerList);
+	SlabPoolInit(&pClientState->mSubsurfacePool, sizeof(struct Subsurface), SUBSURFACES_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mSubsurfaceList);
+	SlabPoolInit(&pClientState->mDmabufParamsPool, sizeof(struct DmabufParams), DMABUF_PARAMS_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mDmabufParamsList);
+	SlabPoolInit(&pClientState->mDmabufBufferPool, sizeof(struct DmabufBuffer), DMABUF_BUFFERS_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mDmabufBufferList);
+	SlabPoolInit(&pClientState->mFeedbackPool, sizeof(struct PresentationFeedback), FEEDBACKS_PER_SLAB_CHUNK);
+	wl_list_init(&pClientState->mFeedbackList);
+
+	pClientState->mDestroyListener.notify = client_handle_destroy;
+	wl_client_add_destroy_listener(pClient, &pClientState->mDestroyListener);
+	wl_list_insert(pServer->mClientList.prev, &pClientState->mLink);
+	pServer->mClientsConnected++;
+
+	return pClientState;
+}
+
+static void* ClientAllocBinding( struct ClientState* pClientState )
+{
+	return SlabPoolAlloc(&pClientState->mBindingPool);
+}
+
+static void ClientFreeBinding( struct ClientState* pClientState, void* pBinding, struct wl_list* pLink )
+{
+	wl_list_remove(pLink);
+	SlabPoolFree(&pClientState->mBindingPool, pBinding);
+}
+
+// Client Stats
+
+struct ClientStats
+{
+	uint32_t mResources;
+	uint32_t mSurfaces;
+	uint32_t mBindings;
+	// buffers the compositor holds, attached or waiting for their release
+	uint32_t mBuffers;
+	// wl_buffers imported through zwp_linux_dmabuf_v1
+	uint32_t mDmabufBuffers;
+	size_t mBytes;
+};
+
+static enum wl_iterator_result ClientCountResource( struct wl_resource* pResource, void* pData )
+{
+	uint32_t* pCount = pData;
+	(*pCount)++;
+	return WL_ITERATOR_CONTINUE;
+}
+
+static void GetClientStats( struct ClientState* pClientState, struct ClientStats* pStats )
+{
+	memset(pStats, 0, sizeof(struct ClientStats));
+	wl_client_for_each_resource(pClientState->mpClient, ClientCountResource, &pStats->mResources);
+
+	pStats->mSurfaces = pClientState->mSurfacePool.mLiveCount;
+	pStats->mBindings = pClientState->mBindingPool.mLiveCount;
+	pStats->mBuffers = pClientState->mReleasePool.mLiveCount;
+	pStats->mDmabufBuffers = pClientState->mDmabufBufferPool.mLiveCount;
+	pStats->mBytes = pClientState->mpServer->mClientPool.mObjectSize +
+		SlabPoolReservedBytes(&pClientState->mSurfacePool) +
+		SlabPoolReservedBytes(&pClientState->mReleasePool) +
+		SlabPoolReservedBytes(&pClientState->mBindingPool) +
+		SlabPoolReservedBytes(&pClientState->mXdgSurfacePool) +
+		SlabPoolReservedBytes(&pClientState->mXdgPositionerPool) +
+		SlabPoolReservedBytes(&pClientState->mSubsurfacePool) +
+		SlabPoolReservedBytes(&pClientState->mDmabufParamsPool) +
+		SlabPoolReservedBytes(&pClientState->mDmabufBufferPool) +
+		SlabPoolReservedBytes(&pClientState->mFeedbackPool);
+
+	struct Surface* pSurface;
+	wl_list_for_each(pSurface, &pClientState->mSurfaceList, mClientLink)
+	{
+		if( pSurface->mCurrent.mpBuffer )
+			pStats->mBuffers++;
+
+		pStats->mBytes += pSurface->mShadow.mCapacity * sizeof(uint32_t);
+		pStats->mBytes += ( pSurface->mPending.mDamage.mCapacity + pSurface->mPending.mBufferDamage.mCapacity +
+			pSurface->mCurrent.mDamage.mCapacity + pSurface->mCurrent.mBufferDamage.mCapacity ) * sizeof(struct RegionBox);
+	}
+}
+
+// Live dump of everything the server holds on behalf of its clients
+static void PrintClientStats( struct ServerState* pServer )
+{
+	size_t totalBytes = 0;
+	uint32_t clientCount = 0;
+
+	struct ClientState* pClientState;
+	wl_list_for_each(pClientState, &pServer->mClientList, mLink)
+	{
+		pid_t pid = 0;
+		wl_client_get_credentials(pClientState->mpClient, &pid, NULL, NULL);
+
+		struct ClientStats stats;
+		GetClientStats(pClientState, &stats);
+		printf("Client %d: %u resources, %u surfaces, %u bindings, %u buffers held, %u dmabuf buffers, %zu bytes\n",
+			(int)pid, stats.mResources, stats.mSurfaces, stats.mBindings, stats.mBuffers,
+			stats.mDmabufBuffers, stats.mBytes
+		);
+		if( pClientState->mPauseCount )
+		{
+			printf("    paused %llu times for %.1f ms, %d bytes queued%s\n",
+				(unsigned long long)pClientState->mPauseCount,
+				pClientState->mPausedNsec / 1e6,
+				ClientSendQueueBytes(pClientState),
+				pClientState->mbEventsPaused ? ", paused now" : ""
+			);
+		}
+
+		totalBytes += stats.mBytes;
+		clientCount++;
+	}
+
+	printf("Clients: %u live, %llu connected, %llu disconnected, %zu bytes in client state, %zu bytes reserved for clients\n",
+		clientCount,
+		(unsigned long long)pServer->mClientsConnected,
+		(unsigned long long)pServer->mClientsDisconnected,
+		totalBytes, SlabPoolReservedBytes(&pServer->mClientPool)
+	);
+}
+
+#endif
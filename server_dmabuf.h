@@ -0,0 +1,496 @@
+#ifndef _SERVER_DMABUF_H
+#define _SERVER_DMABUF_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <wayland-server.h>
+
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+
+#include "server_client.h"
+#include "server_fd_cache.h"
+#include "server_state.h"
+#include "server_workers.h"
+
+// zwp_linux_dmabuf_v1 without a GPU. The compositor composes on the CPU, so
+// an imported buffer is only useful when it can be mapped and read in place:
+// single plane, linear 32 bit formats backed by a memfd sealed against
+// shrinking or by a dma-buf such as a udmabuf made from one. Neither can be
+// truncated under the compositor, so unlike wl_shm no SIGBUS guard is needed
+// while composing. A dma-buf has to say DRM_FORMAT_MOD_LINEAR, the implicit
+// modifier of a driver's buffer may well be tiled, and its reads are synced
+// with DMA_BUF_IOCTL_SYNC. Imports go through the FdMappingCache, which turns
+// re-importing the same memory into a lookup.
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS 1034
+#endif
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+// drm_fourcc.h codes, the compositor does not link libdrm
+#define DMABUF_FOURCC( a, b, c, d ) \
+	( (uint32_t)(a) | ( (uint32_t)(b) << 8 ) | ( (uint32_t)(c) << 16 ) | ( (uint32_t)(d) << 24 ) )
+#define DMABUF_FORMAT_ARGB8888 DMABUF_FOURCC('A', 'R', '2', '4')
+#define DMABUF_FORMAT_XRGB8888 DMABUF_FOURCC('X', 'R', '2', '4')
+#define DMABUF_MOD_LINEAR 0ull
+#define DMABUF_MOD_INVALID 0x00ffffffffffffffull
+
+// Returns 1 with the WL_SHM_FORMAT code for DRM formats the compositor draws
+static int8_t DmabufGetShmFormat( uint32_t drmFormat, uint32_t* pShmFormat )
+{
+	switch( drmFormat )
+	{
+		case DMABUF_FORMAT_ARGB8888:
+			*pShmFormat = WL_SHM_FORMAT_ARGB8888;
+			return 1;
+		case DMABUF_FORMAT_XRGB8888:
+			*pShmFormat = WL_SHM_FORMAT_XRGB8888;
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+// Memory the client cannot shrink under the mapping: a dma-buf, or a memfd
+// sealed with F_SEAL_SHRINK
+static int8_t DmabufFdIsStable( int fd )
+{
+	if( FdIsDmabuf(fd) )
+		return 1;
+
+	const int seals = fcntl(fd, F_GET_SEALS);
+	return seals != -1 && ( seals & F_SEAL_SHRINK );
+}
+
+// Dmabuf Buffer
+
+static void wl_buffer_dmabuf_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static const struct wl_buffer_interface wl_buffer_dmabuf_impl = {
+	.destroy = wl_buffer_dmabuf_handle_destroy
+};
+
+// NULL for wl_shm and any other kind of buffer
+static struct DmabufBuffer* DmabufBufferGet( struct wl_resource* pBuffer )
+{
+	if( !pBuffer || !wl_resource_instance_of(pBuffer, &wl_buffer_interface, &wl_buffer_dmabuf_impl) )
+		return NULL;
+	return wl_resource_get_user_data(pBuffer);
+}
+
+static void DmabufBufferFree( struct DmabufBuffer* pBuffer )
+{
+	struct ClientState* pClientState = pBuffer->mpClientState;
+	FdMappingRelease(&pClientState->mpServer->mFdCache, pBuffer->mpMapping);
+	wl_list_remove(&pBuffer->mLink);
+	SlabPoolFree(&pClientState->mDmabufBufferPool, pBuffer);
+}
+
+static void wl_buffer_dmabuf_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct DmabufBuffer* pBuffer = wl_resource_get_user_data(pResource);
+	if( !pBuffer )
+		return;
+
+	// a compose job may still read a buffer its surface already replaced
+	struct ServerState* pServer = pBuffer->mpClientState->mpServer;
+	if( pServer->mComposeJobsPending )
+		WorkerPoolWait(pServer->mpWorkers);
+
+	pServer->mDmabufStats.mBuffersDestroyed++;
+	DmabufBufferFree(pBuffer);
+}
+
+// Dmabuf Params
+
+static void DmabufParamsClosePlanes( struct DmabufParams* pParams )
+{
+	for( uint32_t i = 0; i < DMABUF_MAX_PLANES; i++ )
+	{
+		if( pParams->mPlanes[i].mFd != -1 )
+			close(pParams->mPlanes[i].mFd);
+		pParams->mPlanes[i].mFd = -1;
+	}
+}
+
+static void DmabufParamsFree( struct DmabufParams* pParams )
+{
+	DmabufParamsClosePlanes(pParams);
+	wl_list_remove(&pParams->mLink);
+	SlabPoolFree(&pParams->mpClientState->mDmabufParamsPool, pParams);
+}
+
+static void DetachClientDmabuf( struct ClientState* pClientState )
+{
+	struct DmabufParams* pParams;
+	struct DmabufParams* pParamsTmp;
+	wl_list_for_each_safe(pParams, pParamsTmp, &pClientState->mDmabufParamsList, mLink)
+	{
+		wl_resource_set_user_data(pParams->mpResource, NULL);
+		DmabufParamsFree(pParams);
+	}
+
+	struct DmabufBuffer* pBuffer;
+	struct DmabufBuffer* pBufferTmp;
+	wl_list_for_each_safe(pBuffer, pBufferTmp, &pClientState->mDmabufBufferList, mLink)
+	{
+		wl_resource_set_user_data(pBuffer->mpResource, NULL);
+		DmabufBufferFree(pBuffer);
+	}
+}
+
+static void zwp_linux_buffer_params_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct DmabufParams* pParams = wl_resource_get_user_data(pResource);
+	if( !pParams )
+		return;
+
+	DmabufParamsFree(pParams);
+}
+
+static void zwp_linux_buffer_params_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void zwp_linux_buffer_params_handle_add(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t fd, uint32_t planeIdx, uint32_t offset, uint32_t stride,
+	uint32_t modifierHi, uint32_t modifierLo
+)
+{
+	struct DmabufParams* pParams = wl_resource_get_user_data(pResource);
+	if( pParams->mbUsed )
+	{
+		close(fd);
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+			"params were already used to create a wl_buffer");
+		return;
+	}
+	if( planeIdx >= DMABUF_MAX_PLANES )
+	{
+		close(fd);
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_IDX,
+			"plane index %u is above %d", planeIdx, DMABUF_MAX_PLANES - 1);
+		return;
+	}
+
+	struct DmabufPlane* pPlane = &pParams->mPlanes[planeIdx];
+	if( pPlane->mFd != -1 )
+	{
+		close(fd);
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_SET,
+			"plane %u was already set", planeIdx);
+		return;
+	}
+
+	pPlane->mFd = fd;
+	pPlane->mOffset = offset;
+	pPlane->mStride = stride;
+	pPlane->mModifier = ( (uint64_t)modifierHi << 32 ) | modifierLo;
+}
+
+// Raises the errors create and create_immed share, returns -1 after posting
+// one. Only single plane formats are advertised.
+static int DmabufParamsValidate(
+	struct DmabufParams* pParams, struct wl_resource* pResource,
+	int32_t width, int32_t height, uint32_t format
+)
+{
+	if( pParams->mbUsed )
+	{
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+			"params were already used to create a wl_buffer");
+		return -1;
+	}
+	pParams->mbUsed = 1;
+
+	uint32_t shmFormat;
+	if( !DmabufGetShmFormat(format, &shmFormat) )
+	{
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_FORMAT,
+			"format 0x%08x is not supported", format);
+		return -1;
+	}
+
+	const struct DmabufPlane* pPlane = &pParams->mPlanes[0];
+	for( uint32_t i = 1; i < DMABUF_MAX_PLANES; i++ )
+	{
+		if( pParams->mPlanes[i].mFd != -1 )
+			pPlane = NULL;
+	}
+	if( !pPlane || pPlane->mFd == -1 )
+	{
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE,
+			"format 0x%08x takes exactly one plane", format);
+		return -1;
+	}
+
+	if( width <= 0 || height <= 0 || pPlane->mStride < (uint64_t)width * sizeof(uint32_t) )
+	{
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_DIMENSIONS,
+			"invalid size %dx%d with a stride of %u", width, height, pPlane->mStride);
+		return -1;
+	}
+
+	// pixels are read as whole uint32_t
+	if( pPlane->mOffset & 3 )
+	{
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_OUT_OF_BOUNDS,
+			"offset %u is not a multiple of 4", pPlane->mOffset);
+		return -1;
+	}
+
+	// fds of unknown size are checked by the import instead
+	struct stat st;
+	off_t size = -1;
+	if( fstat(pPlane->mFd, &st) == 0 )
+		size = FdGetSize(pPlane->mFd, &st, FdIsDmabuf(pPlane->mFd));
+	if( size != -1 && pPlane->mOffset + (uint64_t)pPlane->mStride * height > (uint64_t)size )
+	{
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_OUT_OF_BOUNDS,
+			"%dx%d buffer with stride %u at offset %u does not fit %lld bytes",
+			width, height, pPlane->mStride, pPlane->mOffset, (long long)size);
+		return -1;
+	}
+	return 0;
+}
+
+// Maps the plane of validated params, NULL when the compositor cannot read
+// it in place. The params give up their fd, the mapping keeps the memory.
+static struct FdMapping* DmabufParamsImport(
+	struct ServerState* pServer, struct DmabufParams* pParams,
+	int32_t height, uint32_t flags
+)
+{
+	struct DmabufPlane* pPlane = &pParams->mPlanes[0];
+	struct FdMapping* pMapping = NULL;
+	// a memfd has no layout but linear, the implicit modifier is fine there
+	const int8_t bLinear = pPlane->mModifier == DMABUF_MOD_LINEAR ||
+		( pPlane->mModifier == DMABUF_MOD_INVALID && !FdIsDmabuf(pPlane->mFd) );
+	if( flags == 0 && ( pPlane->mStride & 3 ) == 0 && bLinear && DmabufFdIsStable(pPlane->mFd) )
+		pMapping = FdMappingAcquire(&pServer->mFdCache, pPlane->mFd, pPlane->mOffset + (size_t)pPlane->mStride * height);
+
+	DmabufParamsClosePlanes(pParams);
+	if( pMapping )
+		pServer->mDmabufStats.mImports++;
+	else
+		pServer->mDmabufStats.mFailedImports++;
+	return pMapping;
+}
+
+static struct DmabufBuffer* CreateDmabufBuffer(
+	struct ClientState* pClientState, uint32_t id,
+	struct FdMapping* pMapping, const struct DmabufPlane* pPlane,
+	int32_t width, int32_t height, uint32_t format
+)
+{
+	struct DmabufBuffer* pBuffer = SlabPoolAlloc(&pClientState->mDmabufBufferPool);
+	if( !pBuffer )
+		return NULL;
+
+	struct wl_resource* pResource = wl_resource_create(pClientState->mpClient, &wl_buffer_interface, 1, id);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mDmabufBufferPool, pBuffer);
+		return NULL;
+	}
+	wl_resource_set_implementation(
+		pResource, &wl_buffer_dmabuf_impl,
+		pBuffer, wl_buffer_dmabuf_handle_resource_destroy
+	);
+
+	pBuffer->mpResource = pResource;
+	pBuffer->mpClientState = pClientState;
+	pBuffer->mpMapping = pMapping;
+	pBuffer->mpData = pMapping->mpData + pPlane->mOffset;
+	pBuffer->mWidth = width;
+	pBuffer->mHeight = height;
+	pBuffer->mStride = (int32_t)pPlane->mStride;
+	DmabufGetShmFormat(format, &pBuffer->mFormat);
+	wl_list_insert(pClientState->mDmabufBufferList.prev, &pBuffer->mLink);
+	return pBuffer;
+}
+
+static void zwp_linux_buffer_params_handle_create(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t width, int32_t height, uint32_t format, uint32_t flags
+)
+{
+	struct DmabufParams* pParams = wl_resource_get_user_data(pResource);
+	if( DmabufParamsValidate(pParams, pResource, width, height, format) == -1 )
+		return;
+
+	struct ClientState* pClientState = pParams->mpClientState;
+	struct ServerState* pServer = pClientState->mpServer;
+	const struct DmabufPlane plane = pParams->mPlanes[0];
+	struct FdMapping* pMapping = DmabufParamsImport(pServer, pParams, height, flags);
+	if( !pMapping )
+	{
+		zwp_linux_buffer_params_v1_send_failed(pResource);
+		return;
+	}
+
+	struct DmabufBuffer* pBuffer = CreateDmabufBuffer(pClientState, 0, pMapping, &plane, width, height, format);
+	if( !pBuffer )
+	{
+		FdMappingRelease(&pServer->mFdCache, pMapping);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	zwp_linux_buffer_params_v1_send_created(pResource, pBuffer->mpResource);
+}
+
+static void zwp_linux_buffer_params_handle_create_immed(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	uint32_t bufferId, int32_t width, int32_t height, uint32_t format, uint32_t flags
+)
+{
+	struct DmabufParams* pParams = wl_resource_get_user_data(pResource);
+	if( DmabufParamsValidate(pParams, pResource, width, height, format) == -1 )
+		return;
+
+	struct ClientState* pClientState = pParams->mpClientState;
+	struct ServerState* pServer = pClientState->mpServer;
+	const struct DmabufPlane plane = pParams->mPlanes[0];
+	struct FdMapping* pMapping = DmabufParamsImport(pServer, pParams, height, flags);
+	if( !pMapping )
+	{
+		wl_resource_post_error(pResource, ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_WL_BUFFER,
+			"only memfds sealed against shrinking and linear dma-bufs can be imported");
+		return;
+	}
+
+	if( !CreateDmabufBuffer(pClientState, bufferId, pMapping, &plane, width, height, format) )
+	{
+		FdMappingRelease(&pServer->mFdCache, pMapping);
+		wl_client_post_no_memory(pClient);
+	}
+}
+
+static const struct zwp_linux_buffer_params_v1_interface zwp_linux_buffer_params_impl = {
+	.destroy = zwp_linux_buffer_params_handle_destroy,
+	.add = zwp_linux_buffer_params_handle_add,
+	.create = zwp_linux_buffer_params_handle_create,
+	.create_immed = zwp_linux_buffer_params_handle_create_immed
+};
+
+// Linux Dmabuf Handle
+
+static void zwp_linux_dmabuf_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct LinuxDmabuf* pLinuxDmabuf = wl_resource_get_user_data(pResource);
+	if( !pLinuxDmabuf )
+		return;
+
+	ClientFreeBinding(pLinuxDmabuf->mpClientState, pLinuxDmabuf, &pLinuxDmabuf->mLink);
+}
+
+static void zwp_linux_dmabuf_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void zwp_linux_dmabuf_handle_create_params(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	uint32_t id
+)
+{
+	struct LinuxDmabuf* pLinuxDmabuf = wl_resource_get_user_data(pResource);
+	struct ClientState* pClientState = pLinuxDmabuf->mpClientState;
+	struct DmabufParams* pParams = SlabPoolAlloc(&pClientState->mDmabufParamsPool);
+	if( !pParams )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+
+	struct wl_resource* pParamsResource = wl_resource_create(
+		pClient, &zwp_linux_buffer_params_v1_interface,
+		wl_resource_get_version(pResource), id
+	);
+	if( !pParamsResource )
+	{
+		SlabPoolFree(&pClientState->mDmabufParamsPool, pParams);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pParamsResource, &zwp_linux_buffer_params_impl,
+		pParams, zwp_linux_buffer_params_handle_resource_destroy
+	);
+
+	pParams->mpResource = pParamsResource;
+	pParams->mpClientState = pClientState;
+	for( uint32_t i = 0; i < DMABUF_MAX_PLANES; i++ )
+		pParams->mPlanes[i].mFd = -1;
+	pParams->mbUsed = 0;
+	wl_list_insert(pClientState->mDmabufParamsList.prev, &pParams->mLink);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface zwp_linux_dmabuf_impl = {
+	.destroy = zwp_linux_dmabuf_handle_destroy,
+	.create_params = zwp_linux_dmabuf_handle_create_params
+};
+
+static void zwp_linux_dmabuf_handle_bind(
+	struct wl_client* pClient, void* pData,
+	uint32_t version, uint32_t id
+)
+{
+	struct ClientState* pClientState = GetClientState(pData, pClient);
+	struct LinuxDmabuf* pLinuxDmabuf = pClientState ? ClientAllocBinding(pClientState) : NULL;
+	if( !pLinuxDmabuf )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &zwp_linux_dmabuf_v1_interface,
+		version, id
+	);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mBindingPool, pLinuxDmabuf);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pResource, &zwp_linux_dmabuf_impl,
+		pLinuxDmabuf, zwp_linux_dmabuf_handle_resource_destroy
+	);
+	pLinuxDmabuf->mpResource = pResource;
+	pLinuxDmabuf->mpClientState = pClientState;
+	wl_list_insert(pClientState->mLinuxDmabufList.prev, &pLinuxDmabuf->mLink);
+
+	// linear is the only layout the CPU compositor reads
+	const uint32_t formats[] = { DMABUF_FORMAT_ARGB8888, DMABUF_FORMAT_XRGB8888 };
+	for( uint32_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++ )
+	{
+		zwp_linux_dmabuf_v1_send_format(pResource, formats[i]);
+		if( version >= ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION )
+			zwp_linux_dmabuf_v1_send_modifier(pResource, formats[i],
+				(uint32_t)( DMABUF_MOD_LINEAR >> 32 ), (uint32_t)DMABUF_MOD_LINEAR);
+	}
+}
+
+static void PrintDmabufStats( const struct ServerState* pServer )
+{
+	const struct DmabufStats* pStats = &pServer->mDmabufStats;
+	printf("Dmabuf: %llu imports, %llu failed, %llu buffers destroyed\n",
+		(unsigned long long)pStats->mImports,
+		(unsigned long long)pStats->mFailedImports,
+		(unsigned long long)pStats->mBuffersDestroyed
+	);
+}
+
+#endif
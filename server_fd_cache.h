@@ -0,0 +1,241 @@
+#ifndef _SERVER_FD_CACHE_H
+#define _SERVER_FD_CACHE_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <linux/dma-buf.h>
+#include <linux/magic.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/vfs.h>
+
+#include <wayland-server.h>
+
+#include "server_slab.h"
+
+// Cache of the file mappings behind zwp_linux_dmabuf_v1 buffers, keyed by the
+// inode of the fd the client sent. A client that keeps a few buffers in one
+// memfd, or creates a new wl_buffer for the same memory every frame, gets its
+// existing mapping back instead of paying for mmap, page faults and munmap
+// again. Mappings nobody holds stay around on an idle list, up to
+// FD_CACHE_MAX_IDLE of them, and the oldest is unmapped first. Mappings of
+// real dma-bufs keep an fd of their own for DMA_BUF_IOCTL_SYNC, CPU reads go
+// between FdMappingBeginAccess and FdMappingEndAccess.
+
+#ifndef DMA_BUF_MAGIC
+#define DMA_BUF_MAGIC 0x444d4142
+#endif
+
+#define FD_CACHE_BUCKETS 64
+#define FD_CACHE_MAX_IDLE 4
+#define FD_MAPPINGS_PER_SLAB_CHUNK 16
+
+struct FdMapping
+{
+	dev_t mDev;
+	ino_t mIno;
+	const uint8_t* mpData;
+	size_t mSize;
+	// dma-buf fd the reads are synced through, -1 for memfds
+	int mSyncFd;
+	// buffers and compose jobs reading from this mapping, 0 while it is on
+	// the idle list
+	uint32_t mRefCount;
+	struct wl_list mLink;
+	// FdMappingCache::mIdleList, oldest first
+	struct wl_list mIdleLink;
+};
+
+struct FdMappingCache
+{
+	struct wl_list mBuckets[FD_CACHE_BUCKETS];
+	struct wl_list mIdleList;
+	uint32_t mIdleCount;
+	struct SlabPool mMappingPool;
+
+	uint64_t mMappingsCreated;
+	uint64_t mMappingsReused;
+	uint64_t mMappingsReleased;
+	size_t mMappedBytes;
+};
+
+static void FdMappingCacheInit( struct FdMappingCache* pCache )
+{
+	for( uint32_t i = 0; i < FD_CACHE_BUCKETS; i++ )
+		wl_list_init(&pCache->mBuckets[i]);
+	wl_list_init(&pCache->mIdleList);
+	pCache->mIdleCount = 0;
+
+	SlabPoolInit(&pCache->mMappingPool, sizeof(struct FdMapping), FD_MAPPINGS_PER_SLAB_CHUNK);
+	pCache->mMappingsCreated = pCache->mMappingsReused = pCache->mMappingsReleased = 0;
+	pCache->mMappedBytes = 0;
+}
+
+static void FdMappingUnmap( struct FdMappingCache* pCache, struct FdMapping* pMapping )
+{
+	wl_list_remove(&pMapping->mLink);
+	munmap((void*)pMapping->mpData, pMapping->mSize);
+	if( pMapping->mSyncFd != -1 )
+		close(pMapping->mSyncFd);
+	pCache->mMappedBytes -= pMapping->mSize;
+	pCache->mMappingsReleased++;
+	SlabPoolFree(&pCache->mMappingPool, pMapping);
+}
+
+static void FdMappingCacheFini( struct FdMappingCache* pCache )
+{
+	for( uint32_t i = 0; i < FD_CACHE_BUCKETS; i++ )
+	{
+		struct FdMapping* pMapping;
+		struct FdMapping* pTmp;
+		wl_list_for_each_safe(pMapping, pTmp, &pCache->mBuckets[i], mLink)
+		{
+			munmap((void*)pMapping->mpData, pMapping->mSize);
+			if( pMapping->mSyncFd != -1 )
+				close(pMapping->mSyncFd);
+		}
+	}
+	SlabPoolFini(&pCache->mMappingPool);
+}
+
+// A dma-buf exported by a driver, as opposed to a plain memfd
+static int8_t FdIsDmabuf( int fd )
+{
+	struct statfs fs;
+	return fstatfs(fd, &fs) == 0 && fs.f_type == DMA_BUF_MAGIC;
+}
+
+// Size of the memory behind fd, -1 when it can't be told. dma-bufs report no
+// st_size, theirs is where SEEK_END lands. Memfds and other files are not
+// seeked, the file offset is shared with the client that sent the fd.
+static off_t FdGetSize( int fd, const struct stat* pSt, int8_t bDmabuf )
+{
+	if( bDmabuf )
+		return lseek(fd, 0, SEEK_END);
+	return S_ISREG(pSt->st_mode) ? pSt->st_size : -1;
+}
+
+static uint32_t FdMappingHash( dev_t dev, ino_t ino )
+{
+	uint64_t key = (uint64_t)ino ^ ( (uint64_t)dev << 32 );
+	key ^= key >> 17;
+	key *= 0x9E3779B1u;
+	return (uint32_t)( key >> 7 ) & ( FD_CACHE_BUCKETS - 1 );
+}
+
+// Maps at least minSize bytes of the file behind fd, shared and read only.
+// A memfd that grew since it was mapped gets a second, larger mapping; the
+// smaller one goes away with its last buffer.
+static struct FdMapping* FdMappingAcquire( struct FdMappingCache* pCache, int fd, size_t minSize )
+{
+	struct stat st;
+	if( fstat(fd, &st) == -1 )
+		return NULL;
+
+	struct wl_list* pBucket = &pCache->mBuckets[FdMappingHash(st.st_dev, st.st_ino)];
+	struct FdMapping* pMapping;
+	wl_list_for_each(pMapping, pBucket, mLink)
+	{
+		if( pMapping->mDev != st.st_dev || pMapping->mIno != st.st_ino || pMapping->mSize < minSize )
+			continue;
+
+		if( pMapping->mRefCount++ == 0 )
+		{
+			wl_list_remove(&pMapping->mIdleLink);
+			pCache->mIdleCount--;
+		}
+		pCache->mMappingsReused++;
+		return pMapping;
+	}
+
+	const int8_t bDmabuf = FdIsDmabuf(fd);
+	const off_t size = FdGetSize(fd, &st, bDmabuf);
+	if( size <= 0 || (size_t)size < minSize )
+		return NULL;
+
+	void* pData = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+	if( pData == MAP_FAILED )
+		return NULL;
+
+	// the caller closes fd once the import is done
+	const int syncFd = bDmabuf ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+	pMapping = SlabPoolAlloc(&pCache->mMappingPool);
+	if( !pMapping || ( bDmabuf && syncFd == -1 ) )
+	{
+		if( pMapping )
+			SlabPoolFree(&pCache->mMappingPool, pMapping);
+		if( syncFd != -1 )
+			close(syncFd);
+		munmap(pData, (size_t)size);
+		return NULL;
+	}
+
+	pMapping->mDev = st.st_dev;
+	pMapping->mIno = st.st_ino;
+	pMapping->mpData = pData;
+	pMapping->mSize = (size_t)size;
+	pMapping->mSyncFd = syncFd;
+	pMapping->mRefCount = 1;
+	wl_list_insert(pBucket, &pMapping->mLink);
+	wl_list_init(&pMapping->mIdleLink);
+	pCache->mMappedBytes += pMapping->mSize;
+	pCache->mMappingsCreated++;
+	return pMapping;
+}
+
+static void FdMappingRelease( struct FdMappingCache* pCache, struct FdMapping* pMapping )
+{
+	if( !pMapping || --pMapping->mRefCount > 0 )
+		return;
+
+	wl_list_insert(pCache->mIdleList.prev, &pMapping->mIdleLink);
+	if( ++pCache->mIdleCount <= FD_CACHE_MAX_IDLE )
+		return;
+
+	struct FdMapping* pOldest = wl_container_of(pCache->mIdleList.next, pOldest, mIdleLink);
+	wl_list_remove(&pOldest->mIdleLink);
+	pCache->mIdleCount--;
+	FdMappingUnmap(pCache, pOldest);
+}
+
+static void FdMappingSync( const struct FdMapping* pMapping, uint64_t flags )
+{
+	if( !pMapping || pMapping->mSyncFd == -1 )
+		return;
+
+	struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+	int ret;
+	do
+	{
+		ret = ioctl(pMapping->mSyncFd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while( ret == -1 && ( errno == EINTR || errno == EAGAIN ) );
+}
+
+// Makes what the device wrote visible to the CPU, a no-op for memfds
+static void FdMappingBeginAccess( const struct FdMapping* pMapping )
+{
+	FdMappingSync(pMapping, DMA_BUF_SYNC_START);
+}
+
+static void FdMappingEndAccess( const struct FdMapping* pMapping )
+{
+	FdMappingSync(pMapping, DMA_BUF_SYNC_END);
+}
+
+static void PrintFdMappingStats( const struct FdMappingCache* pCache )
+{
+	printf("Fd mappings: %llu created, %llu reused, %llu released, %u live, %u idle, %zu bytes mapped\n",
+		(unsigned long long)pCache->mMappingsCreated,
+		(unsigned long long)pCache->mMappingsReused,
+		(unsigned long long)pCache->mMappingsReleased,
+		pCache->mMappingPool.mLiveCount, pCache->mIdleCount,
+		pCache->mMappedBytes
+	);
+}
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef _SERVER_LOOP_STATS_H
+#define _SERVER_LOOP_STATS_H
+
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <wayland-server.h>
+
+#include "server_renderer.h"
+#include "server_state.h"
+
+// Where the dispatch thread spends its time. Every sample goes into a log
+// linear histogram of relaxed atomic counters, recording never takes a lock
+// and a dump can run at any point of the loop.
+//
+// Requests are timed from the protocol logger: a request runs until the
+// next one is logged or the loop reaches one of its own marks (end of a
+// dispatch, start of a repaint cycle). Demarshalling the next request is
+// part of the previous one, which is noise next to any real handler.
+
+// 8 buckets per power of two, below 8 nsec every value has its own
+#define LATENCY_SUB_BITS 3
+#define LATENCY_SUB_BUCKETS ( 1 << LATENCY_SUB_BITS )
+// up to 2^40 nsec, about 18 minutes
+#define LATENCY_MAX_SHIFT 40
+#define LATENCY_BUCKET_COUNT ( ( LATENCY_MAX_SHIFT - LATENCY_SUB_BITS + 2 ) * LATENCY_SUB_BUCKETS )
+
+// distinct request opcodes tracked, the rest share the last entry
+#define LOOP_STATS_MAX_REQUESTS 128
+
+struct LatencyHistogram
+{
+	atomic_uint_fast64_t mBuckets[LATENCY_BUCKET_COUNT];
+	atomic_uint_fast64_t mCount;
+	atomic_uint_fast64_t mTotalNsec;
+	atomic_uint_fast64_t mMaxNsec;
+};
+
+struct RequestLatency
+{
+	// wl_interface::methods[opcode]
+	const struct wl_message* mpMessage;
+	const char* mpInterface;
+	struct LatencyHistogram mHistogram;
+};
+
+struct LoopStats
+{
+	struct LatencyHistogram mDispatch;
+	struct LatencyHistogram mFlush;
+	struct LatencyHistogram mRepaint;
+
+	struct wl_protocol_logger* mpLogger;
+	struct RequestLatency mRequests[LOOP_STATS_MAX_REQUESTS];
+	uint32_t mRequestCount;
+
+	// request being handled right now, NULL between requests
+	struct RequestLatency* mpOpenRequest;
+	uint64_t mOpenNsec;
+};
+
+static uint32_t LatencyBucket( uint64_t nsec )
+{
+	if( nsec < LATENCY_SUB_BUCKETS )
+		return (uint32_t)nsec;
+
+	const uint32_t msb = 63 - __builtin_clzll(nsec);
+	if( msb > LATENCY_MAX_SHIFT )
+		return LATENCY_BUCKET_COUNT - 1;
+
+	const uint32_t sub = ( nsec >> ( msb - LATENCY_SUB_BITS ) ) & ( LATENCY_SUB_BUCKETS - 1 );
+	return ( msb - LATENCY_SUB_BITS + 1 ) * LATENCY_SUB_BUCKETS + sub;
+}
+
+// Middle of the nsec range a bucket covers
+static double LatencyBucketValue( uint32_t bucket )
+{
+	if( bucket < LATENCY_SUB_BUCKETS )
+		return bucket;
+
+	const uint32_t shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	const uint64_t lower = (uint64_t)( LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS ) << shift;
+	return lower + ( ( 1ull << shift ) - 1 ) / 2.0;
+}
+
+static void LatencyRecord( struct LatencyHistogram* pHistogram, uint64_t nsec )
+{
+	atomic_fetch_add_explicit(&pHistogram->mBuckets[LatencyBucket(nsec)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pHistogram->mCount, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&pHistogram->mTotalNsec, nsec, memory_order_relaxed);
+
+	uint_fast64_t max = atomic_load_explicit(&pHistogram->mMaxNsec, memory_order_relaxed);
+	while( nsec > max &&
+		!atomic_compare_exchange_weak_explicit(&pHistogram->mMaxNsec, &max, nsec, memory_order_relaxed, memory_order_relaxed) )
+		;
+}
+
+// fraction in [0, 1], samples recorded meanwhile may or may not be counted
+static double LatencyPercentile( struct LatencyHistogram* pHistogram, double fraction )
+{
+	const uint64_t count = atomic_load_explicit(&pHistogram->mCount, memory_order_relaxed);
+	if( count == 0 )
+		return 0.0;
+
+	const uint64_t rank = (uint64_t)( fraction * ( count - 1 ) ) + 1;
+	uint64_t seen = 0;
+	for( uint32_t i = 0; i < LATENCY_BUCKET_COUNT; i++ )
+	{
+		seen += atomic_load_explicit(&pHistogram->mBuckets[i], memory_order_relaxed);
+		if( seen >= rank )
+			return LatencyBucketValue(i);
+	}
+	return atomic_load_explicit(&pHistogram->mMaxNsec, memory_order_relaxed);
+}
+
+static void PrintLatencyHistogram( const char* pName, const char* pDetail, struct LatencyHistogram* pHistogram )
+{
+	const uint64_t count = atomic_load_explicit(&pHistogram->mCount, memory_order_relaxed);
+	printf("    %-24s %-22s %9llu  p50 %9.1f us  p99 %9.1f us  max %9.1f us  total %8.1f ms\n",
+		pName, pDetail ? pDetail : "",
+		(unsigned long long)count,
+		LatencyPercentile(pHistogram, 0.50) / 1000.0,
+		LatencyPercentile(pHistogram, 0.99) / 1000.0,
+		atomic_load_explicit(&pHistogram->mMaxNsec, memory_order_relaxed) / 1000.0,
+		atomic_load_explicit(&pHistogram->mTotalNsec, memory_order_relaxed) / 1e6
+	);
+}
+
+static struct RequestLatency* LoopStatsGetRequest(
+	struct LoopStats* pStats, const char* pInterface, const struct wl_message* pMessage
+)
+{
+	// few dozen opcodes in practice, the entries are only ever appended
+	for( uint32_t i = 0; i < pStats->mRequestCount; i++ )
+	{
+		if( pStats->mRequests[i].mpMessage == pMessage )
+			return &pStats->mRequests[i];
+	}
+
+	// the last entry collects whatever does not fit anymore
+	struct RequestLatency* pRequest = &pStats->mRequests[pStats->mRequestCount];
+	if( pStats->mRequestCount + 1 == LOOP_STATS_MAX_REQUESTS )
+	{
+		pRequest->mpInterface = "(other requests)";
+		return pRequest;
+	}
+
+	pStats->mRequestCount++;
+	pRequest->mpMessage = pMessage;
+	pRequest->mpInterface = pInterface;
+	return pRequest;
+}
+
+// Closes the request being timed, called wherever the loop itself takes over
+static void LoopStatsMark( struct LoopStats* pStats )
+{
+	if( !pStats || !pStats->mpOpenRequest )
+		return;
+
+	LatencyRecord(&pStats->mpOpenRequest->mHistogram, GetTimeNsec() - pStats->mOpenNsec);
+	pStats->mpOpenRequest = NULL;
+}
+
+static void loop_stats_protocol_logger(
+	void* pData, enum wl_protocol_logger_type direction,
+	const struct wl_protocol_logger_message* pMessage
+)
+{
+	if( direction != WL_PROTOCOL_LOGGER_REQUEST )
+		return;
+
+	struct LoopStats* pStats = pData;
+	const uint64_t now = GetTimeNsec();
+	if( pStats->mpOpenRequest )
+		LatencyRecord(&pStats->mpOpenRequest->mHistogram, now - pStats->mOpenNsec);
+
+	pStats->mpOpenRequest = LoopStatsGetRequest(
+		pStats, wl_resource_get_class(pMessage->resource), pMessage->message
+	);
+	pStats->mOpenNsec = now;
+}
+
+static struct LoopStats* LoopStatsCreate( struct wl_display* pDisplay )
+{
+	struct LoopStats* pStats = calloc(1, sizeof(struct LoopStats));
+	if( !pStats )
+		return NULL;
+
+	pStats->mpLogger = wl_display_add_protocol_logger(pDisplay, loop_stats_protocol_logger, pStats);
+	if( !pStats->mpLogger )
+	{
+		free(pStats);
+		return NULL;
+	}
+	return pStats;
+}
+
+static void LoopStatsDestroy( struct LoopStats* pStats )
+{
+	if( !pStats )
+		return;
+
+	wl_protocol_logger_destroy(pStats->mpLogger);
+	free(pStats);
+}
+
+static void PrintLoopStats( struct LoopStats* pStats )
+{
+	printf("Event loop latency:\n");
+	PrintLatencyHistogram("dispatch", NULL, &pStats->mDispatch);
+	PrintLatencyHistogram("client flush", NULL, &pStats->mFlush);
+	PrintLatencyHistogram("repaint cycle", NULL, &pStats->mRepaint);
+
+	// most expensive requests in total first
+	uint32_t order[LOOP_STATS_MAX_REQUESTS];
+	for( uint32_t i = 0; i < pStats->mRequestCount; i++ )
+	{
+		uint32_t j = i;
+		const uint64_t total = atomic_load_explicit(&pStats->mRequests[i].mHistogram.mTotalNsec, memory_order_relaxed);
+		while( j > 0 &&
+			atomic_load_explicit(&pStats->mRequests[order[j - 1]].mHistogram.mTotalNsec, memory_order_relaxed) < total )
+		{
+			order[j] = order[j - 1];
+			j--;
+		}
+		order[j] = i;
+	}
+
+	for( uint32_t i = 0; i < pStats->mRequestCount; i++ )
+	{
+		struct RequestLatency* pRequest = &pStats->mRequests[order[i]];
+		PrintLatencyHistogram(pRequest->mpInterface, pRequest->mpMessage->name, &pRequest->mHistogram);
+	}
+
+	struct RequestLatency* pOther = &pStats->mRequests[LOOP_STATS_MAX_REQUESTS - 1];
+	if( atomic_load_explicit(&pOther->mHistogram.mCount, memory_order_relaxed) )
+		PrintLatencyHistogram(pOther->mpInterface, NULL, &pOther->mHistogram);
+}
+
+// wl_display_run with every iteration timed. Idle sources run before the
+// clients are flushed and the loop blocks, so waiting for input is never
+// counted as dispatch time.
+static void RunInstrumentedLoop( struct ServerState* pServer )
+{
+	struct wl_display* pDisplay = pServer->mpDisplay;
+	struct wl_event_loop* pLoop = pServer->mpEventLoop;
+	struct LoopStats* pStats = pServer->mpLoopStats;
+	struct pollfd loopFd = { .fd = wl_event_loop_get_fd(pLoop), .events = POLLIN };
+
+	pServer->mbRunning = 1;
+	while( pServer->mbRunning )
+	{
+		uint64_t start = GetTimeNsec();
+		wl_event_loop_dispatch_idle(pLoop);
+		LoopStatsMark(pStats);
+		uint64_t idleNsec = GetTimeNsec() - start;
+
+		start = GetTimeNsec();
+		wl_display_flush_clients(pDisplay);
+		LatencyRecord(&pStats->mFlush, GetTimeNsec() - start);
+
+		if( poll(&loopFd, 1, -1) == -1 )
+			continue;
+
+		start = GetTimeNsec();
+		wl_event_loop_dispatch(pLoop, 0);
+		LoopStatsMark(pStats);
+		LatencyRecord(&pStats->mDispatch, idleNsec + GetTimeNsec() - start);
+	}
+}
+
+#endif
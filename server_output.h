@@ -0,0 +1,443 @@
+#ifndef _SERVER_OUTPUT_H
+#define _SERVER_OUTPUT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayland-server.h>
+
+#include "server_client.h"
+#include "server_presentation.h"
+#include "server_region.h"
+#include "server_renderer.h"
+#include "server_repaint.h"
+#include "server_state.h"
+#include "server_surface.h"
+#include "server_vblank.h"
+#include "server_xdg_shell.h"
+
+// Virtual outputs are described on the command line as
+//     WIDTHxHEIGHT[@HZ][+X+Y][,ROTATION]
+// e.g. --output 1920x1080@60 --output 1080x1920+1920+0,90. Outputs without a
+// position are placed right of the previous one, without a rate they use
+// --refresh. A rotation of 90 or 270 swaps the logical size, the framebuffer
+// is composed in logical orientation and left for scan-out to rotate.
+
+struct OutputConfig
+{
+	int32_t mWidth, mHeight;
+	// mHz, -1 for the --refresh default
+	int32_t mRefresh;
+	int32_t mX, mY;
+	int8_t mbPositioned;
+	int32_t mTransform;
+};
+
+static int ParseOutputConfig( const char* pSpec, struct OutputConfig* pConfig )
+{
+	memset(pConfig, 0, sizeof(struct OutputConfig));
+	pConfig->mRefresh = -1;
+	pConfig->mTransform = WL_OUTPUT_TRANSFORM_NORMAL;
+
+	char* pEnd;
+	pConfig->mWidth = strtol(pSpec, &pEnd, 10);
+	if( *pEnd != 'x' )
+		return -1;
+	pConfig->mHeight = strtol(pEnd + 1, &pEnd, 10);
+
+	if( *pEnd == '@' )
+		pConfig->mRefresh = (int32_t)( strtod(pEnd + 1, &pEnd) * 1000.0 );
+
+	if( *pEnd == '+' )
+	{
+		pConfig->mX = strtol(pEnd + 1, &pEnd, 10);
+		if( *pEnd != '+' )
+			return -1;
+		pConfig->mY = strtol(pEnd + 1, &pEnd, 10);
+		pConfig->mbPositioned = 1;
+	}
+
+	if( *pEnd == ',' )
+	{
+		switch( strtol(pEnd + 1, &pEnd, 10) )
+		{
+			case 0: pConfig->mTransform = WL_OUTPUT_TRANSFORM_NORMAL; break;
+			case 90: pConfig->mTransform = WL_OUTPUT_TRANSFORM_90; break;
+			case 180: pConfig->mTransform = WL_OUTPUT_TRANSFORM_180; break;
+			case 270: pConfig->mTransform = WL_OUTPUT_TRANSFORM_270; break;
+			default: return -1;
+		}
+	}
+
+	if( *pEnd != '\0' || pConfig->mWidth <= 0 || pConfig->mHeight <= 0 )
+		return -1;
+	return 0;
+}
+
+static int8_t OutputIsRotated( int32_t transform )
+{
+	return transform == WL_OUTPUT_TRANSFORM_90 || transform == WL_OUTPUT_TRANSFORM_270 ||
+		transform == WL_OUTPUT_TRANSFORM_FLIPPED_90 || transform == WL_OUTPUT_TRANSFORM_FLIPPED_270;
+}
+
+// Sets up everything but the wl_output global, pOutput must be zeroed
+static int OutputInit(
+	struct OutputState* pOutput, struct ServerState* pServer,
+	const struct OutputConfig* pConfig, int32_t defaultRefresh, int32_t x, int32_t y
+)
+{
+	if( pServer->mOutputIndexMask == UINT32_MAX )
+	{
+		printf("At most %d outputs are supported\n", MAX_OUTPUTS);
+		return -1;
+	}
+
+	pOutput->mpServer = pServer;
+	pOutput->mIndex = __builtin_ctz(~pServer->mOutputIndexMask);
+	pOutput->mX = x;
+	pOutput->mY = y;
+	pOutput->mPhyWidth = pConfig->mWidth;
+	pOutput->mPhyHeight = pConfig->mHeight;
+	pOutput->mSubpixel = WL_OUTPUT_SUBPIXEL_UNKNOWN;
+	pOutput->mpMake = "Foo Inc";
+	pOutput->mpModel = "Foo Model";
+	pOutput->mTransform = pConfig->mTransform;
+	pOutput->mRefresh = pConfig->mRefresh >= 0 ? pConfig->mRefresh : defaultRefresh;
+	pOutput->mScale = 1;
+	snprintf(pOutput->mName, sizeof(pOutput->mName), "HEADLESS-%u", pOutput->mIndex + 1);
+
+	const int8_t bRotated = OutputIsRotated(pConfig->mTransform);
+	pOutput->mWidth = bRotated ? pConfig->mHeight : pConfig->mWidth;
+	pOutput->mHeight = bRotated ? pConfig->mWidth : pConfig->mHeight;
+
+	if( FramebufferInit(&pOutput->mFramebuffer, pOutput->mWidth, pOutput->mHeight) == -1 )
+	{
+		printf("Failed to allocate output framebuffer\n");
+		return -1;
+	}
+	// the first frame has to be composed in full
+	RegionUnionRect(&pOutput->mDamage, pOutput->mX, pOutput->mY, pOutput->mWidth, pOutput->mHeight);
+	wl_list_init(&pOutput->mFrameCallbackList);
+	wl_list_init(&pOutput->mComposingCallbackList);
+	wl_list_init(&pOutput->mFeedbackList);
+	wl_list_init(&pOutput->mComposingFeedbackList);
+	wl_list_init(&pOutput->mLatchedFeedbackList);
+	wl_list_init(&pOutput->mBindingList);
+	OcclusionInit(&pOutput->mOcclusion);
+	pOutput->mScanoutBufferDestroy.notify = output_scanout_buffer_destroy;
+	wl_list_init(&pOutput->mScanoutBufferDestroy.link);
+	ComposeJobInit(&pOutput->mComposeJob, pOutput);
+
+	if( VblankInit(&pOutput->mVblank, pServer->mpEventLoop, pOutput->mRefresh, server_repaint_vblank, pOutput) == -1 )
+	{
+		printf("Failed to create virtual vblank clock\n");
+		FramebufferFini(&pOutput->mFramebuffer);
+		RegionFini(&pOutput->mDamage);
+		return -1;
+	}
+
+	// keep the list ordered by index, plugged outputs reuse free indices
+	struct wl_list* pBefore = &pServer->mOutputList;
+	struct OutputState* pOther;
+	wl_list_for_each(pOther, &pServer->mOutputList, mLink)
+	{
+		if( pOther->mIndex > pOutput->mIndex )
+		{
+			pBefore = &pOther->mLink;
+			break;
+		}
+	}
+	wl_list_insert(pBefore->prev, &pOutput->mLink);
+	pServer->mOutputIndexMask |= 1u << pOutput->mIndex;
+	pServer->mOutputCount++;
+	return 0;
+}
+
+static void PrintOutputInfo( const struct OutputState* pOutput )
+{
+	printf("Output %u: %dx%d at %d,%d, ", pOutput->mIndex, pOutput->mWidth, pOutput->mHeight, pOutput->mX, pOutput->mY);
+	if( pOutput->mRefresh > 0 )
+		printf("%.3f Hz virtual refresh\n", pOutput->mRefresh / 1000.0);
+	else
+		printf("repainting as fast as possible\n");
+}
+
+static void OutputFini( struct OutputState* pOutput )
+{
+	struct ServerState* pServer = pOutput->mpServer;
+
+	VblankFini(&pOutput->mVblank);
+	if( pOutput->mpRepaintSource )
+		wl_event_source_remove(pOutput->mpRepaintSource);
+	pOutput->mpRepaintSource = NULL;
+
+	OutputDropScanout(pOutput, 0);
+	// OutputRemove may have unlinked it already
+	wl_list_remove(&pOutput->mLink);
+	wl_list_init(&pOutput->mLink);
+	pServer->mOutputIndexMask &= ~( 1u << pOutput->mIndex );
+	pServer->mOutputCount--;
+
+	WorkerPoolWait(pServer->mpWorkers);
+	ComposeJobFini(&pOutput->mComposeJob);
+	OcclusionFini(&pOutput->mOcclusion);
+	FramebufferFini(&pOutput->mFramebuffer);
+	RegionFini(&pOutput->mDamage);
+}
+
+// wl_output
+//
+// A bind gets the whole description, geometry, mode, scale, name and
+// description, closed by done. Later changes go out to every resource in
+// OutputState::mBindingList in one pass, without looking up any client.
+
+static void OutputSendMode( struct wl_resource* pResource, const struct OutputState* pOutput )
+{
+	// modes are in hardware orientation
+	const int8_t bRotated = OutputIsRotated(pOutput->mTransform);
+	wl_output_send_mode(
+		pResource, WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+		bRotated ? pOutput->mHeight : pOutput->mWidth,
+		bRotated ? pOutput->mWidth : pOutput->mHeight,
+		pOutput->mRefresh
+	);
+}
+
+static void OutputSendDone( struct wl_resource* pResource )
+{
+	if( wl_resource_get_version(pResource) >= WL_OUTPUT_DONE_SINCE_VERSION )
+		wl_output_send_done(pResource);
+}
+
+static void OutputSendState( struct wl_resource* pResource, const struct OutputState* pOutput )
+{
+	const int version = wl_resource_get_version(pResource);
+
+	wl_output_send_geometry(
+		pResource, pOutput->mX, pOutput->mY, pOutput->mPhyWidth, pOutput->mPhyHeight,
+		pOutput->mSubpixel,
+		pOutput->mpMake, pOutput->mpModel,
+		pOutput->mTransform
+	);
+	OutputSendMode(pResource, pOutput);
+	if( version >= WL_OUTPUT_SCALE_SINCE_VERSION )
+		wl_output_send_scale(pResource, pOutput->mScale);
+#ifdef WL_OUTPUT_NAME_SINCE_VERSION
+	if( version >= WL_OUTPUT_NAME_SINCE_VERSION )
+	{
+		char description[64];
+		snprintf(description, sizeof(description), "Headless output %dx%d", pOutput->mWidth, pOutput->mHeight);
+		wl_output_send_name(pResource, pOutput->mName);
+		wl_output_send_description(pResource, description);
+	}
+#endif
+	OutputSendDone(pResource);
+}
+
+static void wl_output_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Output* pClientOutput = wl_resource_get_user_data(pResource);
+	if( !pClientOutput )
+		return;
+
+	if( pClientOutput->mpState )
+	{
+		wl_list_remove(&pClientOutput->mStateLink);
+		pClientOutput->mpState->mBindingCount--;
+	}
+	ClientFreeBinding(pClientOutput->mpClientState, pClientOutput, &pClientOutput->mLink);
+}
+
+static void wl_output_handle_release( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static const struct wl_output_interface wl_output_implementation = {
+	.release = wl_output_handle_release
+};
+
+static void wl_output_handle_bind(
+	struct wl_client* pClient, void* pData,
+	uint32_t version, uint32_t id
+)
+{
+	struct OutputState* pState = pData;
+	struct ClientState* pClientState = GetClientState(pState->mpServer, pClient);
+	struct Output* pClientOutput = pClientState ? ClientAllocBinding(pClientState) : NULL;
+	if( !pClientOutput )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &wl_output_interface,
+		version, id
+	);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mBindingPool, pClientOutput);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pResource, &wl_output_implementation,
+		pClientOutput, wl_output_handle_resource_destroy
+	);
+
+	pClientOutput->mpResource = pResource;
+	pClientOutput->mpState = pState;
+	pClientOutput->mpClientState = pClientState;
+	wl_list_insert(pClientState->mOutputList.prev, &pClientOutput->mLink);
+	wl_list_insert(pState->mBindingList.prev, &pClientOutput->mStateLink);
+	pState->mBindingCount++;
+
+	OutputSendState(pResource, pState);
+
+	// surfaces already shown on the output
+	struct Surface* pSurface;
+	wl_list_for_each(pSurface, &pClientState->mSurfaceList, mClientLink)
+	{
+		if( pSurface->mOutputMask & ( 1u << pState->mIndex ) )
+			wl_surface_send_enter(pSurface->mpResource, pResource);
+	}
+}
+
+static int OutputCreateGlobal( struct OutputState* pOutput )
+{
+	pOutput->mpGlobal = wl_global_create(
+		pOutput->mpServer->mpDisplay, &wl_output_interface,
+		wl_output_interface.version,
+		pOutput, wl_output_handle_bind
+	);
+	return pOutput->mpGlobal ? 0 : -1;
+}
+
+// Surfaces may have entered or left outputs that moved, grew or went away
+static void OutputLayoutChanged( struct ServerState* pServer )
+{
+	uint32_t count;
+	struct Surface** ppStack = GetSurfaceStack(pServer, &count);
+	for( uint32_t i = 0; i < count; i++ )
+		SurfaceUpdateOutputs(ppStack[i]);
+	XdgOutputsChanged(pServer);
+}
+
+// Switches the output to a new mode at runtime, the size is in hardware
+// orientation like OutputConfig
+static int OutputSetMode( struct OutputState* pOutput, int32_t modeWidth, int32_t modeHeight, int32_t refresh )
+{
+	struct ServerState* pServer = pOutput->mpServer;
+	const int8_t bRotated = OutputIsRotated(pOutput->mTransform);
+	const int32_t width = bRotated ? modeHeight : modeWidth;
+	const int32_t height = bRotated ? modeWidth : modeHeight;
+	if( width == pOutput->mWidth && height == pOutput->mHeight && refresh == pOutput->mRefresh )
+		return 0;
+
+	// the workers may still be drawing into the old framebuffer
+	FinishPendingRepaints(pServer);
+
+	if( width != pOutput->mWidth || height != pOutput->mHeight )
+	{
+		struct Framebuffer framebuffer;
+		if( FramebufferInit(&framebuffer, width, height) == -1 )
+		{
+			printf("Failed to allocate output framebuffer\n");
+			return -1;
+		}
+		// a buffer of the old size cannot be scanned out anymore
+		OutputDropScanout(pOutput, 1);
+		FramebufferFini(&pOutput->mFramebuffer);
+		pOutput->mFramebuffer = framebuffer;
+		pOutput->mWidth = width;
+		pOutput->mHeight = height;
+	}
+
+	if( refresh != pOutput->mRefresh )
+	{
+		VblankFini(&pOutput->mVblank);
+		if( VblankInit(&pOutput->mVblank, pServer->mpEventLoop, refresh, server_repaint_vblank, pOutput) == -1 )
+		{
+			printf("Falling back to repainting as fast as possible\n");
+			refresh = 0;
+			VblankInit(&pOutput->mVblank, pServer->mpEventLoop, refresh, server_repaint_vblank, pOutput);
+		}
+		pOutput->mRefresh = refresh;
+	}
+
+	const uint64_t start = GetTimeNsec();
+	struct Output* pClientOutput;
+	wl_list_for_each(pClientOutput, &pOutput->mBindingList, mStateLink)
+	{
+		OutputSendMode(pClientOutput->mpResource, pOutput);
+		OutputSendDone(pClientOutput->mpResource);
+	}
+	pOutput->mFanoutNsec += GetTimeNsec() - start;
+	pOutput->mModeChanges++;
+
+	OutputDamageAll(pOutput);
+	OutputLayoutChanged(pServer);
+	ScheduleRepaint(pOutput);
+	return 0;
+}
+
+// Hot-unplug, pOutput may be freed afterwards. Bound resources stay until
+// their clients release them.
+static void OutputRemove( struct OutputState* pOutput )
+{
+	struct ServerState* pServer = pOutput->mpServer;
+	FinishPendingRepaints(pServer);
+
+	if( pOutput->mpGlobal )
+		wl_global_destroy(pOutput->mpGlobal);
+	pOutput->mpGlobal = NULL;
+
+	// surfaces leave it while its bindings can still be told
+	wl_list_remove(&pOutput->mLink);
+	wl_list_init(&pOutput->mLink);
+	OutputLayoutChanged(pServer);
+
+	struct Output* pClientOutput;
+	struct Output* pTmp;
+	wl_list_for_each_safe(pClientOutput, pTmp, &pOutput->mBindingList, mStateLink)
+	{
+		wl_list_remove(&pClientOutput->mStateLink);
+		pClientOutput->mpState = NULL;
+	}
+	wl_list_init(&pOutput->mBindingList);
+	pOutput->mBindingCount = 0;
+
+	// pending callbacks follow their surfaces to the output pacing them now
+	struct OutputState* pFirst = GetFirstOutput(pServer);
+	if( wl_list_empty(&pOutput->mFrameCallbackList) )
+		;
+	else if( pFirst )
+	{
+		wl_list_insert_list(&pFirst->mFrameCallbackList, &pOutput->mFrameCallbackList);
+		ScheduleRepaint(pFirst);
+	}
+	else
+	{
+		const uint32_t time = GetTimeMsec();
+		struct wl_resource* pCallback;
+		struct wl_resource* pCallbackTmp;
+		wl_resource_for_each_safe(pCallback, pCallbackTmp, &pOutput->mFrameCallbackList)
+		{
+			wl_callback_send_done(pCallback, time);
+			wl_resource_destroy(pCallback);
+		}
+	}
+	wl_list_init(&pOutput->mFrameCallbackList);
+	OutputDiscardFeedback(pOutput);
+	// configures queued for its cycle go out with the first output's, or
+	// right after the dispatch once the last output is gone
+	ScheduleXdgConfigures(pServer, pFirst);
+
+	OutputDropScanout(pOutput, 1);
+	OutputFini(pOutput);
+}
+
+#endif
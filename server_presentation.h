@@ -0,0 +1,306 @@
+#ifndef _SERVER_PRESENTATION_H
+#define _SERVER_PRESENTATION_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <wayland-server.h>
+
+#include "presentation-time-server-protocol.h"
+
+#include "server_client.h"
+#include "server_repaint.h"
+#include "server_state.h"
+#include "server_vblank.h"
+
+// wp_presentation on the headless outputs. Timestamps are CLOCK_MONOTONIC,
+// the clock the virtual vblank runs on. A commit's feedback waits on the
+// output pacing its surface until a repaint cycle latches it, the frame that
+// cycle composes is presented on the following vblank like a page flip with
+// the vblank time, the output's period as refresh and the vblank sequence.
+// Outputs without a virtual refresh rate present a frame as soon as it is
+// composed, with refresh and sequence 0 since nothing predicts the next one.
+// Feedback of a commit replaced before any cycle latched it, of a surface on
+// no output or of a destroyed surface is discarded.
+
+// Feedback
+
+static void PresentationFeedbackFree( struct PresentationFeedback* pFeedback )
+{
+	wl_list_remove(&pFeedback->mLink);
+	wl_list_remove(&pFeedback->mClientLink);
+	SlabPoolFree(&pFeedback->mpClientState->mFeedbackPool, pFeedback);
+}
+
+static void wp_presentation_feedback_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct PresentationFeedback* pFeedback = wl_resource_get_user_data(pResource);
+	if( !pFeedback )
+		return;
+
+	PresentationFeedbackFree(pFeedback);
+}
+
+static void DetachClientPresentation( struct ClientState* pClientState )
+{
+	struct PresentationFeedback* pFeedback;
+	struct PresentationFeedback* pTmp;
+	wl_list_for_each_safe(pFeedback, pTmp, &pClientState->mFeedbackList, mClientLink)
+	{
+		wl_resource_set_user_data(pFeedback->mpResource, NULL);
+		PresentationFeedbackFree(pFeedback);
+	}
+}
+
+static void PresentationDiscard( struct PresentationFeedback* pFeedback )
+{
+	pFeedback->mpClientState->mpServer->mPresentationStats.mDiscarded++;
+	wp_presentation_feedback_send_discarded(pFeedback->mpResource);
+	// the destroy handler frees it
+	wl_resource_destroy(pFeedback->mpResource);
+}
+
+static void PresentationDiscardList( struct wl_list* pList )
+{
+	struct PresentationFeedback* pFeedback;
+	struct PresentationFeedback* pTmp;
+	wl_list_for_each_safe(pFeedback, pTmp, pList, mLink)
+		PresentationDiscard(pFeedback);
+}
+
+// Every feedback of the surface, wherever it waits
+static void SurfaceDiscardFeedback( struct Surface* pSurface )
+{
+	struct PresentationFeedback* pFeedback;
+	struct PresentationFeedback* pTmp;
+	wl_list_for_each_safe(pFeedback, pTmp, &pSurface->mpClientState->mFeedbackList, mClientLink)
+	{
+		if( pFeedback->mpSurface == pSurface )
+			PresentationDiscard(pFeedback);
+	}
+}
+
+// Hands the feedback of the commit in pState to the output showing the
+// surface. A commit no cycle latched yet is replaced by this one.
+static void PresentationCommit( struct Surface* pSurface, struct SurfaceState* pState, struct OutputState* pOutput )
+{
+	if( wl_list_empty(&pState->mFeedbackList) )
+		return;
+
+	if( !pOutput )
+	{
+		PresentationDiscardList(&pState->mFeedbackList);
+		return;
+	}
+
+	struct PresentationFeedback* pFeedback;
+	struct PresentationFeedback* pTmp;
+	wl_list_for_each_safe(pFeedback, pTmp, &pOutput->mFeedbackList, mLink)
+	{
+		if( pFeedback->mpSurface == pSurface )
+			PresentationDiscard(pFeedback);
+	}
+
+	wl_list_insert_list(pOutput->mFeedbackList.prev, &pState->mFeedbackList);
+	wl_list_init(&pState->mFeedbackList);
+}
+
+// Moves the commits of the cycle to pTarget, noting which of them the output
+// shows without composing
+static void PresentationLatch( struct OutputState* pOutput, struct wl_list* pTarget )
+{
+	struct PresentationFeedback* pFeedback;
+	wl_list_for_each(pFeedback, &pOutput->mFeedbackList, mLink)
+	{
+		pFeedback->mFlags = 0;
+		if( pOutput->mpScanoutSurface && pOutput->mpScanoutSurface == pFeedback->mpSurface )
+			pFeedback->mFlags |= WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+	}
+
+	wl_list_insert_list(pTarget->prev, &pOutput->mFeedbackList);
+	wl_list_init(&pOutput->mFeedbackList);
+}
+
+static void PresentationSendPresented(
+	struct OutputState* pOutput, struct wl_list* pList,
+	uint64_t presentNsec, uint32_t refreshNsec, uint64_t sequence, uint32_t flags
+)
+{
+	struct PresentationStats* pStats = &pOutput->mpServer->mPresentationStats;
+	const uint64_t sec = presentNsec / 1000000000ull;
+
+	struct PresentationFeedback* pFeedback;
+	struct PresentationFeedback* pTmp;
+	wl_list_for_each_safe(pFeedback, pTmp, pList, mLink)
+	{
+		// every wl_output of the client bound to this output
+		struct Output* pClientOutput;
+		wl_list_for_each(pClientOutput, &pOutput->mBindingList, mStateLink)
+		{
+			if( pClientOutput->mpClientState == pFeedback->mpClientState )
+				wp_presentation_feedback_send_sync_output(pFeedback->mpResource, pClientOutput->mpResource);
+		}
+
+		wp_presentation_feedback_send_presented(
+			pFeedback->mpResource,
+			(uint32_t)( sec >> 32 ), (uint32_t)sec, (uint32_t)( presentNsec % 1000000000ull ),
+			refreshNsec, (uint32_t)( sequence >> 32 ), (uint32_t)sequence,
+			flags | pFeedback->mFlags
+		);
+
+		const uint64_t latency = presentNsec > pFeedback->mCommitNsec ? presentNsec - pFeedback->mCommitNsec : 0;
+		pStats->mPresented++;
+		pStats->mLatencyNsec += latency;
+		if( latency > pStats->mMaxLatencyNsec )
+			pStats->mMaxLatencyNsec = latency;
+		if( pFeedback->mFlags & WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY )
+			pStats->mZeroCopy++;
+
+		wl_resource_destroy(pFeedback->mpResource);
+	}
+}
+
+// The frame carrying mLatchedFeedbackList is composed. A virtual vblank shows
+// it from the next vblank on, otherwise it is on screen now.
+static void PresentationFrameDone( struct OutputState* pOutput )
+{
+	if( wl_list_empty(&pOutput->mLatchedFeedbackList) )
+		return;
+
+	if( VblankIsVirtual(&pOutput->mVblank) )
+	{
+		ScheduleRepaint(pOutput);
+		return;
+	}
+	PresentationSendPresented(pOutput, &pOutput->mLatchedFeedbackList, GetTimeNsec(), 0, 0, 0);
+}
+
+// Runs on each virtual vblank ahead of the repaint cycle
+static void PresentationFlip( struct OutputState* pOutput, uint64_t vblankNsec, uint64_t sequence )
+{
+	if( wl_list_empty(&pOutput->mLatchedFeedbackList) )
+		return;
+
+	PresentationSendPresented(
+		pOutput, &pOutput->mLatchedFeedbackList, vblankNsec,
+		(uint32_t)pOutput->mVblank.mPeriodNsec, sequence,
+		WP_PRESENTATION_FEEDBACK_KIND_VSYNC
+	);
+}
+
+// The output is going away, frames it did not show yet never will be
+static void OutputDiscardFeedback( struct OutputState* pOutput )
+{
+	PresentationDiscardList(&pOutput->mFeedbackList);
+	PresentationDiscardList(&pOutput->mComposingFeedbackList);
+	PresentationDiscardList(&pOutput->mLatchedFeedbackList);
+}
+
+// Presentation Handle
+
+static void wp_presentation_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Presentation* pPresentation = wl_resource_get_user_data(pResource);
+	if( !pPresentation )
+		return;
+
+	ClientFreeBinding(pPresentation->mpClientState, pPresentation, &pPresentation->mLink);
+}
+
+static void wp_presentation_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void wp_presentation_handle_feedback(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pSurfaceResource, uint32_t callback
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pSurfaceResource);
+	struct ClientState* pClientState = pSurface->mpClientState;
+	struct PresentationFeedback* pFeedback = SlabPoolAlloc(&pClientState->mFeedbackPool);
+	if( !pFeedback )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+
+	struct wl_resource* pFeedbackResource = wl_resource_create(
+		pClient, &wp_presentation_feedback_interface,
+		wl_resource_get_version(pResource), callback
+	);
+	if( !pFeedbackResource )
+	{
+		SlabPoolFree(&pClientState->mFeedbackPool, pFeedback);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pFeedbackResource, NULL,
+		pFeedback, wp_presentation_feedback_handle_resource_destroy
+	);
+
+	pFeedback->mpResource = pFeedbackResource;
+	pFeedback->mpClientState = pClientState;
+	pFeedback->mpSurface = pSurface;
+	// the commit it belongs to comes next, the request is sent right before it
+	pFeedback->mCommitNsec = GetTimeNsec();
+	pFeedback->mFlags = 0;
+	wl_list_insert(pSurface->mPending.mFeedbackList.prev, &pFeedback->mLink);
+	wl_list_insert(pClientState->mFeedbackList.prev, &pFeedback->mClientLink);
+}
+
+static const struct wp_presentation_interface wp_presentation_impl = {
+	.destroy = wp_presentation_handle_destroy,
+	.feedback = wp_presentation_handle_feedback
+};
+
+static void wp_presentation_handle_bind(
+	struct wl_client* pClient, void* pData,
+	uint32_t version, uint32_t id
+)
+{
+	struct ClientState* pClientState = GetClientState(pData, pClient);
+	struct Presentation* pPresentation = pClientState ? ClientAllocBinding(pClientState) : NULL;
+	if( !pPresentation )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &wp_presentation_interface,
+		version, id
+	);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mBindingPool, pPresentation);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pResource, &wp_presentation_impl,
+		pPresentation, wp_presentation_handle_resource_destroy
+	);
+	pPresentation->mpResource = pResource;
+	pPresentation->mpClientState = pClientState;
+	wl_list_insert(pClientState->mPresentationList.prev, &pPresentation->mLink);
+
+	wp_presentation_send_clock_id(pResource, CLOCK_MONOTONIC);
+}
+
+static void PrintPresentationStats( const struct ServerState* pServer )
+{
+	const struct PresentationStats* pStats = &pServer->mPresentationStats;
+	printf("Presentation: %llu presented (%llu zero copy), %llu discarded, commit to present %.3f ms avg, %.3f ms max\n",
+		(unsigned long long)pStats->mPresented,
+		(unsigned long long)pStats->mZeroCopy,
+		(unsigned long long)pStats->mDiscarded,
+		pStats->mPresented ? pStats->mLatencyNsec / 1e6 / pStats->mPresented : 0.0,
+		pStats->mMaxLatencyNsec / 1e6
+	);
+}
+
+#endif
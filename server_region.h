@@ -0,0 +1,336 @@
+#ifndef _SERVER_REGION_H
+#define _SERVER_REGION_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Rectangle set in the spirit of pixman_region32_t. Boxes never overlap, so
+// the area of a region is the sum of its boxes and composing box by box never
+// touches a pixel twice. Storage only grows, clearing keeps the allocation so
+// regions that are refilled every commit do not churn the heap.
+
+struct RegionBox
+{
+	int32_t mX1, mY1;
+	int32_t mX2, mY2;
+};
+
+struct Region
+{
+	struct RegionBox mExtents;
+	struct RegionBox* mpBoxes;
+	uint32_t mCount;
+	uint32_t mCapacity;
+};
+
+static int8_t RegionBoxEmpty( const struct RegionBox* pBox )
+{
+	return pBox->mX1 >= pBox->mX2 || pBox->mY1 >= pBox->mY2;
+}
+
+static int8_t RegionBoxIntersect( const struct RegionBox* pA, const struct RegionBox* pB, struct RegionBox* pOut )
+{
+	pOut->mX1 = pA->mX1 > pB->mX1 ? pA->mX1 : pB->mX1;
+	pOut->mY1 = pA->mY1 > pB->mY1 ? pA->mY1 : pB->mY1;
+	pOut->mX2 = pA->mX2 < pB->mX2 ? pA->mX2 : pB->mX2;
+	pOut->mY2 = pA->mY2 < pB->mY2 ? pA->mY2 : pB->mY2;
+	return !RegionBoxEmpty(pOut);
+}
+
+static int8_t RegionBoxContains( const struct RegionBox* pOuter, const struct RegionBox* pInner )
+{
+	return pOuter->mX1 <= pInner->mX1 && pOuter->mY1 <= pInner->mY1 &&
+		pOuter->mX2 >= pInner->mX2 && pOuter->mY2 >= pInner->mY2;
+}
+
+static void RegionInit( struct Region* pRegion )
+{
+	memset(pRegion, 0, sizeof(struct Region));
+}
+
+static void RegionFini( struct Region* pRegion )
+{
+	free(pRegion->mpBoxes);
+	memset(pRegion, 0, sizeof(struct Region));
+}
+
+static void RegionClear( struct Region* pRegion )
+{
+	pRegion->mCount = 0;
+	memset(&pRegion->mExtents, 0, sizeof(struct RegionBox));
+}
+
+static int8_t RegionNotEmpty( const struct Region* pRegion )
+{
+	return pRegion->mCount != 0;
+}
+
+static int RegionReserve( struct Region* pRegion, uint32_t count )
+{
+	if( count <= pRegion->mCapacity )
+		return 0;
+
+	uint32_t capacity = pRegion->mCapacity ? pRegion->mCapacity : 8;
+	while( capacity < count )
+		capacity *= 2;
+
+	struct RegionBox* pBoxes = realloc(pRegion->mpBoxes, capacity * sizeof(struct RegionBox));
+	if( !pBoxes )
+		return -1;
+
+	pRegion->mpBoxes = pBoxes;
+	pRegion->mCapacity = capacity;
+	return 0;
+}
+
+static void RegionUpdateExtents( struct Region* pRegion )
+{
+	if( pRegion->mCount == 0 )
+	{
+		memset(&pRegion->mExtents, 0, sizeof(struct RegionBox));
+		return;
+	}
+
+	struct RegionBox extents = pRegion->mpBoxes[0];
+	for( uint32_t i = 1; i < pRegion->mCount; i++ )
+	{
+		const struct RegionBox* pBox = &pRegion->mpBoxes[i];
+		if( pBox->mX1 < extents.mX1 ) extents.mX1 = pBox->mX1;
+		if( pBox->mY1 < extents.mY1 ) extents.mY1 = pBox->mY1;
+		if( pBox->mX2 > extents.mX2 ) extents.mX2 = pBox->mX2;
+		if( pBox->mY2 > extents.mY2 ) extents.mY2 = pBox->mY2;
+	}
+	pRegion->mExtents = extents;
+}
+
+static int RegionCopy( struct Region* pDst, const struct Region* pSrc )
+{
+	if( pDst == pSrc )
+		return 0;
+	if( RegionReserve(pDst, pSrc->mCount) == -1 )
+		return -1;
+
+	if( pSrc->mCount )
+		memcpy(pDst->mpBoxes, pSrc->mpBoxes, pSrc->mCount * sizeof(struct RegionBox));
+	pDst->mCount = pSrc->mCount;
+	pDst->mExtents = pSrc->mExtents;
+	return 0;
+}
+
+// A box may span more than INT32_MAX, the sides are taken in 64 bit
+static uint64_t RegionBoxArea( const struct RegionBox* pBox )
+{
+	return (uint64_t)( (int64_t)pBox->mX2 - pBox->mX1 ) * (uint64_t)( (int64_t)pBox->mY2 - pBox->mY1 );
+}
+
+static uint64_t RegionArea( const struct Region* pRegion )
+{
+	uint64_t area = 0;
+	for( uint32_t i = 0; i < pRegion->mCount; i++ )
+		area += RegionBoxArea(&pRegion->mpBoxes[i]);
+	return area;
+}
+
+// Writes the parts of pBox outside pCut, at most 4 boxes, returns the count
+static uint32_t RegionBoxSubtract( const struct RegionBox* pBox, const struct RegionBox* pCut, struct RegionBox* pOut )
+{
+	struct RegionBox overlap;
+	if( !RegionBoxIntersect(pBox, pCut, &overlap) )
+	{
+		pOut[0] = *pBox;
+		return 1;
+	}
+
+	uint32_t count = 0;
+	if( pBox->mY1 < overlap.mY1 )
+		pOut[count++] = (struct RegionBox){ pBox->mX1, pBox->mY1, pBox->mX2, overlap.mY1 };
+	if( pBox->mX1 < overlap.mX1 )
+		pOut[count++] = (struct RegionBox){ pBox->mX1, overlap.mY1, overlap.mX1, overlap.mY2 };
+	if( overlap.mX2 < pBox->mX2 )
+		pOut[count++] = (struct RegionBox){ overlap.mX2, overlap.mY1, pBox->mX2, overlap.mY2 };
+	if( overlap.mY2 < pBox->mY2 )
+		pOut[count++] = (struct RegionBox){ pBox->mX1, overlap.mY2, pBox->mX2, pBox->mY2 };
+	return count;
+}
+
+// Merges boxes sharing a full edge, keeps box counts low for damage that is
+// built from many adjacent rows or tiles.
+static void RegionCoalesce( struct Region* pRegion )
+{
+	int8_t bMerged = 1;
+	while( bMerged )
+	{
+		bMerged = 0;
+		for( uint32_t i = 0; i < pRegion->mCount; i++ )
+		{
+			struct RegionBox* pA = &pRegion->mpBoxes[i];
+			for( uint32_t j = i + 1; j < pRegion->mCount; j++ )
+			{
+				struct RegionBox* pB = &pRegion->mpBoxes[j];
+				const int8_t bVertical = pA->mX1 == pB->mX1 && pA->mX2 == pB->mX2 &&
+					( pA->mY2 == pB->mY1 || pB->mY2 == pA->mY1 );
+				const int8_t bHorizontal = pA->mY1 == pB->mY1 && pA->mY2 == pB->mY2 &&
+					( pA->mX2 == pB->mX1 || pB->mX2 == pA->mX1 );
+
+				if( !bVertical && !bHorizontal )
+					continue;
+
+				if( pB->mX1 < pA->mX1 ) pA->mX1 = pB->mX1;
+				if( pB->mY1 < pA->mY1 ) pA->mY1 = pB->mY1;
+				if( pB->mX2 > pA->mX2 ) pA->mX2 = pB->mX2;
+				if( pB->mY2 > pA->mY2 ) pA->mY2 = pB->mY2;
+
+				*pB = pRegion->mpBoxes[--pRegion->mCount];
+				bMerged = 1;
+				j--;
+			}
+		}
+	}
+}
+
+static int RegionSubtractBox( struct Region* pRegion, const struct RegionBox* pCut )
+{
+	if( RegionBoxEmpty(pCut) || pRegion->mCount == 0 )
+		return 0;
+
+	struct RegionBox overlap;
+	if( !RegionBoxIntersect(&pRegion->mExtents, pCut, &overlap) )
+		return 0;
+
+	// results are appended behind the live boxes, then moved down
+	const uint32_t count = pRegion->mCount;
+	if( RegionReserve(pRegion, count + count * 4) == -1 )
+		return -1;
+
+	uint32_t outCount = 0;
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		outCount += RegionBoxSubtract(
+			&pRegion->mpBoxes[i], pCut, &pRegion->mpBoxes[count + outCount]
+		);
+	}
+
+	memmove(pRegion->mpBoxes, pRegion->mpBoxes + count, outCount * sizeof(struct RegionBox));
+	pRegion->mCount = outCount;
+	RegionCoalesce(pRegion);
+	RegionUpdateExtents(pRegion);
+	return 0;
+}
+
+static int RegionUnionBox( struct Region* pRegion, const struct RegionBox* pBox )
+{
+	if( RegionBoxEmpty(pBox) )
+		return 0;
+
+	for( uint32_t i = 0; i < pRegion->mCount; i++ )
+	{
+		if( RegionBoxContains(&pRegion->mpBoxes[i], pBox) )
+			return 0;
+	}
+
+	// keep the region disjoint by dropping what the new box covers first
+	if( RegionSubtractBox(pRegion, pBox) == -1 )
+		return -1;
+	if( RegionReserve(pRegion, pRegion->mCount + 1) == -1 )
+		return -1;
+
+	pRegion->mpBoxes[pRegion->mCount++] = *pBox;
+	RegionCoalesce(pRegion);
+	RegionUpdateExtents(pRegion);
+	return 0;
+}
+
+static int32_t RegionClampEdge( int64_t edge )
+{
+	return edge > INT32_MAX ? INT32_MAX : edge < INT32_MIN ? INT32_MIN : (int32_t)edge;
+}
+
+// Rectangles come straight from clients, the far edges are summed in 64 bit
+// and clamped instead of overflowing
+static struct RegionBox RegionBoxFromRect( int32_t x, int32_t y, int32_t width, int32_t height )
+{
+	return (struct RegionBox){ x, y, RegionClampEdge((int64_t)x + width), RegionClampEdge((int64_t)y + height) };
+}
+
+static int RegionUnionRect( struct Region* pRegion, int32_t x, int32_t y, int32_t width, int32_t height )
+{
+	if( width <= 0 || height <= 0 )
+		return 0;
+
+	const struct RegionBox box = RegionBoxFromRect(x, y, width, height);
+	return RegionBoxEmpty(&box) ? 0 : RegionUnionBox(pRegion, &box);
+}
+
+static int RegionSubtractRect( struct Region* pRegion, int32_t x, int32_t y, int32_t width, int32_t height )
+{
+	if( width <= 0 || height <= 0 )
+		return 0;
+
+	const struct RegionBox box = RegionBoxFromRect(x, y, width, height);
+	return RegionBoxEmpty(&box) ? 0 : RegionSubtractBox(pRegion, &box);
+}
+
+static int RegionUnion( struct Region* pDst, const struct Region* pSrc )
+{
+	for( uint32_t i = 0; i < pSrc->mCount; i++ )
+	{
+		if( RegionUnionBox(pDst, &pSrc->mpBoxes[i]) == -1 )
+			return -1;
+	}
+	return 0;
+}
+
+static int RegionSubtract( struct Region* pDst, const struct Region* pSrc )
+{
+	for( uint32_t i = 0; i < pSrc->mCount && pDst->mCount; i++ )
+	{
+		if( RegionSubtractBox(pDst, &pSrc->mpBoxes[i]) == -1 )
+			return -1;
+	}
+	return 0;
+}
+
+static void RegionIntersectBox( struct Region* pRegion, const struct RegionBox* pClip )
+{
+	uint32_t count = 0;
+	for( uint32_t i = 0; i < pRegion->mCount; i++ )
+	{
+		struct RegionBox box;
+		if( RegionBoxIntersect(&pRegion->mpBoxes[i], pClip, &box) )
+			pRegion->mpBoxes[count++] = box;
+	}
+	pRegion->mCount = count;
+	RegionUpdateExtents(pRegion);
+}
+
+// Edges saturate like RegionBoxFromRect, a box pushed past the int32 range
+// comes out empty
+static void RegionBoxTranslate( struct RegionBox* pBox, int32_t dx, int32_t dy )
+{
+	pBox->mX1 = RegionClampEdge((int64_t)pBox->mX1 + dx);
+	pBox->mX2 = RegionClampEdge((int64_t)pBox->mX2 + dx);
+	pBox->mY1 = RegionClampEdge((int64_t)pBox->mY1 + dy);
+	pBox->mY2 = RegionClampEdge((int64_t)pBox->mY2 + dy);
+}
+
+static void RegionTranslate( struct Region* pRegion, int32_t dx, int32_t dy )
+{
+	for( uint32_t i = 0; i < pRegion->mCount; i++ )
+		RegionBoxTranslate(&pRegion->mpBoxes[i], dx, dy);
+	if( pRegion->mCount )
+		RegionBoxTranslate(&pRegion->mExtents, dx, dy);
+}
+
+// Collapses the region to its extents once it is fragmented beyond maxBoxes.
+// Only valid for regions where covering too much is harmless, like damage.
+static void RegionSimplify( struct Region* pRegion, uint32_t maxBoxes )
+{
+	if( pRegion->mCount <= maxBoxes )
+		return;
+
+	pRegion->mpBoxes[0] = pRegion->mExtents;
+	pRegion->mCount = 1;
+}
+
+#endif
@@ -0,0 +1,515 @@
+#ifndef _SERVER_RENDERER_H
+#define _SERVER_RENDERER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <wayland-server.h>
+
+#include "server_blend.h"
+#include "server_region.h"
+#include "server_shm_cache.h"
+#include "server_shm_guard.h"
+
+#define RENDERER_BACKGROUND_COLOR 0xFF000000
+// pixels of a scaled row filtered at once, the scratch row lives on the stack
+#define COMPOSE_SCALE_CHUNK 256
+// the scale kernels sample in int32 16.16 relative to the first source
+// pixel, scaled sources are limited to 32767 x 32767 pixels
+#define COMPOSE_SCALE_MAX_SOURCE ( (int64_t)0x7FFF << 16 )
+
+enum ScaleFilter
+{
+	SCALE_FILTER_BILINEAR = 0,
+	SCALE_FILTER_NEAREST
+};
+
+struct Framebuffer;
+struct DrawItem;
+struct ComposeStats;
+
+struct Framebuffer
+{
+	uint32_t* mpPixels;
+	int32_t mWidth, mHeight;
+	// in pixels
+	int32_t mStride;
+};
+
+// One surface worth of pixels, placed in framebuffer coordinates
+struct DrawItem
+{
+	// set when the pixels live in a client wl_shm pool and need SIGBUS
+	// protection, mpMapping only while a compose job holds the pool. Those
+	// items are read under a ShmGuard, the others under libwayland's guard.
+	struct ShmMapping* mpMapping;
+	struct wl_shm_buffer* mpShmBuffer;
+	// set for imported buffers, ComposeRect runs between their
+	// FdMappingBeginAccess and FdMappingEndAccess
+	struct FdMapping* mpFdMapping;
+	const uint8_t* mpData;
+	int32_t mStride;
+	uint32_t mFormat;
+	int32_t mX, mY;
+	int32_t mWidth, mHeight;
+
+	// source rectangle in 16.16 buffer pixels, stretched over mWidth x
+	// mHeight with mFilter when mbScaled is set. mpData is the buffer origin
+	// then, otherwise the first pixel drawn. 64 bit, wl_shm buffers may be
+	// wider than 16.16 int32 reaches.
+	int8_t mbScaled;
+	int8_t mFilter;
+	int64_t mSrcX, mSrcY, mSrcWidth, mSrcHeight;
+
+	// opaque parts of an ARGB8888 item in item coordinates, XRGB8888 items
+	// are opaque as a whole. CullDrawItems hides what is below them, the
+	// compose copies them with full alpha.
+	const struct Region* mpOpaque;
+	// set by CullDrawItems, only the mpVisible boxes are drawn then
+	int8_t mbOccluded;
+	uint32_t mFirstVisible;
+	uint32_t mVisibleCount;
+	const struct RegionBox* mpVisible;
+};
+
+// Visible parts of a draw list, filled by CullDrawItems
+struct Occlusion
+{
+	struct RegionBox* mpBoxes;
+	uint32_t mBoxCount;
+	uint32_t mBoxCapacity;
+	// framebuffer area no opaque item covers
+	struct Region mBackground;
+	// scratch: opaque area above the item being culled and its visible part
+	struct Region mAbove;
+	struct Region mVisible;
+};
+
+struct ComposeStats
+{
+	uint64_t mFrames;
+	// framebuffer pixels written and client pixels read
+	uint64_t mOutputPixels;
+	uint64_t mSourcePixels;
+	// damaged item and background pixels hidden under opaque items
+	uint64_t mCulledPixels;
+	uint64_t mNsec;
+};
+
+static uint64_t GetTimeNsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int FramebufferInit( struct Framebuffer* pFb, int32_t width, int32_t height )
+{
+	// 64 byte rows keep every row start aligned for the vector kernels
+	pFb->mStride = ( width + 15 ) & ~15;
+	pFb->mWidth = width;
+	pFb->mHeight = height;
+	pFb->mpPixels = aligned_alloc(64, (size_t)pFb->mStride * height * sizeof(uint32_t));
+	return pFb->mpPixels ? 0 : -1;
+}
+
+static void FramebufferFini( struct Framebuffer* pFb )
+{
+	free(pFb->mpPixels);
+	pFb->mpPixels = NULL;
+}
+
+// Composes pixels [x1, x2) of row y of an ARGB8888 item with an opaque
+// region. CullDrawItems dropped what lies under that region, so the pixels
+// there are copied with full alpha instead of blended over stale contents.
+// pDst and pSrc point at x1.
+static void ComposeOpaqueRow(
+	uint32_t* pDst, const uint32_t* pSrc, const struct DrawItem* pItem,
+	const struct BlendKernels* pKernels, int32_t x1, int32_t x2, int32_t y
+)
+{
+	const struct Region* pOpaque = pItem->mpOpaque;
+	const int32_t localY = y - pItem->mY;
+	const int32_t localX2 = x2 - pItem->mX;
+	for( int32_t localX = x1 - pItem->mX; localX < localX2; )
+	{
+		// the box covering localX, or else where the next one starts
+		int8_t bCovered = 0;
+		int32_t end = localX2;
+		for( uint32_t i = 0; i < pOpaque->mCount; i++ )
+		{
+			const struct RegionBox* pBox = &pOpaque->mpBoxes[i];
+			if( localY < pBox->mY1 || localY >= pBox->mY2 || pBox->mX2 <= localX )
+				continue;
+			if( pBox->mX1 <= localX )
+			{
+				bCovered = 1;
+				end = pBox->mX2 < localX2 ? pBox->mX2 : localX2;
+				break;
+			}
+			if( pBox->mX1 < end )
+				end = pBox->mX1;
+		}
+
+		const int32_t count = end - localX;
+		if( bCovered )
+			pKernels->mCopyRow(pDst, pSrc, count);
+		else
+			pKernels->mBlendRow(pDst, pSrc, count);
+		pDst += count;
+		pSrc += count;
+		localX = end;
+	}
+}
+
+// Pixel centres of the item are mapped into the source rectangle, a chunk
+// of each row is filtered into a stack buffer and then copied or blended
+// like an unscaled row. x1, y1, x2, y2 is already clipped to the item.
+static uint64_t ComposeScaledItem(
+	struct Framebuffer* pFb, const struct DrawItem* pItem,
+	const struct BlendKernels* pKernels,
+	int32_t x1, int32_t y1, int32_t x2, int32_t y2
+)
+{
+	const int8_t bNearest = pItem->mFilter == SCALE_FILTER_NEAREST;
+	const ScaleRowFunc scaleRow = bNearest ? pKernels->mScaleRowNearest : pKernels->mScaleRowBilinear;
+	const int8_t bOpaque = pItem->mFormat == WL_SHM_FORMAT_XRGB8888;
+
+	// 16.16 source step per framebuffer pixel. Nearest takes the pixel a
+	// centre lands in, bilinear the two centres around it.
+	const int32_t dx = (int32_t)( pItem->mSrcWidth / pItem->mWidth );
+	const int32_t dy = (int32_t)( pItem->mSrcHeight / pItem->mHeight );
+	const int32_t bias = bNearest ? 0 : 0x8000;
+
+	// samples are clamped to the pixels the source rectangle touches
+	const int32_t firstX = (int32_t)( pItem->mSrcX >> 16 );
+	const int32_t firstY = (int32_t)( pItem->mSrcY >> 16 );
+	const int32_t maxX = (int32_t)( ( pItem->mSrcX + pItem->mSrcWidth - 1 ) >> 16 ) - firstX;
+	const int32_t maxY = (int32_t)( ( pItem->mSrcY + pItem->mSrcHeight - 1 ) >> 16 ) - firstY;
+	const int32_t originX = (int32_t)( pItem->mSrcX & 0xFFFF ) + dx / 2 - bias;
+	const int32_t originY = (int32_t)( pItem->mSrcY & 0xFFFF ) + dy / 2 - bias;
+
+	uint32_t row[COMPOSE_SCALE_CHUNK];
+	for( int32_t y = y1; y < y2; y++ )
+	{
+		const int32_t sy = originY + (int32_t)( (int64_t)( y - pItem->mY ) * dy );
+		const int32_t row0 = ClampSample(sy >> 16, maxY);
+		const int32_t row1 = ClampSample(( sy >> 16 ) + 1, maxY);
+		const uint32_t* pSrc0 = (const uint32_t*)( pItem->mpData + (size_t)( firstY + row0 ) * pItem->mStride ) + firstX;
+		const uint32_t* pSrc1 = (const uint32_t*)( pItem->mpData + (size_t)( firstY + row1 ) * pItem->mStride ) + firstX;
+		const uint32_t fy = bNearest ? 0 : ( sy >> 8 ) & 0xFF;
+
+		uint32_t* pDst = pFb->mpPixels + (size_t)y * pFb->mStride;
+		for( int32_t x = x1; x < x2; x += COMPOSE_SCALE_CHUNK )
+		{
+			const int32_t count = x2 - x < COMPOSE_SCALE_CHUNK ? x2 - x : COMPOSE_SCALE_CHUNK;
+			const int32_t sx = originX + (int32_t)( (int64_t)( x - pItem->mX ) * dx );
+			scaleRow(row, pSrc0, pSrc1, fy, sx, dx, maxX, count);
+
+			if( bOpaque )
+				pKernels->mCopyRow(pDst + x, row, count);
+			else if( pItem->mpOpaque )
+				ComposeOpaqueRow(pDst + x, row, pItem, pKernels, x, x + count, y);
+			else
+				pKernels->mBlendRow(pDst + x, row, count);
+		}
+	}
+
+	return (uint64_t)( x2 - x1 ) * ( y2 - y1 );
+}
+
+static uint64_t ComposeItem(
+	struct Framebuffer* pFb, const struct DrawItem* pItem,
+	const struct BlendKernels* pKernels,
+	int32_t clipX1, int32_t clipY1, int32_t clipX2, int32_t clipY2
+)
+{
+	const struct RegionBox itemBox = RegionBoxFromRect(pItem->mX, pItem->mY, pItem->mWidth, pItem->mHeight);
+	int32_t x1 = itemBox.mX1 > clipX1 ? itemBox.mX1 : clipX1;
+	int32_t y1 = itemBox.mY1 > clipY1 ? itemBox.mY1 : clipY1;
+	int32_t x2 = itemBox.mX2 < clipX2 ? itemBox.mX2 : clipX2;
+	int32_t y2 = itemBox.mY2 < clipY2 ? itemBox.mY2 : clipY2;
+
+	if( x1 >= x2 || y1 >= y2 )
+		return 0;
+
+	if( pItem->mbScaled )
+		return ComposeScaledItem(pFb, pItem, pKernels, x1, y1, x2, y2);
+
+	const int32_t count = x2 - x1;
+	const int8_t bOpaque = pItem->mFormat == WL_SHM_FORMAT_XRGB8888;
+
+	for( int32_t y = y1; y < y2; y++ )
+	{
+		uint32_t* pDst = pFb->mpPixels + (size_t)y * pFb->mStride + x1;
+		const uint32_t* pSrc = (const uint32_t*)(
+			pItem->mpData + (size_t)( y - pItem->mY ) * pItem->mStride
+		) + ( x1 - pItem->mX );
+
+		if( bOpaque )
+			pKernels->mCopyRow(pDst, pSrc, count);
+		else if( pItem->mpOpaque )
+			ComposeOpaqueRow(pDst, pSrc, pItem, pKernels, x1, x2, y);
+		else
+			pKernels->mBlendRow(pDst, pSrc, count);
+	}
+
+	return (uint64_t)count * ( y2 - y1 );
+}
+
+// Occlusion Culling
+
+static void OcclusionInit( struct Occlusion* pOcclusion )
+{
+	memset(pOcclusion, 0, sizeof(struct Occlusion));
+	RegionInit(&pOcclusion->mBackground);
+	RegionInit(&pOcclusion->mAbove);
+	RegionInit(&pOcclusion->mVisible);
+}
+
+static void OcclusionFini( struct Occlusion* pOcclusion )
+{
+	free(pOcclusion->mpBoxes);
+	RegionFini(&pOcclusion->mBackground);
+	RegionFini(&pOcclusion->mAbove);
+	RegionFini(&pOcclusion->mVisible);
+	memset(pOcclusion, 0, sizeof(struct Occlusion));
+}
+
+static int OcclusionAppend( struct Occlusion* pOcclusion, const struct Region* pRegion )
+{
+	const uint32_t count = pOcclusion->mBoxCount + pRegion->mCount;
+	if( count > pOcclusion->mBoxCapacity )
+	{
+		uint32_t capacity = pOcclusion->mBoxCapacity ? pOcclusion->mBoxCapacity : 64;
+		while( capacity < count )
+			capacity *= 2;
+
+		struct RegionBox* pBoxes = realloc(pOcclusion->mpBoxes, capacity * sizeof(struct RegionBox));
+		if( !pBoxes )
+			return -1;
+
+		pOcclusion->mpBoxes = pBoxes;
+		pOcclusion->mBoxCapacity = capacity;
+	}
+
+	memcpy(pOcclusion->mpBoxes + pOcclusion->mBoxCount, pRegion->mpBoxes, pRegion->mCount * sizeof(struct RegionBox));
+	pOcclusion->mBoxCount = count;
+	return 0;
+}
+
+static int OcclusionAddOpaque( struct Occlusion* pOcclusion, const struct DrawItem* pItem, const struct RegionBox* pItemBox )
+{
+	if( pItem->mFormat == WL_SHM_FORMAT_XRGB8888 )
+		return RegionUnionBox(&pOcclusion->mAbove, pItemBox);
+
+	if( !pItem->mpOpaque )
+		return 0;
+
+	for( uint32_t i = 0; i < pItem->mpOpaque->mCount; i++ )
+	{
+		struct RegionBox box = pItem->mpOpaque->mpBoxes[i];
+		RegionBoxTranslate(&box, pItem->mX, pItem->mY);
+		struct RegionBox clipped;
+		if( RegionBoxIntersect(&box, pItemBox, &clipped) && RegionUnionBox(&pOcclusion->mAbove, &clipped) == -1 )
+			return -1;
+	}
+	return 0;
+}
+
+// Walks the items top down and trims each one to the part no opaque item
+// above it covers, items hidden completely end up with no visible boxes. The
+// background shrinks the same way. Returns the background to hand to
+// ComposeRect, or NULL when out of memory and the items are drawn unculled.
+static const struct Region* CullDrawItems(
+	struct Occlusion* pOcclusion, struct DrawItem* pItems, uint32_t itemCount,
+	int32_t width, int32_t height
+)
+{
+	const struct RegionBox fbBox = { 0, 0, width, height };
+	RegionClear(&pOcclusion->mAbove);
+	pOcclusion->mBoxCount = 0;
+
+	int8_t bFailed = 0;
+	for( uint32_t i = itemCount; i-- > 0 && !bFailed; )
+	{
+		struct DrawItem* pItem = &pItems[i];
+		pItem->mbOccluded = 0;
+
+		const struct RegionBox itemBox = RegionBoxFromRect(pItem->mX, pItem->mY, pItem->mWidth, pItem->mHeight);
+		struct RegionBox box;
+		if( !RegionBoxIntersect(&itemBox, &fbBox, &box) )
+			continue;
+
+		// nothing opaque above yet, the item is drawn as a whole
+		if( RegionNotEmpty(&pOcclusion->mAbove) )
+		{
+			RegionClear(&pOcclusion->mVisible);
+			bFailed = RegionUnionBox(&pOcclusion->mVisible, &box) == -1 ||
+				RegionSubtract(&pOcclusion->mVisible, &pOcclusion->mAbove) == -1;
+
+			pItem->mbOccluded = 1;
+			pItem->mFirstVisible = pOcclusion->mBoxCount;
+			pItem->mVisibleCount = pOcclusion->mVisible.mCount;
+			bFailed |= OcclusionAppend(pOcclusion, &pOcclusion->mVisible) == -1;
+		}
+
+		bFailed |= OcclusionAddOpaque(pOcclusion, pItem, &box) == -1;
+	}
+
+	RegionClear(&pOcclusion->mBackground);
+	if( !bFailed )
+	{
+		bFailed = RegionUnionBox(&pOcclusion->mBackground, &fbBox) == -1 ||
+			RegionSubtract(&pOcclusion->mBackground, &pOcclusion->mAbove) == -1;
+	}
+
+	// the box array stopped moving, point the items into it
+	for( uint32_t i = 0; i < itemCount; i++ )
+	{
+		struct DrawItem* pItem = &pItems[i];
+		if( bFailed )
+			pItem->mbOccluded = 0;
+		else if( pItem->mbOccluded )
+			pItem->mpVisible = pOcclusion->mpBoxes + pItem->mFirstVisible;
+	}
+	return bFailed ? NULL : &pOcclusion->mBackground;
+}
+
+static void FillRect(
+	struct Framebuffer* pFb, const struct BlendKernels* pKernels,
+	int32_t x1, int32_t y1, int32_t x2, int32_t y2
+)
+{
+	for( int32_t y = y1; y < y2; y++ )
+		pKernels->mFillRow(pFb->mpPixels + (size_t)y * pFb->mStride + x1, RENDERER_BACKGROUND_COLOR, x2 - x1);
+}
+
+static void DrawItemBeginAccess( const struct DrawItem* pItem, struct ShmGuard* pGuard )
+{
+	if( pItem->mpMapping )
+		ShmGuardBegin(pGuard);
+	else if( pItem->mpShmBuffer )
+		wl_shm_buffer_begin_access(pItem->mpShmBuffer);
+}
+
+// Faults of compose job items are left on their mapping for FinishRepaint,
+// libwayland posts the others right away
+static void DrawItemEndAccess( const struct DrawItem* pItem, struct ShmGuard* pGuard )
+{
+	if( pItem->mpMapping )
+	{
+		const uint32_t faults = ShmGuardEnd(pGuard);
+		if( faults )
+			atomic_fetch_add(&pItem->mpMapping->mFaults, faults);
+	}
+	else if( pItem->mpShmBuffer )
+		wl_shm_buffer_end_access(pItem->mpShmBuffer);
+}
+
+// Redraws the clip rectangle from the background up through every item,
+// items are ordered bottom most first. pBackground is the visible background
+// from CullDrawItems, NULL fills the whole clip.
+static void ComposeRect(
+	struct Framebuffer* pFb, const struct DrawItem* pItems, uint32_t itemCount,
+	const struct Region* pBackground, const struct BlendKernels* pKernels,
+	int32_t clipX1, int32_t clipY1, int32_t clipX2, int32_t clipY2,
+	struct ComposeStats* pStats
+)
+{
+	if( clipX1 < 0 ) clipX1 = 0;
+	if( clipY1 < 0 ) clipY1 = 0;
+	if( clipX2 > pFb->mWidth ) clipX2 = pFb->mWidth;
+	if( clipY2 > pFb->mHeight ) clipY2 = pFb->mHeight;
+	if( clipX1 >= clipX2 || clipY1 >= clipY2 )
+		return;
+
+	const struct RegionBox clip = { clipX1, clipY1, clipX2, clipY2 };
+	const uint64_t clipArea = (uint64_t)( clipX2 - clipX1 ) * ( clipY2 - clipY1 );
+	uint64_t culledPixels = clipArea;
+
+	const uint32_t backgroundCount = pBackground ? pBackground->mCount : 1;
+	for( uint32_t i = 0; i < backgroundCount; i++ )
+	{
+		struct RegionBox box;
+		if( !RegionBoxIntersect(pBackground ? &pBackground->mpBoxes[i] : &clip, &clip, &box) )
+			continue;
+		FillRect(pFb, pKernels, box.mX1, box.mY1, box.mX2, box.mY2);
+		culledPixels -= (uint64_t)( box.mX2 - box.mX1 ) * ( box.mY2 - box.mY1 );
+	}
+
+	// consecutive items from the same buffer share one begin/end access. Both
+	// SIGBUS guards are per thread, so tile workers can run this concurrently.
+	const struct DrawItem* pActive = NULL;
+	struct ShmGuard guard;
+	uint64_t sourcePixels = 0;
+	for( uint32_t i = 0; i < itemCount; i++ )
+	{
+		const struct DrawItem* pItem = &pItems[i];
+		const struct RegionBox itemBox = RegionBoxFromRect(pItem->mX, pItem->mY, pItem->mWidth, pItem->mHeight);
+		struct RegionBox covered;
+		if( !RegionBoxIntersect(&itemBox, &clip, &covered) )
+			continue;
+
+		culledPixels += (uint64_t)( covered.mX2 - covered.mX1 ) * ( covered.mY2 - covered.mY1 );
+		if( pItem->mbOccluded && pItem->mVisibleCount == 0 )
+			continue;
+
+		if( !pActive || pItem->mpShmBuffer != pActive->mpShmBuffer )
+		{
+			if( pActive )
+				DrawItemEndAccess(pActive, &guard);
+			pActive = pItem;
+			DrawItemBeginAccess(pActive, &guard);
+		}
+
+		uint64_t drawn = 0;
+		if( !pItem->mbOccluded )
+			drawn = ComposeItem(pFb, pItem, pKernels, clipX1, clipY1, clipX2, clipY2);
+		else
+		{
+			for( uint32_t j = 0; j < pItem->mVisibleCount; j++ )
+			{
+				struct RegionBox box;
+				if( RegionBoxIntersect(&pItem->mpVisible[j], &covered, &box) )
+					drawn += ComposeItem(pFb, pItem, pKernels, box.mX1, box.mY1, box.mX2, box.mY2);
+			}
+		}
+		sourcePixels += drawn;
+		culledPixels -= drawn;
+	}
+	if( pActive )
+		DrawItemEndAccess(pActive, &guard);
+
+	if( pStats )
+	{
+		pStats->mOutputPixels += clipArea;
+		pStats->mSourcePixels += sourcePixels;
+		pStats->mCulledPixels += culledPixels;
+	}
+}
+
+static void PrintComposeStats( const char* pLabel, const struct ComposeStats* pStats )
+{
+	const double seconds = pStats->mNsec / 1e9;
+	if( pStats->mFrames == 0 || seconds <= 0.0 )
+	{
+		printf("%s: no frames composed\n", pLabel);
+		return;
+	}
+
+	printf("%s: %llu frames, %.3f ms/frame, %.1f output MP/s, %.1f source MP/s",
+		pLabel, (unsigned long long)pStats->mFrames,
+		seconds * 1e3 / pStats->mFrames,
+		pStats->mOutputPixels / seconds / 1e6,
+		pStats->mSourcePixels / seconds / 1e6
+	);
+	if( pStats->mCulledPixels )
+		printf(", %.3f MP culled/frame", pStats->mCulledPixels / 1e6 / pStats->mFrames);
+	printf("\n");
+}
+
+#endif
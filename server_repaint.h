@@ -0,0 +1,827 @@
+#ifndef _SERVER_REPAINT_H
+#define _SERVER_REPAINT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <wayland-server.h>
+
+#include "server_buffer_release.h"
+#include "server_capture.h"
+#include "server_fd_cache.h"
+#include "server_loop_stats.h"
+#include "server_region.h"
+#include "server_renderer.h"
+#include "server_state.h"
+#include "server_workers.h"
+
+// past this many boxes one bounding box repaint is cheaper than the overhead
+#define OUTPUT_DAMAGE_MAX_BOXES 32
+
+static void ScheduleRepaint( struct OutputState* pOutput );
+// defined in server_xdg_shell.h
+static void SendXdgConfigures( struct ServerState* pServer );
+// defined in server_client.h
+static struct ClientState* FindClientState( struct wl_client* pClient );
+static int8_t ClientEventsPaused( struct ClientState* pClientState );
+// defined in server_dmabuf.h
+static struct DmabufBuffer* DmabufBufferGet( struct wl_resource* pBuffer );
+// defined in server_presentation.h
+static void PresentationLatch( struct OutputState* pOutput, struct wl_list* pTarget );
+static void PresentationFrameDone( struct OutputState* pOutput );
+static void PresentationFlip( struct OutputState* pOutput, uint64_t vblankNsec, uint64_t sequence );
+
+static int ReserveDrawItems( struct ServerState* pServer, uint32_t count )
+{
+	if( count <= pServer->mDrawItemCapacity )
+		return 0;
+
+	uint32_t capacity = pServer->mDrawItemCapacity ? pServer->mDrawItemCapacity : 16;
+	while( capacity < count )
+		capacity *= 2;
+
+	struct DrawItem* pItems = realloc(pServer->mpDrawItems, capacity * sizeof(struct DrawItem));
+	if( !pItems )
+		return -1;
+
+	pServer->mpDrawItems = pItems;
+	pServer->mDrawItemCapacity = capacity;
+	return 0;
+}
+
+static int8_t SurfaceIsMapped( struct Surface* pSurface )
+{
+	if( pSurface->mpRole && pSurface->mpRole->mIsMapped && !pSurface->mpRole->mIsMapped(pSurface) )
+		return 0;
+	return pSurface->mWidth > 0 && pSurface->mHeight > 0;
+}
+
+// Fills the source rectangle of the item from the viewport and buffer
+// scale of the surface. Crops at whole pixels that are not stretched stay
+// plain row copies, mpData moves to the first pixel shown instead. Returns
+// 0 for a stretched source larger than COMPOSE_SCALE_MAX_SOURCE, the
+// surface is not drawn then.
+static int8_t SurfaceSetDrawSource( struct Surface* pSurface, struct DrawItem* pItem )
+{
+	const struct SurfaceState* pCurrent = &pSurface->mCurrent;
+	const struct ViewportState* pViewport = &pCurrent->mViewport;
+
+	int64_t srcX = 0, srcY = 0;
+	int64_t srcWidth = (int64_t)pSurface->mBufferWidth << 16;
+	int64_t srcHeight = (int64_t)pSurface->mBufferHeight << 16;
+	if( pViewport->mbSource )
+	{
+		// 24.8 surface coordinates to 16.16 buffer pixels
+		const int64_t scale = pCurrent->mScale * 256;
+		srcX = pViewport->mSrcX * scale;
+		srcY = pViewport->mSrcY * scale;
+		srcWidth = pViewport->mSrcWidth * scale;
+		srcHeight = pViewport->mSrcHeight * scale;
+	}
+
+	pItem->mbScaled = srcWidth != (int64_t)pItem->mWidth << 16 || srcHeight != (int64_t)pItem->mHeight << 16 ||
+		( ( srcX | srcY ) & 0xFFFF ) != 0;
+	if( pItem->mbScaled && ( srcWidth > COMPOSE_SCALE_MAX_SOURCE || srcHeight > COMPOSE_SCALE_MAX_SOURCE ) )
+		return 0;
+
+	pItem->mFilter = pSurface->mpClientState->mpServer->mScaleFilter;
+	pItem->mSrcX = srcX;
+	pItem->mSrcY = srcY;
+	pItem->mSrcWidth = srcWidth;
+	pItem->mSrcHeight = srcHeight;
+
+	if( !pItem->mbScaled )
+		pItem->mpData += (size_t)( srcY >> 16 ) * pItem->mStride + (size_t)( srcX >> 16 ) * sizeof(uint32_t);
+	return 1;
+}
+
+static int8_t SurfaceGetDrawItem( struct Surface* pSurface, struct DrawItem* pItem )
+{
+	if( !SurfaceIsMapped(pSurface) )
+		return 0;
+
+	// the buffer went back to the client early, draw the server side copy
+	const struct SurfaceShadow* pShadow = &pSurface->mShadow;
+	if( !pSurface->mCurrent.mpBuffer && pShadow->mbValid )
+	{
+		pItem->mpMapping = NULL;
+		pItem->mpShmBuffer = NULL;
+		pItem->mpFdMapping = NULL;
+		pItem->mpData = (const uint8_t*)pShadow->mpPixels;
+		pItem->mStride = pShadow->mWidth * sizeof(uint32_t);
+		pItem->mFormat = pShadow->mFormat;
+		pItem->mX = pSurface->mX;
+		pItem->mY = pSurface->mY;
+		pItem->mWidth = pSurface->mWidth;
+		pItem->mHeight = pSurface->mHeight;
+		pItem->mpOpaque = RegionNotEmpty(&pSurface->mCurrent.mOpaque) ? &pSurface->mCurrent.mOpaque : NULL;
+		pItem->mbOccluded = 0;
+		return SurfaceSetDrawSource(pSurface, pItem);
+	}
+
+	// rotated buffers are not composited yet, buffer scales go through the
+	// scale kernels like viewports
+	if( !pSurface->mCurrent.mpBuffer || pSurface->mCurrent.mTransform != WL_OUTPUT_TRANSFORM_NORMAL )
+		return 0;
+
+	// imported buffers cannot shrink, they need no SIGBUS guard
+	const struct DmabufBuffer* pDmabuf = DmabufBufferGet(pSurface->mCurrent.mpBuffer);
+	if( pDmabuf )
+	{
+		pItem->mpMapping = NULL;
+		pItem->mpShmBuffer = NULL;
+		pItem->mpFdMapping = pDmabuf->mpMapping;
+		pItem->mpData = pDmabuf->mpData;
+		pItem->mStride = pDmabuf->mStride;
+		pItem->mFormat = pDmabuf->mFormat;
+	}
+	else
+	{
+		struct wl_shm_buffer* pShmBuffer = wl_shm_buffer_get(pSurface->mCurrent.mpBuffer);
+		if( !pShmBuffer )
+			return 0;
+
+		const uint32_t format = wl_shm_buffer_get_format(pShmBuffer);
+		if( format != WL_SHM_FORMAT_ARGB8888 && format != WL_SHM_FORMAT_XRGB8888 )
+			return 0;
+
+		// resolved again for every compose, a resized pool may have moved
+		pItem->mpMapping = NULL;
+		pItem->mpShmBuffer = pShmBuffer;
+		pItem->mpFdMapping = NULL;
+		pItem->mpData = wl_shm_buffer_get_data(pShmBuffer);
+		pItem->mStride = wl_shm_buffer_get_stride(pShmBuffer);
+		pItem->mFormat = format;
+	}
+	pItem->mX = pSurface->mX;
+	pItem->mY = pSurface->mY;
+	pItem->mWidth = pSurface->mWidth;
+	pItem->mHeight = pSurface->mHeight;
+	pItem->mpOpaque = RegionNotEmpty(&pSurface->mCurrent.mOpaque) ? &pSurface->mCurrent.mOpaque : NULL;
+	pItem->mbOccluded = 0;
+	return SurfaceSetDrawSource(pSurface, pItem);
+}
+
+// Imported dma-bufs are synced for the CPU around every compose of them
+static void DrawItemsBeginAccess( const struct DrawItem* pItems, uint32_t itemCount )
+{
+	for( uint32_t i = 0; i < itemCount; i++ )
+		FdMappingBeginAccess(pItems[i].mpFdMapping);
+}
+
+static void DrawItemsEndAccess( const struct DrawItem* pItems, uint32_t itemCount )
+{
+	for( uint32_t i = 0; i < itemCount; i++ )
+		FdMappingEndAccess(pItems[i].mpFdMapping);
+}
+
+// Surface Stack
+
+static void MarkSurfaceStackDirty( struct ServerState* pServer )
+{
+	pServer->mbSurfaceStackDirty = 1;
+}
+
+static int SurfaceStackAppend( struct ServerState* pServer, struct Surface* pSurface )
+{
+	struct Subsurface* pSubsurface;
+	wl_list_for_each(pSubsurface, &pSurface->mBelowList, mParentLink)
+	{
+		if( SurfaceStackAppend(pServer, pSubsurface->mpSurface) == -1 )
+			return -1;
+	}
+
+	if( pServer->mSurfaceStackCount == pServer->mSurfaceStackCapacity )
+	{
+		uint32_t capacity = pServer->mSurfaceStackCapacity ? pServer->mSurfaceStackCapacity * 2 : 16;
+		struct Surface** ppStack = realloc(pServer->mppSurfaceStack, capacity * sizeof(struct Surface*));
+		if( !ppStack )
+			return -1;
+
+		pServer->mppSurfaceStack = ppStack;
+		pServer->mSurfaceStackCapacity = capacity;
+	}
+	pServer->mppSurfaceStack[pServer->mSurfaceStackCount++] = pSurface;
+
+	wl_list_for_each(pSubsurface, &pSurface->mAboveList, mParentLink)
+	{
+		if( SurfaceStackAppend(pServer, pSubsurface->mpSurface) == -1 )
+			return -1;
+	}
+	return 0;
+}
+
+// Every surface in stacking order, bottom most first. Repaints read the
+// cached array, the subsurface trees are only walked again once they or
+// the surface list changed.
+static struct Surface** GetSurfaceStack( struct ServerState* pServer, uint32_t* pCount )
+{
+	if( pServer->mbSurfaceStackDirty )
+	{
+		pServer->mSurfaceStackCount = 0;
+		pServer->mbSurfaceStackDirty = 0;
+		pServer->mSubsurfaceStats.mStackRebuilds++;
+
+		struct Surface* pSurface;
+		wl_list_for_each(pSurface, &pServer->mSurfaceList, mLink)
+		{
+			if( SurfaceStackAppend(pServer, pSurface) == -1 )
+			{
+				// out of memory, draw what fits and try again next time
+				pServer->mbSurfaceStackDirty = 1;
+				break;
+			}
+		}
+	}
+
+	*pCount = pServer->mSurfaceStackCount;
+	return pServer->mppSurfaceStack;
+}
+
+// Only surfaces overlapping the output make it into its draw list, items
+// are moved into output coordinates
+static uint32_t BuildDrawList( struct ServerState* pServer, const struct OutputState* pOutput )
+{
+	uint32_t surfaceCount;
+	struct Surface** ppStack = GetSurfaceStack(pServer, &surfaceCount);
+	if( ReserveDrawItems(pServer, surfaceCount) == -1 )
+		return 0;
+
+	const uint32_t bit = 1u << pOutput->mIndex;
+
+	uint32_t count = 0;
+	for( uint32_t i = 0; i < surfaceCount; i++ )
+	{
+		struct Surface* pSurface = ppStack[i];
+		if( !( pSurface->mOutputMask & bit ) )
+			continue;
+
+		struct DrawItem* pItem = &pServer->mpDrawItems[count];
+		if( SurfaceGetDrawItem(pSurface, pItem) )
+		{
+			pItem->mX -= pOutput->mX;
+			pItem->mY -= pOutput->mY;
+			count++;
+		}
+	}
+	return count;
+}
+
+static struct OutputState* GetFirstOutput( struct ServerState* pServer )
+{
+	if( wl_list_empty(&pServer->mOutputList) )
+		return NULL;
+
+	struct OutputState* pOutput = wl_container_of(pServer->mOutputList.next, pOutput, mLink);
+	return pOutput;
+}
+
+// Output that paces the surface, surfaces off every output use the first one
+// so their frame callbacks still fire
+static struct OutputState* GetSurfaceOutput( struct Surface* pSurface )
+{
+	if( pSurface->mpOutput )
+		return pSurface->mpOutput;
+	return GetFirstOutput(pSurface->mpClientState->mpServer);
+}
+
+static struct RegionBox GetOutputBox( const struct OutputState* pOutput )
+{
+	return RegionBoxFromRect(pOutput->mX, pOutput->mY, pOutput->mWidth, pOutput->mHeight);
+}
+
+static struct RegionBox GetSurfaceBox( const struct Surface* pSurface )
+{
+	return RegionBoxFromRect(pSurface->mX, pSurface->mY, pSurface->mWidth, pSurface->mHeight);
+}
+
+// Damage is in global compositor coordinates, every output it touches
+// schedules its own repaint
+static void DamageOutputBox( struct ServerState* pServer, const struct RegionBox* pBox )
+{
+	struct OutputState* pOutput;
+	wl_list_for_each(pOutput, &pServer->mOutputList, mLink)
+	{
+		const struct RegionBox outputBox = GetOutputBox(pOutput);
+
+		struct RegionBox clipped;
+		if( !RegionBoxIntersect(pBox, &outputBox, &clipped) )
+			continue;
+
+		RegionUnionBox(&pOutput->mDamage, &clipped);
+		RegionSimplify(&pOutput->mDamage, OUTPUT_DAMAGE_MAX_BOXES);
+		ScheduleRepaint(pOutput);
+	}
+}
+
+static void DamageOutputRect( struct ServerState* pServer, int32_t x, int32_t y, int32_t width, int32_t height )
+{
+	const struct RegionBox box = RegionBoxFromRect(x, y, width, height);
+	DamageOutputBox(pServer, &box);
+}
+
+static void DamageOutput( struct ServerState* pServer, const struct Region* pDamage )
+{
+	for( uint32_t i = 0; i < pDamage->mCount; i++ )
+		DamageOutputBox(pServer, &pDamage->mpBoxes[i]);
+}
+
+// Direct Scan-out
+
+static void OutputDamageAll( struct OutputState* pOutput )
+{
+	RegionClear(&pOutput->mDamage);
+	RegionUnionRect(&pOutput->mDamage, pOutput->mX, pOutput->mY, pOutput->mWidth, pOutput->mHeight);
+}
+
+// Goes back to showing the framebuffer, which went stale in the meantime.
+// A buffer the surface already replaced is released unless bRelease is 0.
+static void OutputDropScanout( struct OutputState* pOutput, int8_t bRelease )
+{
+	if( !pOutput->mpScanoutBuffer )
+		return;
+
+	struct Surface* pSurface = pOutput->mpScanoutSurface;
+	if( bRelease && pOutput->mbScanoutReleaseHeld && pSurface &&
+		pSurface->mCurrent.mpBuffer != pOutput->mpScanoutBuffer )
+		QueueBufferRelease(pSurface->mpClientState, pOutput->mpScanoutBuffer, pOutput->mScanoutCommitNsec);
+
+	wl_list_remove(&pOutput->mScanoutBufferDestroy.link);
+	wl_list_init(&pOutput->mScanoutBufferDestroy.link);
+
+	pOutput->mpScanoutSurface = NULL;
+	pOutput->mpScanoutBuffer = NULL;
+	pOutput->mbScanoutReleaseHeld = 0;
+	OutputDamageAll(pOutput);
+}
+
+static void output_scanout_buffer_destroy( struct wl_listener* pListener, void* pData )
+{
+	struct OutputState* pOutput = wl_container_of(pListener, pOutput, mScanoutBufferDestroy);
+	OutputDropScanout(pOutput, 0);
+	ScheduleRepaint(pOutput);
+}
+
+// A surface replaced pBuffer, returns 1 when an output still shows it and
+// takes over its release
+static int8_t HoldScanoutRelease( struct ServerState* pServer, struct wl_resource* pBuffer, uint64_t commitNsec )
+{
+	int8_t bHeld = 0;
+
+	struct OutputState* pOutput;
+	wl_list_for_each(pOutput, &pServer->mOutputList, mLink)
+	{
+		if( pOutput->mpScanoutBuffer != pBuffer )
+			continue;
+
+		pOutput->mbScanoutReleaseHeld = 1;
+		pOutput->mScanoutCommitNsec = commitNsec;
+		// the next cycle switches buffers even when the commit had no damage
+		OutputDamageAll(pOutput);
+		ScheduleRepaint(pOutput);
+		bHeld = 1;
+	}
+	return bHeld;
+}
+
+static void DropSurfaceScanout( struct Surface* pSurface, int8_t bRelease )
+{
+	struct OutputState* pOutput;
+	wl_list_for_each(pOutput, &pSurface->mpClientState->mpServer->mOutputList, mLink)
+	{
+		if( pOutput->mpScanoutSurface == pSurface )
+			OutputDropScanout(pOutput, bRelease);
+	}
+}
+
+// An XRGB8888 client buffer of the output's size covering the output as its
+// topmost surface is shown as is, nothing gets composed. Returns 1 when the
+// output shows a client buffer.
+static int8_t OutputTryScanout( struct OutputState* pOutput )
+{
+	struct ServerState* pServer = pOutput->mpServer;
+	const uint32_t bit = 1u << pOutput->mIndex;
+
+	uint32_t surfaceCount;
+	struct Surface** ppStack = GetSurfaceStack(pServer, &surfaceCount);
+
+	struct Surface* pCandidate = NULL;
+	struct DrawItem item;
+	for( uint32_t i = surfaceCount; i-- > 0; )
+	{
+		struct Surface* pSurface = ppStack[i];
+		if( ( pSurface->mOutputMask & bit ) && SurfaceGetDrawItem(pSurface, &item) )
+		{
+			pCandidate = pSurface;
+			break;
+		}
+	}
+
+	// shadow copies from --early-release, imported and scaled buffers are
+	// never scanned out
+	if( !pCandidate || !item.mpShmBuffer || item.mbScaled || item.mFormat != WL_SHM_FORMAT_XRGB8888 ||
+		item.mX != pOutput->mX || item.mY != pOutput->mY ||
+		item.mWidth != pOutput->mWidth || item.mHeight != pOutput->mHeight ||
+		pCandidate->mBufferWidth != pOutput->mWidth || pCandidate->mBufferHeight != pOutput->mHeight )
+	{
+		OutputDropScanout(pOutput, 1);
+		return 0;
+	}
+
+	struct wl_resource* pBuffer = pCandidate->mCurrent.mpBuffer;
+	if( pOutput->mpScanoutBuffer != pBuffer )
+	{
+		OutputDropScanout(pOutput, 1);
+
+		pOutput->mpScanoutSurface = pCandidate;
+		pOutput->mpScanoutBuffer = pBuffer;
+		wl_resource_add_destroy_listener(pBuffer, &pOutput->mScanoutBufferDestroy);
+	}
+
+	RegionClear(&pOutput->mDamage);
+	pOutput->mScanoutFrames++;
+	return 1;
+}
+
+// Snapshots the draw list and damage of the output into its compose job,
+// returns 0 when the frame has to be composed right here instead
+static int8_t RepaintOutputAsync( struct OutputState* pOutput, uint32_t itemCount, const struct Region* pBackground )
+{
+	struct ServerState* pServer = pOutput->mpServer;
+	struct ComposeJob* pJob = &pOutput->mComposeJob;
+	if( ComposeJobSetItems(pJob, pServer->mpDrawItems, itemCount) == -1 )
+		return 0;
+
+	for( uint32_t i = 0; i < pOutput->mDamage.mCount; i++ )
+	{
+		const struct RegionBox* pBox = &pOutput->mDamage.mpBoxes[i];
+		if( ComposeJobAddRect(
+				pJob, &pOutput->mFramebuffer,
+				pBox->mX1 - pOutput->mX, pBox->mY1 - pOutput->mY,
+				pBox->mX2 - pOutput->mX, pBox->mY2 - pOutput->mY
+			) == -1 )
+			return 0;
+	}
+
+	// the workers read through the mpData resolved above, the pools keep that
+	// mapping until FinishRepaint. A wl_shm_pool.resize meanwhile is deferred
+	// by libwayland and applied once the last reference goes.
+	for( uint32_t i = 0; i < itemCount; i++ )
+	{
+		struct DrawItem* pItem = &pJob->mpItems[i];
+		if( !pItem->mpShmBuffer )
+			continue;
+
+		// the workers read under a ShmGuard instead of libwayland's guard
+		if( ShmGuardInstall(pItem->mpShmBuffer) == 0 )
+			pItem->mpMapping = ShmMappingAcquire(&pServer->mShmCache, pItem->mpShmBuffer);
+		if( !pItem->mpMapping )
+		{
+			while( i-- > 0 )
+			{
+				ShmMappingRelease(&pServer->mShmCache, pJob->mpItems[i].mpMapping);
+				pJob->mpItems[i].mpMapping = NULL;
+			}
+			return 0;
+		}
+	}
+	// imported buffers stay mapped and synced for the CPU until FinishRepaint
+	for( uint32_t i = 0; i < itemCount; i++ )
+	{
+		if( pJob->mpItems[i].mpFdMapping )
+			pJob->mpItems[i].mpFdMapping->mRefCount++;
+	}
+	DrawItemsBeginAccess(pJob->mpItems, itemCount);
+
+	pJob->mpFramebuffer = &pOutput->mFramebuffer;
+	pJob->mpKernels = pServer->mpKernels;
+	pJob->mpBackground = pBackground;
+	RegionClear(&pOutput->mDamage);
+
+	pOutput->mbComposing = 1;
+	pServer->mComposeJobsPending++;
+	WorkerPoolSubmit(pServer->mpWorkers, pJob);
+	return 1;
+}
+
+// Recomposes only the damaged boxes of the output, returns 1 when the frame
+// went to the tile workers and is finished by FinishRepaint
+static int8_t RepaintOutput( struct OutputState* pOutput )
+{
+	struct ServerState* pServer = pOutput->mpServer;
+	if( OutputTryScanout(pOutput) )
+		return 0;
+
+	const uint64_t start = GetTimeNsec();
+
+	const uint32_t itemCount = BuildDrawList(pServer, pOutput);
+	const struct Region* pBackground = CullDrawItems(
+		&pOutput->mOcclusion, pServer->mpDrawItems, itemCount, pOutput->mWidth, pOutput->mHeight
+	);
+	if( pServer->mpWorkers && RepaintOutputAsync(pOutput, itemCount, pBackground) )
+		return 1;
+
+	DrawItemsBeginAccess(pServer->mpDrawItems, itemCount);
+	for( uint32_t i = 0; i < pOutput->mDamage.mCount; i++ )
+	{
+		const struct RegionBox* pBox = &pOutput->mDamage.mpBoxes[i];
+		ComposeRect(
+			&pOutput->mFramebuffer, pServer->mpDrawItems, itemCount,
+			pBackground, pServer->mpKernels,
+			pBox->mX1 - pOutput->mX, pBox->mY1 - pOutput->mY,
+			pBox->mX2 - pOutput->mX, pBox->mY2 - pOutput->mY,
+			&pOutput->mComposeStats
+		);
+	}
+	DrawItemsEndAccess(pServer->mpDrawItems, itemCount);
+	RegionClear(&pOutput->mDamage);
+
+	pOutput->mComposeStats.mNsec += GetTimeNsec() - start;
+	pOutput->mComposeStats.mFrames++;
+	return 0;
+}
+
+// All callbacks committed during the cycle get the same done timestamp,
+// callbacks of paused clients wait in the output's list for a later cycle
+static void SendFrameCallbacks( struct OutputState* pOutput, struct wl_list* pCallbackList, uint32_t time )
+{
+	uint32_t batch = 0;
+	uint32_t heldCount = 0;
+	struct wl_list held;
+	wl_list_init(&held);
+
+	// callbacks of one client tend to be next to each other
+	struct wl_client* pLastClient = NULL;
+	int8_t bPaused = 0;
+
+	struct wl_resource* pCallback;
+	struct wl_resource* pTmp;
+	wl_resource_for_each_safe(pCallback, pTmp, pCallbackList)
+	{
+		struct wl_client* pClient = wl_resource_get_client(pCallback);
+		if( pClient != pLastClient )
+		{
+			struct ClientState* pClientState = FindClientState(pClient);
+			bPaused = pClientState && ClientEventsPaused(pClientState);
+			pLastClient = pClient;
+		}
+
+		if( bPaused )
+		{
+			wl_list_remove(wl_resource_get_link(pCallback));
+			wl_list_insert(held.prev, wl_resource_get_link(pCallback));
+			heldCount++;
+			continue;
+		}
+
+		wl_callback_send_done(pCallback, time);
+		wl_resource_destroy(pCallback);
+		batch++;
+	}
+	// ahead of anything committed since
+	wl_list_insert_list(&pOutput->mFrameCallbackList, &held);
+
+	struct FrameCallbackStats* pStats = &pOutput->mFrameStats;
+	pStats->mCycles++;
+	pStats->mCallbacks += batch;
+	pStats->mHeldCallbacks += heldCount;
+	if( batch > pStats->mMaxBatch )
+		pStats->mMaxBatch = batch;
+}
+
+// Hands the frame the output just finished to the capture writer, the copy
+// is the only part of the dump done on the dispatch thread
+static void CaptureOutput( struct OutputState* pOutput )
+{
+	struct Capture* pCapture = pOutput->mpServer->mpCapture;
+	if( !pCapture )
+		return;
+
+	if( !pOutput->mpScanoutBuffer )
+	{
+		const struct Framebuffer* pFb = &pOutput->mFramebuffer;
+		CaptureQueueFrame(
+			pCapture, pOutput->mIndex, (const uint8_t*)pFb->mpPixels,
+			pFb->mStride * sizeof(uint32_t), pFb->mWidth, pFb->mHeight, 0
+		);
+		return;
+	}
+
+	struct wl_shm_buffer* pShmBuffer = wl_shm_buffer_get(pOutput->mpScanoutBuffer);
+	wl_shm_buffer_begin_access(pShmBuffer);
+	CaptureQueueFrame(
+		pCapture, pOutput->mIndex, wl_shm_buffer_get_data(pShmBuffer),
+		wl_shm_buffer_get_stride(pShmBuffer), pOutput->mWidth, pOutput->mHeight,
+		CAPTURE_FRAME_SCANOUT
+	);
+	wl_shm_buffer_end_access(pShmBuffer);
+}
+
+static void RepaintCycle( struct OutputState* pOutput, uint32_t time )
+{
+	if( pOutput->mbComposing )
+	{
+		// FinishRepaint schedules the cycle again
+		pOutput->mbCycleDeferred = 1;
+		pOutput->mFrameStats.mBusyCycles++;
+		return;
+	}
+
+	struct LoopStats* pLoopStats = pOutput->mpServer->mpLoopStats;
+	LoopStatsMark(pLoopStats);
+	const uint64_t start = GetTimeNsec();
+
+	const int8_t bNewFrame = RegionNotEmpty(&pOutput->mDamage);
+	const int8_t bAsync = bNewFrame && RepaintOutput(pOutput);
+
+	// configures are not tied to an output, whichever cycle runs first sends them
+	SendXdgConfigures(pOutput->mpServer);
+
+	if( bAsync )
+	{
+		// callbacks committed from now on wait for the next frame
+		wl_list_insert_list(&pOutput->mComposingCallbackList, &pOutput->mFrameCallbackList);
+		wl_list_init(&pOutput->mFrameCallbackList);
+		PresentationLatch(pOutput, &pOutput->mComposingFeedbackList);
+		pOutput->mComposeTime = time;
+	}
+	else
+	{
+		SendFrameCallbacks(pOutput, &pOutput->mFrameCallbackList, time);
+		PresentationLatch(pOutput, &pOutput->mLatchedFeedbackList);
+		PresentationFrameDone(pOutput);
+		if( bNewFrame )
+			CaptureOutput(pOutput);
+	}
+
+	if( pLoopStats )
+		LatencyRecord(&pLoopStats->mRepaint, GetTimeNsec() - start);
+}
+
+// The workers took a SIGBUS reading the pool of pMapping. Surfaces that still
+// show one of its buffers get the error libwayland posts for its own guard,
+// the zeros mapped over the pages stand in until the client is gone.
+static void PostShmFault( struct ServerState* pServer, const struct ShmMapping* pMapping )
+{
+	uint32_t surfaceCount;
+	struct Surface** ppStack = GetSurfaceStack(pServer, &surfaceCount);
+	for( uint32_t i = 0; i < surfaceCount; i++ )
+	{
+		struct wl_resource* pBuffer = ppStack[i]->mCurrent.mpBuffer;
+		struct wl_shm_buffer* pShmBuffer = pBuffer ? wl_shm_buffer_get(pBuffer) : NULL;
+		if( !pShmBuffer )
+			continue;
+
+		struct wl_shm_pool* pPool = wl_shm_buffer_ref_pool(pShmBuffer);
+		wl_shm_pool_unref(pPool);
+		if( pPool == pMapping->mpPool )
+			wl_resource_post_error(pBuffer, WL_SHM_ERROR_INVALID_FD, "error accessing SHM buffer");
+	}
+}
+
+// Back on the dispatch thread once the workers composed the output's frame
+static void FinishRepaint( struct OutputState* pOutput )
+{
+	struct ServerState* pServer = pOutput->mpServer;
+	struct ComposeJob* pJob = &pOutput->mComposeJob;
+
+	DrawItemsEndAccess(pJob->mpItems, pJob->mItemCount);
+	for( uint32_t i = 0; i < pJob->mItemCount; i++ )
+	{
+		struct ShmMapping* pMapping = pJob->mpItems[i].mpMapping;
+		if( pMapping && atomic_exchange(&pMapping->mFaults, 0) )
+			PostShmFault(pServer, pMapping);
+		ShmMappingRelease(&pServer->mShmCache, pJob->mpItems[i].mpMapping);
+		FdMappingRelease(&pServer->mFdCache, pJob->mpItems[i].mpFdMapping);
+	}
+
+	struct ComposeStats* pStats = &pOutput->mComposeStats;
+	pStats->mOutputPixels += atomic_load(&pJob->mOutputPixels);
+	pStats->mSourcePixels += atomic_load(&pJob->mSourcePixels);
+	pStats->mCulledPixels += atomic_load(&pJob->mCulledPixels);
+	pStats->mNsec += pJob->mDoneNsec - pJob->mSubmitNsec;
+	pStats->mFrames++;
+
+	pOutput->mbComposing = 0;
+	pServer->mComposeJobsPending--;
+	SendFrameCallbacks(pOutput, &pOutput->mComposingCallbackList, pOutput->mComposeTime);
+	wl_list_insert_list(pOutput->mLatchedFeedbackList.prev, &pOutput->mComposingFeedbackList);
+	wl_list_init(&pOutput->mComposingFeedbackList);
+	PresentationFrameDone(pOutput);
+	CaptureOutput(pOutput);
+
+	// releases were held back while the workers could still read the buffers
+	if( pServer->mComposeJobsPending == 0 )
+		FlushBufferReleases(pServer);
+
+	if( pOutput->mbCycleDeferred )
+	{
+		pOutput->mbCycleDeferred = 0;
+		ScheduleRepaint(pOutput);
+	}
+}
+
+// Finishes every frame the workers still hold, for changes that cannot wait
+// for server_workers_done like resizing or removing an output
+static void FinishPendingRepaints( struct ServerState* pServer )
+{
+	if( pServer->mComposeJobsPending == 0 )
+		return;
+
+	WorkerPoolWait(pServer->mpWorkers);
+	struct ComposeJob* pJob;
+	while( ( pJob = WorkerPoolCollect(pServer->mpWorkers) ) )
+		FinishRepaint(pJob->mpUserData);
+}
+
+static int server_workers_done( int fd, uint32_t mask, void* pData )
+{
+	struct ServerState* pServer = pData;
+	LoopStatsMark(pServer->mpLoopStats);
+
+	uint64_t count;
+	if( read(fd, &count, sizeof(count)) != sizeof(count) )
+		return 0;
+
+	struct ComposeJob* pJob;
+	while( ( pJob = WorkerPoolCollect(pServer->mpWorkers) ) )
+		FinishRepaint(pJob->mpUserData);
+	return 0;
+}
+
+static void server_repaint_idle( void* pData )
+{
+	struct OutputState* pOutput = pData;
+	pOutput->mpRepaintSource = NULL;
+
+	RepaintCycle(pOutput, GetTimeMsec());
+}
+
+static void server_repaint_vblank( void* pData, uint64_t vblankNsec, uint64_t sequence )
+{
+	// the frame latched by the previous cycle is shown from this vblank on
+	PresentationFlip(pData, vblankNsec, sequence);
+	RepaintCycle(pData, (uint32_t)( vblankNsec / 1000000ull ));
+}
+
+// With a virtual refresh rate the cycle runs on the output's next vblank,
+// otherwise at most once per dispatch after every request read in it was
+// handled. Outputs run their cycles independently of each other.
+static void ScheduleRepaint( struct OutputState* pOutput )
+{
+	if( !pOutput )
+		return;
+
+	if( !RegionNotEmpty(&pOutput->mDamage) && wl_list_empty(&pOutput->mFrameCallbackList) &&
+		wl_list_empty(&pOutput->mFeedbackList) && wl_list_empty(&pOutput->mLatchedFeedbackList) &&
+		wl_list_empty(&pOutput->mpServer->mXdgConfigureList) )
+		return;
+
+	struct VirtualVblank* pVblank = &pOutput->mVblank;
+	if( VblankIsVirtual(pVblank) )
+	{
+		VblankArm(pVblank);
+		return;
+	}
+
+	if( pOutput->mpRepaintSource )
+		return;
+
+	pOutput->mpRepaintSource = wl_event_loop_add_idle(
+		pOutput->mpServer->mpEventLoop, server_repaint_idle, pOutput
+	);
+}
+
+static void PrintOutputStats( const struct OutputState* pOutput )
+{
+	const struct FrameCallbackStats* pStats = &pOutput->mFrameStats;
+	const struct VirtualVblank* pVblank = &pOutput->mVblank;
+
+	char name[32];
+	snprintf(name, sizeof(name), "Output %u", pOutput->mIndex);
+	PrintComposeStats(name, &pOutput->mComposeStats);
+
+	printf("Output %u: %llu repaint cycles, frame callbacks: %llu (%.2f per cycle, max %u)",
+		pOutput->mIndex,
+		(unsigned long long)pStats->mCycles, (unsigned long long)pStats->mCallbacks,
+		pStats->mCycles ? (double)pStats->mCallbacks / pStats->mCycles : 0.0,
+		pStats->mMaxBatch
+	);
+	if( pOutput->mScanoutFrames )
+		printf(", %llu frames scanned out, %llu composed",
+			(unsigned long long)pOutput->mScanoutFrames, (unsigned long long)pOutput->mComposeStats.mFrames);
+	if( pStats->mBusyCycles )
+		printf(", %llu cycles waited for the workers", (unsigned long long)pStats->mBusyCycles);
+	if( pOutput->mModeChanges )
+		printf(", %llu mode changes sent to %u bindings in %.3f ms",
+			(unsigned long long)pOutput->mModeChanges, pOutput->mBindingCount, pOutput->mFanoutNsec / 1e6);
+	if( pStats->mHeldCallbacks )
+		printf(", %llu callbacks held for paused clients", (unsigned long long)pStats->mHeldCallbacks);
+	if( VblankIsVirtual(pVblank) )
+		printf(", %.3f Hz virtual vblank, %llu missed\n", pVblank->mRefresh / 1000.0, (unsigned long long)pVblank->mMissed);
+	else
+		printf(", as fast as possible\n");
+}
+
+#endif
@@ -0,0 +1,130 @@
+#ifndef _SERVER_SHM_CACHE_H
+#define _SERVER_SHM_CACHE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <wayland-server.h>
+
+#include "server_slab.h"
+
+// Cache of the wl_shm_pool mappings compose jobs read from. libwayland maps a
+// pool once when it is created and again on wl_shm_pool.resize, which it
+// defers while the pool has references. Surfaces take none, their draw items
+// resolve wl_shm_buffer_get_data on every compose so a client can grow a pool
+// with one of its buffers on screen. Only a compose job handed to the tile
+// workers holds an entry, from the snapshot until FinishRepaint, so the data
+// pointers it took stay valid while the dispatch thread goes on. Items of
+// the same pool in one job, like several surfaces sharing it, are lookup hits.
+
+#define SHM_CACHE_BUCKETS 64
+#define SHM_MAPPINGS_PER_SLAB_CHUNK 64
+
+struct ShmMapping
+{
+	struct wl_shm_pool* mpPool;
+	// draw items of compose jobs that may still read from the pool
+	uint32_t mRefCount;
+	// SIGBUS faults the tile workers took reading the pool, see ShmGuard
+	atomic_uint mFaults;
+	struct wl_list mLink;
+};
+
+struct ShmMappingCache
+{
+	struct wl_list mBuckets[SHM_CACHE_BUCKETS];
+	struct SlabPool mMappingPool;
+
+	uint64_t mMappingsCreated;
+	uint64_t mMappingsReused;
+	uint64_t mMappingsReleased;
+};
+
+static void ShmMappingCacheInit( struct ShmMappingCache* pCache )
+{
+	for( uint32_t i = 0; i < SHM_CACHE_BUCKETS; i++ )
+		wl_list_init(&pCache->mBuckets[i]);
+
+	SlabPoolInit(&pCache->mMappingPool, sizeof(struct ShmMapping), SHM_MAPPINGS_PER_SLAB_CHUNK);
+	pCache->mMappingsCreated = pCache->mMappingsReused = pCache->mMappingsReleased = 0;
+}
+
+static void ShmMappingCacheFini( struct ShmMappingCache* pCache )
+{
+	for( uint32_t i = 0; i < SHM_CACHE_BUCKETS; i++ )
+	{
+		struct ShmMapping* pMapping;
+		struct ShmMapping* pTmp;
+		wl_list_for_each_safe(pMapping, pTmp, &pCache->mBuckets[i], mLink)
+		{
+			wl_list_remove(&pMapping->mLink);
+			wl_shm_pool_unref(pMapping->mpPool);
+		}
+	}
+	SlabPoolFini(&pCache->mMappingPool);
+}
+
+static uint32_t ShmMappingHash( const struct wl_shm_pool* pPool )
+{
+	uintptr_t key = (uintptr_t)pPool;
+	key ^= key >> 17;
+	key *= 0x9E3779B1u;
+	return (uint32_t)( key >> 7 ) & ( SHM_CACHE_BUCKETS - 1 );
+}
+
+static struct ShmMapping* ShmMappingAcquire( struct ShmMappingCache* pCache, struct wl_shm_buffer* pShmBuffer )
+{
+	// takes a pool reference that is dropped again on a cache hit
+	struct wl_shm_pool* pPool = wl_shm_buffer_ref_pool(pShmBuffer);
+	struct wl_list* pBucket = &pCache->mBuckets[ShmMappingHash(pPool)];
+
+	struct ShmMapping* pMapping;
+	wl_list_for_each(pMapping, pBucket, mLink)
+	{
+		if( pMapping->mpPool == pPool )
+		{
+			wl_shm_pool_unref(pPool);
+			pMapping->mRefCount++;
+			pCache->mMappingsReused++;
+			return pMapping;
+		}
+	}
+
+	pMapping = SlabPoolAlloc(&pCache->mMappingPool);
+	if( !pMapping )
+	{
+		wl_shm_pool_unref(pPool);
+		return NULL;
+	}
+
+	pMapping->mpPool = pPool;
+	pMapping->mRefCount = 1;
+	atomic_init(&pMapping->mFaults, 0);
+	wl_list_insert(pBucket, &pMapping->mLink);
+	pCache->mMappingsCreated++;
+	return pMapping;
+}
+
+static void ShmMappingRelease( struct ShmMappingCache* pCache, struct ShmMapping* pMapping )
+{
+	if( !pMapping || --pMapping->mRefCount > 0 )
+		return;
+
+	wl_list_remove(&pMapping->mLink);
+	wl_shm_pool_unref(pMapping->mpPool);
+	SlabPoolFree(&pCache->mMappingPool, pMapping);
+	pCache->mMappingsReleased++;
+}
+
+static void PrintShmMappingStats( const struct ShmMappingCache* pCache )
+{
+	printf("Shm mappings: %llu created, %llu reused, %llu released, %u live\n",
+		(unsigned long long)pCache->mMappingsCreated,
+		(unsigned long long)pCache->mMappingsReused,
+		(unsigned long long)pCache->mMappingsReleased,
+		pCache->mMappingPool.mLiveCount
+	);
+}
+
+#endif
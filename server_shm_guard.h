@@ -0,0 +1,110 @@
+#ifndef _SERVER_SHM_GUARD_H
+#define _SERVER_SHM_GUARD_H
+
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <wayland-server.h>
+
+// SIGBUS guard for the wl_shm reads of the tile workers. A client can shrink
+// its pool file under the compositor's mapping. libwayland's guard,
+// wl_shm_buffer_begin_access, posts the protocol error from
+// wl_shm_buffer_end_access on the thread that calls it, and posting is not
+// thread safe. Workers read between ShmGuardBegin and ShmGuardEnd instead. A
+// fault in there maps zeros over the page, as libwayland does over the whole
+// pool, and is only counted. FinishRepaint posts the error on the dispatch
+// thread. Any other SIGBUS goes on to the handler that was installed before,
+// libwayland's, which ShmGuardInstall makes sure is there first.
+
+#define SHM_GUARD_HUGE_PAGE_SIZE ( (uintptr_t)2 << 20 )
+
+struct ShmGuard
+{
+	uint32_t mFaults;
+};
+
+static _Thread_local struct ShmGuard* g_pShmGuard;
+static struct sigaction g_shmGuardNextAction;
+static uintptr_t g_shmGuardPageSize;
+static int8_t g_bShmGuardInstalled;
+
+// Replaces the page at pAddr with zeros, hugetlbfs mappings only take whole
+// huge pages
+static int8_t ShmGuardMapZeros( void* pAddr )
+{
+	const uintptr_t sizes[2] = { g_shmGuardPageSize, SHM_GUARD_HUGE_PAGE_SIZE };
+	for( uint32_t i = 0; i < 2; i++ )
+	{
+		void* pPage = (void*)( (uintptr_t)pAddr & ~( sizes[i] - 1 ) );
+		if( mmap(pPage, sizes[i], PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED )
+			return 1;
+	}
+	return 0;
+}
+
+static void shm_guard_sigbus( int signal, siginfo_t* pInfo, void* pContext )
+{
+	// si_code is positive for faults, not for a raise() or kill()
+	struct ShmGuard* pGuard = g_pShmGuard;
+	if( pGuard && pInfo->si_code > 0 && ShmGuardMapZeros(pInfo->si_addr) )
+	{
+		pGuard->mFaults++;
+		return;
+	}
+
+	const struct sigaction* pNext = &g_shmGuardNextAction;
+	if( pNext->sa_flags & SA_SIGINFO )
+		pNext->sa_sigaction(signal, pInfo, pContext);
+	else if( pNext->sa_handler != SIG_DFL && pNext->sa_handler != SIG_IGN )
+		pNext->sa_handler(signal);
+	else
+	{
+		sigaction(SIGBUS, pNext, NULL);
+		raise(SIGBUS);
+	}
+}
+
+// Installs the guard on top of libwayland's, pShmBuffer is any live buffer.
+// libwayland installs its handler once on the first begin access, an empty
+// access makes sure that happened. Returns 0 on success.
+static int ShmGuardInstall( struct wl_shm_buffer* pShmBuffer )
+{
+	if( g_bShmGuardInstalled )
+		return 0;
+
+	wl_shm_buffer_begin_access(pShmBuffer);
+	wl_shm_buffer_end_access(pShmBuffer);
+
+	struct sigaction action = {0};
+	action.sa_sigaction = shm_guard_sigbus;
+	action.sa_flags = SA_SIGINFO | SA_NODEFER;
+	sigemptyset(&action.sa_mask);
+	g_shmGuardPageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	if( sigaction(SIGBUS, &action, &g_shmGuardNextAction) == -1 )
+		return -1;
+
+	g_bShmGuardInstalled = 1;
+	return 0;
+}
+
+// The fences keep the compiler from moving the guarded reads, or the guard
+// itself, across what the signal handler sees
+static void ShmGuardBegin( struct ShmGuard* pGuard )
+{
+	pGuard->mFaults = 0;
+	g_pShmGuard = pGuard;
+	atomic_signal_fence(memory_order_seq_cst);
+}
+
+// Returns the number of faults taken since ShmGuardBegin
+static uint32_t ShmGuardEnd( struct ShmGuard* pGuard )
+{
+	atomic_signal_fence(memory_order_seq_cst);
+	g_pShmGuard = NULL;
+	return pGuard->mFaults;
+}
+
+#endif
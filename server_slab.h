@@ -0,0 +1,112 @@
+#ifndef _SERVER_SLAB_H
+#define _SERVER_SLAB_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Fixed size object allocator. Objects are carved out of chunks that are never
+// moved or returned until SlabPoolFini, so pointers stay valid for the whole
+// lifetime of an object and alloc/free are a free-list pop/push.
+
+#define SLAB_OBJECT_ALIGN 16
+
+struct SlabFreeNode
+{
+	struct SlabFreeNode* mpNext;
+};
+
+struct SlabPool
+{
+	size_t mObjectSize;
+	uint32_t mObjectsPerChunk;
+
+	uint8_t** mppChunks;
+	uint32_t mChunkCount;
+	uint32_t mChunkCapacity;
+
+	struct SlabFreeNode* mpFreeList;
+	uint32_t mLiveCount;
+};
+
+static void SlabPoolInit( struct SlabPool* pPool, size_t objectSize, uint32_t objectsPerChunk )
+{
+	memset(pPool, 0, sizeof(struct SlabPool));
+
+	if( objectSize < sizeof(struct SlabFreeNode) )
+		objectSize = sizeof(struct SlabFreeNode);
+
+	pPool->mObjectSize = ( objectSize + SLAB_OBJECT_ALIGN - 1 ) & ~(size_t)( SLAB_OBJECT_ALIGN - 1 );
+	pPool->mObjectsPerChunk = objectsPerChunk ? objectsPerChunk : 1;
+}
+
+static int SlabPoolGrow( struct SlabPool* pPool )
+{
+	if( pPool->mChunkCount == pPool->mChunkCapacity )
+	{
+		uint32_t capacity = pPool->mChunkCapacity ? pPool->mChunkCapacity * 2 : 4;
+		uint8_t** ppChunks = realloc(pPool->mppChunks, capacity * sizeof(uint8_t*));
+		if( !ppChunks )
+			return -1;
+
+		pPool->mppChunks = ppChunks;
+		pPool->mChunkCapacity = capacity;
+	}
+
+	uint8_t* pChunk = aligned_alloc(
+		SLAB_OBJECT_ALIGN, pPool->mObjectSize * pPool->mObjectsPerChunk
+	);
+	if( !pChunk )
+		return -1;
+
+	pPool->mppChunks[pPool->mChunkCount++] = pChunk;
+
+	// push in reverse so the first allocations come out in address order
+	for( int32_t i = pPool->mObjectsPerChunk - 1; i >= 0; i-- )
+	{
+		struct SlabFreeNode* pNode = (struct SlabFreeNode*)( pChunk + i * pPool->mObjectSize );
+		pNode->mpNext = pPool->mpFreeList;
+		pPool->mpFreeList = pNode;
+	}
+	return 0;
+}
+
+static void* SlabPoolAlloc( struct SlabPool* pPool )
+{
+	if( !pPool->mpFreeList && SlabPoolGrow(pPool) == -1 )
+		return NULL;
+
+	struct SlabFreeNode* pNode = pPool->mpFreeList;
+	pPool->mpFreeList = pNode->mpNext;
+	pPool->mLiveCount++;
+
+	memset(pNode, 0, pPool->mObjectSize);
+	return pNode;
+}
+
+static void SlabPoolFree( struct SlabPool* pPool, void* pObject )
+{
+	if( !pObject )
+		return;
+
+	struct SlabFreeNode* pNode = pObject;
+	pNode->mpNext = pPool->mpFreeList;
+	pPool->mpFreeList = pNode;
+	pPool->mLiveCount--;
+}
+
+static size_t SlabPoolReservedBytes( const struct SlabPool* pPool )
+{
+	return (size_t)pPool->mChunkCount * pPool->mObjectsPerChunk * pPool->mObjectSize;
+}
+
+static void SlabPoolFini( struct SlabPool* pPool )
+{
+	for( uint32_t i = 0; i < pPool->mChunkCount; i++ )
+		free(pPool->mppChunks[i]);
+
+	free(pPool->mppChunks);
+	memset(pPool, 0, sizeof(struct SlabPool));
+}
+
+#endif
@@ -0,0 +1,628 @@
+#ifndef _SERVER_STATE_H
+#define _SERVER_STATE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include <wayland-server.h>
+
+#include "server_fd_cache.h"
+#include "server_region.h"
+#include "server_renderer.h"
+#include "server_shm_cache.h"
+#include "server_slab.h"
+#include "server_vblank.h"
+#include "server_workers.h"
+
+struct OutputState;
+struct ServerState;
+struct ClientState;
+struct SurfaceState;
+struct Surface;
+struct XdgSurface;
+
+// bits of Surface::mOutputMask
+#define MAX_OUTPUTS 32
+
+struct FrameCallbackStats
+{
+	uint64_t mCycles;
+	uint64_t mCallbacks;
+	uint32_t mMaxBatch;
+	// cycles that found the workers still composing the previous frame
+	uint64_t mBusyCycles;
+	// callbacks kept for the next cycle because their client was paused
+	uint64_t mHeldCallbacks;
+};
+
+struct OutputState
+{
+	int32_t mX, mY;
+	int32_t mPhyWidth, mPhyHeight;
+	int32_t mSubpixel;
+	const char* mpMake;
+	const char* mpModel;
+	int32_t mTransform;
+
+	// current mode in logical orientation, refresh in mHz
+	int32_t mWidth, mHeight;
+	int32_t mRefresh;
+	int32_t mScale;
+	char mName[16];
+
+	// offscreen image the headless compositor draws into
+	struct Framebuffer mFramebuffer;
+	// output pixels to recompose on the next repaint
+	struct Region mDamage;
+	// visible parts of the last draw list, read by the workers while composing
+	struct Occlusion mOcclusion;
+
+	// client buffer shown instead of mFramebuffer, see OutputTryScanout
+	struct Surface* mpScanoutSurface;
+	struct wl_resource* mpScanoutBuffer;
+	struct wl_listener mScanoutBufferDestroy;
+	// the surface moved on to another buffer, the shown one is released
+	// once the output stops showing it
+	int8_t mbScanoutReleaseHeld;
+	uint64_t mScanoutCommitNsec;
+	uint64_t mScanoutFrames;
+	struct VirtualVblank mVblank;
+
+	struct ServerState* mpServer;
+	// bit in Surface::mOutputMask
+	uint32_t mIndex;
+	struct wl_global* mpGlobal;
+	// Output::mStateLink, every wl_output resource bound to this output
+	struct wl_list mBindingList;
+	uint32_t mBindingCount;
+	uint64_t mModeChanges;
+	// spent sending mode changes to mBindingList
+	uint64_t mFanoutNsec;
+
+	// as fast as possible mode only, see server_vblank.h
+	struct wl_event_source* mpRepaintSource;
+	// wl_callback resources of surfaces mainly shown on this output,
+	// committed since the last done batch
+	struct wl_list mFrameCallbackList;
+	struct FrameCallbackStats mFrameStats;
+	struct ComposeStats mComposeStats;
+
+	// frame handed to the tile workers, its callbacks are sent with
+	// mComposeTime once it is done
+	struct ComposeJob mComposeJob;
+	int8_t mbComposing;
+	int8_t mbCycleDeferred;
+	struct wl_list mComposingCallbackList;
+	uint32_t mComposeTime;
+
+	// PresentationFeedback::mLink of the commits since the last cycle, of
+	// the frame the workers are composing and of the frame shown from the
+	// next vblank on
+	struct wl_list mFeedbackList;
+	struct wl_list mComposingFeedbackList;
+	struct wl_list mLatchedFeedbackList;
+
+	// ServerState::mOutputList
+	struct wl_list mLink;
+};
+
+struct SubsurfaceStats
+{
+	// commits of synchronized subsurfaces held until their parent commits
+	uint64_t mCachedCommits;
+	// cached states applied by a parent commit
+	uint64_t mParentApplies;
+	// times ServerState::mppSurfaceStack was flattened again
+	uint64_t mStackRebuilds;
+};
+
+struct DmabufStats
+{
+	uint64_t mImports;
+	// params the fds of which could not be read safely or in their layout
+	uint64_t mFailedImports;
+	// wl_buffers destroyed by their client
+	uint64_t mBuffersDestroyed;
+};
+
+struct PresentationStats
+{
+	uint64_t mPresented;
+	// presented without being composed, see OutputTryScanout
+	uint64_t mZeroCopy;
+	uint64_t mDiscarded;
+	// commit to presented time summed over every presented feedback
+	uint64_t mLatencyNsec;
+	uint64_t mMaxLatencyNsec;
+};
+
+struct XdgShellStats
+{
+	// toplevel and popup state changes requested or made by the server
+	uint64_t mStateChanges;
+	// xdg_surface.configure events those changes were coalesced into
+	uint64_t mConfigures;
+	// cycles a queued configure waited for its paused client
+	uint64_t mHeldConfigures;
+};
+
+struct ServerState
+{
+	struct wl_display* mpDisplay;
+	struct wl_event_loop* mpEventLoop;
+	// cleared to leave RunInstrumentedLoop
+	int8_t mbRunning;
+	struct LoopStats* mpLoopStats;
+	// OutputState::mLink, ordered by mIndex
+	struct wl_list mOutputList;
+	uint32_t mOutputCount;
+	// OutputState::mIndex values in use
+	uint32_t mOutputIndexMask;
+
+	// ClientState::mLink
+	struct wl_list mClientList;
+	// Surface::mLink, bottom most surface first, subsurfaces are stacked
+	// with their parent instead
+	struct wl_list mSurfaceList;
+	// mSurfaceList with every subsurface tree flattened in, bottom most
+	// first. Only rebuilt after a surface came or went or a tree changed.
+	struct Surface** mppSurfaceStack;
+	uint32_t mSurfaceStackCount;
+	uint32_t mSurfaceStackCapacity;
+	int8_t mbSurfaceStackDirty;
+	struct SubsurfaceStats mSubsurfaceStats;
+
+	const struct BlendKernels* mpKernels;
+	// ScaleFilter for surfaces whose buffer is scaled to their size
+	int8_t mScaleFilter;
+	// scratch draw list, only ever grows
+	struct DrawItem* mpDrawItems;
+	uint32_t mDrawItemCapacity;
+
+	// tile workers, NULL composes on the dispatch thread
+	struct WorkerPool* mpWorkers;
+	struct wl_event_source* mpWorkersSource;
+	// jobs submitted and not collected yet
+	uint32_t mComposeJobsPending;
+
+	struct ShmMappingCache mShmCache;
+	// mappings of zwp_linux_dmabuf_v1 buffers
+	struct FdMappingCache mFdCache;
+	struct DmabufStats mDmabufStats;
+	struct PresentationStats mPresentationStats;
+
+	// frame dumps, NULL when --capture is not given
+	struct Capture* mpCapture;
+
+	// copy committed buffers into SurfaceShadow and release them right away
+	int8_t mbEarlyRelease;
+	struct wl_event_source* mpReleaseSource;
+
+	// XdgSurface::mConfigureLink, configures to send on the next repaint cycle
+	struct wl_list mXdgConfigureList;
+	// sends mXdgConfigureList while there is no output to run a cycle
+	struct wl_event_source* mpXdgConfigureSource;
+	struct XdgShellStats mXdgStats;
+
+	// ClientState storage, reused across connections
+	struct SlabPool mClientPool;
+	uint64_t mClientsConnected;
+	uint64_t mClientsDisconnected;
+};
+
+struct ClientState
+{
+	struct wl_client* mpClient;
+	struct ServerState* mpServer;
+	struct wl_listener mDestroyListener;
+	struct wl_list mLink;
+
+	// Surface storage, never moves so resources can keep raw pointers
+	struct SlabPool mSurfacePool;
+	// Surface::mClientLink
+	struct wl_list mSurfaceList;
+
+	// PendingRelease storage and the releases queued during this dispatch
+	struct SlabPool mReleasePool;
+	struct wl_list mPendingReleaseList;
+	uint64_t mBuffersReleased;
+	uint64_t mReleaseBatches;
+	// commit to release time summed over every released buffer
+	uint64_t mBufferHoldNsec;
+
+	// Output, Compositor, Subcompositor, Viewporter, LinuxDmabuf,
+	// Presentation and XdgWmBase storage, one object per bind
+	struct SlabPool mBindingPool;
+	// Output::mLink, Compositor::mLink, Subcompositor::mLink,
+	// Viewporter::mLink, LinuxDmabuf::mLink, Presentation::mLink and
+	// XdgWmBase::mLink
+	struct wl_list mOutputList;
+	struct wl_list mCompositorList;
+	struct wl_list mSubcompositorList;
+	struct wl_list mViewporterList;
+	struct wl_list mLinuxDmabufList;
+	struct wl_list mPresentationList;
+	struct wl_list mXdgWmBaseList;
+
+	// XdgSurface and XdgPositioner storage, XdgSurface::mLink and XdgPositioner::mLink
+	struct SlabPool mXdgSurfacePool;
+	struct wl_list mXdgSurfaceList;
+	struct SlabPool mXdgPositionerPool;
+	struct wl_list mXdgPositionerList;
+
+	// Subsurface storage, Subsurface::mLink
+	struct SlabPool mSubsurfacePool;
+	struct wl_list mSubsurfaceList;
+
+	// DmabufParams and DmabufBuffer storage, DmabufParams::mLink and
+	// DmabufBuffer::mLink
+	struct SlabPool mDmabufParamsPool;
+	struct wl_list mDmabufParamsList;
+	struct SlabPool mDmabufBufferPool;
+	struct wl_list mDmabufBufferList;
+
+	// PresentationFeedback storage, PresentationFeedback::mClientLink
+	struct SlabPool mFeedbackPool;
+	struct wl_list mFeedbackList;
+
+	// no frame callbacks or configures while the client's socket is backed
+	// up, a dup of its fd polls for it draining again
+	int8_t mbEventsPaused;
+	int32_t mWritableFd;
+	struct wl_event_source* mpWritableSource;
+	// SO_SNDBUF of the client socket, 0 until first needed
+	int32_t mSendBufferSize;
+	uint64_t mPauseStartNsec;
+	uint64_t mPauseCount;
+	uint64_t mPausedNsec;
+};
+
+// Per client objects of the bound globals
+
+struct Output
+{
+	struct wl_resource* mpResource;
+	// NULL once the output was unplugged
+	struct OutputState* mpState;
+	struct ClientState* mpClientState;
+	struct wl_list mLink;
+	// OutputState::mBindingList
+	struct wl_list mStateLink;
+};
+
+struct Compositor
+{
+	struct wl_resource* mpResource;
+	struct ServerState* mpServer;
+	struct ClientState* mpClientState;
+	struct wl_list mLink;
+};
+
+struct Subcompositor
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct wl_list mLink;
+};
+
+struct Viewporter
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct wl_list mLink;
+};
+
+struct LinuxDmabuf
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct wl_list mLink;
+};
+
+struct Presentation
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct wl_list mLink;
+};
+
+struct XdgWmBase
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct wl_list mLink;
+	// xdg_surfaces created through this object
+	uint32_t mSurfaceCount;
+};
+
+// sizes ClientState::mBindingPool slots
+union GlobalBinding
+{
+	struct Output mOutput;
+	struct Compositor mCompositor;
+	struct Subcompositor mSubcompositor;
+	struct Viewporter mViewporter;
+	struct LinuxDmabuf mLinuxDmabuf;
+	struct Presentation mPresentation;
+	struct XdgWmBase mXdgWmBase;
+};
+
+// wp_viewport crop and scale. The source rectangle is in the surface
+// coordinates the buffer would have without a viewport.
+struct ViewportState
+{
+	int8_t mbSource;
+	wl_fixed_t mSrcX, mSrcY, mSrcWidth, mSrcHeight;
+	int8_t mbDestination;
+	int32_t mDstWidth, mDstHeight;
+};
+
+struct SurfaceState
+{
+	struct wl_resource* mpBuffer;
+	int8_t mbNewBuffer;
+	int32_t mDx, mDy;
+	int32_t mScale;
+	int32_t mTransform;
+	struct ViewportState mViewport;
+
+	// surface local and buffer local damage, merged on commit
+	struct Region mDamage;
+	struct Region mBufferDamage;
+
+	// surface local, set_opaque_region marks it changed until the commit
+	struct Region mOpaque;
+	int8_t mbOpaqueChanged;
+
+	// wl_callback resources linked through wl_resource_get_link
+	struct wl_list mFrameCallbackList;
+	// PresentationFeedback::mLink
+	struct wl_list mFeedbackList;
+};
+
+// A wl_surface role, set once and kept for the lifetime of the surface even
+// after the role object is gone
+struct SurfaceRole
+{
+	const char* mpName;
+	// runs before the pending state is applied, -1 after posting an error,
+	// 1 when the role took the pending state to apply it later
+	int (*mPreCommit)( struct Surface* pSurface );
+	// runs once buffer, size and position of the commit are known
+	void (*mCommit)( struct Surface* pSurface );
+	// roles can hide a surface that has a buffer, like an unacked xdg_surface
+	int8_t (*mIsMapped)( struct Surface* pSurface );
+	void (*mDestroy)( struct Surface* pSurface );
+};
+
+// Server side copy of a surface's pixels, used when buffers are released early
+struct SurfaceShadow
+{
+	uint32_t* mpPixels;
+	int32_t mWidth, mHeight;
+	size_t mCapacity;
+	uint32_t mFormat;
+	int8_t mbValid;
+};
+
+struct Surface
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+
+	struct SurfaceState mPending;
+	struct SurfaceState mCurrent;
+	struct wl_listener mPendingBufferDestroy;
+	struct wl_listener mCurrentBufferDestroy;
+	struct SurfaceShadow mShadow;
+
+	// last committed buffer, kept after an early release
+	int32_t mBufferWidth, mBufferHeight;
+	uint32_t mBufferFormat;
+	uint64_t mBufferCommitNsec;
+
+	// position in the global compositor space and size in surface coordinates
+	int32_t mX, mY;
+	int32_t mWidth, mHeight;
+
+	uint32_t mCommitCount;
+
+	// outputs the surface overlaps and the one it overlaps most, which
+	// paces its frame callbacks
+	uint32_t mOutputMask;
+	struct OutputState* mpOutput;
+
+	const struct SurfaceRole* mpRole;
+	// role object, NULL once it was destroyed
+	void* mpRoleData;
+	// wp_viewport resource, at most one per surface
+	struct wl_resource* mpViewport;
+
+	// Subsurface::mParentLink of the children stacked below and above the
+	// surface, bottom most first
+	struct wl_list mBelowList;
+	struct wl_list mAboveList;
+	// Subsurface::mParentPendingLink, the order as of the next commit
+	struct wl_list mPendingBelowList;
+	struct wl_list mPendingAboveList;
+	int8_t mbRestackPending;
+
+	// ServerState::mSurfaceList
+	struct wl_list mLink;
+	// ClientState::mSurfaceList
+	struct wl_list mClientLink;
+};
+
+// wl_subsurface role object
+struct Subsurface
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	// NULL once the wl_surface or the parent was destroyed
+	struct Surface* mpSurface;
+	struct Surface* mpParent;
+
+	// position relative to the parent, set_position takes effect with the
+	// parent's next commit
+	int32_t mX, mY;
+	int32_t mPendingX, mPendingY;
+	int8_t mbPositionPending;
+
+	int8_t mbSynchronized;
+	// commits made while synchronized, applied by the parent's next commit
+	struct SurfaceState mCached;
+	struct wl_listener mCachedBufferDestroy;
+	int8_t mbCached;
+	// mapped as of the last commit or parent change
+	int8_t mbMapped;
+
+	// mpParent's mBelowList or mAboveList and their pending counterparts
+	struct wl_list mParentLink;
+	struct wl_list mParentPendingLink;
+	// ClientState::mSubsurfaceList
+	struct wl_list mLink;
+};
+
+// zwp_linux_dmabuf_v1
+
+#define DMABUF_MAX_PLANES 4
+
+struct DmabufPlane
+{
+	// -1 while the plane was not added
+	int32_t mFd;
+	uint32_t mOffset;
+	uint32_t mStride;
+	uint64_t mModifier;
+};
+
+// zwp_linux_buffer_params_v1, holds the plane fds until create
+struct DmabufParams
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct DmabufPlane mPlanes[DMABUF_MAX_PLANES];
+	int8_t mbUsed;
+	// ClientState::mDmabufParamsList
+	struct wl_list mLink;
+};
+
+// wl_buffer imported through zwp_linux_dmabuf_v1, read in place by the
+// compositor like a wl_shm_buffer
+struct DmabufBuffer
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct FdMapping* mpMapping;
+	// first pixel of the buffer inside mpMapping
+	const uint8_t* mpData;
+	int32_t mWidth, mHeight;
+	int32_t mStride;
+	// WL_SHM_FORMAT code the DRM format matches
+	uint32_t mFormat;
+	// ClientState::mDmabufBufferList
+	struct wl_list mLink;
+};
+
+// wp_presentation
+
+// wp_presentation_feedback of one commit, follows it from the surface state
+// to the output that shows it
+struct PresentationFeedback
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+	struct Surface* mpSurface;
+	uint64_t mCommitNsec;
+	// wp_presentation_feedback_kind bits known when the frame was latched
+	uint32_t mFlags;
+	// SurfaceState::mFeedbackList or one of the OutputState feedback lists
+	struct wl_list mLink;
+	// ClientState::mFeedbackList
+	struct wl_list mClientLink;
+};
+
+// xdg-shell
+
+enum XdgRole
+{
+	XDG_ROLE_NONE,
+	XDG_ROLE_TOPLEVEL,
+	XDG_ROLE_POPUP
+};
+
+struct XdgPositioner
+{
+	struct wl_resource* mpResource;
+	struct ClientState* mpClientState;
+
+	int32_t mWidth, mHeight;
+	// a 0x0 anchor rect is valid, mbAnchorRectSet tells it from none
+	struct RegionBox mAnchorRect;
+	int8_t mbAnchorRectSet;
+	uint32_t mAnchor;
+	uint32_t mGravity;
+	uint32_t mConstraintAdjustment;
+	int32_t mOffsetX, mOffsetY;
+
+	// ClientState::mXdgPositionerList
+	struct wl_list mLink;
+};
+
+struct XdgToplevelState
+{
+	// 0 lets the client pick its size
+	int32_t mWidth, mHeight;
+	int8_t mbMaximized;
+	int8_t mbFullscreen;
+	int8_t mbActivated;
+};
+
+struct XdgSurface
+{
+	struct wl_resource* mpResource;
+	struct Surface* mpSurface;
+	struct ClientState* mpClientState;
+	struct XdgWmBase* mpWmBase;
+
+	int32_t mRole;
+	// xdg_toplevel or xdg_popup
+	struct wl_resource* mpRoleResource;
+
+	// window geometry in surface coordinates, empty when never set
+	struct RegionBox mPendingGeometry;
+	struct RegionBox mGeometry;
+
+	struct XdgToplevelState mToplevelPending;
+	struct XdgToplevelState mToplevelSent;
+	int32_t mMinWidth, mMinHeight;
+	int32_t mMaxWidth, mMaxHeight;
+
+	// popup position relative to the parent's window geometry
+	struct XdgSurface* mpParent;
+	struct RegionBox mPopupBox;
+	uint32_t mRepositionToken;
+	int8_t mbRepositioned;
+
+	// configure serials, the first ack allows a buffer to be attached
+	uint32_t mLastSerial;
+	uint32_t mAckedSerial;
+	int8_t mbConfigureSent;
+	int8_t mbAcked;
+	int8_t mbInitialCommit;
+	int8_t mbMapped;
+
+	// ServerState::mXdgConfigureList, empty while no configure is queued
+	struct wl_list mConfigureLink;
+	// ClientState::mXdgSurfaceList
+	struct wl_list mLink;
+};
+
+static uint32_t GetTimeMsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)( ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+#endif
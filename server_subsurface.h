@@ -0,0 +1,621 @@
+#ifndef _SERVER_SUBSURFACE_H
+#define _SERVER_SUBSURFACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+#include "server_buffer_release.h"
+#include "server_client.h"
+#include "server_region.h"
+#include "server_repaint.h"
+#include "server_state.h"
+#include "server_surface.h"
+
+// wl_subcompositor and wl_subsurface. A subsurface is taken out of
+// ServerState::mSurfaceList and stacked with its parent instead, the
+// repaints read the flattened order from GetSurfaceStack. Positions are
+// derived from the parent on every commit that could move them, the tree is
+// never walked from the repaint cycle.
+
+static const struct SurfaceRole subsurface_role;
+
+// Synchronized as long as the subsurface or any subsurface above it in the
+// tree is, a subsurface without a parent is shown by nobody and just applies
+static int8_t SubsurfaceIsSynchronized( const struct Subsurface* pSubsurface )
+{
+	while( pSubsurface && pSubsurface->mpParent )
+	{
+		if( pSubsurface->mbSynchronized )
+			return 1;
+
+		const struct Surface* pParent = pSubsurface->mpParent;
+		pSubsurface = pParent->mpRole == &subsurface_role ? pParent->mpRoleData : NULL;
+	}
+	return 0;
+}
+
+// Cached State
+
+static void subsurface_cached_buffer_destroy( struct wl_listener* pListener, void* pData )
+{
+	struct Subsurface* pSubsurface = wl_container_of(pListener, pSubsurface, mCachedBufferDestroy);
+	pSubsurface->mCached.mpBuffer = NULL;
+	wl_list_remove(&pListener->link);
+	wl_list_init(&pListener->link);
+}
+
+// Moves the surface's pending state on top of what is cached already
+static void SubsurfaceCacheState( struct Subsurface* pSubsurface )
+{
+	struct Surface* pSurface = pSubsurface->mpSurface;
+	struct SurfaceState* pPending = &pSurface->mPending;
+	struct SurfaceState* pCached = &pSubsurface->mCached;
+
+	if( pPending->mbNewBuffer )
+	{
+		// a cached buffer that is replaced before it was ever shown goes
+		// straight back to the client
+		struct wl_resource* pOldBuffer = pCached->mbNewBuffer ? pCached->mpBuffer : NULL;
+		if( pOldBuffer && pOldBuffer != pPending->mpBuffer && pOldBuffer != pSurface->mCurrent.mpBuffer )
+			QueueBufferRelease(pSurface->mpClientState, pOldBuffer, GetTimeNsec());
+
+		SurfaceTrackBuffer(&pCached->mpBuffer, &pSubsurface->mCachedBufferDestroy, pPending->mpBuffer);
+		SurfaceTrackBuffer(&pPending->mpBuffer, &pSurface->mPendingBufferDestroy, NULL);
+		pCached->mbNewBuffer = 1;
+		pPending->mbNewBuffer = 0;
+	}
+
+	pCached->mDx = SurfaceClampCoord((int64_t)pCached->mDx + pPending->mDx);
+	pCached->mDy = SurfaceClampCoord((int64_t)pCached->mDy + pPending->mDy);
+	pPending->mDx = pPending->mDy = 0;
+	pCached->mScale = pPending->mScale;
+	pCached->mTransform = pPending->mTransform;
+	pCached->mViewport = pPending->mViewport;
+
+	RegionUnion(&pCached->mDamage, &pPending->mDamage);
+	RegionSimplify(&pCached->mDamage, SURFACE_DAMAGE_MAX_BOXES);
+	RegionUnion(&pCached->mBufferDamage, &pPending->mBufferDamage);
+	RegionSimplify(&pCached->mBufferDamage, SURFACE_DAMAGE_MAX_BOXES);
+	RegionClear(&pPending->mDamage);
+	RegionClear(&pPending->mBufferDamage);
+
+	if( pPending->mbOpaqueChanged )
+	{
+		RegionCopy(&pCached->mOpaque, &pPending->mOpaque);
+		pCached->mbOpaqueChanged = 1;
+		pPending->mbOpaqueChanged = 0;
+	}
+
+	wl_list_insert_list(pCached->mFrameCallbackList.prev, &pPending->mFrameCallbackList);
+	wl_list_init(&pPending->mFrameCallbackList);
+	// a commit that never got applied is never presented either
+	if( !wl_list_empty(&pPending->mFeedbackList) )
+	{
+		PresentationDiscardList(&pCached->mFeedbackList);
+		wl_list_insert_list(pCached->mFeedbackList.prev, &pPending->mFeedbackList);
+		wl_list_init(&pPending->mFeedbackList);
+	}
+	pSubsurface->mbCached = 1;
+}
+
+static void SubsurfaceApplyCache( struct Subsurface* pSubsurface )
+{
+	pSubsurface->mbCached = 0;
+	SurfaceApplyState(pSubsurface->mpSurface, &pSubsurface->mCached, &pSubsurface->mCachedBufferDestroy);
+}
+
+// Position and Mapping
+
+static void SubsurfaceRefresh( struct Subsurface* pSubsurface );
+
+static void SubsurfaceRefreshChildren( struct Surface* pParent )
+{
+	struct Subsurface* pSubsurface;
+	wl_list_for_each(pSubsurface, &pParent->mBelowList, mParentLink)
+		SubsurfaceRefresh(pSubsurface);
+	wl_list_for_each(pSubsurface, &pParent->mAboveList, mParentLink)
+		SubsurfaceRefresh(pSubsurface);
+}
+
+// Nested offsets add up, the position is clamped like any other
+static void SubsurfaceUpdatePosition( struct Subsurface* pSubsurface )
+{
+	struct Surface* pSurface = pSubsurface->mpSurface;
+	pSurface->mX = SurfaceClampCoord((int64_t)pSubsurface->mpParent->mX + pSubsurface->mX);
+	pSurface->mY = SurfaceClampCoord((int64_t)pSubsurface->mpParent->mY + pSubsurface->mY);
+}
+
+// The parent moved, mapped or unmapped. Damages the old and new bounds and
+// carries on down the tree, a subsurface that stayed put stops the walk.
+static void SubsurfaceRefresh( struct Subsurface* pSubsurface )
+{
+	struct Surface* pSurface = pSubsurface->mpSurface;
+	struct ServerState* pServer = pSurface->mpClientState->mpServer;
+
+	const struct RegionBox oldBox = GetSurfaceBox(pSurface);
+	const int8_t bWasMapped = pSubsurface->mbMapped;
+
+	if( pSubsurface->mpParent )
+		SubsurfaceUpdatePosition(pSubsurface);
+	pSubsurface->mbMapped = SurfaceIsMapped(pSurface);
+
+	if( bWasMapped == pSubsurface->mbMapped && oldBox.mX1 == pSurface->mX && oldBox.mY1 == pSurface->mY )
+		return;
+
+	if( bWasMapped )
+		DamageOutputBox(pServer, &oldBox);
+	if( pSubsurface->mbMapped )
+		DamageOutputRect(pServer, pSurface->mX, pSurface->mY, pSurface->mWidth, pSurface->mHeight);
+	SurfaceUpdateOutputs(pSurface);
+	SubsurfaceRefreshChildren(pSurface);
+}
+
+// Runs at the end of every commit applied to pParent: restacks its children,
+// applies their pending positions and the state synchronized children cached
+static void SubsurfaceParentCommit( struct Surface* pParent )
+{
+	struct ServerState* pServer = pParent->mpClientState->mpServer;
+	struct wl_list* pLists[2] = { &pParent->mBelowList, &pParent->mAboveList };
+	struct wl_list* pPendingLists[2] = { &pParent->mPendingBelowList, &pParent->mPendingAboveList };
+
+	const int8_t bRestack = pParent->mbRestackPending;
+	if( bRestack )
+	{
+		for( uint32_t i = 0; i < 2; i++ )
+		{
+			struct Subsurface* pSubsurface;
+			wl_list_for_each(pSubsurface, pPendingLists[i], mParentPendingLink)
+			{
+				wl_list_remove(&pSubsurface->mParentLink);
+				wl_list_insert(pLists[i]->prev, &pSubsurface->mParentLink);
+			}
+		}
+		pParent->mbRestackPending = 0;
+		MarkSurfaceStackDirty(pServer);
+	}
+
+	for( uint32_t i = 0; i < 2; i++ )
+	{
+		struct Subsurface* pSubsurface;
+		wl_list_for_each(pSubsurface, pLists[i], mParentLink)
+		{
+			// same bounds, but the children cover each other differently
+			struct Surface* pSurface = pSubsurface->mpSurface;
+			if( bRestack && pSubsurface->mbMapped )
+				DamageOutputRect(pServer, pSurface->mX, pSurface->mY, pSurface->mWidth, pSurface->mHeight);
+
+			if( pSubsurface->mbPositionPending )
+			{
+				pSubsurface->mX = pSubsurface->mPendingX;
+				pSubsurface->mY = pSubsurface->mPendingY;
+				pSubsurface->mbPositionPending = 0;
+			}
+
+			if( pSubsurface->mbCached && SubsurfaceIsSynchronized(pSubsurface) )
+			{
+				pServer->mSubsurfaceStats.mParentApplies++;
+				SubsurfaceApplyCache(pSubsurface);
+			}
+			else
+				SubsurfaceRefresh(pSubsurface);
+		}
+	}
+}
+
+// Takes the subsurface out of its parent's stack and drops the cached state,
+// the role object is done with its wl_surface
+static void SubsurfaceUnlink( struct Subsurface* pSubsurface, int8_t bClientGone )
+{
+	struct Surface* pSurface = pSubsurface->mpSurface;
+	struct SurfaceState* pCached = &pSubsurface->mCached;
+
+	SurfaceStateDropCallbacks(pCached, bClientGone);
+	if( !bClientGone && pCached->mbNewBuffer && pCached->mpBuffer && pCached->mpBuffer != pSurface->mCurrent.mpBuffer )
+		QueueBufferRelease(pSurface->mpClientState, pCached->mpBuffer, GetTimeNsec());
+	SurfaceTrackBuffer(&pCached->mpBuffer, &pSubsurface->mCachedBufferDestroy, NULL);
+	RegionFini(&pCached->mDamage);
+	RegionFini(&pCached->mBufferDamage);
+	RegionFini(&pCached->mOpaque);
+	pSubsurface->mbCached = 0;
+
+	if( pSubsurface->mpParent )
+	{
+		wl_list_remove(&pSubsurface->mParentLink);
+		wl_list_remove(&pSubsurface->mParentPendingLink);
+		pSubsurface->mpParent = NULL;
+		MarkSurfaceStackDirty(pSurface->mpClientState->mpServer);
+	}
+	pSubsurface->mpSurface = NULL;
+	pSurface->mpRoleData = NULL;
+}
+
+// pSurface is going away, its children stay around unmapped until a new
+// get_subsurface gives them another parent
+static void SurfaceDetachSubsurfaces( struct Surface* pSurface )
+{
+	struct wl_list* pLists[2] = { &pSurface->mBelowList, &pSurface->mAboveList };
+	for( uint32_t i = 0; i < 2; i++ )
+	{
+		struct Subsurface* pSubsurface;
+		struct Subsurface* pTmp;
+		wl_list_for_each_safe(pSubsurface, pTmp, pLists[i], mParentLink)
+		{
+			wl_list_remove(&pSubsurface->mParentLink);
+			wl_list_remove(&pSubsurface->mParentPendingLink);
+			wl_list_init(&pSubsurface->mParentLink);
+			wl_list_init(&pSubsurface->mParentPendingLink);
+			pSubsurface->mpParent = NULL;
+			SubsurfaceRefresh(pSubsurface);
+			MarkSurfaceStackDirty(pSurface->mpClientState->mpServer);
+		}
+	}
+	pSurface->mbRestackPending = 0;
+}
+
+// Subsurface Role
+
+static int subsurface_role_pre_commit( struct Surface* pSurface )
+{
+	struct Subsurface* pSubsurface = pSurface->mpRoleData;
+	if( !pSubsurface )
+		return 0;
+
+	if( SubsurfaceIsSynchronized(pSubsurface) )
+	{
+		SubsurfaceCacheState(pSubsurface);
+		pSurface->mpClientState->mpServer->mSubsurfaceStats.mCachedCommits++;
+		return 1;
+	}
+
+	// a desynchronized commit applies whatever was cached along with it
+	if( pSubsurface->mbCached )
+	{
+		SubsurfaceCacheState(pSubsurface);
+		SubsurfaceApplyCache(pSubsurface);
+		return 1;
+	}
+	return 0;
+}
+
+// set_position places the subsurface, the offset of wl_surface.attach does
+// not move it
+static void subsurface_role_commit( struct Surface* pSurface )
+{
+	struct Subsurface* pSubsurface = pSurface->mpRoleData;
+	if( !pSubsurface || !pSubsurface->mpParent )
+		return;
+
+	SubsurfaceUpdatePosition(pSubsurface);
+	pSubsurface->mbMapped = SurfaceIsMapped(pSurface);
+}
+
+static int8_t subsurface_role_is_mapped( struct Surface* pSurface )
+{
+	const struct Subsurface* pSubsurface = pSurface->mpRoleData;
+	return pSubsurface && pSubsurface->mpParent && SurfaceIsMapped(pSubsurface->mpParent);
+}
+
+static void subsurface_role_destroy( struct Surface* pSurface )
+{
+	struct Subsurface* pSubsurface = pSurface->mpRoleData;
+	if( pSubsurface )
+		SubsurfaceUnlink(pSubsurface, 0);
+}
+
+static const struct SurfaceRole subsurface_role = {
+	.mpName = "wl_subsurface",
+	.mPreCommit = subsurface_role_pre_commit,
+	.mCommit = subsurface_role_commit,
+	.mIsMapped = subsurface_role_is_mapped,
+	.mDestroy = subsurface_role_destroy
+};
+
+// Subsurface Handle
+
+static void wl_subsurface_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Subsurface* pSubsurface = wl_resource_get_user_data(pResource);
+	if( !pSubsurface )
+		return;
+
+	// the wl_surface is unmapped right away, along with its own children
+	struct Surface* pSurface = pSubsurface->mpSurface;
+	if( pSurface )
+	{
+		struct ServerState* pServer = pSurface->mpClientState->mpServer;
+		const int8_t bWasMapped = pSubsurface->mbMapped;
+		SubsurfaceUnlink(pSubsurface, 0);
+		if( bWasMapped )
+			DamageOutputRect(pServer, pSurface->mX, pSurface->mY, pSurface->mWidth, pSurface->mHeight);
+		SurfaceUpdateOutputs(pSurface);
+		SubsurfaceRefreshChildren(pSurface);
+	}
+
+	wl_list_remove(&pSubsurface->mLink);
+	SlabPoolFree(&pSubsurface->mpClientState->mSubsurfacePool, pSubsurface);
+}
+
+static void wl_subsurface_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void wl_subsurface_handle_set_position(
+	struct wl_client* pClient, struct wl_resource* pResource, int32_t x, int32_t y
+)
+{
+	struct Subsurface* pSubsurface = wl_resource_get_user_data(pResource);
+	pSubsurface->mPendingX = SurfaceClampCoord(x);
+	pSubsurface->mPendingY = SurfaceClampCoord(y);
+	pSubsurface->mbPositionPending = 1;
+}
+
+// NULL after posting an error when pSiblingResource is neither the parent
+// nor another child of it
+static struct Surface* SubsurfaceGetSibling(
+	struct Subsurface* pSubsurface, struct wl_resource* pResource,
+	struct wl_resource* pSiblingResource, struct Subsurface** ppSibling
+)
+{
+	struct Surface* pSibling = wl_resource_get_user_data(pSiblingResource);
+	*ppSibling = NULL;
+
+	if( pSibling && pSibling == pSubsurface->mpParent )
+		return pSibling;
+
+	if( pSibling && pSibling != pSubsurface->mpSurface && pSibling->mpRole == &subsurface_role )
+	{
+		struct Subsurface* pOther = pSibling->mpRoleData;
+		if( pOther && pSubsurface->mpParent && pOther->mpParent == pSubsurface->mpParent )
+		{
+			*ppSibling = pOther;
+			return pSibling;
+		}
+	}
+
+	wl_resource_post_error(pResource, WL_SUBSURFACE_ERROR_BAD_SURFACE,
+		"wl_surface@%u is not a sibling or the parent", wl_resource_get_id(pSiblingResource));
+	return NULL;
+}
+
+static void wl_subsurface_handle_place_above(
+	struct wl_client* pClient, struct wl_resource* pResource, struct wl_resource* pSiblingResource
+)
+{
+	struct Subsurface* pSubsurface = wl_resource_get_user_data(pResource);
+	if( !pSubsurface->mpSurface )
+		return;
+
+	struct Subsurface* pSibling;
+	struct Surface* pSiblingSurface = SubsurfaceGetSibling(pSubsurface, pResource, pSiblingResource, &pSibling);
+	if( !pSiblingSurface )
+		return;
+
+	wl_list_remove(&pSubsurface->mParentPendingLink);
+	if( pSibling )
+		wl_list_insert(&pSibling->mParentPendingLink, &pSubsurface->mParentPendingLink);
+	else
+		wl_list_insert(&pSiblingSurface->mPendingAboveList, &pSubsurface->mParentPendingLink);
+	pSubsurface->mpParent->mbRestackPending = 1;
+}
+
+static void wl_subsurface_handle_place_below(
+	struct wl_client* pClient, struct wl_resource* pResource, struct wl_resource* pSiblingResource
+)
+{
+	struct Subsurface* pSubsurface = wl_resource_get_user_data(pResource);
+	if( !pSubsurface->mpSurface )
+		return;
+
+	struct Subsurface* pSibling;
+	struct Surface* pSiblingSurface = SubsurfaceGetSibling(pSubsurface, pResource, pSiblingResource, &pSibling);
+	if( !pSiblingSurface )
+		return;
+
+	wl_list_remove(&pSubsurface->mParentPendingLink);
+	if( pSibling )
+		wl_list_insert(pSibling->mParentPendingLink.prev, &pSubsurface->mParentPendingLink);
+	else
+		wl_list_insert(pSiblingSurface->mPendingBelowList.prev, &pSubsurface->mParentPendingLink);
+	pSubsurface->mpParent->mbRestackPending = 1;
+}
+
+static void wl_subsurface_handle_set_sync( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	struct Subsurface* pSubsurface = wl_resource_get_user_data(pResource);
+	pSubsurface->mbSynchronized = 1;
+}
+
+static void wl_subsurface_handle_set_desync( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	struct Subsurface* pSubsurface = wl_resource_get_user_data(pResource);
+	if( !pSubsurface->mbSynchronized )
+		return;
+
+	pSubsurface->mbSynchronized = 0;
+	// nothing waits for the parent anymore unless an ancestor is synchronized
+	if( pSubsurface->mpSurface && pSubsurface->mbCached && !SubsurfaceIsSynchronized(pSubsurface) )
+		SubsurfaceApplyCache(pSubsurface);
+}
+
+static const struct wl_subsurface_interface wl_subsurface_impl = {
+	.destroy = wl_subsurface_handle_destroy,
+	.set_position = wl_subsurface_handle_set_position,
+	.place_above = wl_subsurface_handle_place_above,
+	.place_below = wl_subsurface_handle_place_below,
+	.set_sync = wl_subsurface_handle_set_sync,
+	.set_desync = wl_subsurface_handle_set_desync
+};
+
+static struct Subsurface* CreateSubsurface(
+	struct Subcompositor* pSubcompositor, uint32_t version, uint32_t id,
+	struct wl_resource* pSurfaceResource, struct wl_resource* pParentResource
+)
+{
+	struct ClientState* pClientState = pSubcompositor->mpClientState;
+	struct wl_client* pClient = pClientState->mpClient;
+	struct Surface* pSurface = wl_resource_get_user_data(pSurfaceResource);
+	struct Surface* pParent = wl_resource_get_user_data(pParentResource);
+
+	// the parent may not be the surface itself or one of its descendants
+	const struct Surface* pAncestor = pParent;
+	while( pAncestor && pAncestor != pSurface && pAncestor->mpRole == &subsurface_role && pAncestor->mpRoleData )
+		pAncestor = ( (const struct Subsurface*)pAncestor->mpRoleData )->mpParent;
+	if( pAncestor == pSurface )
+	{
+		wl_resource_post_error(pSubcompositor->mpResource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE,
+			"wl_surface@%u cannot be a subsurface of wl_surface@%u",
+			wl_resource_get_id(pSurfaceResource), wl_resource_get_id(pParentResource));
+		return NULL;
+	}
+
+	struct Subsurface* pSubsurface = SlabPoolAlloc(&pClientState->mSubsurfacePool);
+	if( !pSubsurface )
+	{
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+
+	if( SurfaceSetRole(pSurface, &subsurface_role, pSubsurface, pSubcompositor->mpResource, WL_SUBCOMPOSITOR_ERROR_BAD_SURFACE) == -1 )
+	{
+		SlabPoolFree(&pClientState->mSubsurfacePool, pSubsurface);
+		return NULL;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &wl_subsurface_interface, version, id
+	);
+	if( !pResource )
+	{
+		pSurface->mpRoleData = NULL;
+		SlabPoolFree(&pClientState->mSubsurfacePool, pSubsurface);
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+	wl_resource_set_implementation(
+		pResource, &wl_subsurface_impl,
+		pSubsurface, wl_subsurface_handle_resource_destroy
+	);
+
+	pSubsurface->mpResource = pResource;
+	pSubsurface->mpClientState = pClientState;
+	pSubsurface->mpSurface = pSurface;
+	pSubsurface->mpParent = pParent;
+	// subsurfaces start out synchronized
+	pSubsurface->mbSynchronized = 1;
+	SurfaceStateInit(&pSubsurface->mCached);
+	pSubsurface->mCachedBufferDestroy.notify = subsurface_cached_buffer_destroy;
+	wl_list_init(&pSubsurface->mCachedBufferDestroy.link);
+	wl_list_insert(pClientState->mSubsurfaceList.prev, &pSubsurface->mLink);
+
+	// new children stack on top of their siblings, the surface leaves the
+	// top level list for its parent's
+	wl_list_insert(pParent->mAboveList.prev, &pSubsurface->mParentLink);
+	wl_list_insert(pParent->mPendingAboveList.prev, &pSubsurface->mParentPendingLink);
+	wl_list_remove(&pSurface->mLink);
+	wl_list_init(&pSurface->mLink);
+	MarkSurfaceStackDirty(pClientState->mpServer);
+
+	// a surface that was shown on its own before moves to its parent
+	const struct RegionBox oldBox = GetSurfaceBox(pSurface);
+	if( pSurface->mOutputMask )
+		DamageOutputBox(pClientState->mpServer, &oldBox);
+	SubsurfaceRefresh(pSubsurface);
+	SurfaceUpdateOutputs(pSurface);
+
+	return pSubsurface;
+}
+
+// Runs from the client destroy signal ahead of DetachClientSurfaces, every
+// subsurface of the client lets go of its surface, parent and cached state
+static void DetachClientSubsurfaces( struct ClientState* pClientState )
+{
+	struct Subsurface* pSubsurface;
+	struct Subsurface* pTmp;
+	wl_list_for_each_safe(pSubsurface, pTmp, &pClientState->mSubsurfaceList, mLink)
+	{
+		wl_resource_set_user_data(pSubsurface->mpResource, NULL);
+		if( pSubsurface->mpSurface )
+			SubsurfaceUnlink(pSubsurface, 1);
+
+		wl_list_remove(&pSubsurface->mLink);
+		SlabPoolFree(&pClientState->mSubsurfacePool, pSubsurface);
+	}
+}
+
+// Subcompositor Handle
+
+static void wl_subcompositor_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Subcompositor* pSubcompositor = wl_resource_get_user_data(pResource);
+	if( !pSubcompositor )
+		return;
+
+	ClientFreeBinding(pSubcompositor->mpClientState, pSubcompositor, &pSubcompositor->mLink);
+}
+
+static void wl_subcompositor_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void wl_subcompositor_handle_get_subsurface(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t id,
+	struct wl_resource* pSurface, struct wl_resource* pParent
+)
+{
+	struct Subcompositor* pSubcompositor = wl_resource_get_user_data(pResource);
+	CreateSubsurface(pSubcompositor, wl_resource_get_version(pResource), id, pSurface, pParent);
+}
+
+static const struct wl_subcompositor_interface wl_subcompositor_impl = {
+	.destroy = wl_subcompositor_handle_destroy,
+	.get_subsurface = wl_subcompositor_handle_get_subsurface
+};
+
+static void wl_subcompositor_handle_bind(
+	struct wl_client* pClient, void* pData,
+	uint32_t version, uint32_t id
+)
+{
+	struct ClientState* pClientState = GetClientState(pData, pClient);
+	struct Subcompositor* pSubcompositor = pClientState ? ClientAllocBinding(pClientState) : NULL;
+	if( !pSubcompositor )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &wl_subcompositor_interface,
+		version, id
+	);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mBindingPool, pSubcompositor);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pResource, &wl_subcompositor_impl,
+		pSubcompositor, wl_subcompositor_handle_resource_destroy
+	);
+	pSubcompositor->mpResource = pResource;
+	pSubcompositor->mpClientState = pClientState;
+	wl_list_insert(pClientState->mSubcompositorList.prev, &pSubcompositor->mLink);
+}
+
+static void PrintSubsurfaceStats( const struct ServerState* pServer )
+{
+	const struct SubsurfaceStats* pStats = &pServer->mSubsurfaceStats;
+	printf("Subsurfaces: %llu synchronized commits cached, %llu applied by their parent, %llu stack rebuilds for %u surfaces\n",
+		(unsigned long long)pStats->mCachedCommits,
+		(unsigned long long)pStats->mParentApplies,
+		(unsigned long long)pStats->mStackRebuilds,
+		pServer->mSurfaceStackCount
+	);
+}
+
+#endif
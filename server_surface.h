@@ -0,0 +1,879 @@
+#ifndef _SERVER_SURFACE_H
+#define _SERVER_SURFACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <wayland-server.h>
+
+#include "server_buffer_release.h"
+#include "server_client.h"
+#include "server_region.h"
+#include "server_repaint.h"
+#include "server_state.h"
+
+#define SURFACE_DAMAGE_MAX_BOXES 32
+#define SURFACE_OPAQUE_MAX_BOXES 16
+// Positions are clamped to +-SURFACE_COORD_MAX, clients move surfaces by
+// deltas that would otherwise add up past the int32 range
+#define SURFACE_COORD_MAX ( 1 << 30 )
+
+// defined in server_subsurface.h
+static void SubsurfaceParentCommit( struct Surface* pParent );
+static void SurfaceDetachSubsurfaces( struct Surface* pSurface );
+static void SubsurfaceRefreshChildren( struct Surface* pParent );
+// defined in server_viewporter.h
+static int SurfaceCheckViewport( struct Surface* pSurface );
+// defined in server_presentation.h
+static void PresentationDiscardList( struct wl_list* pList );
+static void SurfaceDiscardFeedback( struct Surface* pSurface );
+static void PresentationCommit( struct Surface* pSurface, struct SurfaceState* pState, struct OutputState* pOutput );
+
+// Surface State
+
+static int32_t SurfaceClampCoord( int64_t coord )
+{
+	return coord > SURFACE_COORD_MAX ? SURFACE_COORD_MAX : coord < -SURFACE_COORD_MAX ? -SURFACE_COORD_MAX : (int32_t)coord;
+}
+
+static void SurfaceStateInit( struct SurfaceState* pState )
+{
+	pState->mpBuffer = NULL;
+	pState->mbNewBuffer = 0;
+	pState->mDx = pState->mDy = 0;
+	pState->mScale = 1;
+	pState->mTransform = WL_OUTPUT_TRANSFORM_NORMAL;
+	memset(&pState->mViewport, 0, sizeof(struct ViewportState));
+	RegionInit(&pState->mDamage);
+	RegionInit(&pState->mBufferDamage);
+	RegionInit(&pState->mOpaque);
+	pState->mbOpaqueChanged = 0;
+	wl_list_init(&pState->mFrameCallbackList);
+	wl_list_init(&pState->mFeedbackList);
+}
+
+static int8_t SurfaceHasViewport( const struct SurfaceState* pState )
+{
+	return pState->mViewport.mbSource || pState->mViewport.mbDestination;
+}
+
+static int8_t ViewportStateEqual( const struct ViewportState* pA, const struct ViewportState* pB )
+{
+	if( pA->mbSource != pB->mbSource || pA->mbDestination != pB->mbDestination )
+		return 0;
+	if( pA->mbSource && ( pA->mSrcX != pB->mSrcX || pA->mSrcY != pB->mSrcY ||
+		pA->mSrcWidth != pB->mSrcWidth || pA->mSrcHeight != pB->mSrcHeight ) )
+		return 0;
+	return !pA->mbDestination || ( pA->mDstWidth == pB->mDstWidth && pA->mDstHeight == pB->mDstHeight );
+}
+
+static void surface_pending_buffer_destroy( struct wl_listener* pListener, void* pData )
+{
+	struct Surface* pSurface = wl_container_of(pListener, pSurface, mPendingBufferDestroy);
+	pSurface->mPending.mpBuffer = NULL;
+	wl_list_remove(&pListener->link);
+	wl_list_init(&pListener->link);
+}
+
+static void surface_current_buffer_destroy( struct wl_listener* pListener, void* pData )
+{
+	struct Surface* pSurface = wl_container_of(pListener, pSurface, mCurrentBufferDestroy);
+	WorkerPoolWait(pSurface->mpClientState->mpServer->mpWorkers);
+	pSurface->mCurrent.mpBuffer = NULL;
+	wl_list_remove(&pListener->link);
+	wl_list_init(&pListener->link);
+
+	// the contents are gone, show what was underneath
+	DamageOutputRect(pSurface->mpClientState->mpServer, pSurface->mX, pSurface->mY, pSurface->mWidth, pSurface->mHeight);
+}
+
+static void SurfaceTrackBuffer(
+	struct wl_resource** ppSlot, struct wl_listener* pListener,
+	struct wl_resource* pBuffer
+)
+{
+	if( *ppSlot == pBuffer )
+		return;
+
+	wl_list_remove(&pListener->link);
+	wl_list_init(&pListener->link);
+
+	*ppSlot = pBuffer;
+	if( pBuffer )
+		wl_resource_add_destroy_listener(pBuffer, pListener);
+}
+
+// Shadow Copy
+
+static int SurfaceShadowReserve( struct SurfaceShadow* pShadow, int32_t width, int32_t height )
+{
+	const size_t count = (size_t)width * height;
+	if( count > pShadow->mCapacity )
+	{
+		uint32_t* pPixels = realloc(pShadow->mpPixels, count * sizeof(uint32_t));
+		if( !pPixels )
+			return -1;
+
+		pShadow->mpPixels = pPixels;
+		pShadow->mCapacity = count;
+	}
+	return 0;
+}
+
+static void SurfaceShadowFini( struct SurfaceShadow* pShadow )
+{
+	free(pShadow->mpPixels);
+	memset(pShadow, 0, sizeof(struct SurfaceShadow));
+}
+
+// Copies the damaged boxes of the buffer, or all of it when pDamage is NULL
+static void SurfaceShadowCopy(
+	struct SurfaceShadow* pShadow, struct wl_shm_buffer* pShmBuffer,
+	const struct Region* pDamage
+)
+{
+	const struct RegionBox bufferBox = { 0, 0, pShadow->mWidth, pShadow->mHeight };
+	const int32_t stride = wl_shm_buffer_get_stride(pShmBuffer);
+
+	wl_shm_buffer_begin_access(pShmBuffer);
+	const uint8_t* pData = wl_shm_buffer_get_data(pShmBuffer);
+
+	const uint32_t count = pDamage ? pDamage->mCount : 1;
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		struct RegionBox box;
+		if( !RegionBoxIntersect(pDamage ? &pDamage->mpBoxes[i] : &bufferBox, &bufferBox, &box) )
+			continue;
+
+		const size_t rowBytes = ( box.mX2 - box.mX1 ) * sizeof(uint32_t);
+		for( int32_t y = box.mY1; y < box.mY2; y++ )
+		{
+			memcpy(
+				pShadow->mpPixels + (size_t)y * pShadow->mWidth + box.mX1,
+				pData + (size_t)y * stride + box.mX1 * sizeof(uint32_t),
+				rowBytes
+			);
+		}
+	}
+
+	wl_shm_buffer_end_access(pShmBuffer);
+}
+
+// With --early-release the committed contents are copied into the surface's
+// shadow and the buffer goes back to the client within the same dispatch.
+// pDamage is the committed damage in surface coordinates. Buffers the
+// compositor cannot draw from a shadow stay attached as before.
+static void SurfaceEarlyRelease( struct Surface* pSurface, const struct Region* pDamage )
+{
+	struct SurfaceShadow* pShadow = &pSurface->mShadow;
+	struct wl_resource* pBuffer = pSurface->mCurrent.mpBuffer;
+	struct wl_shm_buffer* pShmBuffer = wl_shm_buffer_get(pBuffer);
+
+	const uint32_t format = pSurface->mBufferFormat;
+	if( !pShmBuffer ||
+		( format != WL_SHM_FORMAT_ARGB8888 && format != WL_SHM_FORMAT_XRGB8888 ) ||
+		pSurface->mCurrent.mScale != 1 || pSurface->mCurrent.mTransform != WL_OUTPUT_TRANSFORM_NORMAL ||
+		SurfaceHasViewport(&pSurface->mCurrent) )
+	{
+		pShadow->mbValid = 0;
+		return;
+	}
+
+	// the tile workers may be reading the shadow, keep the buffer this time
+	if( pSurface->mpClientState->mpServer->mComposeJobsPending )
+	{
+		pShadow->mbValid = 0;
+		return;
+	}
+
+	// a new size or format invalidates everything copied so far
+	const int8_t bFull = !pShadow->mbValid || pShadow->mFormat != format ||
+		pShadow->mWidth != pSurface->mBufferWidth || pShadow->mHeight != pSurface->mBufferHeight;
+
+	if( SurfaceShadowReserve(pShadow, pSurface->mBufferWidth, pSurface->mBufferHeight) == -1 )
+	{
+		pShadow->mbValid = 0;
+		return;
+	}
+	pShadow->mWidth = pSurface->mBufferWidth;
+	pShadow->mHeight = pSurface->mBufferHeight;
+	pShadow->mFormat = format;
+	SurfaceShadowCopy(pShadow, pShmBuffer, bFull ? NULL : pDamage);
+	pShadow->mbValid = 1;
+
+	QueueBufferRelease(pSurface->mpClientState, pBuffer, pSurface->mBufferCommitNsec);
+	SurfaceTrackBuffer(&pSurface->mCurrent.mpBuffer, &pSurface->mCurrentBufferDestroy, NULL);
+}
+
+// Surface Role
+
+// Assigns pRole, a surface keeps its first role forever. Posts errorCode on
+// pErrorResource and returns -1 for a surface with another role or a live
+// role object.
+static int SurfaceSetRole(
+	struct Surface* pSurface, const struct SurfaceRole* pRole, void* pRoleData,
+	struct wl_resource* pErrorResource, uint32_t errorCode
+)
+{
+	if( ( pSurface->mpRole && pSurface->mpRole != pRole ) || pSurface->mpRoleData )
+	{
+		wl_resource_post_error(pErrorResource, errorCode,
+			"wl_surface@%u already has the %s role",
+			wl_resource_get_id(pSurface->mpResource),
+			pSurface->mpRole ? pSurface->mpRole->mpName : pRole->mpName
+		);
+		return -1;
+	}
+
+	pSurface->mpRole = pRole;
+	pSurface->mpRoleData = pRoleData;
+	return 0;
+}
+
+// Frame Callbacks
+
+static void wl_callback_handle_resource_destroy( struct wl_resource* pResource )
+{
+	wl_list_remove(wl_resource_get_link(pResource));
+}
+
+// Surface Handle
+
+static void SurfaceStateDropCallbacks( struct SurfaceState* pState, int8_t bClientGone )
+{
+	struct wl_resource* pCallback;
+	struct wl_resource* pTmp;
+	wl_resource_for_each_safe(pCallback, pTmp, &pState->mFrameCallbackList)
+	{
+		if( bClientGone )
+		{
+			// libwayland destroys the callback later, keep its unlink harmless
+			wl_list_remove(wl_resource_get_link(pCallback));
+			wl_list_init(wl_resource_get_link(pCallback));
+		}
+		else
+			wl_resource_destroy(pCallback);
+	}
+
+	// a gone client's feedbacks were detached already
+	if( !bClientGone )
+		PresentationDiscardList(&pState->mFeedbackList);
+}
+
+static void SurfaceRelease( struct Surface* pSurface, int8_t bClientGone )
+{
+	if( !bClientGone )
+		SurfaceDiscardFeedback(pSurface);
+	SurfaceStateDropCallbacks(&pSurface->mPending, bClientGone);
+
+	if( pSurface->mpRole && pSurface->mpRole->mDestroy )
+		pSurface->mpRole->mDestroy(pSurface);
+	// requests on the viewport raise no_surface from now on
+	if( pSurface->mpViewport )
+		wl_resource_set_user_data(pSurface->mpViewport, NULL);
+
+	// whatever was underneath becomes visible again
+	struct ServerState* pServer = pSurface->mpClientState->mpServer;
+	SurfaceDetachSubsurfaces(pSurface);
+	MarkSurfaceStackDirty(pServer);
+	DropSurfaceScanout(pSurface, !bClientGone);
+	DamageOutputRect(pServer, pSurface->mX, pSurface->mY, pSurface->mWidth, pSurface->mHeight);
+
+	RegionFini(&pSurface->mPending.mDamage);
+	RegionFini(&pSurface->mPending.mBufferDamage);
+	RegionFini(&pSurface->mCurrent.mDamage);
+	RegionFini(&pSurface->mCurrent.mBufferDamage);
+	RegionFini(&pSurface->mPending.mOpaque);
+	RegionFini(&pSurface->mCurrent.mOpaque);
+	if( pSurface->mShadow.mpPixels )
+		WorkerPoolWait(pServer->mpWorkers);
+	SurfaceShadowFini(&pSurface->mShadow);
+
+	// a destroyed surface no longer reads its buffer
+	if( !bClientGone && pSurface->mCurrent.mpBuffer )
+		QueueBufferRelease(pSurface->mpClientState, pSurface->mCurrent.mpBuffer, pSurface->mBufferCommitNsec);
+
+	wl_list_remove(&pSurface->mPendingBufferDestroy.link);
+	wl_list_remove(&pSurface->mCurrentBufferDestroy.link);
+	wl_list_remove(&pSurface->mLink);
+	wl_list_remove(&pSurface->mClientLink);
+
+	SlabPoolFree(&pSurface->mpClientState->mSurfacePool, pSurface);
+}
+
+static void DetachClientSurfaces( struct ClientState* pClientState )
+{
+	struct Surface* pSurface;
+	struct Surface* pTmp;
+	wl_list_for_each_safe(pSurface, pTmp, &pClientState->mSurfaceList, mClientLink)
+	{
+		wl_resource_set_user_data(pSurface->mpResource, NULL);
+		SurfaceRelease(pSurface, 1);
+	}
+}
+
+static void wl_surface_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	if( !pSurface )
+		return;
+
+	SurfaceRelease(pSurface, 0);
+}
+
+static void wl_surface_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void wl_surface_handle_attach(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pBuffer, int32_t x, int32_t y
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+
+	SurfaceTrackBuffer(&pSurface->mPending.mpBuffer, &pSurface->mPendingBufferDestroy, pBuffer);
+	pSurface->mPending.mbNewBuffer = 1;
+	pSurface->mPending.mDx = x;
+	pSurface->mPending.mDy = y;
+}
+
+#ifdef WL_SURFACE_OFFSET_SINCE_VERSION
+static void wl_surface_handle_offset(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t x, int32_t y
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	pSurface->mPending.mDx = x;
+	pSurface->mPending.mDy = y;
+}
+#endif
+
+static void wl_surface_handle_damage(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t x, int32_t y, int32_t width, int32_t height
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	RegionUnionRect(&pSurface->mPending.mDamage, x, y, width, height);
+	RegionSimplify(&pSurface->mPending.mDamage, SURFACE_DAMAGE_MAX_BOXES);
+}
+
+static void wl_surface_handle_damage_buffer(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t x, int32_t y, int32_t width, int32_t height
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	RegionUnionRect(&pSurface->mPending.mBufferDamage, x, y, width, height);
+	RegionSimplify(&pSurface->mPending.mBufferDamage, SURFACE_DAMAGE_MAX_BOXES);
+}
+
+static void wl_surface_handle_frame(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t callback
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+
+	struct wl_resource* pCallback = wl_resource_create(
+		pClient, &wl_callback_interface, 1, callback
+	);
+	if( !pCallback )
+	{
+		wl_resource_post_no_memory(pResource);
+		return;
+	}
+	wl_resource_set_implementation(
+		pCallback, NULL, NULL, wl_callback_handle_resource_destroy
+	);
+	wl_list_insert(pSurface->mPending.mFrameCallbackList.prev, wl_resource_get_link(pCallback));
+}
+
+// Unlike damage an opaque region may only shrink, past the limit the largest
+// box stands in for all of it
+static void SurfaceLimitOpaque( struct Region* pOpaque )
+{
+	if( pOpaque->mCount <= SURFACE_OPAQUE_MAX_BOXES )
+		return;
+
+	uint32_t largest = 0;
+	uint64_t largestArea = 0;
+	for( uint32_t i = 0; i < pOpaque->mCount; i++ )
+	{
+		const uint64_t area = RegionBoxArea(&pOpaque->mpBoxes[i]);
+		if( area > largestArea )
+		{
+			largest = i;
+			largestArea = area;
+		}
+	}
+
+	pOpaque->mpBoxes[0] = pOpaque->mpBoxes[largest];
+	pOpaque->mCount = 1;
+	RegionUpdateExtents(pOpaque);
+}
+
+// Pixels under the region are composed with their alpha forced to 0xFF, what
+// lies beneath them is not drawn at all
+static void wl_surface_handle_set_opaque_region(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pRegion
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	struct SurfaceState* pPending = &pSurface->mPending;
+
+	if( pRegion )
+	{
+		if( RegionCopy(&pPending->mOpaque, wl_resource_get_user_data(pRegion)) == -1 )
+		{
+			wl_resource_post_no_memory(pResource);
+			return;
+		}
+		SurfaceLimitOpaque(&pPending->mOpaque);
+	}
+	else
+		RegionClear(&pPending->mOpaque);
+	pPending->mbOpaqueChanged = 1;
+}
+
+static void wl_surface_handle_set_input_region(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pRegion
+)
+{
+}
+
+static void wl_surface_handle_set_buffer_transform(
+	struct wl_client* pClient, struct wl_resource* pResource, int32_t transform
+)
+{
+	if( transform < WL_OUTPUT_TRANSFORM_NORMAL || transform > WL_OUTPUT_TRANSFORM_FLIPPED_270 )
+	{
+		wl_resource_post_error(pResource, WL_SURFACE_ERROR_INVALID_TRANSFORM,
+			"buffer transform must be a valid transform (%d specified)", transform);
+		return;
+	}
+
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	pSurface->mPending.mTransform = transform;
+}
+
+static void wl_surface_handle_set_buffer_scale(
+	struct wl_client* pClient, struct wl_resource* pResource, int32_t scale
+)
+{
+	if( scale < 1 )
+	{
+		wl_resource_post_error(pResource, WL_SURFACE_ERROR_INVALID_SCALE,
+			"buffer scale must be at least one (%d specified)", scale);
+		return;
+	}
+
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	pSurface->mPending.mScale = scale;
+}
+
+// Remembers the committed buffer's size and format, they outlive the buffer
+// once it has been released early
+static void SurfaceUpdateBufferInfo( struct Surface* pSurface )
+{
+	const struct DmabufBuffer* pDmabuf = DmabufBufferGet(pSurface->mCurrent.mpBuffer);
+	if( pDmabuf )
+	{
+		pSurface->mBufferWidth = pDmabuf->mWidth;
+		pSurface->mBufferHeight = pDmabuf->mHeight;
+		pSurface->mBufferFormat = pDmabuf->mFormat;
+		return;
+	}
+
+	struct wl_shm_buffer* pShmBuffer = NULL;
+	if( pSurface->mCurrent.mpBuffer )
+		pShmBuffer = wl_shm_buffer_get(pSurface->mCurrent.mpBuffer);
+
+	if( !pShmBuffer )
+	{
+		pSurface->mBufferWidth = pSurface->mBufferHeight = 0;
+		pSurface->mBufferFormat = 0;
+		return;
+	}
+
+	pSurface->mBufferWidth = wl_shm_buffer_get_width(pShmBuffer);
+	pSurface->mBufferHeight = wl_shm_buffer_get_height(pShmBuffer);
+	pSurface->mBufferFormat = wl_shm_buffer_get_format(pShmBuffer);
+}
+
+// A viewport decides the size of a surface with contents, the destination
+// size first and then the source rectangle
+static void SurfaceUpdateSize( struct Surface* pSurface )
+{
+	int32_t width = pSurface->mBufferWidth;
+	int32_t height = pSurface->mBufferHeight;
+
+	const struct ViewportState* pViewport = &pSurface->mCurrent.mViewport;
+	if( width > 0 && height > 0 && pViewport->mbDestination )
+	{
+		pSurface->mWidth = pViewport->mDstWidth;
+		pSurface->mHeight = pViewport->mDstHeight;
+		return;
+	}
+	if( width > 0 && height > 0 && pViewport->mbSource )
+	{
+		pSurface->mWidth = wl_fixed_to_int(pViewport->mSrcWidth);
+		pSurface->mHeight = wl_fixed_to_int(pViewport->mSrcHeight);
+		return;
+	}
+
+	switch( pSurface->mCurrent.mTransform )
+	{
+		case WL_OUTPUT_TRANSFORM_90:
+		case WL_OUTPUT_TRANSFORM_270:
+		case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		{
+			int32_t tmp = width;
+			width = height;
+			height = tmp;
+			break;
+		}
+		default:
+			break;
+	}
+
+	pSurface->mWidth = width / pSurface->mCurrent.mScale;
+	pSurface->mHeight = height / pSurface->mCurrent.mScale;
+}
+
+// Moves the committed damage into output coordinates. A surface that was
+// mapped, unmapped, moved or resized damages both its old and new bounds.
+static void SurfaceApplyDamage( struct Surface* pSurface, const struct RegionBox* pOldBox )
+{
+	struct ServerState* pServer = pSurface->mpClientState->mpServer;
+	struct SurfaceState* pCurrent = &pSurface->mCurrent;
+
+	const struct RegionBox newBox = GetSurfaceBox(pSurface);
+
+	if( memcmp(pOldBox, &newBox, sizeof(struct RegionBox)) != 0 )
+	{
+		DamageOutputBox(pServer, pOldBox);
+		DamageOutputBox(pServer, &newBox);
+		return;
+	}
+
+	if( !RegionNotEmpty(&pCurrent->mDamage) )
+		return;
+
+	const struct RegionBox surfaceBox = { 0, 0, pSurface->mWidth, pSurface->mHeight };
+	RegionIntersectBox(&pCurrent->mDamage, &surfaceBox);
+	RegionTranslate(&pCurrent->mDamage, pSurface->mX, pSurface->mY);
+	DamageOutput(pServer, &pCurrent->mDamage);
+}
+
+// Routes the surface to the outputs it overlaps, sends wl_surface.enter and
+// leave to every wl_output the client bound for an output that changed
+static void SurfaceUpdateOutputs( struct Surface* pSurface )
+{
+	struct ServerState* pServer = pSurface->mpClientState->mpServer;
+	const struct RegionBox surfaceBox = GetSurfaceBox(pSurface);
+	const int8_t bMapped = SurfaceIsMapped(pSurface);
+
+	uint32_t mask = 0;
+	uint64_t bestArea = 0;
+	struct OutputState* pBest = NULL;
+
+	struct OutputState* pOutput;
+	wl_list_for_each(pOutput, &pServer->mOutputList, mLink)
+	{
+		const struct RegionBox outputBox = GetOutputBox(pOutput);
+		struct RegionBox overlap;
+		if( !bMapped || !RegionBoxIntersect(&surfaceBox, &outputBox, &overlap) )
+			continue;
+
+		mask |= 1u << pOutput->mIndex;
+		const uint64_t area = (uint64_t)( overlap.mX2 - overlap.mX1 ) * ( overlap.mY2 - overlap.mY1 );
+		if( area > bestArea )
+		{
+			bestArea = area;
+			pBest = pOutput;
+		}
+	}
+
+	const uint32_t changed = mask ^ pSurface->mOutputMask;
+	pSurface->mOutputMask = mask;
+	pSurface->mpOutput = pBest;
+	if( !changed )
+		return;
+
+	struct Output* pClientOutput;
+	wl_list_for_each(pClientOutput, &pSurface->mpClientState->mOutputList, mLink)
+	{
+		if( !pClientOutput->mpState )
+			continue;
+
+		const uint32_t bit = 1u << pClientOutput->mpState->mIndex;
+		if( !( changed & bit ) )
+			continue;
+
+		if( mask & bit )
+			wl_surface_send_enter(pSurface->mpResource, pClientOutput->mpResource);
+		else
+			wl_surface_send_leave(pSurface->mpResource, pClientOutput->mpResource);
+	}
+}
+
+// Makes pPending the current state of the surface. It is the surface's own
+// pending state, or for a synchronized subsurface the state cached from its
+// earlier commits; pBufferDestroy tracks the buffer of pPending.
+static void SurfaceApplyState(
+	struct Surface* pSurface, struct SurfaceState* pPending,
+	struct wl_listener* pBufferDestroy
+)
+{
+	struct SurfaceState* pCurrent = &pSurface->mCurrent;
+	struct ClientState* pClientState = pSurface->mpClientState;
+	struct ServerState* pServer = pClientState->mpServer;
+	const struct SurfaceRole* pRole = pSurface->mpRole;
+
+	const struct RegionBox oldBox = GetSurfaceBox(pSurface);
+
+	pCurrent->mScale = pPending->mScale;
+	pCurrent->mTransform = pPending->mTransform;
+	const int8_t bViewportChanged = !ViewportStateEqual(&pCurrent->mViewport, &pPending->mViewport);
+	pCurrent->mViewport = pPending->mViewport;
+
+	const int8_t bNewBuffer = pPending->mbNewBuffer;
+	if( bNewBuffer )
+	{
+		// the previous buffer is no longer read once it has been replaced
+		struct wl_resource* pOldBuffer = pCurrent->mpBuffer;
+		if( pOldBuffer && pOldBuffer != pPending->mpBuffer &&
+			!HoldScanoutRelease(pServer, pOldBuffer, pSurface->mBufferCommitNsec) )
+			QueueBufferRelease(pClientState, pOldBuffer, pSurface->mBufferCommitNsec);
+		if( pPending->mpBuffer )
+			CancelBufferRelease(pClientState, pPending->mpBuffer);
+
+		SurfaceTrackBuffer(&pCurrent->mpBuffer, &pSurface->mCurrentBufferDestroy, pPending->mpBuffer);
+		SurfaceTrackBuffer(&pPending->mpBuffer, pBufferDestroy, NULL);
+		pPending->mbNewBuffer = 0;
+
+		SurfaceUpdateBufferInfo(pSurface);
+		pSurface->mBufferCommitNsec = GetTimeNsec();
+		pSurface->mShadow.mbValid &= pCurrent->mpBuffer != NULL;
+	}
+	pSurface->mX = SurfaceClampCoord((int64_t)pSurface->mX + pPending->mDx);
+	pSurface->mY = SurfaceClampCoord((int64_t)pSurface->mY + pPending->mDy);
+	pPending->mDx = pPending->mDy = 0;
+	SurfaceUpdateSize(pSurface);
+	if( pRole && pRole->mCommit )
+		pRole->mCommit(pSurface);
+
+	// damage is reported in surface coordinates from here on
+	RegionCopy(&pCurrent->mDamage, &pPending->mDamage);
+	if( RegionNotEmpty(&pPending->mBufferDamage) )
+	{
+		if( pCurrent->mTransform != WL_OUTPUT_TRANSFORM_NORMAL || SurfaceHasViewport(pCurrent) )
+			RegionUnionRect(&pCurrent->mDamage, 0, 0, pSurface->mWidth, pSurface->mHeight);
+		else
+		{
+			const int32_t scale = pCurrent->mScale;
+			for( uint32_t i = 0; i < pPending->mBufferDamage.mCount; i++ )
+			{
+				const struct RegionBox* pBox = &pPending->mBufferDamage.mpBoxes[i];
+				RegionUnionRect(
+					&pCurrent->mDamage,
+					pBox->mX1 / scale, pBox->mY1 / scale,
+					( pBox->mX2 + scale - 1 ) / scale - pBox->mX1 / scale,
+					( pBox->mY2 + scale - 1 ) / scale - pBox->mY1 / scale
+				);
+			}
+		}
+	}
+	RegionClear(&pPending->mDamage);
+	RegionClear(&pPending->mBufferDamage);
+	// a new crop or scale redraws everything, even at the same size
+	if( bViewportChanged )
+		RegionUnionRect(&pCurrent->mDamage, 0, 0, pSurface->mWidth, pSurface->mHeight);
+
+	if( pPending->mbOpaqueChanged )
+	{
+		RegionCopy(&pCurrent->mOpaque, &pPending->mOpaque);
+		pPending->mbOpaqueChanged = 0;
+		// surfaces culled under the old region may show through now
+		RegionUnionRect(&pCurrent->mDamage, 0, 0, pSurface->mWidth, pSurface->mHeight);
+	}
+
+	if( bNewBuffer && pServer->mbEarlyRelease && pCurrent->mpBuffer )
+		SurfaceEarlyRelease(pSurface, &pCurrent->mDamage);
+
+	SurfaceApplyDamage(pSurface, &oldBox);
+	RegionClear(&pCurrent->mDamage);
+	SurfaceUpdateOutputs(pSurface);
+
+	struct OutputState* pOutput = GetSurfaceOutput(pSurface);
+	PresentationCommit(pSurface, pPending, pOutput);
+	if( pOutput )
+	{
+		wl_list_insert_list(pOutput->mFrameCallbackList.prev, &pPending->mFrameCallbackList);
+		wl_list_init(&pPending->mFrameCallbackList);
+		ScheduleRepaint(pOutput);
+	}
+
+	pSurface->mCommitCount++;
+
+	// subsurfaces move along and apply what they committed in sync mode
+	SubsurfaceParentCommit(pSurface);
+}
+
+static void wl_surface_handle_commit( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	if( SurfaceCheckViewport(pSurface) == -1 )
+		return;
+
+	const struct SurfaceRole* pRole = pSurface->mpRole;
+	if( pRole && pRole->mPreCommit && pRole->mPreCommit(pSurface) != 0 )
+		return;
+
+	SurfaceApplyState(pSurface, &pSurface->mPending, &pSurface->mPendingBufferDestroy);
+}
+
+static const struct wl_surface_interface wl_surface_impl = {
+	.destroy = wl_surface_handle_destroy,
+	.attach = wl_surface_handle_attach,
+	.damage = wl_surface_handle_damage,
+	.frame = wl_surface_handle_frame,
+	.set_opaque_region = wl_surface_handle_set_opaque_region,
+	.set_input_region = wl_surface_handle_set_input_region,
+	.commit = wl_surface_handle_commit,
+	.set_buffer_transform = wl_surface_handle_set_buffer_transform,
+	.set_buffer_scale = wl_surface_handle_set_buffer_scale,
+	.damage_buffer = wl_surface_handle_damage_buffer,
+#ifdef WL_SURFACE_OFFSET_SINCE_VERSION
+	.offset = wl_surface_handle_offset
+#endif
+};
+
+// Region Handle
+
+static void wl_region_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Region* pRegion = wl_resource_get_user_data(pResource);
+	RegionFini(pRegion);
+	free(pRegion);
+}
+
+static void wl_region_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void wl_region_handle_add(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t x, int32_t y, int32_t width, int32_t height
+)
+{
+	struct Region* pRegion = wl_resource_get_user_data(pResource);
+	RegionUnionRect(pRegion, x, y, width, height);
+}
+
+static void wl_region_handle_subtract(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t x, int32_t y, int32_t width, int32_t height
+)
+{
+	struct Region* pRegion = wl_resource_get_user_data(pResource);
+	RegionSubtractRect(pRegion, x, y, width, height);
+}
+
+static const struct wl_region_interface wl_region_impl = {
+	.destroy = wl_region_handle_destroy,
+	.add = wl_region_handle_add,
+	.subtract = wl_region_handle_subtract
+};
+
+static struct Region* CreateRegion( struct wl_client* pClient, uint32_t version, uint32_t id )
+{
+	struct Region* pRegion = calloc(1, sizeof(struct Region));
+	if( !pRegion )
+	{
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &wl_region_interface, version, id
+	);
+	if( !pResource )
+	{
+		free(pRegion);
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+	wl_resource_set_implementation(
+		pResource, &wl_region_impl,
+		pRegion, wl_region_handle_resource_destroy
+	);
+	return pRegion;
+}
+
+// Surface Creation
+
+static struct Surface* CreateSurface(
+	struct ServerState* pServer, struct wl_client* pClient,
+	uint32_t version, uint32_t id
+)
+{
+	struct ClientState* pClientState = GetClientState(pServer, pClient);
+	if( !pClientState )
+	{
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+
+	struct Surface* pSurface = SlabPoolAlloc(&pClientState->mSurfacePool);
+	if( !pSurface )
+	{
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &wl_surface_interface, version, id
+	);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mSurfacePool, pSurface);
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+	wl_resource_set_implementation(
+		pResource, &wl_surface_impl,
+		pSurface, wl_surface_handle_resource_destroy
+	);
+
+	pSurface->mpResource = pResource;
+	pSurface->mpClientState = pClientState;
+	SurfaceStateInit(&pSurface->mPending);
+	SurfaceStateInit(&pSurface->mCurrent);
+	pSurface->mPendingBufferDestroy.notify = surface_pending_buffer_destroy;
+	wl_list_init(&pSurface->mPendingBufferDestroy.link);
+	pSurface->mCurrentBufferDestroy.notify = surface_current_buffer_destroy;
+	wl_list_init(&pSurface->mCurrentBufferDestroy.link);
+	wl_list_init(&pSurface->mBelowList);
+	wl_list_init(&pSurface->mAboveList);
+	wl_list_init(&pSurface->mPendingBelowList);
+	wl_list_init(&pSurface->mPendingAboveList);
+
+	// new surfaces stack on top
+	wl_list_insert(pServer->mSurfaceList.prev, &pSurface->mLink);
+	wl_list_insert(pClientState->mSurfaceList.prev, &pSurface->mClientLink);
+	MarkSurfaceStackDirty(pServer);
+
+	return pSurface;
+}
+
+#endif
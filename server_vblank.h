@@ -0,0 +1,152 @@
+#ifndef _SERVER_VBLANK_H
+#define _SERVER_VBLANK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <wayland-server.h>
+
+// Virtual vertical blank for a headless output. Vblanks sit on a fixed grid
+// of mPeriodNsec starting at mStartNsec, the timerfd is armed with absolute
+// CLOCK_MONOTONIC deadlines so the clock never drifts and 240 Hz periods are
+// not rounded to whole milliseconds like wl_event_loop_add_timer would.
+// A refresh of 0 means "as fast as possible": no timer, every dispatch that
+// has work repaints once.
+
+typedef void (*VblankFunc)( void* pData, uint64_t vblankNsec, uint64_t sequence );
+
+struct VirtualVblank
+{
+	int mTimerFd;
+	struct wl_event_source* mpSource;
+	int8_t mbArmed;
+
+	// refresh in mHz, 0 for as fast as possible
+	int32_t mRefresh;
+	uint64_t mPeriodNsec;
+	uint64_t mStartNsec;
+	uint64_t mLastSequence;
+	uint64_t mTargetSequence;
+
+	VblankFunc mFunc;
+	void* mpData;
+
+	uint64_t mCycles;
+	// vblanks that passed after the targeted one before the cycle ran
+	uint64_t mMissed;
+};
+
+static uint64_t VblankNowNsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int vblank_handle_timer( int fd, uint32_t mask, void* pData )
+{
+	struct VirtualVblank* pVblank = pData;
+
+	uint64_t expirations;
+	if( read(fd, &expirations, sizeof(expirations)) != sizeof(expirations) )
+		return 0;
+
+	pVblank->mbArmed = 0;
+
+	// report the vblank that just passed, even if we woke up late
+	const uint64_t now = VblankNowNsec();
+	const uint64_t sequence = ( now - pVblank->mStartNsec ) / pVblank->mPeriodNsec;
+	if( sequence > pVblank->mTargetSequence )
+		pVblank->mMissed += sequence - pVblank->mTargetSequence;
+	pVblank->mLastSequence = sequence;
+	pVblank->mCycles++;
+
+	pVblank->mFunc(pVblank->mpData, pVblank->mStartNsec + sequence * pVblank->mPeriodNsec, sequence);
+	return 0;
+}
+
+static int VblankInit(
+	struct VirtualVblank* pVblank, struct wl_event_loop* pEventLoop,
+	int32_t refresh, VblankFunc func, void* pData
+)
+{
+	memset(pVblank, 0, sizeof(struct VirtualVblank));
+	pVblank->mTimerFd = -1;
+	pVblank->mRefresh = refresh;
+	pVblank->mFunc = func;
+	pVblank->mpData = pData;
+	pVblank->mStartNsec = VblankNowNsec();
+
+	if( refresh <= 0 )
+		return 0;
+
+	pVblank->mPeriodNsec = 1000000000000ull / (uint64_t)refresh;
+
+	pVblank->mTimerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if( pVblank->mTimerFd == -1 )
+	{
+		printf("Failed to create vblank timerfd\n");
+		return -1;
+	}
+
+	pVblank->mpSource = wl_event_loop_add_fd(
+		pEventLoop, pVblank->mTimerFd, WL_EVENT_READABLE,
+		vblank_handle_timer, pVblank
+	);
+	if( !pVblank->mpSource )
+	{
+		close(pVblank->mTimerFd);
+		pVblank->mTimerFd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+static void VblankFini( struct VirtualVblank* pVblank )
+{
+	if( pVblank->mpSource )
+		wl_event_source_remove(pVblank->mpSource);
+	if( pVblank->mTimerFd != -1 )
+		close(pVblank->mTimerFd);
+
+	pVblank->mpSource = NULL;
+	pVblank->mTimerFd = -1;
+}
+
+// Arms the timer for the first vblank after now, a no-op while armed
+static void VblankArm( struct VirtualVblank* pVblank )
+{
+	if( pVblank->mbArmed || pVblank->mTimerFd == -1 )
+		return;
+
+	const uint64_t now = VblankNowNsec();
+	uint64_t sequence = ( now - pVblank->mStartNsec ) / pVblank->mPeriodNsec + 1;
+	// never fire twice for the same vblank
+	if( sequence <= pVblank->mLastSequence )
+		sequence = pVblank->mLastSequence + 1;
+
+	const uint64_t deadline = pVblank->mStartNsec + sequence * pVblank->mPeriodNsec;
+	pVblank->mTargetSequence = sequence;
+
+	struct itimerspec spec = {0};
+	spec.it_value.tv_sec = deadline / 1000000000ull;
+	spec.it_value.tv_nsec = deadline % 1000000000ull;
+
+	if( timerfd_settime(pVblank->mTimerFd, TFD_TIMER_ABSTIME, &spec, NULL) == -1 )
+	{
+		printf("Failed to arm vblank timer\n");
+		return;
+	}
+	pVblank->mbArmed = 1;
+}
+
+static int8_t VblankIsVirtual( const struct VirtualVblank* pVblank )
+{
+	return pVblank->mTimerFd != -1;
+}
+
+#endif
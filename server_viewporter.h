@@ -0,0 +1,252 @@
+#ifndef _SERVER_VIEWPORTER_H
+#define _SERVER_VIEWPORTER_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <wayland-server.h>
+
+#include "viewporter-server-protocol.h"
+
+#include "server_client.h"
+#include "server_state.h"
+#include "server_surface.h"
+
+// wp_viewporter and wp_viewport. The crop and scale are double-buffered
+// surface state like the buffer scale, SurfaceUpdateSize turns them into the
+// surface size and SurfaceSetDrawSource into the rectangle the compositor
+// stretches with the scale kernels. Clients can render at a fraction of
+// their window size and have the server upscale it.
+
+// Raises the errors wp_viewport leaves to the commit, returns -1 after
+// posting one
+static int SurfaceCheckViewport( struct Surface* pSurface )
+{
+	const struct SurfaceState* pPending = &pSurface->mPending;
+	const struct ViewportState* pViewport = &pPending->mViewport;
+	if( !pSurface->mpViewport || !pViewport->mbSource )
+		return 0;
+
+	if( !pViewport->mbDestination && ( ( pViewport->mSrcWidth | pViewport->mSrcHeight ) & 0xFF ) )
+	{
+		wl_resource_post_error(pSurface->mpViewport, WP_VIEWPORT_ERROR_BAD_SIZE,
+			"source size %fx%f is not integer and no destination size is set",
+			wl_fixed_to_double(pViewport->mSrcWidth), wl_fixed_to_double(pViewport->mSrcHeight));
+		return -1;
+	}
+
+	// the buffer the commit leaves attached, a NULL one has nothing to crop
+	int32_t width = pSurface->mBufferWidth;
+	int32_t height = pSurface->mBufferHeight;
+	if( pPending->mbNewBuffer )
+	{
+		const struct DmabufBuffer* pDmabuf = DmabufBufferGet(pPending->mpBuffer);
+		struct wl_shm_buffer* pShmBuffer = pPending->mpBuffer && !pDmabuf ? wl_shm_buffer_get(pPending->mpBuffer) : NULL;
+		width = pDmabuf ? pDmabuf->mWidth : pShmBuffer ? wl_shm_buffer_get_width(pShmBuffer) : 0;
+		height = pDmabuf ? pDmabuf->mHeight : pShmBuffer ? wl_shm_buffer_get_height(pShmBuffer) : 0;
+	}
+	if( width == 0 || height == 0 )
+		return 0;
+
+	// odd transforms turn the buffer by 90 or 270 degrees
+	if( pPending->mTransform & 1 )
+	{
+		int32_t tmp = width;
+		width = height;
+		height = tmp;
+	}
+
+	// compared in buffer pixels, 24.8 like the rectangle
+	const int64_t scale = pPending->mScale;
+	if( ( pViewport->mSrcX + (int64_t)pViewport->mSrcWidth ) * scale > (int64_t)width * 256 ||
+		( pViewport->mSrcY + (int64_t)pViewport->mSrcHeight ) * scale > (int64_t)height * 256 )
+	{
+		wl_resource_post_error(pSurface->mpViewport, WP_VIEWPORT_ERROR_OUT_OF_BUFFER,
+			"source rectangle %fx%f+%f+%f extends outside of the %dx%d buffer at scale %d",
+			wl_fixed_to_double(pViewport->mSrcWidth), wl_fixed_to_double(pViewport->mSrcHeight),
+			wl_fixed_to_double(pViewport->mSrcX), wl_fixed_to_double(pViewport->mSrcY),
+			width, height, pPending->mScale);
+		return -1;
+	}
+	return 0;
+}
+
+// Viewport Handle
+
+// NULL after posting no_surface
+static struct Surface* ViewportGetSurface( struct wl_resource* pResource )
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	if( !pSurface )
+		wl_resource_post_error(pResource, WP_VIEWPORT_ERROR_NO_SURFACE,
+			"wl_surface of wp_viewport@%u was destroyed", wl_resource_get_id(pResource));
+	return pSurface;
+}
+
+static void wp_viewport_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pResource);
+	if( !pSurface )
+		return;
+
+	// the crop and scale go away with the next commit
+	pSurface->mpViewport = NULL;
+	pSurface->mPending.mViewport.mbSource = 0;
+	pSurface->mPending.mViewport.mbDestination = 0;
+}
+
+static void wp_viewport_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void wp_viewport_handle_set_source(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	wl_fixed_t x, wl_fixed_t y, wl_fixed_t width, wl_fixed_t height
+)
+{
+	struct Surface* pSurface = ViewportGetSurface(pResource);
+	if( !pSurface )
+		return;
+
+	struct ViewportState* pViewport = &pSurface->mPending.mViewport;
+	const wl_fixed_t unset = wl_fixed_from_int(-1);
+	if( x == unset && y == unset && width == unset && height == unset )
+	{
+		pViewport->mbSource = 0;
+		return;
+	}
+
+	if( x < 0 || y < 0 || width <= 0 || height <= 0 )
+	{
+		wl_resource_post_error(pResource, WP_VIEWPORT_ERROR_BAD_VALUE,
+			"invalid source rectangle %fx%f+%f+%f",
+			wl_fixed_to_double(width), wl_fixed_to_double(height),
+			wl_fixed_to_double(x), wl_fixed_to_double(y));
+		return;
+	}
+
+	pViewport->mbSource = 1;
+	pViewport->mSrcX = x;
+	pViewport->mSrcY = y;
+	pViewport->mSrcWidth = width;
+	pViewport->mSrcHeight = height;
+}
+
+static void wp_viewport_handle_set_destination(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t width, int32_t height
+)
+{
+	struct Surface* pSurface = ViewportGetSurface(pResource);
+	if( !pSurface )
+		return;
+
+	struct ViewportState* pViewport = &pSurface->mPending.mViewport;
+	if( width == -1 && height == -1 )
+	{
+		pViewport->mbDestination = 0;
+		return;
+	}
+
+	if( width <= 0 || height <= 0 )
+	{
+		wl_resource_post_error(pResource, WP_VIEWPORT_ERROR_BAD_VALUE,
+			"invalid destination size %dx%d", width, height);
+		return;
+	}
+
+	pViewport->mbDestination = 1;
+	pViewport->mDstWidth = width;
+	pViewport->mDstHeight = height;
+}
+
+static const struct wp_viewport_interface wp_viewport_impl = {
+	.destroy = wp_viewport_handle_destroy,
+	.set_source = wp_viewport_handle_set_source,
+	.set_destination = wp_viewport_handle_set_destination
+};
+
+// Viewporter Handle
+
+static void wp_viewporter_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct Viewporter* pViewporter = wl_resource_get_user_data(pResource);
+	if( !pViewporter )
+		return;
+
+	ClientFreeBinding(pViewporter->mpClientState, pViewporter, &pViewporter->mLink);
+}
+
+static void wp_viewporter_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void wp_viewporter_handle_get_viewport(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	uint32_t id, struct wl_resource* pSurfaceResource
+)
+{
+	struct Surface* pSurface = wl_resource_get_user_data(pSurfaceResource);
+	if( pSurface->mpViewport )
+	{
+		wl_resource_post_error(pResource, WP_VIEWPORTER_ERROR_VIEWPORT_EXISTS,
+			"wl_surface@%u already has a wp_viewport", wl_resource_get_id(pSurfaceResource));
+		return;
+	}
+
+	struct wl_resource* pViewport = wl_resource_create(
+		pClient, &wp_viewport_interface,
+		wl_resource_get_version(pResource), id
+	);
+	if( !pViewport )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pViewport, &wp_viewport_impl,
+		pSurface, wp_viewport_handle_resource_destroy
+	);
+	pSurface->mpViewport = pViewport;
+}
+
+static const struct wp_viewporter_interface wp_viewporter_impl = {
+	.destroy = wp_viewporter_handle_destroy,
+	.get_viewport = wp_viewporter_handle_get_viewport
+};
+
+static void wp_viewporter_handle_bind(
+	struct wl_client* pClient, void* pData,
+	uint32_t version, uint32_t id
+)
+{
+	struct ClientState* pClientState = GetClientState(pData, pClient);
+	struct Viewporter* pViewporter = pClientState ? ClientAllocBinding(pClientState) : NULL;
+	if( !pViewporter )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &wp_viewporter_interface,
+		version, id
+	);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mBindingPool, pViewporter);
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pResource, &wp_viewporter_impl,
+		pViewporter, wp_viewporter_handle_resource_destroy
+	);
+	pViewporter->mpResource = pResource;
+	pViewporter->mpClientState = pClientState;
+	wl_list_insert(pClientState->mViewporterList.prev, &pViewporter->mLink);
+}
+
+#endif
@@ -0,0 +1,346 @@
+#ifndef _SERVER_WORKERS_H
+#define _SERVER_WORKERS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "server_blend.h"
+#include "server_renderer.h"
+
+// Fixed pool of threads composing output framebuffers tile by tile, off the
+// thread running wl_display_run. Each repaint hands over a ComposeJob: a copy
+// of the output's draw list and its damage cut along a tile grid. Workers pull
+// tiles of the oldest job first, the one finishing the last tile moves the job
+// to the done list and wakes the dispatch thread through an eventfd.
+//
+// Tiles are disjoint, no two workers write the same pixel. They are clipped
+// to damage boxes with arbitrary x edges, so tiles of neighbouring boxes may
+// still share a cache line.
+
+#define COMPOSE_TILE_WIDTH 256
+#define COMPOSE_TILE_HEIGHT 64
+#define WORKER_MAX_THREADS 64
+
+struct ComposeTile
+{
+	int32_t mX1, mY1, mX2, mY2;
+};
+
+struct ComposeJob
+{
+	struct Framebuffer* mpFramebuffer;
+	const struct BlendKernels* mpKernels;
+	// owned copy of the draw list, stays valid while the workers read it.
+	// Visible boxes and background belong to the submitter and must not
+	// change until the job is collected.
+	struct DrawItem* mpItems;
+	uint32_t mItemCount;
+	uint32_t mItemCapacity;
+	struct ComposeTile* mpTiles;
+	uint32_t mTileCount;
+	uint32_t mTileCapacity;
+	const struct Region* mpBackground;
+
+	// next tile to hand out, guarded by WorkerPool::mMutex
+	uint32_t mNextTile;
+	atomic_uint mTilesDone;
+	atomic_uint_fast64_t mOutputPixels;
+	atomic_uint_fast64_t mSourcePixels;
+	atomic_uint_fast64_t mCulledPixels;
+	uint64_t mSubmitNsec;
+	// set by the worker finishing the last tile
+	uint64_t mDoneNsec;
+
+	void* mpUserData;
+	// WorkerPool queue or done list
+	struct ComposeJob* mpNext;
+};
+
+struct WorkerPool
+{
+	pthread_t mThreads[WORKER_MAX_THREADS];
+	uint32_t mThreadCount;
+
+	pthread_mutex_t mMutex;
+	// signaled when a job is queued or the pool shuts down
+	pthread_cond_t mWorkCond;
+	// signaled when the last running job finishes
+	pthread_cond_t mIdleCond;
+
+	// jobs with tiles left to hand out, oldest first
+	struct ComposeJob* mpQueueHead;
+	struct ComposeJob* mpQueueTail;
+	// finished jobs waiting for WorkerPoolCollect
+	struct ComposeJob* mpDoneHead;
+	struct ComposeJob* mpDoneTail;
+	// submitted and not finished yet
+	uint32_t mJobsRunning;
+	int8_t mbQuit;
+
+	// readable while the done list is not empty
+	int mEventFd;
+};
+
+// Compose Job
+
+static void ComposeJobInit( struct ComposeJob* pJob, void* pUserData )
+{
+	memset(pJob, 0, sizeof(struct ComposeJob));
+	pJob->mpUserData = pUserData;
+}
+
+static void ComposeJobFini( struct ComposeJob* pJob )
+{
+	free(pJob->mpItems);
+	free(pJob->mpTiles);
+	pJob->mpItems = NULL;
+	pJob->mpTiles = NULL;
+	pJob->mItemCapacity = pJob->mTileCapacity = 0;
+}
+
+static int ComposeJobSetItems( struct ComposeJob* pJob, const struct DrawItem* pItems, uint32_t count )
+{
+	if( count > pJob->mItemCapacity )
+	{
+		uint32_t capacity = pJob->mItemCapacity ? pJob->mItemCapacity : 16;
+		while( capacity < count )
+			capacity *= 2;
+
+		struct DrawItem* pNew = realloc(pJob->mpItems, capacity * sizeof(struct DrawItem));
+		if( !pNew )
+			return -1;
+
+		pJob->mpItems = pNew;
+		pJob->mItemCapacity = capacity;
+	}
+
+	memcpy(pJob->mpItems, pItems, count * sizeof(struct DrawItem));
+	pJob->mItemCount = count;
+	pJob->mTileCount = 0;
+	return 0;
+}
+
+static int ComposeJobAddTile( struct ComposeJob* pJob, int32_t x1, int32_t y1, int32_t x2, int32_t y2 )
+{
+	if( pJob->mTileCount == pJob->mTileCapacity )
+	{
+		uint32_t capacity = pJob->mTileCapacity ? pJob->mTileCapacity * 2 : 64;
+		struct ComposeTile* pNew = realloc(pJob->mpTiles, capacity * sizeof(struct ComposeTile));
+		if( !pNew )
+			return -1;
+
+		pJob->mpTiles = pNew;
+		pJob->mTileCapacity = capacity;
+	}
+
+	pJob->mpTiles[pJob->mTileCount++] = (struct ComposeTile){ x1, y1, x2, y2 };
+	return 0;
+}
+
+// Cuts a framebuffer rectangle along the tile grid, the rectangles of one
+// job must not overlap
+static int ComposeJobAddRect(
+	struct ComposeJob* pJob, const struct Framebuffer* pFb,
+	int32_t x1, int32_t y1, int32_t x2, int32_t y2
+)
+{
+	if( x1 < 0 ) x1 = 0;
+	if( y1 < 0 ) y1 = 0;
+	if( x2 > pFb->mWidth ) x2 = pFb->mWidth;
+	if( y2 > pFb->mHeight ) y2 = pFb->mHeight;
+
+	for( int32_t ty = y1 - y1 % COMPOSE_TILE_HEIGHT; ty < y2; ty += COMPOSE_TILE_HEIGHT )
+	{
+		const int32_t tileY1 = ty > y1 ? ty : y1;
+		const int32_t tileY2 = ty + COMPOSE_TILE_HEIGHT < y2 ? ty + COMPOSE_TILE_HEIGHT : y2;
+
+		for( int32_t tx = x1 - x1 % COMPOSE_TILE_WIDTH; tx < x2; tx += COMPOSE_TILE_WIDTH )
+		{
+			const int32_t tileX1 = tx > x1 ? tx : x1;
+			const int32_t tileX2 = tx + COMPOSE_TILE_WIDTH < x2 ? tx + COMPOSE_TILE_WIDTH : x2;
+			if( ComposeJobAddTile(pJob, tileX1, tileY1, tileX2, tileY2) == -1 )
+				return -1;
+		}
+	}
+	return 0;
+}
+
+// Worker Pool
+
+static void WorkerPoolFinishJob( struct WorkerPool* pPool, struct ComposeJob* pJob )
+{
+	pJob->mDoneNsec = GetTimeNsec();
+	pJob->mpNext = NULL;
+
+	pthread_mutex_lock(&pPool->mMutex);
+	if( pPool->mpDoneTail )
+		pPool->mpDoneTail->mpNext = pJob;
+	else
+		pPool->mpDoneHead = pJob;
+	pPool->mpDoneTail = pJob;
+
+	if( --pPool->mJobsRunning == 0 )
+		pthread_cond_broadcast(&pPool->mIdleCond);
+	pthread_mutex_unlock(&pPool->mMutex);
+
+	const uint64_t one = 1;
+	if( write(pPool->mEventFd, &one, sizeof(one)) != sizeof(one) )
+		printf("Failed to signal a finished compose job\n");
+}
+
+static void* WorkerPoolThread( void* pData )
+{
+	struct WorkerPool* pPool = pData;
+
+	pthread_mutex_lock(&pPool->mMutex);
+	for( ;; )
+	{
+		while( !pPool->mpQueueHead && !pPool->mbQuit )
+			pthread_cond_wait(&pPool->mWorkCond, &pPool->mMutex);
+
+		// queued jobs are drained before the pool shuts down
+		struct ComposeJob* pJob = pPool->mpQueueHead;
+		if( !pJob )
+			break;
+
+		const struct ComposeTile tile = pJob->mpTiles[pJob->mNextTile++];
+		if( pJob->mNextTile == pJob->mTileCount )
+		{
+			pPool->mpQueueHead = pJob->mpNext;
+			if( !pPool->mpQueueHead )
+				pPool->mpQueueTail = NULL;
+		}
+		pthread_mutex_unlock(&pPool->mMutex);
+
+		struct ComposeStats stats = {0};
+		ComposeRect(
+			pJob->mpFramebuffer, pJob->mpItems, pJob->mItemCount, pJob->mpBackground, pJob->mpKernels,
+			tile.mX1, tile.mY1, tile.mX2, tile.mY2, &stats
+		);
+		atomic_fetch_add(&pJob->mOutputPixels, stats.mOutputPixels);
+		atomic_fetch_add(&pJob->mSourcePixels, stats.mSourcePixels);
+		atomic_fetch_add(&pJob->mCulledPixels, stats.mCulledPixels);
+
+		if( atomic_fetch_add(&pJob->mTilesDone, 1) + 1 == pJob->mTileCount )
+			WorkerPoolFinishJob(pPool, pJob);
+
+		pthread_mutex_lock(&pPool->mMutex);
+	}
+	pthread_mutex_unlock(&pPool->mMutex);
+	return NULL;
+}
+
+static int WorkerPoolInit( struct WorkerPool* pPool, uint32_t threadCount )
+{
+	memset(pPool, 0, sizeof(struct WorkerPool));
+	if( threadCount > WORKER_MAX_THREADS )
+		threadCount = WORKER_MAX_THREADS;
+
+	pPool->mEventFd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if( pPool->mEventFd == -1 )
+		return -1;
+
+	pthread_mutex_init(&pPool->mMutex, NULL);
+	pthread_cond_init(&pPool->mWorkCond, NULL);
+	pthread_cond_init(&pPool->mIdleCond, NULL);
+
+	for( uint32_t i = 0; i < threadCount; i++ )
+	{
+		if( pthread_create(&pPool->mThreads[i], NULL, WorkerPoolThread, pPool) != 0 )
+			break;
+		pPool->mThreadCount++;
+	}
+	return pPool->mThreadCount ? 0 : -1;
+}
+
+static void WorkerPoolFini( struct WorkerPool* pPool )
+{
+	pthread_mutex_lock(&pPool->mMutex);
+	pPool->mbQuit = 1;
+	pthread_cond_broadcast(&pPool->mWorkCond);
+	pthread_mutex_unlock(&pPool->mMutex);
+
+	for( uint32_t i = 0; i < pPool->mThreadCount; i++ )
+		pthread_join(pPool->mThreads[i], NULL);
+	pPool->mThreadCount = 0;
+
+	pthread_cond_destroy(&pPool->mIdleCond);
+	pthread_cond_destroy(&pPool->mWorkCond);
+	pthread_mutex_destroy(&pPool->mMutex);
+	close(pPool->mEventFd);
+}
+
+// The job and everything it points to belong to the workers until
+// WorkerPoolCollect hands it back
+static void WorkerPoolSubmit( struct WorkerPool* pPool, struct ComposeJob* pJob )
+{
+	pJob->mNextTile = 0;
+	pJob->mpNext = NULL;
+	atomic_store(&pJob->mTilesDone, 0);
+	atomic_store(&pJob->mOutputPixels, 0);
+	atomic_store(&pJob->mSourcePixels, 0);
+	atomic_store(&pJob->mCulledPixels, 0);
+	pJob->mSubmitNsec = GetTimeNsec();
+
+	pthread_mutex_lock(&pPool->mMutex);
+	pPool->mJobsRunning++;
+	if( pJob->mTileCount == 0 )
+	{
+		pthread_mutex_unlock(&pPool->mMutex);
+		WorkerPoolFinishJob(pPool, pJob);
+		return;
+	}
+
+	if( pPool->mpQueueTail )
+		pPool->mpQueueTail->mpNext = pJob;
+	else
+		pPool->mpQueueHead = pJob;
+	pPool->mpQueueTail = pJob;
+	pthread_cond_broadcast(&pPool->mWorkCond);
+	pthread_mutex_unlock(&pPool->mMutex);
+}
+
+// Next finished job, NULL when there is none
+static struct ComposeJob* WorkerPoolCollect( struct WorkerPool* pPool )
+{
+	pthread_mutex_lock(&pPool->mMutex);
+	struct ComposeJob* pJob = pPool->mpDoneHead;
+	if( pJob )
+	{
+		pPool->mpDoneHead = pJob->mpNext;
+		if( !pPool->mpDoneHead )
+			pPool->mpDoneTail = NULL;
+		pJob->mpNext = NULL;
+	}
+	pthread_mutex_unlock(&pPool->mMutex);
+	return pJob;
+}
+
+// Blocks until no worker reads from a job anymore, for the rare cases where
+// the dispatch thread is about to free memory a job may point to
+static void WorkerPoolWait( struct WorkerPool* pPool )
+{
+	if( !pPool )
+		return;
+
+	pthread_mutex_lock(&pPool->mMutex);
+	while( pPool->mJobsRunning )
+		pthread_cond_wait(&pPool->mIdleCond, &pPool->mMutex);
+	pthread_mutex_unlock(&pPool->mMutex);
+}
+
+static uint32_t GetDefaultWorkerCount()
+{
+	const long count = sysconf(_SC_NPROCESSORS_ONLN);
+	if( count < 1 )
+		return 1;
+	return count > WORKER_MAX_THREADS ? WORKER_MAX_THREADS : (uint32_t)count;
+}
+
+#endif
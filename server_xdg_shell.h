@@ -0,0 +1,991 @@
+#ifndef _SERVER_XDG_SHELL_H
+#define _SERVER_XDG_SHELL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <wayland-server.h>
+
+#include "xdg-shell-server-protocol.h"
+
+#include "server_client.h"
+#include "server_repaint.h"
+#include "server_state.h"
+#include "server_surface.h"
+
+// xdg_surface, xdg_toplevel, xdg_popup and xdg_positioner. Every state change
+// only marks its xdg_surface dirty, the configure events go out once per
+// repaint cycle so a client asking for maximized and fullscreen in the same
+// dispatch acks and redraws once. Without any output they go out at the end
+// of the dispatch.
+
+// Configure Batching
+
+static void server_xdg_configure_idle( void* pData )
+{
+	struct ServerState* pServer = pData;
+	pServer->mpXdgConfigureSource = NULL;
+	SendXdgConfigures(pServer);
+}
+
+// Without an output no repaint cycle runs, the queued configures go out at
+// the end of the dispatch instead
+static void ScheduleXdgConfigures( struct ServerState* pServer, struct OutputState* pOutput )
+{
+	if( pOutput )
+	{
+		ScheduleRepaint(pOutput);
+		return;
+	}
+
+	if( !pServer->mpXdgConfigureSource && !wl_list_empty(&pServer->mXdgConfigureList) )
+	{
+		pServer->mpXdgConfigureSource = wl_event_loop_add_idle(
+			pServer->mpEventLoop, server_xdg_configure_idle, pServer
+		);
+	}
+}
+
+static void XdgSurfaceScheduleConfigure( struct XdgSurface* pXdgSurface )
+{
+	struct ServerState* pServer = pXdgSurface->mpClientState->mpServer;
+	pServer->mXdgStats.mStateChanges++;
+
+	// nothing goes out before the initial commit
+	if( !pXdgSurface->mbInitialCommit || !wl_list_empty(&pXdgSurface->mConfigureLink) )
+		return;
+
+	wl_list_insert(pServer->mXdgConfigureList.prev, &pXdgSurface->mConfigureLink);
+	ScheduleXdgConfigures(pServer, pXdgSurface->mpSurface ? GetSurfaceOutput(pXdgSurface->mpSurface) : GetFirstOutput(pServer));
+}
+
+static void XdgSurfaceCancelConfigure( struct XdgSurface* pXdgSurface )
+{
+	wl_list_remove(&pXdgSurface->mConfigureLink);
+	wl_list_init(&pXdgSurface->mConfigureLink);
+}
+
+static void XdgToplevelSendConfigure( struct XdgSurface* pXdgSurface )
+{
+	const struct XdgToplevelState* pState = &pXdgSurface->mToplevelPending;
+
+	struct wl_array states;
+	wl_array_init(&states);
+
+	uint32_t* pStates = wl_array_add(&states, 3 * sizeof(uint32_t));
+	uint32_t count = 0;
+	if( pStates )
+	{
+		if( pState->mbMaximized )
+			pStates[count++] = XDG_TOPLEVEL_STATE_MAXIMIZED;
+		if( pState->mbFullscreen )
+			pStates[count++] = XDG_TOPLEVEL_STATE_FULLSCREEN;
+		if( pState->mbActivated )
+			pStates[count++] = XDG_TOPLEVEL_STATE_ACTIVATED;
+		states.size = count * sizeof(uint32_t);
+	}
+
+	xdg_toplevel_send_configure(pXdgSurface->mpRoleResource, pState->mWidth, pState->mHeight, &states);
+	wl_array_release(&states);
+
+	pXdgSurface->mToplevelSent = *pState;
+}
+
+static void XdgPopupSendConfigure( struct XdgSurface* pXdgSurface )
+{
+	if( pXdgSurface->mbRepositioned )
+	{
+		xdg_popup_send_repositioned(pXdgSurface->mpRoleResource, pXdgSurface->mRepositionToken);
+		pXdgSurface->mbRepositioned = 0;
+	}
+
+	const struct RegionBox* pBox = &pXdgSurface->mPopupBox;
+	xdg_popup_send_configure(
+		pXdgSurface->mpRoleResource, pBox->mX1, pBox->mY1,
+		pBox->mX2 - pBox->mX1, pBox->mY2 - pBox->mY1
+	);
+}
+
+static void SendXdgConfigures( struct ServerState* pServer )
+{
+	struct XdgSurface* pXdgSurface;
+	struct XdgSurface* pTmp;
+	wl_list_for_each_safe(pXdgSurface, pTmp, &pServer->mXdgConfigureList, mConfigureLink)
+	{
+		// stays queued, client_handle_writable schedules another cycle
+		if( ClientEventsPaused(pXdgSurface->mpClientState) )
+		{
+			pServer->mXdgStats.mHeldConfigures++;
+			continue;
+		}
+
+		XdgSurfaceCancelConfigure(pXdgSurface);
+		if( !pXdgSurface->mpRoleResource )
+			continue;
+
+		if( pXdgSurface->mRole == XDG_ROLE_TOPLEVEL )
+			XdgToplevelSendConfigure(pXdgSurface);
+		else if( pXdgSurface->mRole == XDG_ROLE_POPUP )
+			XdgPopupSendConfigure(pXdgSurface);
+
+		pXdgSurface->mLastSerial = wl_display_next_serial(pServer->mpDisplay);
+		pXdgSurface->mbConfigureSent = 1;
+		xdg_surface_send_configure(pXdgSurface->mpResource, pXdgSurface->mLastSerial);
+		pServer->mXdgStats.mConfigures++;
+	}
+}
+
+static void PrintXdgShellStats( const struct ServerState* pServer )
+{
+	const struct XdgShellStats* pStats = &pServer->mXdgStats;
+	printf("xdg-shell: %llu state changes in %llu configures, %llu held for paused clients\n",
+		(unsigned long long)pStats->mStateChanges,
+		(unsigned long long)pStats->mConfigures,
+		(unsigned long long)pStats->mHeldConfigures
+	);
+}
+
+// Positioner
+
+static void xdg_positioner_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pResource);
+	if( !pPositioner )
+		return;
+
+	wl_list_remove(&pPositioner->mLink);
+	SlabPoolFree(&pPositioner->mpClientState->mXdgPositionerPool, pPositioner);
+}
+
+static void xdg_positioner_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void xdg_positioner_handle_set_size(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t width, int32_t height
+)
+{
+	if( width <= 0 || height <= 0 )
+	{
+		wl_resource_post_error(pResource, XDG_POSITIONER_ERROR_INVALID_INPUT,
+			"positioner size must be positive (%dx%d specified)", width, height);
+		return;
+	}
+
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pResource);
+	pPositioner->mWidth = width;
+	pPositioner->mHeight = height;
+}
+
+static void xdg_positioner_handle_set_anchor_rect(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t x, int32_t y, int32_t width, int32_t height
+)
+{
+	if( width < 0 || height < 0 )
+	{
+		wl_resource_post_error(pResource, XDG_POSITIONER_ERROR_INVALID_INPUT,
+			"anchor rect size must not be negative (%dx%d specified)", width, height);
+		return;
+	}
+
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pResource);
+	pPositioner->mAnchorRect = RegionBoxFromRect(x, y, width, height);
+	pPositioner->mbAnchorRectSet = 1;
+}
+
+static void xdg_positioner_handle_set_anchor(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t anchor
+)
+{
+	if( anchor > XDG_POSITIONER_ANCHOR_BOTTOM_RIGHT )
+	{
+		wl_resource_post_error(pResource, XDG_POSITIONER_ERROR_INVALID_INPUT,
+			"invalid anchor %u", anchor);
+		return;
+	}
+
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pResource);
+	pPositioner->mAnchor = anchor;
+}
+
+static void xdg_positioner_handle_set_gravity(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t gravity
+)
+{
+	if( gravity > XDG_POSITIONER_GRAVITY_BOTTOM_RIGHT )
+	{
+		wl_resource_post_error(pResource, XDG_POSITIONER_ERROR_INVALID_INPUT,
+			"invalid gravity %u", gravity);
+		return;
+	}
+
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pResource);
+	pPositioner->mGravity = gravity;
+}
+
+static void xdg_positioner_handle_set_constraint_adjustment(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t adjustment
+)
+{
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pResource);
+	pPositioner->mConstraintAdjustment = adjustment;
+}
+
+static void xdg_positioner_handle_set_offset(
+	struct wl_client* pClient, struct wl_resource* pResource, int32_t x, int32_t y
+)
+{
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pResource);
+	pPositioner->mOffsetX = x;
+	pPositioner->mOffsetY = y;
+}
+
+// popups are placed once, there is nothing to react to or track
+static void xdg_positioner_handle_set_reactive( struct wl_client* pClient, struct wl_resource* pResource )
+{
+}
+
+static void xdg_positioner_handle_set_parent_size(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t width, int32_t height
+)
+{
+}
+
+static void xdg_positioner_handle_set_parent_configure(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t serial
+)
+{
+}
+
+static const struct xdg_positioner_interface xdg_positioner_impl = {
+	.destroy = xdg_positioner_handle_destroy,
+	.set_size = xdg_positioner_handle_set_size,
+	.set_anchor_rect = xdg_positioner_handle_set_anchor_rect,
+	.set_anchor = xdg_positioner_handle_set_anchor,
+	.set_gravity = xdg_positioner_handle_set_gravity,
+	.set_constraint_adjustment = xdg_positioner_handle_set_constraint_adjustment,
+	.set_offset = xdg_positioner_handle_set_offset,
+	.set_reactive = xdg_positioner_handle_set_reactive,
+	.set_parent_size = xdg_positioner_handle_set_parent_size,
+	.set_parent_configure = xdg_positioner_handle_set_parent_configure
+};
+
+static struct XdgPositioner* CreateXdgPositioner(
+	struct ClientState* pClientState, uint32_t version, uint32_t id
+)
+{
+	struct wl_client* pClient = pClientState->mpClient;
+	struct XdgPositioner* pPositioner = SlabPoolAlloc(&pClientState->mXdgPositionerPool);
+	if( !pPositioner )
+	{
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &xdg_positioner_interface, version, id
+	);
+	if( !pResource )
+	{
+		SlabPoolFree(&pClientState->mXdgPositionerPool, pPositioner);
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+	wl_resource_set_implementation(
+		pResource, &xdg_positioner_impl,
+		pPositioner, xdg_positioner_handle_resource_destroy
+	);
+
+	pPositioner->mpResource = pResource;
+	pPositioner->mpClientState = pClientState;
+	wl_list_insert(pClientState->mXdgPositionerList.prev, &pPositioner->mLink);
+	return pPositioner;
+}
+
+// Popup box relative to the parent's window geometry. Constraint adjustment
+// is not applied, a headless output has no edges a client could care about.
+static struct RegionBox XdgPositionerGetBox( const struct XdgPositioner* pPositioner )
+{
+	const struct RegionBox* pRect = &pPositioner->mAnchorRect;
+	const int32_t width = pPositioner->mWidth;
+	const int32_t height = pPositioner->mHeight;
+
+	// summed in 64 bit, the anchor rect and offset come from the client
+	int64_t x = ( (int64_t)pRect->mX1 + pRect->mX2 ) / 2;
+	int64_t y = ( (int64_t)pRect->mY1 + pRect->mY2 ) / 2;
+	switch( pPositioner->mAnchor )
+	{
+		case XDG_POSITIONER_ANCHOR_LEFT:
+		case XDG_POSITIONER_ANCHOR_TOP_LEFT:
+		case XDG_POSITIONER_ANCHOR_BOTTOM_LEFT:
+			x = pRect->mX1;
+			break;
+		case XDG_POSITIONER_ANCHOR_RIGHT:
+		case XDG_POSITIONER_ANCHOR_TOP_RIGHT:
+		case XDG_POSITIONER_ANCHOR_BOTTOM_RIGHT:
+			x = pRect->mX2;
+			break;
+	}
+	switch( pPositioner->mAnchor )
+	{
+		case XDG_POSITIONER_ANCHOR_TOP:
+		case XDG_POSITIONER_ANCHOR_TOP_LEFT:
+		case XDG_POSITIONER_ANCHOR_TOP_RIGHT:
+			y = pRect->mY1;
+			break;
+		case XDG_POSITIONER_ANCHOR_BOTTOM:
+		case XDG_POSITIONER_ANCHOR_BOTTOM_LEFT:
+		case XDG_POSITIONER_ANCHOR_BOTTOM_RIGHT:
+			y = pRect->mY2;
+			break;
+	}
+
+	// gravity is the direction the popup grows in from the anchor point
+	switch( pPositioner->mGravity )
+	{
+		case XDG_POSITIONER_GRAVITY_LEFT:
+		case XDG_POSITIONER_GRAVITY_TOP_LEFT:
+		case XDG_POSITIONER_GRAVITY_BOTTOM_LEFT:
+			x -= width;
+			break;
+		case XDG_POSITIONER_GRAVITY_RIGHT:
+		case XDG_POSITIONER_GRAVITY_TOP_RIGHT:
+		case XDG_POSITIONER_GRAVITY_BOTTOM_RIGHT:
+			break;
+		default:
+			x -= width / 2;
+			break;
+	}
+	switch( pPositioner->mGravity )
+	{
+		case XDG_POSITIONER_GRAVITY_TOP:
+		case XDG_POSITIONER_GRAVITY_TOP_LEFT:
+		case XDG_POSITIONER_GRAVITY_TOP_RIGHT:
+			y -= height;
+			break;
+		case XDG_POSITIONER_GRAVITY_BOTTOM:
+		case XDG_POSITIONER_GRAVITY_BOTTOM_LEFT:
+		case XDG_POSITIONER_GRAVITY_BOTTOM_RIGHT:
+			break;
+		default:
+			y -= height / 2;
+			break;
+	}
+
+	x += pPositioner->mOffsetX;
+	y += pPositioner->mOffsetY;
+	return RegionBoxFromRect(RegionClampEdge(x), RegionClampEdge(y), width, height);
+}
+
+static int8_t XdgPositionerIsComplete( const struct XdgPositioner* pPositioner )
+{
+	return pPositioner->mWidth > 0 && pPositioner->mHeight > 0 && pPositioner->mbAnchorRectSet;
+}
+
+// Destroying the role object or its xdg_surface hides the wl_surface until
+// the client goes through the initial commit and configure again
+static void XdgSurfaceUnmap( struct XdgSurface* pXdgSurface )
+{
+	struct Surface* pSurface = pXdgSurface->mpSurface;
+	if( pSurface && pXdgSurface->mbMapped )
+		DamageOutputRect(pXdgSurface->mpClientState->mpServer, pSurface->mX, pSurface->mY, pSurface->mWidth, pSurface->mHeight);
+
+	pXdgSurface->mbMapped = 0;
+	pXdgSurface->mbAcked = 0;
+	pXdgSurface->mbInitialCommit = 0;
+	XdgSurfaceCancelConfigure(pXdgSurface);
+
+	// subsurfaces go down with their parent
+	if( pSurface )
+		SubsurfaceRefreshChildren(pSurface);
+}
+
+// Toplevel
+
+static struct XdgSurface* XdgRoleGetSurface( struct wl_resource* pResource )
+{
+	return wl_resource_get_user_data(pResource);
+}
+
+static void xdg_toplevel_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mpRoleResource = NULL;
+	XdgSurfaceUnmap(pXdgSurface);
+}
+
+static void xdg_toplevel_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static void xdg_toplevel_handle_set_parent(
+	struct wl_client* pClient, struct wl_resource* pResource, struct wl_resource* pParent
+)
+{
+}
+
+static void xdg_toplevel_handle_set_title(
+	struct wl_client* pClient, struct wl_resource* pResource, const char* pTitle
+)
+{
+}
+
+static void xdg_toplevel_handle_set_app_id(
+	struct wl_client* pClient, struct wl_resource* pResource, const char* pAppId
+)
+{
+}
+
+// interactive requests need a seat, SampleServer does not have one
+static void xdg_toplevel_handle_show_window_menu(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pSeat, uint32_t serial, int32_t x, int32_t y
+)
+{
+}
+
+static void xdg_toplevel_handle_move(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pSeat, uint32_t serial
+)
+{
+}
+
+static void xdg_toplevel_handle_resize(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pSeat, uint32_t serial, uint32_t edges
+)
+{
+}
+
+static void xdg_toplevel_handle_set_max_size(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t width, int32_t height
+)
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mMaxWidth = width;
+	pXdgSurface->mMaxHeight = height;
+}
+
+static void xdg_toplevel_handle_set_min_size(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t width, int32_t height
+)
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mMinWidth = width;
+	pXdgSurface->mMinHeight = height;
+}
+
+// Maximized and fullscreen toplevels cover the output they are mostly on
+static void XdgToplevelUpdateSize( struct XdgSurface* pXdgSurface )
+{
+	struct XdgToplevelState* pState = &pXdgSurface->mToplevelPending;
+	const struct OutputState* pOutput = pXdgSurface->mpSurface ?
+		GetSurfaceOutput(pXdgSurface->mpSurface) : GetFirstOutput(pXdgSurface->mpClientState->mpServer);
+
+	if( pOutput && ( pState->mbMaximized || pState->mbFullscreen ) )
+	{
+		pState->mWidth = pOutput->mWidth;
+		pState->mHeight = pOutput->mHeight;
+	}
+	else
+		pState->mWidth = pState->mHeight = 0;
+
+	XdgSurfaceScheduleConfigure(pXdgSurface);
+}
+
+// An output changed size or went away, maximized and fullscreen toplevels
+// are sized again
+static void XdgOutputsChanged( struct ServerState* pServer )
+{
+	struct ClientState* pClientState;
+	wl_list_for_each(pClientState, &pServer->mClientList, mLink)
+	{
+		struct XdgSurface* pXdgSurface;
+		wl_list_for_each(pXdgSurface, &pClientState->mXdgSurfaceList, mLink)
+		{
+			const struct XdgToplevelState* pState = &pXdgSurface->mToplevelPending;
+			if( pXdgSurface->mRole == XDG_ROLE_TOPLEVEL && ( pState->mbMaximized || pState->mbFullscreen ) )
+				XdgToplevelUpdateSize(pXdgSurface);
+		}
+	}
+}
+
+static void xdg_toplevel_handle_set_maximized( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mToplevelPending.mbMaximized = 1;
+	XdgToplevelUpdateSize(pXdgSurface);
+}
+
+static void xdg_toplevel_handle_unset_maximized( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mToplevelPending.mbMaximized = 0;
+	XdgToplevelUpdateSize(pXdgSurface);
+}
+
+static void xdg_toplevel_handle_set_fullscreen(
+	struct wl_client* pClient, struct wl_resource* pResource, struct wl_resource* pOutput
+)
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mToplevelPending.mbFullscreen = 1;
+	XdgToplevelUpdateSize(pXdgSurface);
+}
+
+static void xdg_toplevel_handle_unset_fullscreen( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mToplevelPending.mbFullscreen = 0;
+	XdgToplevelUpdateSize(pXdgSurface);
+}
+
+static void xdg_toplevel_handle_set_minimized( struct wl_client* pClient, struct wl_resource* pResource )
+{
+}
+
+static const struct xdg_toplevel_interface xdg_toplevel_impl = {
+	.destroy = xdg_toplevel_handle_destroy,
+	.set_parent = xdg_toplevel_handle_set_parent,
+	.set_title = xdg_toplevel_handle_set_title,
+	.set_app_id = xdg_toplevel_handle_set_app_id,
+	.show_window_menu = xdg_toplevel_handle_show_window_menu,
+	.move = xdg_toplevel_handle_move,
+	.resize = xdg_toplevel_handle_resize,
+	.set_max_size = xdg_toplevel_handle_set_max_size,
+	.set_min_size = xdg_toplevel_handle_set_min_size,
+	.set_maximized = xdg_toplevel_handle_set_maximized,
+	.unset_maximized = xdg_toplevel_handle_unset_maximized,
+	.set_fullscreen = xdg_toplevel_handle_set_fullscreen,
+	.unset_fullscreen = xdg_toplevel_handle_unset_fullscreen,
+	.set_minimized = xdg_toplevel_handle_set_minimized
+};
+
+// Popup
+
+static void xdg_popup_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mpRoleResource = NULL;
+	pXdgSurface->mpParent = NULL;
+	XdgSurfaceUnmap(pXdgSurface);
+}
+
+static void xdg_popup_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+// without a seat there is no grab to take, the popup just stays up
+static void xdg_popup_handle_grab(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pSeat, uint32_t serial
+)
+{
+}
+
+static void xdg_popup_handle_reposition(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	struct wl_resource* pPositionerResource, uint32_t token
+)
+{
+	struct XdgSurface* pXdgSurface = XdgRoleGetSurface(pResource);
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pPositionerResource);
+	if( !pXdgSurface || !pPositioner )
+		return;
+
+	if( !XdgPositionerIsComplete(pPositioner) )
+	{
+		wl_resource_post_error(pXdgSurface->mpWmBase->mpResource, XDG_WM_BASE_ERROR_INVALID_POSITIONER,
+			"xdg_positioner@%u is incomplete", wl_resource_get_id(pPositionerResource));
+		return;
+	}
+
+	pXdgSurface->mPopupBox = XdgPositionerGetBox(pPositioner);
+	pXdgSurface->mRepositionToken = token;
+	pXdgSurface->mbRepositioned = 1;
+	XdgSurfaceScheduleConfigure(pXdgSurface);
+}
+
+static const struct xdg_popup_interface xdg_popup_impl = {
+	.destroy = xdg_popup_handle_destroy,
+	.grab = xdg_popup_handle_grab,
+	.reposition = xdg_popup_handle_reposition
+};
+
+// Popups of a parent that goes away are dismissed
+static void XdgSurfaceDismissChildren( struct XdgSurface* pParent )
+{
+	struct XdgSurface* pXdgSurface;
+	wl_list_for_each(pXdgSurface, &pParent->mpClientState->mXdgSurfaceList, mLink)
+	{
+		if( pXdgSurface->mpParent != pParent )
+			continue;
+
+		pXdgSurface->mpParent = NULL;
+		if( pXdgSurface->mpRoleResource )
+			xdg_popup_send_popup_done(pXdgSurface->mpRoleResource);
+	}
+}
+
+// Xdg Surface
+
+static int xdg_surface_role_pre_commit( struct Surface* pSurface )
+{
+	struct XdgSurface* pXdgSurface = pSurface->mpRoleData;
+	if( !pXdgSurface )
+		return 0;
+
+	if( pXdgSurface->mRole == XDG_ROLE_NONE )
+	{
+		wl_resource_post_error(pXdgSurface->mpResource, XDG_SURFACE_ERROR_NOT_CONSTRUCTED,
+			"xdg_surface@%u has no role object", wl_resource_get_id(pXdgSurface->mpResource));
+		return -1;
+	}
+
+	const struct SurfaceState* pPending = &pSurface->mPending;
+	if( pPending->mbNewBuffer && pPending->mpBuffer && !pXdgSurface->mbAcked )
+	{
+		wl_resource_post_error(pXdgSurface->mpResource, XDG_SURFACE_ERROR_UNCONFIGURED_BUFFER,
+			"buffer committed before the first configure was acked");
+		return -1;
+	}
+	return 0;
+}
+
+static void xdg_surface_role_commit( struct Surface* pSurface )
+{
+	struct XdgSurface* pXdgSurface = pSurface->mpRoleData;
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mGeometry = pXdgSurface->mPendingGeometry;
+
+	if( pXdgSurface->mRole == XDG_ROLE_POPUP && pXdgSurface->mpParent && pXdgSurface->mpParent->mpSurface )
+	{
+		const struct XdgSurface* pParent = pXdgSurface->mpParent;
+		pSurface->mX = SurfaceClampCoord(
+			(int64_t)pParent->mpSurface->mX + pParent->mGeometry.mX1 + pXdgSurface->mPopupBox.mX1 - pXdgSurface->mGeometry.mX1
+		);
+		pSurface->mY = SurfaceClampCoord(
+			(int64_t)pParent->mpSurface->mY + pParent->mGeometry.mY1 + pXdgSurface->mPopupBox.mY1 - pXdgSurface->mGeometry.mY1
+		);
+	}
+
+	if( !pXdgSurface->mbInitialCommit )
+	{
+		// the initial commit is answered with the first configure
+		pXdgSurface->mbInitialCommit = 1;
+		XdgSurfaceScheduleConfigure(pXdgSurface);
+	}
+	else if( pSurface->mBufferWidth > 0 )
+		pXdgSurface->mbMapped = 1;
+	else if( pXdgSurface->mbMapped )
+	{
+		// a NULL buffer unmaps, the client starts over with an initial commit
+		XdgSurfaceUnmap(pXdgSurface);
+	}
+}
+
+static int8_t xdg_surface_role_is_mapped( struct Surface* pSurface )
+{
+	const struct XdgSurface* pXdgSurface = pSurface->mpRoleData;
+	return pXdgSurface && pXdgSurface->mpRoleResource && pXdgSurface->mbAcked;
+}
+
+static void xdg_surface_role_destroy( struct Surface* pSurface )
+{
+	struct XdgSurface* pXdgSurface = pSurface->mpRoleData;
+	if( !pXdgSurface )
+		return;
+
+	pXdgSurface->mpSurface = NULL;
+	pSurface->mpRoleData = NULL;
+}
+
+static const struct SurfaceRole xdg_surface_role = {
+	.mpName = "xdg_surface",
+	.mPreCommit = xdg_surface_role_pre_commit,
+	.mCommit = xdg_surface_role_commit,
+	.mIsMapped = xdg_surface_role_is_mapped,
+	.mDestroy = xdg_surface_role_destroy
+};
+
+static void XdgSurfaceFree( struct XdgSurface* pXdgSurface )
+{
+	XdgSurfaceUnmap(pXdgSurface);
+	XdgSurfaceDismissChildren(pXdgSurface);
+
+	if( pXdgSurface->mpRoleResource )
+		wl_resource_set_user_data(pXdgSurface->mpRoleResource, NULL);
+	if( pXdgSurface->mpSurface )
+		pXdgSurface->mpSurface->mpRoleData = NULL;
+
+	wl_list_remove(&pXdgSurface->mLink);
+	SlabPoolFree(&pXdgSurface->mpClientState->mXdgSurfacePool, pXdgSurface);
+}
+
+static void xdg_surface_handle_resource_destroy( struct wl_resource* pResource )
+{
+	struct XdgSurface* pXdgSurface = wl_resource_get_user_data(pResource);
+	if( !pXdgSurface )
+		return;
+
+	if( pXdgSurface->mpWmBase )
+		pXdgSurface->mpWmBase->mSurfaceCount--;
+	XdgSurfaceFree(pXdgSurface);
+}
+
+static void xdg_surface_handle_destroy( struct wl_client* pClient, struct wl_resource* pResource )
+{
+	wl_resource_destroy(pResource);
+}
+
+static int XdgSurfaceSetRole( struct XdgSurface* pXdgSurface, int32_t role )
+{
+	if( pXdgSurface->mRole != XDG_ROLE_NONE )
+	{
+		wl_resource_post_error(pXdgSurface->mpResource, XDG_SURFACE_ERROR_ALREADY_CONSTRUCTED,
+			"xdg_surface@%u already has a role object", wl_resource_get_id(pXdgSurface->mpResource));
+		return -1;
+	}
+	if( !pXdgSurface->mpSurface )
+	{
+		wl_resource_post_error(pXdgSurface->mpWmBase->mpResource, XDG_WM_BASE_ERROR_INVALID_SURFACE_STATE,
+			"the wl_surface of xdg_surface@%u was destroyed", wl_resource_get_id(pXdgSurface->mpResource));
+		return -1;
+	}
+
+	pXdgSurface->mRole = role;
+	return 0;
+}
+
+static void xdg_surface_handle_get_toplevel(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t id
+)
+{
+	struct XdgSurface* pXdgSurface = wl_resource_get_user_data(pResource);
+	if( XdgSurfaceSetRole(pXdgSurface, XDG_ROLE_TOPLEVEL) == -1 )
+		return;
+
+	struct wl_resource* pToplevel = wl_resource_create(
+		pClient, &xdg_toplevel_interface, wl_resource_get_version(pResource), id
+	);
+	if( !pToplevel )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pToplevel, &xdg_toplevel_impl,
+		pXdgSurface, xdg_toplevel_handle_resource_destroy
+	);
+
+	pXdgSurface->mpRoleResource = pToplevel;
+	// headless and seatless, every toplevel counts as focused
+	pXdgSurface->mToplevelPending.mbActivated = 1;
+}
+
+static void xdg_surface_handle_get_popup(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t id,
+	struct wl_resource* pParentResource, struct wl_resource* pPositionerResource
+)
+{
+	struct XdgSurface* pXdgSurface = wl_resource_get_user_data(pResource);
+	struct XdgPositioner* pPositioner = wl_resource_get_user_data(pPositionerResource);
+
+	if( !pPositioner || !XdgPositionerIsComplete(pPositioner) )
+	{
+		wl_resource_post_error(pXdgSurface->mpWmBase->mpResource, XDG_WM_BASE_ERROR_INVALID_POSITIONER,
+			"xdg_positioner@%u is incomplete", wl_resource_get_id(pPositionerResource));
+		return;
+	}
+	if( XdgSurfaceSetRole(pXdgSurface, XDG_ROLE_POPUP) == -1 )
+		return;
+
+	struct wl_resource* pPopup = wl_resource_create(
+		pClient, &xdg_popup_interface, wl_resource_get_version(pResource), id
+	);
+	if( !pPopup )
+	{
+		wl_client_post_no_memory(pClient);
+		return;
+	}
+	wl_resource_set_implementation(
+		pPopup, &xdg_popup_impl,
+		pXdgSurface, xdg_popup_handle_resource_destroy
+	);
+
+	pXdgSurface->mpRoleResource = pPopup;
+	pXdgSurface->mpParent = pParentResource ? wl_resource_get_user_data(pParentResource) : NULL;
+	pXdgSurface->mPopupBox = XdgPositionerGetBox(pPositioner);
+}
+
+static void xdg_surface_handle_set_window_geometry(
+	struct wl_client* pClient, struct wl_resource* pResource,
+	int32_t x, int32_t y, int32_t width, int32_t height
+)
+{
+	struct XdgSurface* pXdgSurface = wl_resource_get_user_data(pResource);
+	if( width <= 0 || height <= 0 )
+	{
+		wl_resource_post_error(pXdgSurface->mpWmBase->mpResource, XDG_WM_BASE_ERROR_INVALID_SURFACE_STATE,
+			"window geometry must be positive (%dx%d specified)", width, height);
+		return;
+	}
+	// a clamped edge would silently shrink the geometry
+	if( (int64_t)x + width > INT32_MAX || (int64_t)y + height > INT32_MAX )
+	{
+		wl_resource_post_error(pXdgSurface->mpWmBase->mpResource, XDG_WM_BASE_ERROR_INVALID_SURFACE_STATE,
+			"window geometry %dx%d at %d,%d ends outside the coordinate range", width, height, x, y);
+		return;
+	}
+
+	pXdgSurface->mPendingGeometry = RegionBoxFromRect(x, y, width, height);
+}
+
+static void xdg_surface_handle_ack_configure(
+	struct wl_client* pClient, struct wl_resource* pResource, uint32_t serial
+)
+{
+	struct XdgSurface* pXdgSurface = wl_resource_get_user_data(pResource);
+
+	// serials wrap, compare them by distance; acks may skip configures but
+	// never go back or ahead of the last one sent
+	if( !pXdgSurface->mbConfigureSent ||
+		(int32_t)( serial - pXdgSurface->mLastSerial ) > 0 ||
+		( pXdgSurface->mbAcked && (int32_t)( serial - pXdgSurface->mAckedSerial ) < 0 ) )
+	{
+		wl_resource_post_error(pXdgSurface->mpWmBase->mpResource, XDG_WM_BASE_ERROR_INVALID_SURFACE_STATE,
+			"ack_configure with unknown serial %u", serial);
+		return;
+	}
+
+	pXdgSurface->mAckedSerial = serial;
+	pXdgSurface->mbAcked = 1;
+}
+
+static const struct xdg_surface_interface xdg_surface_impl = {
+	.destroy = xdg_surface_handle_destroy,
+	.get_toplevel = xdg_surface_handle_get_toplevel,
+	.get_popup = xdg_surface_handle_get_popup,
+	.set_window_geometry = xdg_surface_handle_set_window_geometry,
+	.ack_configure = xdg_surface_handle_ack_configure
+};
+
+static struct XdgSurface* CreateXdgSurface(
+	struct XdgWmBase* pXdgWmBase, uint32_t version, uint32_t id,
+	struct wl_resource* pSurfaceResource
+)
+{
+	struct ClientState* pClientState = pXdgWmBase->mpClientState;
+	struct wl_client* pClient = pClientState->mpClient;
+	struct Surface* pSurface = wl_resource_get_user_data(pSurfaceResource);
+
+	if( pSurface->mCurrent.mpBuffer || pSurface->mBufferWidth > 0 )
+	{
+		wl_resource_post_error(pXdgWmBase->mpResource, XDG_WM_BASE_ERROR_INVALID_SURFACE_STATE,
+			"wl_surface@%u already has a buffer", wl_resource_get_id(pSurfaceResource));
+		return NULL;
+	}
+
+	struct XdgSurface* pXdgSurface = SlabPoolAlloc(&pClientState->mXdgSurfacePool);
+	if( !pXdgSurface )
+	{
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+
+	if( SurfaceSetRole(pSurface, &xdg_surface_role, pXdgSurface, pXdgWmBase->mpResource, XDG_WM_BASE_ERROR_ROLE) == -1 )
+	{
+		SlabPoolFree(&pClientState->mXdgSurfacePool, pXdgSurface);
+		return NULL;
+	}
+
+	struct wl_resource* pResource = wl_resource_create(
+		pClient, &xdg_surface_interface, version, id
+	);
+	if( !pResource )
+	{
+		pSurface->mpRoleData = NULL;
+		SlabPoolFree(&pClientState->mXdgSurfacePool, pXdgSurface);
+		wl_client_post_no_memory(pClient);
+		return NULL;
+	}
+	wl_resource_set_implementation(
+		pResource, &xdg_surface_impl,
+		pXdgSurface, xdg_surface_handle_resource_destroy
+	);
+
+	pXdgSurface->mpResource = pResource;
+	pXdgSurface->mpSurface = pSurface;
+	pXdgSurface->mpClientState = pClientState;
+	pXdgSurface->mpWmBase = pXdgWmBase;
+	wl_list_init(&pXdgSurface->mConfigureLink);
+	wl_list_insert(pClientState->mXdgSurfaceList.prev, &pXdgSurface->mLink);
+	pXdgWmBase->mSurfaceCount++;
+
+	return pXdgSurface;
+}
+
+// Runs from the client destroy signal, before libwayland destroys the
+// resources that still point into the client's pools
+static void DetachClientXdgSurfaces( struct ClientState* pClientState )
+{
+	struct XdgSurface* pXdgSurface;
+	struct XdgSurface* pTmp;
+	// no popup_done for popups that go away with the client
+	wl_list_for_each(pXdgSurface, &pClientState->mXdgSurfaceList, mLink)
+		pXdgSurface->mpParent = NULL;
+
+	wl_list_for_each_safe(pXdgSurface, pTmp, &pClientState->mXdgSurfaceList, mLink)
+	{
+		wl_resource_set_user_data(pXdgSurface->mpResource, NULL);
+		pXdgSurface->mpWmBase = NULL;
+		XdgSurfaceFree(pXdgSurface);
+	}
+
+	struct XdgPositioner* pPositioner;
+	struct XdgPositioner* pPositionerTmp;
+	wl_list_for_each_safe(pPositioner, pPositionerTmp, &pClientState->mXdgPositionerList, mLink)
+	{
+		wl_resource_set_user_data(pPositioner->mpResource, NULL);
+		wl_list_remove(&pPositioner->mLink);
+		SlabPoolFree(&pClientState->mXdgPositionerPool, pPositioner);
+	}
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef _SHM_BUFFER_POOL_H
+#define _SHM_BUFFER_POOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "shm_helper.h"
+
+// N same sized wl_buffers carved out of one shm file, mapped once for the
+// lifetime of the pool. A frame takes a buffer the compositor released,
+// draws into it in place and attaches it; wl_buffer.release hands it back.
+// Compared to a new file, mapping and wl_shm_pool per frame this saves the
+// syscalls, the page faults of touching fresh pages and the compositor's
+// mmap of every new pool.
+
+#define SHM_POOL_MAX_BUFFERS 4
+
+struct ShmBufferPool;
+
+struct ShmBuffer
+{
+	struct ShmBufferPool* mpPool;
+	struct wl_buffer* mpWlBuffer;
+	uint32_t* mpPixels;
+	// attached and not released by the compositor yet
+	int8_t mbBusy;
+};
+
+struct ShmBufferPool
+{
+	struct wl_shm_pool* mpShmPool;
+	uint8_t* mpData;
+	size_t mSize;
+
+	int32_t mWidth, mHeight;
+	int32_t mStride;
+	uint32_t mFormat;
+
+	struct ShmBuffer mBuffers[SHM_POOL_MAX_BUFFERS];
+	uint32_t mBufferCount;
+
+	uint64_t mAcquired;
+	// frames that found every buffer still held by the compositor
+	uint64_t mExhausted;
+};
+
+// Maps a new shm file of size bytes read and write, returns its fd or -1
+static int MapShmFile( size_t size, uint8_t** ppData )
+{
+	int fd = allocate_shm_file(size);
+	if( fd == -1 )
+		return -1;
+
+	void* pData = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if( pData == MAP_FAILED )
+	{
+		close(fd);
+		return -1;
+	}
+	*ppData = pData;
+	return fd;
+}
+
+static void shm_pool_buffer_release( void* pData, struct wl_buffer* pWlBuffer )
+{
+	struct ShmBuffer* pBuffer = pData;
+	pBuffer->mbBusy = 0;
+}
+
+static const struct wl_buffer_listener shm_pool_buffer_listener = {
+	.release = shm_pool_buffer_release
+};
+
+static void DestroyShmBufferPool( struct ShmBufferPool* pPool )
+{
+	for( uint32_t i = 0; i < pPool->mBufferCount; i++ )
+	{
+		if( pPool->mBuffers[i].mpWlBuffer )
+			wl_buffer_destroy(pPool->mBuffers[i].mpWlBuffer);
+	}
+	if( pPool->mpShmPool )
+		wl_shm_pool_destroy(pPool->mpShmPool);
+	if( pPool->mpData )
+		munmap(pPool->mpData, pPool->mSize);
+	memset(pPool, 0, sizeof(struct ShmBufferPool));
+}
+
+// Maps the pool's file and lays the buffers out in it, without any protocol
+// objects yet. Returns the fd of the file or -1, count is clamped to
+// SHM_POOL_MAX_BUFFERS.
+static int MapShmBufferPool(
+	struct ShmBufferPool* pPool,
+	int32_t width, int32_t height, uint32_t format, uint32_t count
+)
+{
+	memset(pPool, 0, sizeof(struct ShmBufferPool));
+	if( count == 0 || count > SHM_POOL_MAX_BUFFERS )
+		count = SHM_POOL_MAX_BUFFERS;
+
+	pPool->mWidth = width;
+	pPool->mHeight = height;
+	pPool->mStride = width * 4;
+	pPool->mFormat = format;
+
+	const size_t bufferSize = (size_t)pPool->mStride * height;
+	pPool->mSize = bufferSize * count;
+
+	int fd = MapShmFile(pPool->mSize, &pPool->mpData);
+	if( fd == -1 )
+	{
+		printf("Failed to allocate shm file\n");
+		pPool->mpData = NULL;
+		return -1;
+	}
+
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		pPool->mBuffers[i].mpPool = pPool;
+		pPool->mBuffers[i].mpPixels = (uint32_t*)( pPool->mpData + bufferSize * i );
+	}
+	pPool->mBufferCount = count;
+	return fd;
+}
+
+// Returns 0 on success
+static int CreateShmBufferPool(
+	struct ShmBufferPool* pPool, struct wl_shm* pShm,
+	int32_t width, int32_t height, uint32_t format, uint32_t count
+)
+{
+	int fd = MapShmBufferPool(pPool, width, height, format, count);
+	if( fd == -1 )
+		return -1;
+
+	// the compositor keeps its own reference to the file
+	pPool->mpShmPool = wl_shm_create_pool(pShm, fd, (int32_t)pPool->mSize);
+	close(fd);
+
+	const size_t bufferSize = (size_t)pPool->mStride * height;
+	for( uint32_t i = 0; i < pPool->mBufferCount; i++ )
+	{
+		struct ShmBuffer* pBuffer = &pPool->mBuffers[i];
+		pBuffer->mpWlBuffer = wl_shm_pool_create_buffer(
+			pPool->mpShmPool, (int32_t)( bufferSize * i ),
+			width, height, pPool->mStride, format
+		);
+		wl_buffer_add_listener(pBuffer->mpWlBuffer, &shm_pool_buffer_listener, pBuffer);
+	}
+	return 0;
+}
+
+// A buffer the compositor does not hold, marked busy until its release. NULL
+// when every buffer is in use, skip the frame and try on the next one.
+static struct ShmBuffer* AcquireShmBuffer( struct ShmBufferPool* pPool )
+{
+	for( uint32_t i = 0; i < pPool->mBufferCount; i++ )
+	{
+		struct ShmBuffer* pBuffer = &pPool->mBuffers[i];
+		if( pBuffer->mbBusy )
+			continue;
+
+		pBuffer->mbBusy = 1;
+		pPool->mAcquired++;
+		return pBuffer;
+	}
+	pPool->mExhausted++;
+	return NULL;
+}
+
+#endif
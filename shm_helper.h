@@ -1,13 +1,60 @@
 #ifndef _SHM_HELPER_H
 #define _SHM_HELPER_H
 
-#define _POSIX_C_SOURCE 200112L
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
 #include <time.h>
 #include <unistd.h>
 
+// memfd, sealing and madvise values for libc headers older than the kernel,
+// or included after a strict feature macro hid them
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001u
+#endif
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002u
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004u
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#endif
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK 0x0002
+#endif
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0x08000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+
+// Flags of allocate_shm_file_flags and map_shm_file.
+// SHM_FILE_PREFAULT allocates every page of the file up front and maps it
+// populated, the first touch of a buffer then takes no page fault.
+// SHM_FILE_HUGEPAGES backs pools of at least SHM_HUGEPAGE_MIN_SIZE, several
+// 1080p buffers or a 4K one, with 2 MiB pages: hugetlbfs when the system
+// reserved any, transparent huge pages otherwise.
+#define SHM_FILE_PREFAULT (1u << 0)
+#define SHM_FILE_HUGEPAGES (1u << 1)
+
+#define SHM_HUGEPAGE_SIZE ((size_t)2 << 20)
+#define SHM_HUGEPAGE_MIN_SIZE (4 * SHM_HUGEPAGE_SIZE)
+
 static void randname(char *buf)
 {
 	struct timespec ts;
@@ -19,7 +66,9 @@ static void randname(char *buf)
 	}
 }
 
-static int create_shm_file(void)
+// Named POSIX shm, for kernels before memfd (3.17) and systems without it.
+// Clients starting together race for the same time derived names.
+static int create_shm_open_file(void)
 {
 	int retries = 100;
 	do {
@@ -35,20 +84,147 @@ static int create_shm_file(void)
 	return -1;
 }
 
-static int allocate_shm_file(size_t size)
+// Anonymous file that can be sealed, no name to pick and no unlink
+static int create_memfd_file(unsigned int flags)
+{
+#ifdef SYS_memfd_create
+	int fd;
+	do {
+		fd = (int)syscall(SYS_memfd_create, "wl_shm",
+			MFD_CLOEXEC | MFD_ALLOW_SEALING | flags);
+	} while (fd < 0 && errno == EINTR);
+	return fd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static int create_shm_file(void)
+{
+	int fd = create_memfd_file(0);
+	if (fd >= 0)
+		return fd;
+	return create_shm_open_file();
+}
+
+static int resize_shm_file(int fd, size_t size)
 {
-	int fd = create_shm_file();
-	if (fd < 0)
-		return -1;
 	int ret;
 	do {
 		ret = ftruncate(fd, size);
 	} while (ret < 0 && errno == EINTR);
-	if (ret < 0) {
+	return ret;
+}
+
+// Allocates the pages behind [offset, offset + size) now instead of one
+// fault at a time, growing the file when the range ends past it
+static int prefault_shm_range(int fd, size_t offset, size_t size)
+{
+	int ret;
+	do {
+		ret = posix_fallocate(fd, offset, size);
+	} while (ret == EINTR);
+	if (ret != 0) {
+		errno = ret;
+		return -1;
+	}
+	return 0;
+}
+
+static int prefault_shm_file(int fd, size_t size)
+{
+	return prefault_shm_range(fd, 0, size);
+}
+
+static int shm_file_is_hugetlb(int fd)
+{
+	struct statfs fs;
+	return fstatfs(fd, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC;
+}
+
+static int shm_file_wants_hugepages(size_t size, unsigned int flags)
+{
+	return (flags & SHM_FILE_HUGEPAGES) && size >= SHM_HUGEPAGE_MIN_SIZE;
+}
+
+// A hugetlbfs memfd of size rounded up to whole huge pages, -1 when the
+// kernel has no huge pages to give. hugetlbfs fails a fault it can't back
+// with SIGBUS, allocating the pages up front turns that into an error here.
+static int allocate_hugetlb_file(size_t size)
+{
+	int fd = create_memfd_file(MFD_HUGETLB);
+	if (fd < 0)
+		return -1;
+	if (resize_shm_file(fd, size) < 0 || prefault_shm_file(fd, size) < 0) {
 		close(fd);
 		return -1;
 	}
 	return fd;
 }
 
-#endif
\ No newline at end of file
+// Creates a shm file of *size bytes for a wl_shm_pool, see SHM_FILE_PREFAULT
+// and SHM_FILE_HUGEPAGES. A hugetlbfs file rounds *size up to whole huge
+// pages, pass the updated size to wl_shm_create_pool and map_shm_file.
+// memfds are sealed against shrinking so the compositor's mapping of the
+// pool can't fault past the end of the file.
+static int allocate_shm_file_flags(size_t *size, unsigned int flags)
+{
+	const int huge = shm_file_wants_hugepages(*size, flags);
+	int fd = -1;
+	if (huge) {
+		const size_t huge_size = (*size + SHM_HUGEPAGE_SIZE - 1) &
+			~(SHM_HUGEPAGE_SIZE - 1);
+		fd = allocate_hugetlb_file(huge_size);
+		if (fd >= 0)
+			*size = huge_size;
+	}
+
+	if (fd < 0) {
+		fd = create_shm_file();
+		if (fd < 0)
+			return -1;
+		// transparent huge pages are picked when the mapping is
+		// populated after its madvise, see map_shm_file
+		if (resize_shm_file(fd, *size) < 0 ||
+		    ((flags & SHM_FILE_PREFAULT) && !huge &&
+		     prefault_shm_file(fd, *size) < 0)) {
+			close(fd);
+			return -1;
+		}
+	}
+
+	// fails on shm_open files, they just stay unsealed
+	fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK);
+	return fd;
+}
+
+static int allocate_shm_file(size_t size)
+{
+	return allocate_shm_file_flags(&size, 0);
+}
+
+// Maps a file from allocate_shm_file_flags read and write with the same
+// flags, NULL on failure
+static void *map_shm_file(int fd, size_t size, unsigned int flags)
+{
+	if (!shm_file_wants_hugepages(size, flags)) {
+		const int populate = (flags & SHM_FILE_PREFAULT) ? MAP_POPULATE : 0;
+		void *data = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | populate, fd, 0);
+		return data == MAP_FAILED ? NULL : data;
+	}
+
+	void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED)
+		return NULL;
+	// a no-op on hugetlbfs, on shmem it takes effect where
+	// /sys/kernel/mm/transparent_hugepage/shmem_enabled is advise or always
+	madvise(data, size, MADV_HUGEPAGE);
+	// MADV_POPULATE_WRITE is 5.14+, older kernels fault on first touch
+	if (flags & SHM_FILE_PREFAULT)
+		madvise(data, size, MADV_POPULATE_WRITE);
+	return data;
+}
+
+#endif
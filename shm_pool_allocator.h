@@ -0,0 +1,338 @@
+#ifndef _SHM_POOL_ALLOCATOR_H
+#define _SHM_POOL_ALLOCATOR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <wayland-client.h>
+
+#include "shm_helper.h"
+
+// Buffers of any size and format sub-allocated from one shm file and one
+// wl_shm_pool, for clients with many small surfaces such as tooltips and
+// icons that would otherwise need a file, a mapping and a pool each. Freed
+// ranges go back to an address ordered free list, merged with their
+// neighbours, and are handed out again first fit. When no range fits, the
+// file grows with ftruncate, the compositor's mapping with wl_shm_pool.resize
+// and ours is remapped, so pixels are reached through ShmAllocationPixels and
+// never kept across an allocation.
+
+// offsets and sizes of allocations, keeps every row start cache line aligned
+// for strides that are
+#define SHM_ALLOC_ALIGN 64
+#define SHM_ALLOC_INITIAL_RANGES 16
+
+struct ShmPoolAllocator;
+
+struct ShmRange
+{
+	size_t mOffset;
+	size_t mSize;
+};
+
+struct ShmAllocation
+{
+	struct ShmPoolAllocator* mpAllocator;
+	// NULL for an allocator without a wl_shm_pool
+	struct wl_buffer* mpWlBuffer;
+	size_t mOffset;
+	size_t mSize;
+	int32_t mWidth, mHeight;
+	int32_t mStride;
+	uint32_t mFormat;
+};
+
+struct ShmPoolAllocator
+{
+	struct wl_shm_pool* mpShmPool;
+	int mFd;
+	uint8_t* mpData;
+	size_t mSize;
+	// the file grows in multiples of it, huge pages for SHM_FILE_HUGEPAGES
+	size_t mGranularity;
+	unsigned int mFlags;
+	// the file is on hugetlbfs, see ShmPoolGrow
+	int8_t mbHugetlb;
+
+	// sorted by offset, never two adjacent ones
+	struct ShmRange* mpFreeRanges;
+	uint32_t mFreeCount;
+	uint32_t mFreeCapacity;
+
+	size_t mLiveBytes;
+	size_t mPeakBytes;
+	uint32_t mLiveCount;
+	uint64_t mAllocations;
+	uint64_t mGrowths;
+};
+
+static size_t ShmAlignUp( size_t size, size_t align )
+{
+	return ( size + align - 1 ) / align * align;
+}
+
+static void* ShmAllocationPixels( const struct ShmAllocation* pAllocation )
+{
+	return pAllocation->mpAllocator->mpData + pAllocation->mOffset;
+}
+
+// Returns 0 on success
+static int ShmInsertFreeRange( struct ShmPoolAllocator* pAllocator, uint32_t index, size_t offset, size_t size )
+{
+	if( pAllocator->mFreeCount == pAllocator->mFreeCapacity )
+	{
+		const uint32_t capacity = pAllocator->mFreeCapacity ? pAllocator->mFreeCapacity * 2 : SHM_ALLOC_INITIAL_RANGES;
+		struct ShmRange* pRanges = realloc(pAllocator->mpFreeRanges, capacity * sizeof(struct ShmRange));
+		if( !pRanges )
+			return -1;
+		pAllocator->mpFreeRanges = pRanges;
+		pAllocator->mFreeCapacity = capacity;
+	}
+
+	struct ShmRange* pRanges = pAllocator->mpFreeRanges;
+	memmove(&pRanges[index + 1], &pRanges[index], ( pAllocator->mFreeCount - index ) * sizeof(struct ShmRange));
+	pRanges[index].mOffset = offset;
+	pRanges[index].mSize = size;
+	pAllocator->mFreeCount++;
+	return 0;
+}
+
+static void ShmRemoveFreeRange( struct ShmPoolAllocator* pAllocator, uint32_t index )
+{
+	struct ShmRange* pRanges = pAllocator->mpFreeRanges;
+	memmove(&pRanges[index], &pRanges[index + 1], ( pAllocator->mFreeCount - index - 1 ) * sizeof(struct ShmRange));
+	pAllocator->mFreeCount--;
+}
+
+// Returns [offset, offset + size) to the free list, merged with the ranges
+// right before and after it. Returns 0 on success.
+static int ShmReleaseRange( struct ShmPoolAllocator* pAllocator, size_t offset, size_t size )
+{
+	struct ShmRange* pRanges = pAllocator->mpFreeRanges;
+	uint32_t index = 0;
+	while( index < pAllocator->mFreeCount && pRanges[index].mOffset < offset )
+		index++;
+
+	const int8_t bMergePrev = index > 0 && pRanges[index - 1].mOffset + pRanges[index - 1].mSize == offset;
+	const int8_t bMergeNext = index < pAllocator->mFreeCount && offset + size == pRanges[index].mOffset;
+	if( bMergePrev && bMergeNext )
+	{
+		pRanges[index - 1].mSize += size + pRanges[index].mSize;
+		ShmRemoveFreeRange(pAllocator, index);
+		return 0;
+	}
+	if( bMergePrev )
+	{
+		pRanges[index - 1].mSize += size;
+		return 0;
+	}
+	if( bMergeNext )
+	{
+		pRanges[index].mOffset = offset;
+		pRanges[index].mSize += size;
+		return 0;
+	}
+	return ShmInsertFreeRange(pAllocator, index, offset, size);
+}
+
+// Maps a new file of at least size bytes with the flags of shm_helper.h,
+// without a wl_shm_pool. Returns 0 on success.
+static int InitShmPoolAllocator( struct ShmPoolAllocator* pAllocator, size_t size, unsigned int flags )
+{
+	memset(pAllocator, 0, sizeof(struct ShmPoolAllocator));
+	pAllocator->mFd = -1;
+	pAllocator->mFlags = flags;
+	pAllocator->mGranularity = ( flags & SHM_FILE_HUGEPAGES ) ? SHM_HUGEPAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+
+	size = ShmAlignUp(size ? size : 1, pAllocator->mGranularity);
+	pAllocator->mFd = allocate_shm_file_flags(&size, flags);
+	if( pAllocator->mFd == -1 )
+		return -1;
+	pAllocator->mbHugetlb = shm_file_is_hugetlb(pAllocator->mFd);
+
+	pAllocator->mpData = map_shm_file(pAllocator->mFd, size, flags);
+	if( !pAllocator->mpData || ShmInsertFreeRange(pAllocator, 0, 0, size) == -1 )
+	{
+		if( pAllocator->mpData )
+			munmap(pAllocator->mpData, size);
+		close(pAllocator->mFd);
+		pAllocator->mpData = NULL;
+		pAllocator->mFd = -1;
+		return -1;
+	}
+	pAllocator->mSize = size;
+	return 0;
+}
+
+// Returns 0 on success
+static int CreateShmPoolAllocator(
+	struct ShmPoolAllocator* pAllocator, struct wl_shm* pShm,
+	size_t size, unsigned int flags
+)
+{
+	if( InitShmPoolAllocator(pAllocator, size, flags) == -1 )
+		return -1;
+
+	// the fd stays open to grow the file, wl_shm_pool.resize sends no new one
+	pAllocator->mpShmPool = wl_shm_create_pool(pShm, pAllocator->mFd, (int32_t)pAllocator->mSize);
+	return 0;
+}
+
+// Grows the file so that a range of size bytes fits at its end. Returns 0 on
+// success, the pool stays as it was otherwise.
+static int ShmPoolGrow( struct ShmPoolAllocator* pAllocator, size_t size )
+{
+	// the free space already at the end counts towards it
+	size_t tailFree = 0;
+	if( pAllocator->mFreeCount )
+	{
+		const struct ShmRange* pLast = &pAllocator->mpFreeRanges[pAllocator->mFreeCount - 1];
+		if( pLast->mOffset + pLast->mSize == pAllocator->mSize )
+			tailFree = pLast->mSize;
+	}
+
+	// doubling keeps the number of resizes logarithmic in the final size
+	size_t newSize = pAllocator->mSize * 2;
+	if( newSize < pAllocator->mSize + size - tailFree )
+		newSize = pAllocator->mSize + size - tailFree;
+	newSize = ShmAlignUp(newSize, pAllocator->mGranularity);
+	if( newSize > INT32_MAX )
+		return -1;
+
+	// the new tail gets its pages up front where the rest of the file did:
+	// always on hugetlbfs, which raises SIGBUS on a fault it has no page for,
+	// and for SHM_FILE_PREFAULT unless map_shm_file populates huge pages.
+	// posix_fallocate grows the file along with it and leaves it as it was
+	// when the pages aren't there.
+	const size_t oldSize = pAllocator->mSize;
+	const int8_t bPrefault = pAllocator->mbHugetlb ||
+		( ( pAllocator->mFlags & SHM_FILE_PREFAULT ) && !shm_file_wants_hugepages(newSize, pAllocator->mFlags) );
+	if( bPrefault ? prefault_shm_range(pAllocator->mFd, oldSize, newSize - oldSize) == -1 :
+		resize_shm_file(pAllocator->mFd, newSize) == -1 )
+		return -1;
+	uint8_t* pData = map_shm_file(pAllocator->mFd, newSize, pAllocator->mFlags);
+	if( !pData )
+		return -1;
+	if( ShmReleaseRange(pAllocator, pAllocator->mSize, newSize - pAllocator->mSize) == -1 )
+	{
+		munmap(pData, newSize);
+		return -1;
+	}
+
+	munmap(pAllocator->mpData, pAllocator->mSize);
+	pAllocator->mpData = pData;
+	pAllocator->mSize = newSize;
+	pAllocator->mGrowths++;
+	if( pAllocator->mpShmPool )
+		wl_shm_pool_resize(pAllocator->mpShmPool, (int32_t)newSize);
+	return 0;
+}
+
+// Carves a stride * height buffer out of the pool, growing it when no free
+// range fits. Returns 0 on success.
+static int ShmPoolAlloc(
+	struct ShmPoolAllocator* pAllocator, struct ShmAllocation* pAllocation,
+	int32_t width, int32_t height, int32_t stride, uint32_t format
+)
+{
+	if( width <= 0 || height <= 0 || stride < width )
+		return -1;
+	const size_t size = ShmAlignUp((size_t)stride * height, SHM_ALLOC_ALIGN);
+
+	uint32_t index = 0;
+	while( index < pAllocator->mFreeCount && pAllocator->mpFreeRanges[index].mSize < size )
+		index++;
+	if( index == pAllocator->mFreeCount )
+	{
+		if( ShmPoolGrow(pAllocator, size) == -1 )
+			return -1;
+		// the end of the file, merged with whatever was free there
+		index = pAllocator->mFreeCount - 1;
+	}
+
+	struct ShmRange* pRange = &pAllocator->mpFreeRanges[index];
+	memset(pAllocation, 0, sizeof(struct ShmAllocation));
+	pAllocation->mpAllocator = pAllocator;
+	pAllocation->mOffset = pRange->mOffset;
+	pAllocation->mSize = size;
+	pAllocation->mWidth = width;
+	pAllocation->mHeight = height;
+	pAllocation->mStride = stride;
+	pAllocation->mFormat = format;
+
+	pRange->mOffset += size;
+	pRange->mSize -= size;
+	if( !pRange->mSize )
+		ShmRemoveFreeRange(pAllocator, index);
+
+	if( pAllocator->mpShmPool )
+	{
+		pAllocation->mpWlBuffer = wl_shm_pool_create_buffer(
+			pAllocator->mpShmPool, (int32_t)pAllocation->mOffset,
+			width, height, stride, format
+		);
+	}
+
+	pAllocator->mLiveBytes += size;
+	if( pAllocator->mLiveBytes > pAllocator->mPeakBytes )
+		pAllocator->mPeakBytes = pAllocator->mLiveBytes;
+	pAllocator->mLiveCount++;
+	pAllocator->mAllocations++;
+	return 0;
+}
+
+// Destroys the wl_buffer and hands its range to the next allocation. Only
+// free a buffer the compositor released, it may still read from it before.
+static void ShmPoolFree( struct ShmAllocation* pAllocation )
+{
+	struct ShmPoolAllocator* pAllocator = pAllocation->mpAllocator;
+	if( !pAllocator )
+		return;
+
+	if( pAllocation->mpWlBuffer )
+		wl_buffer_destroy(pAllocation->mpWlBuffer);
+	// without room for a new range the bytes stay lost until the pool goes
+	ShmReleaseRange(pAllocator, pAllocation->mOffset, pAllocation->mSize);
+
+	pAllocator->mLiveBytes -= pAllocation->mSize;
+	pAllocator->mLiveCount--;
+	memset(pAllocation, 0, sizeof(struct ShmAllocation));
+}
+
+// Allocations still live must not be used afterwards, their wl_buffers are
+// the caller's to destroy
+static void DestroyShmPoolAllocator( struct ShmPoolAllocator* pAllocator )
+{
+	if( pAllocator->mpShmPool )
+		wl_shm_pool_destroy(pAllocator->mpShmPool);
+	if( pAllocator->mpData )
+		munmap(pAllocator->mpData, pAllocator->mSize);
+	if( pAllocator->mFd != -1 )
+		close(pAllocator->mFd);
+	free(pAllocator->mpFreeRanges);
+	memset(pAllocator, 0, sizeof(struct ShmPoolAllocator));
+	pAllocator->mFd = -1;
+}
+
+static void PrintShmPoolAllocatorStats( const struct ShmPoolAllocator* pAllocator )
+{
+	size_t freeBytes = 0;
+	size_t largestFree = 0;
+	for( uint32_t i = 0; i < pAllocator->mFreeCount; i++ )
+	{
+		freeBytes += pAllocator->mpFreeRanges[i].mSize;
+		if( pAllocator->mpFreeRanges[i].mSize > largestFree )
+			largestFree = pAllocator->mpFreeRanges[i].mSize;
+	}
+
+	printf("Shm pool: %zu bytes, %u live allocations of %zu bytes (peak %zu), %llu allocated, %llu growths, %u free ranges of %zu bytes, largest %zu\n",
+		pAllocator->mSize, pAllocator->mLiveCount, pAllocator->mLiveBytes, pAllocator->mPeakBytes,
+		(unsigned long long)pAllocator->mAllocations, (unsigned long long)pAllocator->mGrowths,
+		pAllocator->mFreeCount, freeBytes, largestFree
+	);
+}
+
+#endif
@@ -0,0 +1,623 @@
+#ifndef _SHM_RASTER_H
+#define _SHM_RASTER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RASTER_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RASTER_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+// CPU raster kernels for drawing shm frames, 32bpp pixels in wl_shm little
+// endian layout (B, G, R, A in memory). Colors with alpha are premultiplied
+// as wl_shm expects, blending is "over": dst = src + dst * ( 255 - src.a ) / 255.
+// Each kernel set draws whole rows, the Raster* functions below clip a
+// rectangle to the image and walk its rows. The set is picked once at
+// startup with SelectRasterKernels, AVX2 when the CPU reports it, NEON on
+// ARM and plain C everywhere else.
+
+struct RasterImage
+{
+	uint32_t* mpPixels;
+	int32_t mWidth, mHeight;
+	// bytes
+	int32_t mStride;
+};
+
+typedef void (*RasterFillRowFunc)( uint32_t* pDst, uint32_t color, int32_t count );
+// Pixel i is color1 where bit cellShift of phase + i is set, color0 otherwise
+typedef void (*RasterCheckerRowFunc)(
+	uint32_t* pDst, uint32_t phase, uint32_t cellShift,
+	uint32_t color0, uint32_t color1, int32_t count
+);
+// Pixel i blends color0 into color1 by t + i * dt, 16.16 and clamped to [0, 1]
+typedef void (*RasterGradientRowFunc)(
+	uint32_t* pDst, uint32_t color0, uint32_t color1,
+	int32_t t, int32_t dt, int32_t count
+);
+typedef void (*RasterCopyRowFunc)( uint32_t* pDst, const uint32_t* pSrc, int32_t count );
+typedef void (*RasterBlendRowFunc)( uint32_t* pDst, const uint32_t* pSrc, int32_t count );
+
+struct RasterKernels
+{
+	const char* mpName;
+	RasterFillRowFunc mFillRow;
+	RasterCheckerRowFunc mCheckerRow;
+	RasterGradientRowFunc mGradientRow;
+	RasterCopyRowFunc mCopyRow;
+	RasterBlendRowFunc mBlendRow;
+};
+
+static inline uint32_t RasterDiv255( uint32_t x )
+{
+	x += 128;
+	return ( x + ( x >> 8 ) ) >> 8;
+}
+
+// a + ( b - a ) * f / 256 on every channel for f in [0, 256], two channels
+// per multiply
+static inline uint32_t RasterLerpPixel( uint32_t a, uint32_t b, uint32_t f )
+{
+	const uint32_t rb = ( ( a & 0x00FF00FF ) * ( 256 - f ) + ( b & 0x00FF00FF ) * f + 0x00800080 ) >> 8;
+	const uint32_t ag = ( ( a >> 8 ) & 0x00FF00FF ) * ( 256 - f ) + ( ( b >> 8 ) & 0x00FF00FF ) * f + 0x00800080;
+	return ( rb & 0x00FF00FF ) | ( ag & 0xFF00FF00 );
+}
+
+// a / b rounded down, b > 0
+static inline int64_t RasterFloorDiv( int64_t a, int64_t b )
+{
+	return a >= 0 ? a / b : -( ( -a + b - 1 ) / b );
+}
+
+static inline int32_t RasterClampT( int32_t t )
+{
+	return t < 0 ? 0 : ( t > 0x10000 ? 0x10000 : t );
+}
+
+// Scalar
+
+static void RasterFillRowScalar( uint32_t* pDst, uint32_t color, int32_t count )
+{
+	for( int32_t i = 0; i < count; i++ )
+		pDst[i] = color;
+}
+
+static void RasterCheckerRowScalar(
+	uint32_t* pDst, uint32_t phase, uint32_t cellShift,
+	uint32_t color0, uint32_t color1, int32_t count
+)
+{
+	// a mask instead of a branch, the compiler keeps it vectorizable
+	const uint32_t diff = color0 ^ color1;
+	for( int32_t i = 0; i < count; i++ )
+		pDst[i] = color0 ^ ( diff & -( ( ( phase + (uint32_t)i ) >> cellShift ) & 1 ) );
+}
+
+static void RasterGradientRowScalar(
+	uint32_t* pDst, uint32_t color0, uint32_t color1,
+	int32_t t, int32_t dt, int32_t count
+)
+{
+	for( int32_t i = 0; i < count; i++, t += dt )
+		pDst[i] = RasterLerpPixel(color0, color1, (uint32_t)RasterClampT(t) >> 8);
+}
+
+static void RasterCopyRowScalar( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	memcpy(pDst, pSrc, (size_t)count * sizeof(uint32_t));
+}
+
+static void RasterBlendRowScalar( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	for( int32_t i = 0; i < count; i++ )
+	{
+		const uint32_t s = pSrc[i];
+		const uint32_t a = s >> 24;
+
+		if( a == 0xFF )
+		{
+			pDst[i] = s;
+			continue;
+		}
+		if( s == 0 )
+			continue;
+
+		const uint32_t d = pDst[i];
+		const uint32_t inv = 255 - a;
+		uint32_t out = 0;
+		for( int shift = 0; shift < 32; shift += 8 )
+		{
+			uint32_t c = ( ( s >> shift ) & 0xFF ) + RasterDiv255( ( ( d >> shift ) & 0xFF ) * inv );
+			out |= ( c > 255 ? 255 : c ) << shift;
+		}
+		pDst[i] = out;
+	}
+}
+
+#ifdef RASTER_HAVE_X86
+
+// AVX2, 8 pixels per iteration, only selected when the CPU reports it
+
+__attribute__((target("avx2")))
+static void RasterFillRowAVX2( uint32_t* pDst, uint32_t color, int32_t count )
+{
+	const __m256i c = _mm256_set1_epi32((int32_t)color);
+	int32_t i = 0;
+
+	for( ; i + 32 <= count; i += 32 )
+	{
+		_mm256_storeu_si256((__m256i*)( pDst + i ), c);
+		_mm256_storeu_si256((__m256i*)( pDst + i + 8 ), c);
+		_mm256_storeu_si256((__m256i*)( pDst + i + 16 ), c);
+		_mm256_storeu_si256((__m256i*)( pDst + i + 24 ), c);
+	}
+	for( ; i + 8 <= count; i += 8 )
+		_mm256_storeu_si256((__m256i*)( pDst + i ), c);
+
+	RasterFillRowScalar(pDst + i, color, count - i);
+}
+
+__attribute__((target("avx2")))
+static void RasterCheckerRowAVX2(
+	uint32_t* pDst, uint32_t phase, uint32_t cellShift,
+	uint32_t color0, uint32_t color1, int32_t count
+)
+{
+	const __m256i c0 = _mm256_set1_epi32((int32_t)color0);
+	const __m256i c1 = _mm256_set1_epi32((int32_t)color1);
+	const __m256i bit = _mm256_set1_epi32((int32_t)( 1u << cellShift ));
+	const __m256i step = _mm256_set1_epi32(8);
+	__m256i index = _mm256_add_epi32(_mm256_set1_epi32((int32_t)phase), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+	{
+		const __m256i set = _mm256_cmpeq_epi32(_mm256_and_si256(index, bit), bit);
+		_mm256_storeu_si256((__m256i*)( pDst + i ), _mm256_blendv_epi8(c0, c1, set));
+		index = _mm256_add_epi32(index, step);
+	}
+
+	RasterCheckerRowScalar(pDst + i, phase + (uint32_t)i, cellShift, color0, color1, count - i);
+}
+
+__attribute__((target("avx2")))
+static void RasterGradientRowAVX2(
+	uint32_t* pDst, uint32_t color0, uint32_t color1,
+	int32_t t, int32_t dt, int32_t count
+)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i one = _mm256_set1_epi32(0x10000);
+	const __m256i c256 = _mm256_set1_epi16(256);
+	const __m256i c128 = _mm256_set1_epi16(128);
+	// two pixels of 16 bit channels, the layout unpacklo and unpackhi produce
+	const __m256i a = _mm256_unpacklo_epi8(_mm256_set1_epi32((int32_t)color0), zero);
+	const __m256i b = _mm256_unpacklo_epi8(_mm256_set1_epi32((int32_t)color1), zero);
+	const __m256i step = _mm256_set1_epi32(dt * 8);
+	__m256i tv = _mm256_add_epi32(
+		_mm256_set1_epi32(t),
+		_mm256_mullo_epi32(_mm256_set1_epi32(dt), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7))
+	);
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+	{
+		// the weight of every pixel repeated over its four 16 bit channels
+		__m256i w = _mm256_srli_epi32(_mm256_min_epi32(_mm256_max_epi32(tv, zero), one), 8);
+		w = _mm256_or_si256(w, _mm256_slli_epi32(w, 16));
+		const __m256i wLo = _mm256_unpacklo_epi32(w, w);
+		const __m256i wHi = _mm256_unpackhi_epi32(w, w);
+
+		// a * ( 256 - w ) + b * w stays below 2^16
+		__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(a, _mm256_sub_epi16(c256, wLo)), _mm256_mullo_epi16(b, wLo));
+		__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(a, _mm256_sub_epi16(c256, wHi)), _mm256_mullo_epi16(b, wHi));
+		lo = _mm256_srli_epi16(_mm256_add_epi16(lo, c128), 8);
+		hi = _mm256_srli_epi16(_mm256_add_epi16(hi, c128), 8);
+
+		_mm256_storeu_si256((__m256i*)( pDst + i ), _mm256_packus_epi16(lo, hi));
+		tv = _mm256_add_epi32(tv, step);
+	}
+
+	RasterGradientRowScalar(pDst + i, color0, color1, t + dt * i, dt, count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i RasterBlendOverAVX2( __m256i s, __m256i d )
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i c255 = _mm256_set1_epi16(255);
+	const __m256i c128 = _mm256_set1_epi16(128);
+
+	__m256i sLo = _mm256_unpacklo_epi8(s, zero);
+	__m256i sHi = _mm256_unpackhi_epi8(s, zero);
+	__m256i dLo = _mm256_unpacklo_epi8(d, zero);
+	__m256i dHi = _mm256_unpackhi_epi8(d, zero);
+
+	__m256i aLo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sLo, 0xFF), 0xFF);
+	__m256i aHi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(sHi, 0xFF), 0xFF);
+	aLo = _mm256_sub_epi16(c255, aLo);
+	aHi = _mm256_sub_epi16(c255, aHi);
+
+	dLo = _mm256_add_epi16(_mm256_mullo_epi16(dLo, aLo), c128);
+	dHi = _mm256_add_epi16(_mm256_mullo_epi16(dHi, aHi), c128);
+	dLo = _mm256_srli_epi16(_mm256_add_epi16(dLo, _mm256_srli_epi16(dLo, 8)), 8);
+	dHi = _mm256_srli_epi16(_mm256_add_epi16(dHi, _mm256_srli_epi16(dHi, 8)), 8);
+
+	// unpack and pack both work per 128 bit lane, so the pixel order survives
+	return _mm256_adds_epu8(s, _mm256_packus_epi16(dLo, dHi));
+}
+
+__attribute__((target("avx2")))
+static void RasterBlendRowAVX2( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	const __m256i alphaMask = _mm256_set1_epi32((int32_t)0xFF000000);
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i*)( pSrc + i ));
+		__m256i alpha = _mm256_and_si256(s, alphaMask);
+
+		if( (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(alpha, alphaMask)) == 0xFFFFFFFFu )
+		{
+			_mm256_storeu_si256((__m256i*)( pDst + i ), s);
+			continue;
+		}
+		if( _mm256_testz_si256(s, s) )
+			continue;
+
+		__m256i d = _mm256_loadu_si256((const __m256i*)( pDst + i ));
+		_mm256_storeu_si256((__m256i*)( pDst + i ), RasterBlendOverAVX2(s, d));
+	}
+
+	RasterBlendRowScalar(pDst + i, pSrc + i, count - i);
+}
+
+#endif
+
+#ifdef RASTER_HAVE_NEON
+
+// NEON, 4 pixels per iteration, 8 where channels are de-interleaved
+
+static void RasterFillRowNEON( uint32_t* pDst, uint32_t color, int32_t count )
+{
+	const uint32x4_t c = vdupq_n_u32(color);
+	int32_t i = 0;
+
+	for( ; i + 16 <= count; i += 16 )
+	{
+		vst1q_u32(pDst + i, c);
+		vst1q_u32(pDst + i + 4, c);
+		vst1q_u32(pDst + i + 8, c);
+		vst1q_u32(pDst + i + 12, c);
+	}
+	for( ; i + 4 <= count; i += 4 )
+		vst1q_u32(pDst + i, c);
+
+	RasterFillRowScalar(pDst + i, color, count - i);
+}
+
+static void RasterCheckerRowNEON(
+	uint32_t* pDst, uint32_t phase, uint32_t cellShift,
+	uint32_t color0, uint32_t color1, int32_t count
+)
+{
+	static const uint32_t lanes[4] = { 0, 1, 2, 3 };
+	const uint32x4_t c0 = vdupq_n_u32(color0);
+	const uint32x4_t c1 = vdupq_n_u32(color1);
+	const uint32x4_t bit = vdupq_n_u32(1u << cellShift);
+	const uint32x4_t step = vdupq_n_u32(4);
+	uint32x4_t index = vaddq_u32(vdupq_n_u32(phase), vld1q_u32(lanes));
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+	{
+		vst1q_u32(pDst + i, vbslq_u32(vtstq_u32(index, bit), c1, c0));
+		index = vaddq_u32(index, step);
+	}
+
+	RasterCheckerRowScalar(pDst + i, phase + (uint32_t)i, cellShift, color0, color1, count - i);
+}
+
+// Two pixels, w0 and w1 in [0, 256] repeated over their four channels
+static inline uint8x8_t RasterLerpNEON( uint16x8_t a, uint16x8_t b, uint16x8_t w )
+{
+	uint16x8_t t = vmulq_u16(a, vsubq_u16(vdupq_n_u16(256), w));
+	t = vmlaq_u16(t, b, w);
+	return vrshrn_n_u16(t, 8);
+}
+
+static void RasterGradientRowNEON(
+	uint32_t* pDst, uint32_t color0, uint32_t color1,
+	int32_t t, int32_t dt, int32_t count
+)
+{
+	static const int32_t lanes[4] = { 0, 1, 2, 3 };
+	const uint16x8_t a = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(color0)));
+	const uint16x8_t b = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(color1)));
+	const int32x4_t zero = vdupq_n_s32(0);
+	const int32x4_t one = vdupq_n_s32(0x10000);
+	const int32x4_t step = vdupq_n_s32(dt * 4);
+	int32x4_t tv = vmlaq_s32(vdupq_n_s32(t), vdupq_n_s32(dt), vld1q_s32(lanes));
+	int32_t i = 0;
+
+	for( ; i + 4 <= count; i += 4 )
+	{
+		const uint32x4_t w32 = vshrq_n_u32(vreinterpretq_u32_s32(vminq_s32(vmaxq_s32(tv, zero), one)), 8);
+		const uint16x4_t w16 = vmovn_u32(w32);
+		// w0 w0 w1 w1 and w2 w2 w3 w3, then each weight four times
+		const uint16x4x2_t pairs = vzip_u16(w16, w16);
+		const uint16x4x2_t lo = vzip_u16(pairs.val[0], pairs.val[0]);
+		const uint16x4x2_t hi = vzip_u16(pairs.val[1], pairs.val[1]);
+
+		const uint8x8_t p01 = RasterLerpNEON(a, b, vcombine_u16(lo.val[0], lo.val[1]));
+		const uint8x8_t p23 = RasterLerpNEON(a, b, vcombine_u16(hi.val[0], hi.val[1]));
+		vst1q_u32(pDst + i, vreinterpretq_u32_u8(vcombine_u8(p01, p23)));
+		tv = vaddq_s32(tv, step);
+	}
+
+	RasterGradientRowScalar(pDst + i, color0, color1, t + dt * i, dt, count - i);
+}
+
+static void RasterBlendRowNEON( uint32_t* pDst, const uint32_t* pSrc, int32_t count )
+{
+	int32_t i = 0;
+
+	for( ; i + 8 <= count; i += 8 )
+	{
+		uint8x8x4_t s = vld4_u8((const uint8_t*)( pSrc + i ));
+
+		if( vget_lane_u64(vreinterpret_u64_u8(vmvn_u8(s.val[3])), 0) == 0 )
+		{
+			vst4_u8((uint8_t*)( pDst + i ), s);
+			continue;
+		}
+
+		uint8x8x4_t d = vld4_u8((const uint8_t*)( pDst + i ));
+		uint8x8_t inv = vmvn_u8(s.val[3]);
+
+		for( int c = 0; c < 4; c++ )
+		{
+			uint16x8_t t = vmull_u8(d.val[c], inv);
+			d.val[c] = vqadd_u8(s.val[c], vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8));
+		}
+		vst4_u8((uint8_t*)( pDst + i ), d);
+	}
+
+	RasterBlendRowScalar(pDst + i, pSrc + i, count - i);
+}
+
+#endif
+
+// copies are memcpy in every set, libc already picks the widest moves the CPU
+// has and a loop of vector loads and stores only matched it
+
+static const struct RasterKernels g_rasterKernelsScalar = {
+	"scalar", RasterFillRowScalar, RasterCheckerRowScalar,
+	RasterGradientRowScalar, RasterCopyRowScalar, RasterBlendRowScalar
+};
+
+#ifdef RASTER_HAVE_X86
+static const struct RasterKernels g_rasterKernelsAVX2 = {
+	"avx2", RasterFillRowAVX2, RasterCheckerRowAVX2,
+	RasterGradientRowAVX2, RasterCopyRowScalar, RasterBlendRowAVX2
+};
+#endif
+
+#ifdef RASTER_HAVE_NEON
+static const struct RasterKernels g_rasterKernelsNEON = {
+	"neon", RasterFillRowNEON, RasterCheckerRowNEON,
+	RasterGradientRowNEON, RasterCopyRowScalar, RasterBlendRowNEON
+};
+#endif
+
+// Fills ppKernels with every kernel set the running CPU supports, fastest
+// first, and returns how many were written.
+static int32_t GetSupportedRasterKernels( const struct RasterKernels** ppKernels, int32_t maxCount )
+{
+	int32_t count = 0;
+
+#ifdef RASTER_HAVE_X86
+	__builtin_cpu_init();
+	if( count < maxCount && __builtin_cpu_supports("avx2") )
+		ppKernels[count++] = &g_rasterKernelsAVX2;
+#endif
+#ifdef RASTER_HAVE_NEON
+	if( count < maxCount )
+		ppKernels[count++] = &g_rasterKernelsNEON;
+#endif
+	if( count < maxCount )
+		ppKernels[count++] = &g_rasterKernelsScalar;
+
+	return count;
+}
+
+// The set called pName when the CPU supports it, the fastest one otherwise
+static const struct RasterKernels* SelectRasterKernels( const char* pName )
+{
+	const struct RasterKernels* pKernels[3];
+	const int32_t count = GetSupportedRasterKernels(pKernels, 3);
+
+	if( pName )
+	{
+		for( int32_t i = 0; i < count; i++ )
+		{
+			if( strcmp(pKernels[i]->mpName, pName) == 0 )
+				return pKernels[i];
+		}
+	}
+	return pKernels[0];
+}
+
+// Drawing
+
+static inline uint32_t* RasterRow( const struct RasterImage* pImage, int32_t y )
+{
+	return (uint32_t*)( (uint8_t*)pImage->mpPixels + (size_t)y * pImage->mStride );
+}
+
+// Clips the rectangle to the image, returns 0 when nothing is left
+static int8_t RasterClip( const struct RasterImage* pImage, int32_t* pX, int32_t* pY, int32_t* pWidth, int32_t* pHeight )
+{
+	int32_t x0 = *pX, y0 = *pY;
+	int32_t x1 = x0 + *pWidth, y1 = y0 + *pHeight;
+	if( x0 < 0 ) x0 = 0;
+	if( y0 < 0 ) y0 = 0;
+	if( x1 > pImage->mWidth ) x1 = pImage->mWidth;
+	if( y1 > pImage->mHeight ) y1 = pImage->mHeight;
+	if( x0 >= x1 || y0 >= y1 )
+		return 0;
+
+	*pX = x0;
+	*pY = y0;
+	*pWidth = x1 - x0;
+	*pHeight = y1 - y0;
+	return 1;
+}
+
+static void RasterFillRect(
+	const struct RasterKernels* pKernels, const struct RasterImage* pImage,
+	int32_t x, int32_t y, int32_t width, int32_t height, uint32_t color
+)
+{
+	if( !RasterClip(pImage, &x, &y, &width, &height) )
+		return;
+
+	for( int32_t row = y; row < y + height; row++ )
+		pKernels->mFillRow(RasterRow(pImage, row) + x, color, width);
+}
+
+static void RasterFill( const struct RasterKernels* pKernels, const struct RasterImage* pImage, uint32_t color )
+{
+	RasterFillRect(pKernels, pImage, 0, 0, pImage->mWidth, pImage->mHeight, color);
+}
+
+// Squares of 1 << cellShift pixels, shifted right by offset pixels. Rows of
+// one band of squares are the same, the first is drawn and the others copied.
+static void RasterChecker(
+	const struct RasterKernels* pKernels, const struct RasterImage* pImage,
+	uint32_t offset, uint32_t cellShift, uint32_t color0, uint32_t color1
+)
+{
+	const int32_t cell = 1 << cellShift;
+	for( int32_t y = 0; y < pImage->mHeight; y++ )
+	{
+		uint32_t* pRow = RasterRow(pImage, y);
+		if( y % cell == 0 )
+			pKernels->mCheckerRow(pRow, offset + (uint32_t)y, cellShift, color0, color1, pImage->mWidth);
+		else
+			pKernels->mCopyRow(pRow, RasterRow(pImage, y - 1), pImage->mWidth);
+	}
+}
+
+// Linear gradient over the rectangle, color0 at its top left corner and
+// color1 at (gradientX, gradientY) from there, constant across the direction
+// between them and clamped past either end
+static void RasterLinearGradient(
+	const struct RasterKernels* pKernels, const struct RasterImage* pImage,
+	int32_t x, int32_t y, int32_t width, int32_t height,
+	int32_t gradientX, int32_t gradientY, uint32_t color0, uint32_t color1
+)
+{
+	const int64_t length2 = (int64_t)gradientX * gradientX + (int64_t)gradientY * gradientY;
+	if( !length2 )
+	{
+		RasterFillRect(pKernels, pImage, x, y, width, height, color1);
+		return;
+	}
+
+	const int32_t originX = x, originY = y;
+	if( !RasterClip(pImage, &x, &y, &width, &height) )
+		return;
+
+	// 16.16 steps per pixel along x and y
+	const int64_t dtx = ( (int64_t)gradientX << 16 ) / length2;
+	const int64_t dty = ( (int64_t)gradientY << 16 ) / length2;
+	for( int32_t row = y; row < y + height; row++ )
+	{
+		uint32_t* pRow = RasterRow(pImage, row) + x;
+		const int64_t t = ( x - originX ) * dtx + ( row - originY ) * dty;
+		if( !dtx )
+		{
+			const int32_t clamped = t < 0 ? 0 : ( t > 0x10000 ? 0x10000 : (int32_t)t );
+			pKernels->mFillRow(pRow, RasterLerpPixel(color0, color1, (uint32_t)clamped >> 8), width);
+			continue;
+		}
+
+		// [first, last] is where t is in [0, 1], the pixels before and after
+		// are fills, which also keeps t + i * dt of the kernel in 32 bits
+		int64_t first, last;
+		if( dtx > 0 )
+		{
+			first = -RasterFloorDiv(t, dtx);
+			last = RasterFloorDiv(0x10000 - t, dtx);
+		}
+		else
+		{
+			first = -RasterFloorDiv(0x10000 - t, -dtx);
+			last = RasterFloorDiv(t, -dtx);
+		}
+		const int32_t head = (int32_t)( first < 0 ? 0 : ( first > width ? width : first ) );
+		const int32_t tail = (int32_t)( last + 1 < head ? head : ( last + 1 > width ? width : last + 1 ) );
+
+		if( head )
+			pKernels->mFillRow(pRow, dtx > 0 ? color0 : color1, head);
+		if( tail > head )
+			pKernels->mGradientRow(pRow + head, color0, color1, (int32_t)( t + head * dtx ), (int32_t)dtx, tail - head);
+		if( tail < width )
+			pKernels->mFillRow(pRow + tail, dtx > 0 ? color1 : color0, width - tail);
+	}
+}
+
+// Clips the source placed at (x, y) in pDst, returns 0 when nothing is left
+static int8_t RasterClipSource(
+	const struct RasterImage* pDst, const struct RasterImage* pSrc,
+	int32_t* pX, int32_t* pY, int32_t* pSrcX, int32_t* pSrcY, int32_t* pWidth, int32_t* pHeight
+)
+{
+	const int32_t x = *pX, y = *pY;
+	*pWidth = pSrc->mWidth;
+	*pHeight = pSrc->mHeight;
+	if( !RasterClip(pDst, pX, pY, pWidth, pHeight) )
+		return 0;
+
+	*pSrcX = *pX - x;
+	*pSrcY = *pY - y;
+	return 1;
+}
+
+// Copies pSrc to (x, y) in pDst as it is
+static void RasterBlit(
+	const struct RasterKernels* pKernels, const struct RasterImage* pDst,
+	int32_t x, int32_t y, const struct RasterImage* pSrc
+)
+{
+	int32_t srcX, srcY, width, height;
+	if( !RasterClipSource(pDst, pSrc, &x, &y, &srcX, &srcY, &width, &height) )
+		return;
+
+	for( int32_t row = 0; row < height; row++ )
+		pKernels->mCopyRow(RasterRow(pDst, y + row) + x, RasterRow(pSrc, srcY + row) + srcX, width);
+}
+
+// Blends the premultiplied pSrc over (x, y) in pDst
+static void RasterBlend(
+	const struct RasterKernels* pKernels, const struct RasterImage* pDst,
+	int32_t x, int32_t y, const struct RasterImage* pSrc
+)
+{
+	int32_t srcX, srcY, width, height;
+	if( !RasterClipSource(pDst, pSrc, &x, &y, &srcX, &srcY, &width, &height) )
+		return;
+
+	for( int32_t row = 0; row < height; row++ )
+		pKernels->mBlendRow(RasterRow(pDst, y + row) + x, RasterRow(pSrc, srcY + row) + srcX, width);
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef _SHM_SWAPCHAIN_H
+#define _SHM_SWAPCHAIN_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <wayland-client.h>
+
+#include "shm_pool_allocator.h"
+
+// N shm buffers presented on a surface at the pace of its frame callbacks.
+// Each wl_surface.frame done draws into the released buffer that was shown
+// the longest ago, attaches, damages and commits it along with the request
+// for the next callback. When the compositor still holds every buffer the
+// frame is dropped and only the callback is committed, so pacing goes on.
+// A callback that comes a refresh interval or more after the previous one,
+// the shortest interval seen standing in for the refresh, counts as late.
+// Dropped frames ask for another buffer, late ones for faster rendering, the
+// report printed every SHM_SWAPCHAIN_REPORT_FRAMES callbacks tells which.
+
+#define SHM_SWAPCHAIN_MAX_BUFFERS 4
+#define SHM_SWAPCHAIN_REPORT_FRAMES 300
+
+struct ShmSwapchain;
+struct ShmSwapchainImage;
+
+// Draws the frame for time, the ms of the frame callback, into pImage
+typedef void (*ShmSwapchainRenderFunc)( void* pData, struct ShmSwapchainImage* pImage, uint32_t time );
+
+struct ShmSwapchainImage
+{
+	struct ShmSwapchain* mpSwapchain;
+	struct ShmAllocation mAllocation;
+	// attached and not released by the compositor yet
+	int8_t mbBusy;
+	// the frame that last attached it, 0 before its first
+	uint64_t mAttachFrame;
+	// frames since the content was shown, 1 for the previous frame and 0 for
+	// a buffer never drawn; lets the render function redraw only what changed
+	uint32_t mAge;
+};
+
+struct ShmSwapchain
+{
+	struct wl_surface* mpWlSurface;
+	struct wl_callback* mpFrameCallback;
+
+	struct ShmSwapchainImage mImages[SHM_SWAPCHAIN_MAX_BUFFERS];
+	uint32_t mImageCount;
+	int32_t mWidth, mHeight;
+
+	ShmSwapchainRenderFunc mpRender;
+	void* mpRenderData;
+
+	// frames committed with a new buffer
+	uint64_t mFrame;
+	uint64_t mCallbacks;
+	// callbacks that found every buffer held by the compositor
+	uint64_t mDropped;
+	// callbacks a refresh interval or more later than expected
+	uint64_t mLate;
+	uint64_t mMissedIntervals;
+	uint32_t mLastCallbackMs;
+	// shortest interval between two callbacks, 0 until there were two
+	uint32_t mIntervalMs;
+	uint64_t mRenderNsec;
+	uint64_t mMaxRenderNsec;
+};
+
+static uint64_t ShmSwapchainNowNsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void shm_swapchain_buffer_release( void* pData, struct wl_buffer* pWlBuffer )
+{
+	struct ShmSwapchainImage* pImage = pData;
+	pImage->mbBusy = 0;
+}
+
+static const struct wl_buffer_listener shm_swapchain_buffer_listener = {
+	.release = shm_swapchain_buffer_release
+};
+
+static void shm_swapchain_frame_done( void* pData, struct wl_callback* pCallback, uint32_t time );
+
+static const struct wl_callback_listener shm_swapchain_frame_listener = {
+	.done = shm_swapchain_frame_done
+};
+
+static void DestroyShmSwapchain( struct ShmSwapchain* pSwapchain )
+{
+	if( pSwapchain->mpFrameCallback )
+		wl_callback_destroy(pSwapchain->mpFrameCallback);
+	for( uint32_t i = 0; i < pSwapchain->mImageCount; i++ )
+		ShmPoolFree(&pSwapchain->mImages[i].mAllocation);
+	memset(pSwapchain, 0, sizeof(struct ShmSwapchain));
+}
+
+// count buffers of width x height from pAllocator for pWlSurface, count is
+// clamped to [2, SHM_SWAPCHAIN_MAX_BUFFERS]. Nothing is shown before
+// StartShmSwapchain. Returns 0 on success.
+static int CreateShmSwapchain(
+	struct ShmSwapchain* pSwapchain, struct ShmPoolAllocator* pAllocator,
+	struct wl_surface* pWlSurface, int32_t width, int32_t height, uint32_t format,
+	uint32_t count, ShmSwapchainRenderFunc pRender, void* pRenderData
+)
+{
+	memset(pSwapchain, 0, sizeof(struct ShmSwapchain));
+	if( count < 2 )
+		count = 2;
+	if( count > SHM_SWAPCHAIN_MAX_BUFFERS )
+		count = SHM_SWAPCHAIN_MAX_BUFFERS;
+
+	pSwapchain->mpWlSurface = pWlSurface;
+	pSwapchain->mWidth = width;
+	pSwapchain->mHeight = height;
+	pSwapchain->mpRender = pRender;
+	pSwapchain->mpRenderData = pRenderData;
+
+	for( uint32_t i = 0; i < count; i++ )
+	{
+		struct ShmSwapchainImage* pImage = &pSwapchain->mImages[i];
+		if( ShmPoolAlloc(pAllocator, &pImage->mAllocation, width, height, width * 4, format) == -1 )
+		{
+			DestroyShmSwapchain(pSwapchain);
+			return -1;
+		}
+		pImage->mpSwapchain = pSwapchain;
+		pSwapchain->mImageCount++;
+		if( pImage->mAllocation.mpWlBuffer )
+			wl_buffer_add_listener(pImage->mAllocation.mpWlBuffer, &shm_swapchain_buffer_listener, pImage);
+	}
+	return 0;
+}
+
+// The released image shown the longest ago, NULL when the compositor holds
+// all of them
+static struct ShmSwapchainImage* ShmSwapchainAcquire( struct ShmSwapchain* pSwapchain )
+{
+	struct ShmSwapchainImage* pOldest = NULL;
+	for( uint32_t i = 0; i < pSwapchain->mImageCount; i++ )
+	{
+		struct ShmSwapchainImage* pImage = &pSwapchain->mImages[i];
+		if( pImage->mbBusy )
+			continue;
+		if( !pOldest || pImage->mAttachFrame < pOldest->mAttachFrame )
+			pOldest = pImage;
+	}
+	if( !pOldest )
+		return NULL;
+
+	pOldest->mAge = pOldest->mAttachFrame ? (uint32_t)( pSwapchain->mFrame + 1 - pOldest->mAttachFrame ) : 0;
+	pOldest->mbBusy = 1;
+	return pOldest;
+}
+
+static void PrintShmSwapchainStats( const struct ShmSwapchain* pSwapchain )
+{
+	const uint64_t rendered = pSwapchain->mFrame ? pSwapchain->mFrame : 1;
+	printf("Swapchain: %u buffers, %llu frames, %llu dropped (no free buffer), %llu late (%llu intervals missed), interval %u ms, render %.2f ms avg, %.2f ms max\n",
+		pSwapchain->mImageCount,
+		(unsigned long long)pSwapchain->mFrame,
+		(unsigned long long)pSwapchain->mDropped,
+		(unsigned long long)pSwapchain->mLate,
+		(unsigned long long)pSwapchain->mMissedIntervals,
+		pSwapchain->mIntervalMs,
+		pSwapchain->mRenderNsec / 1e6 / rendered,
+		pSwapchain->mMaxRenderNsec / 1e6
+	);
+}
+
+// Draws and commits the frame for time, or only the request for the next
+// callback when no buffer is free
+static void ShmSwapchainPresent( struct ShmSwapchain* pSwapchain, uint32_t time )
+{
+	struct wl_surface* pWlSurface = pSwapchain->mpWlSurface;
+	struct ShmSwapchainImage* pImage = ShmSwapchainAcquire(pSwapchain);
+	if( pImage )
+	{
+		const uint64_t start = ShmSwapchainNowNsec();
+		pSwapchain->mpRender(pSwapchain->mpRenderData, pImage, time);
+		const uint64_t renderNsec = ShmSwapchainNowNsec() - start;
+		pSwapchain->mRenderNsec += renderNsec;
+		if( renderNsec > pSwapchain->mMaxRenderNsec )
+			pSwapchain->mMaxRenderNsec = renderNsec;
+
+		pImage->mAttachFrame = ++pSwapchain->mFrame;
+		wl_surface_attach(pWlSurface, pImage->mAllocation.mpWlBuffer, 0, 0);
+		wl_surface_damage(pWlSurface, 0, 0, pSwapchain->mWidth, pSwapchain->mHeight);
+	}
+	else
+		pSwapchain->mDropped++;
+
+	pSwapchain->mpFrameCallback = wl_surface_frame(pWlSurface);
+	wl_callback_add_listener(pSwapchain->mpFrameCallback, &shm_swapchain_frame_listener, pSwapchain);
+	wl_surface_commit(pWlSurface);
+}
+
+static void shm_swapchain_frame_done( void* pData, struct wl_callback* pCallback, uint32_t time )
+{
+	struct ShmSwapchain* pSwapchain = pData;
+	wl_callback_destroy(pCallback);
+	pSwapchain->mpFrameCallback = NULL;
+
+	if( pSwapchain->mCallbacks )
+	{
+		const uint32_t delta = time - pSwapchain->mLastCallbackMs;
+		if( delta && ( !pSwapchain->mIntervalMs || delta < pSwapchain->mIntervalMs ) )
+			pSwapchain->mIntervalMs = delta;
+
+		// one and a half intervals rounds to at least one vblank missed
+		const uint32_t interval = pSwapchain->mIntervalMs;
+		if( interval && delta * 2 >= interval * 3 )
+		{
+			pSwapchain->mLate++;
+			pSwapchain->mMissedIntervals += ( delta + interval / 2 ) / interval - 1;
+		}
+	}
+	pSwapchain->mLastCallbackMs = time;
+	pSwapchain->mCallbacks++;
+
+	ShmSwapchainPresent(pSwapchain, time);
+
+	if( pSwapchain->mCallbacks % SHM_SWAPCHAIN_REPORT_FRAMES == 0 )
+		PrintShmSwapchainStats(pSwapchain);
+}
+
+// Shows the first frame, the frame callbacks draw the rest
+static void StartShmSwapchain( struct ShmSwapchain* pSwapchain, uint32_t time )
+{
+	ShmSwapchainPresent(pSwapchain, time);
+}
+
+#endif
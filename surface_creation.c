@@ -1,12 +1,199 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/resource.h>
 #include <wayland-client.h>
 
 #include "global_registry_handle.h"
 #include "shm_helper.h"
+#include "shm_pool_allocator.h"
+#include "shm_swapchain.h"
+
+// A 1920x1080 surface redrawn on every frame callback through a swapchain,
+// and a grid of icon surfaces, all sub-allocated from one shm pool that the
+// icons make grow.
+//     SurfaceCreation [--buffers N]
+// picks double, triple or quad buffering, 3 by default; the swapchain report
+// of dropped and late frames shows which one a device needs.
+//     SurfaceCreation --bench-shm [ITERATIONS]
+// runs without a compositor and times creating, mapping and first touching
+// a file the size of two framebuffers with each way shm_helper.h has of
+// making it.
+
+#define POOL_WIDTH 1920
+#define POOL_HEIGHT 1080
+#define BENCH_BUFFER_COUNT 2
+#define POOL_FLAGS ( SHM_FILE_PREFAULT | SHM_FILE_HUGEPAGES )
+#define SWAPCHAIN_BUFFER_COUNT 3
+#define SWEEP_BAR_WIDTH 64
+// 8 x 256 x 256 x 4 bytes is SHM_HUGEPAGE_SIZE, more than the slack of a pool
+// rounded up to whole huge pages
+#define ICON_COUNT 8
+#define ICON_SIZE 256
+
+// Shm Benchmark
+
+static uint64_t get_time_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t get_minor_faults()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t)usage.ru_minflt;
+}
+
+struct ShmBenchVariant
+{
+	const char* mpName;
+	// the shm_open loop instead of a memfd, flags are ignored
+	int8_t mbShmOpen;
+	unsigned int mFlags;
+};
+
+struct ShmBenchResult
+{
+	uint64_t mCreateNsec;
+	uint64_t mTouchNsec;
+	uint64_t mFreeNsec;
+	// faults taken by the first touch, populating the mapping counts as faults too
+	uint64_t mTouchFaults;
+	// iterations that ended up on hugetlbfs
+	uint32_t mHugetlb;
+};
+
+static int bench_shm_variant(
+	const struct ShmBenchVariant* pVariant, int iterations, struct ShmBenchResult* pResult
+)
+{
+	const size_t poolSize = (size_t)POOL_WIDTH * 4 * POOL_HEIGHT * BENCH_BUFFER_COUNT;
+	const long pageSize = sysconf(_SC_PAGESIZE);
+	memset(pResult, 0, sizeof(struct ShmBenchResult));
+
+	for( int i = 0; i < iterations; i++ )
+	{
+		size_t size = poolSize;
+		const uint64_t start = get_time_nsec();
+
+		int fd;
+		uint8_t* pData;
+		if( pVariant->mbShmOpen )
+		{
+			fd = create_shm_open_file();
+			if( fd != -1 && resize_shm_file(fd, size) == -1 )
+			{
+				close(fd);
+				fd = -1;
+			}
+			pData = fd == -1 ? NULL : map_shm_file(fd, size, 0);
+		}
+		else
+		{
+			fd = allocate_shm_file_flags(&size, pVariant->mFlags);
+			pData = fd == -1 ? NULL : map_shm_file(fd, size, pVariant->mFlags);
+		}
+		if( !pData )
+		{
+			if( fd != -1 )
+				close(fd);
+			return -1;
+		}
+		const uint64_t created = get_time_nsec();
+		const uint64_t faults = get_minor_faults();
+
+		// a write to every page, what the first frame drawn into the pool does
+		for( size_t offset = 0; offset < poolSize; offset += (size_t)pageSize )
+			pData[offset] = (uint8_t)i;
+		const uint64_t touched = get_time_nsec();
+		pResult->mTouchFaults += get_minor_faults() - faults;
+
+		munmap(pData, size);
+		close(fd);
+		const uint64_t end = get_time_nsec();
+
+		pResult->mCreateNsec += created - start;
+		pResult->mTouchNsec += touched - created;
+		pResult->mFreeNsec += end - touched;
+		if( size != poolSize )
+			pResult->mHugetlb++;
+	}
+	return 0;
+}
+
+static int run_shm_benchmark( int iterations )
+{
+	static const struct ShmBenchVariant variants[] = {
+		{ "shm_open", 1, 0 },
+		{ "memfd", 0, 0 },
+		{ "memfd prefault", 0, SHM_FILE_PREFAULT },
+		{ "memfd hugepages", 0, SHM_FILE_HUGEPAGES },
+		{ "memfd hugepages+prefault", 0, SHM_FILE_PREFAULT | SHM_FILE_HUGEPAGES }
+	};
+
+	printf("Shm benchmark: %d iterations of a %dx%d XRGB8888 pool of %d buffers, %zu bytes\n",
+		iterations, POOL_WIDTH, POOL_HEIGHT, BENCH_BUFFER_COUNT,
+		(size_t)POOL_WIDTH * 4 * POOL_HEIGHT * BENCH_BUFFER_COUNT
+	);
+
+	for( uint32_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++ )
+	{
+		struct ShmBenchResult result;
+		if( bench_shm_variant(&variants[i], iterations, &result) == -1 )
+		{
+			printf("%-26s failed to allocate shm file\n", variants[i].mpName);
+			continue;
+		}
+		printf("%-26s create %8.1f us, first touch %8.1f us, total %8.1f us, free %7.1f us, %7.1f faults on touch%s\n",
+			variants[i].mpName,
+			result.mCreateNsec / 1e3 / iterations,
+			result.mTouchNsec / 1e3 / iterations,
+			( result.mCreateNsec + result.mTouchNsec ) / 1e3 / iterations,
+			result.mFreeNsec / 1e3 / iterations,
+			(double)result.mTouchFaults / iterations,
+			result.mHugetlb ? " (hugetlbfs)" : ""
+		);
+	}
+	return 0;
+}
+
+// Swapchain Rendering
+
+// A bar sweeping across the framebuffer, one pixel per ms
+static void draw_sweep( void* pData, struct ShmSwapchainImage* pImage, uint32_t time )
+{
+	const struct ShmAllocation* pAllocation = &pImage->mAllocation;
+	const int32_t barX = (int32_t)( time % (uint32_t)( pAllocation->mWidth - SWEEP_BAR_WIDTH ) );
+
+	uint8_t* pRow = ShmAllocationPixels(pAllocation);
+	for( int32_t y = 0; y < pAllocation->mHeight; y++, pRow += pAllocation->mStride )
+	{
+		uint32_t* pPixels = (uint32_t*)pRow;
+		for( int32_t x = 0; x < pAllocation->mWidth; x++ )
+			pPixels[x] = ( x >= barX && x < barX + SWEEP_BAR_WIDTH ) ? 0xFFE0E0E0u : 0xFF202020u;
+	}
+}
 
 int main(int argc, const char* argv[])
 {
+	int bufferCount = SWAPCHAIN_BUFFER_COUNT;
+	for( int i = 1; i < argc; i++ )
+	{
+		if( strcmp(argv[i], "--bench-shm") == 0 )
+		{
+			const int iterations = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return run_shm_benchmark(iterations > 0 ? iterations : 50);
+		}
+		if( strcmp(argv[i], "--buffers") == 0 && i + 1 < argc )
+			bufferCount = atoi(argv[++i]);
+	}
+	if( bufferCount < 2 || bufferCount > SHM_SWAPCHAIN_MAX_BUFFERS )
+		bufferCount = SWAPCHAIN_BUFFER_COUNT;
+
 	struct wl_display* pDisplay = wl_display_connect(NULL);
 	if(!pDisplay)
 	{
@@ -40,54 +227,54 @@ int main(int argc, const char* argv[])
 		return 1;
 	}
 
-	const int width = 1920, height = 1080;
+	const int width = POOL_WIDTH, height = POOL_HEIGHT;
 	const int stride = width * 4;
-	const int shm_pool_size = height * stride * 2;
 
-	int fd = allocate_shm_file(shm_pool_size);
-	if( fd == -1 )
+	// sized for the framebuffers alone, the icons don't fit in what rounding
+	// to huge pages leaves over and grow the pool
+	struct ShmPoolAllocator allocator;
+	if( CreateShmPoolAllocator(
+		&allocator, gObjState.mpShm,
+		(size_t)height * stride * bufferCount, POOL_FLAGS ) == -1 )
 	{
 		printf("Failed to allocate shm file\n");
 		return 1;
 	}
 
-	uint8_t *pool_data = mmap(
-		NULL, shm_pool_size,
-	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
-	);
-
-	struct wl_shm* pShm = gObjState.mpShm;
-	struct wl_shm_pool* pPool = wl_shm_create_pool(pShm, fd, shm_pool_size);
-
-	int index = 0;
-	int offset = height * stride * index;
-
-	struct wl_buffer* pBuffers[2];
-	struct wl_buffer* pFb0 = pBuffers[0];
-	struct wl_buffer* pFb1 = pBuffers[1];
-
-	pFb0 = wl_shm_pool_create_buffer(
-		pPool, offset,
-    	width, height, stride, WL_SHM_FORMAT_XRGB8888
-	);
-
-	uint32_t *pixels = (uint32_t *)&pool_data[offset];
-	memset(pixels, 0, width * height * 4);
-
-	wl_surface_attach(pSurface, pFb0, 0, 0);
-	wl_surface_damage(pSurface, 0, 0, width, height);
-	wl_surface_commit(pSurface);
+	struct ShmSwapchain swapchain;
+	if( CreateShmSwapchain(
+		&swapchain, &allocator, pSurface,
+		width, height, WL_SHM_FORMAT_XRGB8888,
+		(uint32_t)bufferCount, draw_sweep, NULL ) == -1 )
+	{
+		printf("Failed to allocate framebuffers\n");
+		return 1;
+	}
+	StartShmSwapchain(&swapchain, 0);
 
-	index = 1;
-	offset = height * stride * index;
+	// small surfaces of their own, all in the framebuffers' pool
+	struct wl_surface* pIcons[ICON_COUNT];
+	struct ShmAllocation icons[ICON_COUNT];
+	for( int i = 0; i < ICON_COUNT; i++ )
+	{
+		pIcons[i] = wl_compositor_create_surface(gObjState.mpCompositor);
+		if( !pIcons[i] || ShmPoolAlloc(
+			&allocator, &icons[i],
+			ICON_SIZE, ICON_SIZE, ICON_SIZE * 4, WL_SHM_FORMAT_ARGB8888 ) == -1 )
+		{
+			printf("Failed to allocate icon\n");
+			return 1;
+		}
 
-	pFb1 = wl_shm_pool_create_buffer(
-		pPool, offset,
-    	width, height, stride, WL_SHM_FORMAT_XRGB8888
-	);
+		uint32_t* pPixels = ShmAllocationPixels(&icons[i]);
+		for( int p = 0; p < ICON_SIZE * ICON_SIZE; p++ )
+			pPixels[p] = 0xFF000000u | ( 0x3F << ( 8 * ( i % 3 ) ) );
 
-	pixels = (uint32_t *)&pool_data[offset];
-	memset(pixels, 0, width * height * 4);
+		wl_surface_attach(pIcons[i], icons[i].mpWlBuffer, 0, 0);
+		wl_surface_damage(pIcons[i], 0, 0, ICON_SIZE, ICON_SIZE);
+		wl_surface_commit(pIcons[i]);
+	}
+	PrintShmPoolAllocatorStats(&allocator);
 
 	printf("Starting Client Event Loop\n");
 
@@ -96,6 +283,7 @@ int main(int argc, const char* argv[])
 
 	}
 	wl_display_disconnect(pDisplay);
+	PrintShmSwapchainStats(&swapchain);
 	printf("Client Disconnected from the Display\n");
 	return 0;
 }
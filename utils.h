@@ -6,13 +6,11 @@
 #include <stddef.h>
 #include <stdlib.h>
 
-#if defined STB_IMAGE_IMPLEMENTATION || STB_IMAGE_WRITE_IMPLEMENTATION
+#if defined STB_IMAGE_IMPLEMENTATION || defined STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include <stb/stb_image_write.h>
 #include <stb/stb_image.h>
 
-#include <GLES2/gl2.h>
-
 static uint8_t* LoadPixelsFromFile(
     const char* filePath,
     int* imgWidth, int* imgHeight,
@@ -29,14 +27,16 @@ static uint8_t* LoadPixelsFromFile(
     );
 }
 
+// GL read backs are bottom up, pass bFlip = 0 for top down pixels
 static int16_t WritePixelsToFile(
     const char* filename,
     int width, int height,
     int channels,
-    const void* pixelData   
+    const void* pixelData,
+    int8_t bFlip
 )
 {
-    stbi_flip_vertically_on_write(1);
+    stbi_flip_vertically_on_write(bFlip);
 
     int16_t reslt = 0;
     if( !pixelData )
@@ -57,6 +57,11 @@ static int16_t WritePixelsToFile(
     return reslt;
 }
 
+// the headless server writes images without linking GLES2
+#ifndef UTILS_NO_GLES2
+
+#include <GLES2/gl2.h>
+
 static void GenerateTextureFromImage(
     const char* filename,
     int* imgWidth, int* imgHeight,
@@ -98,6 +103,8 @@ static void GenerateTextureFromImage(
 }
 #endif
 
+#endif
+
 static void ReadFileContentsToCpuBuffer(
     const char* filename,
     char** pCpubuffer,
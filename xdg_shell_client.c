@@ -1,17 +1,49 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <wayland-client.h>
 
 #include "global_registry_handle.h"
+#include "shm_buffer_pool.h"
 #include "shm_helper.h"
+#include "shm_raster.h"
+
+// Scrolling checkerboard under a gradient strip drawn on every frame
+// callback into the buffers of a ShmBufferPool, with the kernels of
+// shm_raster.h.
+//     XdgShellClient [--kernel avx2|neon|scalar]
+// forces a kernel set, the fastest one the CPU supports by default.
+//     XdgShellClient --bench-pool [FRAMES]
+// runs without a compositor and compares the client side cost of preparing
+// a frame with a new shm file per frame against the pool. Syscalls are
+// counted on the raw_syscalls:sys_enter tracepoint, which needs a readable
+// tracefs and perf_event_paranoid 1 or lower, or CAP_PERFMON. A new file
+// should take six per frame: memfd_create, ftruncate, the F_ADD_SEALS fcntl
+// and mmap in MapShmFile, then munmap and close. The pool should take none.
+//     XdgShellClient --bench-raster [FRAMES]
+// runs without a compositor and reports Gpix/s of every raster kernel next
+// to the modulo and branch checker loop the frames used to be drawn with.
+
+#define FRAME_WIDTH 640
+#define FRAME_HEIGHT 480
+// one on screen, one queued for the compositor and one to draw into
+#define FRAME_BUFFER_COUNT 3
+// squares of 1 << 3 pixels
+#define CHECKER_CELL_SHIFT 3
+#define STRIP_HEIGHT 24
 
 struct ClientObjState;
 
-static void wl_buffer_release( void* pData, struct wl_buffer* pWlBuffer );
-static struct wl_buffer* draw_frame( struct ClientObjState* pClientObjState );
+static void draw_frame( struct ClientObjState* pClientObjState, uint32_t time );
 static void xdg_surface_configure(
 	void* pData, struct xdg_surface* pXdgSurface, uint32_t serial
 );
+static void frame_done( void* pData, struct wl_callback* pCallback, uint32_t time );
 
 struct ClientObjState
 {
@@ -19,87 +51,430 @@ struct ClientObjState
 	struct wl_surface* mpWlSurface;
 	struct xdg_surface* mpXdgSurface;
 	struct xdg_toplevel* mpXdgTopLevel;
+	struct wl_callback* mpFrameCallback;
+	struct ShmBufferPool mBufferPool;
+	const struct RasterKernels* mpRasterKernels;
+	uint64_t mFrames;
+	// frames skipped because the compositor held every buffer
+	uint64_t mSkippedFrames;
 };
 
 static const struct xdg_surface_listener xdg_surface_listener = {
 	.configure = xdg_surface_configure
 };
 
-static const struct wl_buffer_listener wl_buffer_listener = {
-	.release = wl_buffer_release
+static const struct wl_callback_listener frame_listener = {
+	.done = frame_done
 };
 
-static void wl_buffer_release( void* pData, struct wl_buffer* pWlBuffer )
+static void fill_frame(
+	const struct RasterKernels* pKernels, uint32_t* pPixels,
+	int width, int height, int offset
+)
 {
-	wl_buffer_destroy(pWlBuffer);
+	const struct RasterImage image = { pPixels, width, height, width * 4 };
+	RasterChecker(pKernels, &image, (uint32_t)offset, CHECKER_CELL_SHIFT, 0xFF666666, 0xFFEEEEEE);
+	RasterLinearGradient(pKernels, &image, 0, 0, width, STRIP_HEIGHT, width, 0, 0xFF203060, 0xFF6080C0);
 }
 
-static struct wl_buffer* draw_frame( struct ClientObjState* pClientObjState )
+static void draw_frame( struct ClientObjState* pClientObjState, uint32_t time )
 {
-	const int width = 640, height = 480;
-	const int stride = width * 4;
-	const int shm_pool_size = height * stride;
+	struct wl_surface* pSurface = pClientObjState->mpWlSurface;
 
-	int fd = allocate_shm_file(shm_pool_size);
-	if( fd == -1 )
+	pClientObjState->mpFrameCallback = wl_surface_frame(pSurface);
+	wl_callback_add_listener(pClientObjState->mpFrameCallback, &frame_listener, pClientObjState);
+
+	struct ShmBuffer* pBuffer = AcquireShmBuffer(&pClientObjState->mBufferPool);
+	if( pBuffer )
 	{
-		printf("Failed to allocate shm file\n");
-		return NULL;
+		// one pixel every 16 ms
+		fill_frame(pClientObjState->mpRasterKernels, pBuffer->mpPixels, FRAME_WIDTH, FRAME_HEIGHT, (int)( time / 16 ));
+		wl_surface_attach(pSurface, pBuffer->mpWlBuffer, 0, 0);
+		wl_surface_damage_buffer(pSurface, 0, 0, FRAME_WIDTH, FRAME_HEIGHT);
+		pClientObjState->mFrames++;
 	}
+	else
+		pClientObjState->mSkippedFrames++;
 
-	uint32_t *pool_data = mmap(
-		NULL, shm_pool_size,
-		PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
-	);
+	wl_surface_commit(pSurface);
+}
+
+static void frame_done( void* pData, struct wl_callback* pCallback, uint32_t time )
+{
+	struct ClientObjState* pClientObjState = pData;
+	wl_callback_destroy(pCallback);
+	pClientObjState->mpFrameCallback = NULL;
+
+	draw_frame(pClientObjState, time);
+}
+
+static void xdg_surface_configure(
+	void* pData, struct xdg_surface* pXdgSurface, uint32_t serial
+)
+{
+	struct ClientObjState* pClientObjState = pData;
+	xdg_surface_ack_configure(pXdgSurface, serial);
 
-	if( pool_data == MAP_FAILED )
+	if( !pClientObjState->mBufferPool.mpShmPool )
 	{
-		printf("Failed to map data from shm pool\n");
-		close(fd);
-		return NULL;
+		if( CreateShmBufferPool(
+			&pClientObjState->mBufferPool, pClientObjState->mpGlobalObjState->mpShm,
+			FRAME_WIDTH, FRAME_HEIGHT, WL_SHM_FORMAT_XRGB8888, FRAME_BUFFER_COUNT ) == -1 )
+			return;
+	}
+
+	// the frame callback keeps drawing once the first frame is up
+	if( !pClientObjState->mpFrameCallback )
+		draw_frame(pClientObjState, 0);
+	else
+		wl_surface_commit(pClientObjState->mpWlSurface);
+}
+
+// Buffer Benchmark
+
+static uint64_t get_time_nsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t get_minor_faults()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t)usage.ru_minflt;
+}
+
+// Counter of the syscalls this thread enters, -1 when the tracepoint can't
+// be opened. Starts disabled.
+static int open_syscall_counter()
+{
+	static const char* const pIdPaths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+	};
+
+	unsigned long long id = 0;
+	for( size_t i = 0; i < sizeof(pIdPaths) / sizeof(pIdPaths[0]) && !id; i++ )
+	{
+		FILE* pFile = fopen(pIdPaths[i], "r");
+		if( !pFile )
+			continue;
+		if( fscanf(pFile, "%llu", &id) != 1 )
+			id = 0;
+		fclose(pFile);
 	}
+	if( !id )
+		return -1;
+
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(struct perf_event_attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(struct perf_event_attr);
+	attr.config = id;
+	attr.disabled = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void start_syscall_counter( int fd )
+{
+	if( fd == -1 )
+		return;
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Syscalls since start_syscall_counter, the ioctl that stops the counter is
+// entered while it still runs and is taken off
+static uint64_t stop_syscall_counter( int fd )
+{
+	if( fd == -1 )
+		return 0;
+	ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+	uint64_t count = 0;
+	if( read(fd, &count, sizeof(count)) != sizeof(count) || count == 0 )
+		return 0;
+	return count - 1;
+}
+
+struct BenchResult
+{
+	uint64_t mPrepareNsec;
+	uint64_t mTotalNsec;
+	uint64_t mSyscalls;
+	uint64_t mFaults;
+};
 
-	struct wl_shm* pShm = pClientObjState->mpGlobalObjState->mpShm;
-	struct wl_shm_pool* pPool = wl_shm_create_pool(pShm, fd, shm_pool_size);
+static void print_bench_result( const char* pName, const struct BenchResult* pResult, int frames, int8_t bSyscalls )
+{
+	char syscalls[32] = "n/a";
+	if( bSyscalls )
+		snprintf(syscalls, sizeof(syscalls), "%.1f", (double)pResult->mSyscalls / frames);
 
-	struct wl_buffer* pWlBuffer = wl_shm_pool_create_buffer(
-		pPool, 0,
-	    	width, height, stride, WL_SHM_FORMAT_XRGB8888
+	printf("%-22s %8.1f us/frame (%6.1f us preparing the buffer), %5s syscalls/frame, %7.1f page faults/frame\n",
+		pName,
+		pResult->mTotalNsec / 1e3 / frames,
+		pResult->mPrepareNsec / 1e3 / frames,
+		syscalls,
+		(double)pResult->mFaults / frames
 	);
-	wl_shm_pool_destroy(pPool);
+}
+
+// What draw_frame used to do: a new file and mapping per frame
+static int bench_file_per_frame(
+	const struct RasterKernels* pKernels, int frames, int syscallCounter, struct BenchResult* pResult
+)
+{
+	const size_t size = (size_t)FRAME_WIDTH * 4 * FRAME_HEIGHT;
+	memset(pResult, 0, sizeof(struct BenchResult));
+	const uint64_t faults = get_minor_faults();
+	start_syscall_counter(syscallCounter);
+
+	for( int i = 0; i < frames; i++ )
+	{
+		const uint64_t start = get_time_nsec();
+		uint8_t* pData;
+		int fd = MapShmFile(size, &pData);
+		if( fd == -1 )
+			return -1;
+		const uint64_t mapped = get_time_nsec();
+
+		fill_frame(pKernels, (uint32_t*)pData, FRAME_WIDTH, FRAME_HEIGHT, i);
+
+		const uint64_t filled = get_time_nsec();
+		munmap(pData, size);
+		close(fd);
+		const uint64_t end = get_time_nsec();
+
+		pResult->mPrepareNsec += ( mapped - start ) + ( end - filled );
+		pResult->mTotalNsec += end - start;
+	}
+	pResult->mSyscalls = stop_syscall_counter(syscallCounter);
+	pResult->mFaults = get_minor_faults() - faults;
+	return 0;
+}
+
+// The pool with the compositor releasing each buffer once the next one is
+// attached, the mapping is made once up front
+static int bench_pool(
+	const struct RasterKernels* pKernels, int frames, int syscallCounter, struct BenchResult* pResult
+)
+{
+	memset(pResult, 0, sizeof(struct BenchResult));
+	struct ShmBufferPool pool;
+	int fd = MapShmBufferPool(&pool, FRAME_WIDTH, FRAME_HEIGHT, WL_SHM_FORMAT_XRGB8888, FRAME_BUFFER_COUNT);
+	if( fd == -1 )
+		return -1;
 	close(fd);
 
-	// Fill Buffer
+	const uint64_t faults = get_minor_faults();
+	start_syscall_counter(syscallCounter);
+	struct ShmBuffer* pShown = NULL;
+	for( int i = 0; i < frames; i++ )
+	{
+		const uint64_t start = get_time_nsec();
+		struct ShmBuffer* pBuffer = AcquireShmBuffer(&pool);
+		if( !pBuffer )
+			return -1;
+		const uint64_t acquired = get_time_nsec();
+
+		fill_frame(pKernels, pBuffer->mpPixels, FRAME_WIDTH, FRAME_HEIGHT, i);
+
+		if( pShown )
+			shm_pool_buffer_release(pShown, NULL);
+		pShown = pBuffer;
+		const uint64_t end = get_time_nsec();
+
+		pResult->mPrepareNsec += acquired - start;
+		pResult->mTotalNsec += end - start;
+	}
+	pResult->mSyscalls = stop_syscall_counter(syscallCounter);
+	pResult->mFaults = get_minor_faults() - faults;
+
+	munmap(pool.mpData, pool.mSize);
+	return 0;
+}
+
+static int run_buffer_benchmark( const struct RasterKernels* pKernels, int frames )
+{
+	printf("Buffer benchmark: %d frames of %dx%d XRGB8888, %s kernels\n", frames, FRAME_WIDTH, FRAME_HEIGHT, pKernels->mpName);
+
+	const int syscallCounter = open_syscall_counter();
+	if( syscallCounter == -1 )
+		printf("Syscalls not counted: raw_syscalls:sys_enter needs a readable tracefs and perf_event_paranoid <= 1 or CAP_PERFMON\n");
+
+	struct BenchResult perFrame;
+	struct BenchResult pooled;
+	if( bench_file_per_frame(pKernels, frames, syscallCounter, &perFrame) == -1 ||
+		bench_pool(pKernels, frames, syscallCounter, &pooled) == -1 )
+	{
+		printf("Failed to allocate shm file\n");
+		if( syscallCounter != -1 )
+			close(syscallCounter);
+		return 1;
+	}
+	print_bench_result("shm file per frame:", &perFrame, frames, syscallCounter != -1);
+	print_bench_result("buffer pool:", &pooled, frames, syscallCounter != -1);
+	if( syscallCounter != -1 )
+		close(syscallCounter);
+	return 0;
+}
+
+// Raster Benchmark
+
+// What draw_frame used to draw with, a modulo and a branch per pixel
+static void fill_checker_modulo( uint32_t* pPixels, int width, int height, int offset )
+{
 	for( int y = 0; y < height; y++ )
 	{
 		for( int x = 0; x < width; x++ )
 		{
-			if( ( x + y  / 8 * 8 ) % 16 < 8 )
-				pool_data[y * width + x] = 0xFF666666;
+			if( ( x + offset + y / 8 * 8 ) % 16 < 8 )
+				pPixels[y * width + x] = 0xFF666666;
 			else
-				pool_data[y * width + x] = 0xFFEEEEEE;
+				pPixels[y * width + x] = 0xFFEEEEEE;
 		}
 	}
-
-	munmap(pool_data, shm_pool_size);
-	wl_buffer_add_listener(pWlBuffer, &wl_buffer_listener, NULL);
-	return pWlBuffer;
 }
 
-static void xdg_surface_configure(
-	void* pData, struct xdg_surface* pXdgSurface, uint32_t serial
+enum RasterBenchOp
+{
+	RASTER_BENCH_FILL,
+	RASTER_BENCH_RECTS,
+	RASTER_BENCH_CHECKER,
+	RASTER_BENCH_GRADIENT,
+	RASTER_BENCH_BLIT,
+	RASTER_BENCH_BLEND,
+	RASTER_BENCH_OP_COUNT
+};
+
+static const char* const g_rasterBenchOpNames[RASTER_BENCH_OP_COUNT] = {
+	"fill", "rect fill 40x30", "checker", "gradient", "blit", "blend"
+};
+
+// Draws op once into pDst and returns the pixels it wrote
+static uint64_t raster_bench_draw(
+	const struct RasterKernels* pKernels, enum RasterBenchOp op, int frame,
+	const struct RasterImage* pDst, const struct RasterImage* pOpaque, const struct RasterImage* pTranslucent
 )
 {
-	struct ClientObjState* pClientObjState = pData;
-	xdg_surface_ack_configure(pXdgSurface, serial);
+	const uint64_t pixels = (uint64_t)pDst->mWidth * pDst->mHeight;
+	switch( op )
+	{
+	case RASTER_BENCH_FILL:
+		RasterFill(pKernels, pDst, 0xFF000000u | (uint32_t)frame);
+		return pixels;
+	case RASTER_BENCH_RECTS:
+	{
+		// a quarter of the frame in small rectangles, widgets and icons
+		uint64_t count = 0;
+		for( int32_t y = 0; y + 30 <= pDst->mHeight; y += 60 )
+		{
+			for( int32_t x = frame % 40; x + 40 <= pDst->mWidth; x += 80 )
+			{
+				RasterFillRect(pKernels, pDst, x, y, 40, 30, 0xFF336699u);
+				count += 40 * 30;
+			}
+		}
+		return count;
+	}
+	case RASTER_BENCH_CHECKER:
+		RasterChecker(pKernels, pDst, (uint32_t)frame, CHECKER_CELL_SHIFT, 0xFF666666, 0xFFEEEEEE);
+		return pixels;
+	case RASTER_BENCH_GRADIENT:
+		RasterLinearGradient(pKernels, pDst, 0, 0, pDst->mWidth, pDst->mHeight,
+			pDst->mWidth, pDst->mHeight, 0xFF000000u | (uint32_t)frame, 0xFFFFFFFFu);
+		return pixels;
+	case RASTER_BENCH_BLIT:
+		RasterBlit(pKernels, pDst, 0, 0, pOpaque);
+		return pixels;
+	case RASTER_BENCH_BLEND:
+		RasterBlend(pKernels, pDst, 0, 0, pTranslucent);
+		return pixels;
+	default:
+		return 0;
+	}
+}
+
+static int run_raster_benchmark( int frames )
+{
+	const size_t size = (size_t)FRAME_WIDTH * FRAME_HEIGHT * 4;
+	struct RasterImage images[3];
+	for( int i = 0; i < 3; i++ )
+	{
+		images[i] = (struct RasterImage){ aligned_alloc(64, size), FRAME_WIDTH, FRAME_HEIGHT, FRAME_WIDTH * 4 };
+		if( !images[i].mpPixels )
+		{
+			printf("Failed to allocate benchmark images\n");
+			return 1;
+		}
+	}
+	const struct RasterImage* pDst = &images[0];
+	const struct RasterImage* pOpaque = &images[1];
+	const struct RasterImage* pTranslucent = &images[2];
+
+	const struct RasterKernels* pScalar = &g_rasterKernelsScalar;
+	RasterChecker(pScalar, pOpaque, 0, CHECKER_CELL_SHIFT, 0xFF204080, 0xFF80C0E0);
+	// premultiplied, from fully transparent to three quarters opaque
+	RasterLinearGradient(pScalar, pTranslucent, 0, 0, FRAME_WIDTH, FRAME_HEIGHT, FRAME_WIDTH, 0, 0x00000000, 0xC0604020);
+
+	const struct RasterKernels* pKernels[3];
+	const int32_t kernelCount = GetSupportedRasterKernels(pKernels, 3);
 
-	struct wl_buffer* pBuffer = draw_frame(pClientObjState);
-	wl_surface_attach(pClientObjState->mpWlSurface, pBuffer, 0, 0);
-	wl_surface_commit(pClientObjState->mpWlSurface);
+	printf("Raster benchmark: %d frames of %dx%d, Gpix/s\n", frames, FRAME_WIDTH, FRAME_HEIGHT);
+	printf("%-22s", "");
+	for( int32_t k = 0; k < kernelCount; k++ )
+		printf(" %8s", pKernels[k]->mpName);
+	printf("\n");
+
+	for( int op = 0; op < RASTER_BENCH_OP_COUNT; op++ )
+	{
+		printf("%-22s", g_rasterBenchOpNames[op]);
+		for( int32_t k = 0; k < kernelCount; k++ )
+		{
+			raster_bench_draw(pKernels[k], op, 0, pDst, pOpaque, pTranslucent);
+
+			uint64_t pixels = 0;
+			const uint64_t start = get_time_nsec();
+			for( int frame = 0; frame < frames; frame++ )
+				pixels += raster_bench_draw(pKernels[k], op, frame, pDst, pOpaque, pTranslucent);
+			printf(" %8.2f", (double)pixels / ( get_time_nsec() - start ));
+		}
+		printf("\n");
+	}
+
+	fill_checker_modulo(pDst->mpPixels, FRAME_WIDTH, FRAME_HEIGHT, 0);
+	const uint64_t start = get_time_nsec();
+	for( int frame = 0; frame < frames; frame++ )
+		fill_checker_modulo(pDst->mpPixels, FRAME_WIDTH, FRAME_HEIGHT, frame);
+	printf("%-22s %8.2f\n", "checker, modulo loop",
+		(double)FRAME_WIDTH * FRAME_HEIGHT * frames / ( get_time_nsec() - start ));
+
+	for( int i = 0; i < 3; i++ )
+		free(images[i].mpPixels);
+	return 0;
 }
 
 int main(int argc, const char* argv[])
 {
+	const char* pKernelName = NULL;
+	for( int i = 1; i < argc; i++ )
+	{
+		if( strcmp(argv[i], "--bench-pool") == 0 )
+		{
+			const int frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return run_buffer_benchmark(SelectRasterKernels(pKernelName), frames > 0 ? frames : 600);
+		}
+		if( strcmp(argv[i], "--bench-raster") == 0 )
+		{
+			const int frames = i + 1 < argc ? atoi(argv[i + 1]) : 0;
+			return run_raster_benchmark(frames > 0 ? frames : 600);
+		}
+		if( strcmp(argv[i], "--kernel") == 0 && i + 1 < argc )
+			pKernelName = argv[++i];
+	}
+
 	struct wl_display* pDisplay = wl_display_connect(NULL);
 	if(!pDisplay)
 	{
@@ -130,6 +505,8 @@ int main(int argc, const char* argv[])
 
 	struct ClientObjState clientObjState = {0};
 	clientObjState.mpGlobalObjState = &gObjState;
+	clientObjState.mpRasterKernels = SelectRasterKernels(pKernelName);
+	printf("Drawing with %s kernels\n", clientObjState.mpRasterKernels->mpName);
 
 	clientObjState.mpWlSurface = wl_compositor_create_surface(gObjState.mpCompositor);
 	if( !clientObjState.mpWlSurface )
@@ -162,6 +539,11 @@ int main(int argc, const char* argv[])
 	{
 
 	}
+	printf("%llu frames drawn, %llu skipped with every buffer held, %llu buffers acquired\n",
+		(unsigned long long)clientObjState.mFrames,
+		(unsigned long long)clientObjState.mSkippedFrames,
+		(unsigned long long)clientObjState.mBufferPool.mAcquired);
+	DestroyShmBufferPool(&clientObjState.mBufferPool);
 	wl_display_disconnect(pDisplay);
 	printf("Client Disconnected from the Display\n");
 	return 0;